@@ -241,6 +241,7 @@ static int s_flag = 1;					/* show progress of test */
 static int cancel_ops = 0;				/* abort current operation */
 static int cur_pattern, nr_pattern;
 static int cur_op;
+static BOOL read_only = FALSE;
 /* Abort test if more than this number of bad blocks has been encountered */
 static unsigned int max_bb = BB_BAD_BLOCKS_THRESHOLD;
 static blk_t currently_testing = 0;
@@ -268,6 +269,166 @@ static __inline void free_buffer(void* p) {
 #endif
 }
 
+/*
+ * Speed map: the time spent and bytes moved, for reads and writes, in each region of
+ * the device and for each pass. The time elapsed since the previous sample is charged
+ * to the region of the block being processed, which also accounts for the writes that
+ * are in flight, since queuing a write blocks once the asynchronous queue is full.
+ * We also keep track of the latency of individual reads.
+ */
+typedef struct {
+	uint64_t bytes[2];
+	uint64_t ticks[2];
+	uint64_t read_latency;
+	uint64_t read_max_latency;
+	uint32_t nb_reads;
+} bb_speed_region;
+static bb_speed_region* speed_map = NULL;
+static blk_t speed_region_blocks = 0;
+static uint32_t speed_nb_regions = 0;
+static uint64_t speed_last = 0;
+
+static void speed_start(void)
+{
+	speed_last = IOStatsTimestamp();
+}
+
+static void speed_record(int pass, enum op_type op, blk_t block, blk_t nb_blocks, size_t block_size)
+{
+	uint64_t now = IOStatsTimestamp();
+	uint32_t region;
+
+	if (speed_map == NULL)
+		return;
+	region = (uint32_t)min(block / speed_region_blocks, speed_nb_regions - 1);
+	speed_map[pass * speed_nb_regions + region].bytes[op] += nb_blocks * block_size;
+	speed_map[pass * speed_nb_regions + region].ticks[op] += now - speed_last;
+	speed_last = now;
+}
+
+static void speed_latency(int pass, blk_t block, uint64_t ticks)
+{
+	bb_speed_region* r;
+
+	if (speed_map == NULL)
+		return;
+	r = &speed_map[pass * speed_nb_regions + (uint32_t)min(block / speed_region_blocks, speed_nb_regions - 1)];
+	r->read_latency += ticks;
+	r->read_max_latency = max(r->read_max_latency, ticks);
+	r->nb_reads++;
+}
+
+static int speed_cmp(const void* a, const void* b)
+{
+	float fa = *(const float*)a, fb = *(const float*)b;
+	return (fa < fb)?-1:((fa > fb)?1:0);
+}
+
+/*
+ * Compute the burst (fastest region) and sustained (overall) write speeds, as well as
+ * the read speed, flag the regions that are much slower than the median, and save the
+ * speed map as CSV, with one line per region and per pass.
+ */
+static void speed_report(int nb_passes, size_t block_size, badblocks_report *report, FILE* speed_fd)
+{
+	LARGE_INTEGER freq;
+	uint32_t i, n[2] = { 0, 0 };
+	uint64_t total_bytes[2] = { 0, 0 }, total_ticks[2] = { 0, 0 };
+	float *speed[2] = { NULL, NULL }, median[2] = { 0.0f, 0.0f }, *sorted = NULL, s[2];
+	double region_mb = (double)speed_region_blocks * block_size / (1024.0 * 1024.0);
+	bb_speed_region* r;
+	BOOL slow;
+	int op;
+
+	if ((speed_map == NULL) || (!QueryPerformanceFrequency(&freq)))
+		return;
+	for (op = OP_READ; op <= OP_WRITE; op++) {
+		speed[op] = (float*)calloc(nb_passes * speed_nb_regions, sizeof(float));
+		if (speed[op] == NULL)
+			goto out;
+	}
+	sorted = (float*)calloc(nb_passes * speed_nb_regions, sizeof(float));
+	if (sorted == NULL)
+		goto out;
+
+	for (i = 0; i < nb_passes * speed_nb_regions; i++) {
+		r = &speed_map[i];
+		for (op = OP_READ; op <= OP_WRITE; op++) {
+			total_bytes[op] += r->bytes[op];
+			total_ticks[op] += r->ticks[op];
+			if ((r->bytes[op] == 0) || (r->ticks[op] == 0))
+				continue;
+			speed[op][i] = (float)(((double)r->bytes[op] / (1024.0 * 1024.0)) /
+				((double)r->ticks[op] / freq.QuadPart));
+			if ((op == OP_WRITE) && (speed[op][i] > report->burst_write_speed))
+				report->burst_write_speed = speed[op][i];
+		}
+	}
+	for (op = OP_READ; op <= OP_WRITE; op++) {
+		for (i = 0; i < nb_passes * speed_nb_regions; i++) {
+			if (speed[op][i] != 0.0f)
+				sorted[n[op]++] = speed[op][i];
+		}
+		if (n[op] == 0)
+			continue;
+		qsort(sorted, n[op], sizeof(float), speed_cmp);
+		median[op] = sorted[n[op] / 2];
+	}
+	if (total_ticks[OP_WRITE] != 0)
+		report->sustained_write_speed = (float)(((double)total_bytes[OP_WRITE] / (1024.0 * 1024.0)) /
+			((double)total_ticks[OP_WRITE] / freq.QuadPart));
+	if (total_ticks[OP_READ] != 0)
+		report->read_speed = (float)(((double)total_bytes[OP_READ] / (1024.0 * 1024.0)) /
+			((double)total_ticks[OP_READ] / freq.QuadPart));
+
+	if (speed_fd != NULL)
+		fprintf(speed_fd, "pass,offset_mb,size_mb,write_mb_s,read_mb_s,read_lat_avg_ms,read_lat_max_ms,slow\n");
+	for (i = 0; i < nb_passes * speed_nb_regions; i++) {
+		for (op = OP_READ; op <= OP_WRITE; op++)
+			s[op] = speed[op][i];
+		if ((s[OP_READ] == 0.0f) && (s[OP_WRITE] == 0.0f))
+			continue;
+		slow = ((s[OP_WRITE] != 0.0f) && (s[OP_WRITE] < median[OP_WRITE] * BB_SPEED_SLOW_PERCENT / 100.0f)) ||
+			((s[OP_READ] != 0.0f) && (s[OP_READ] < median[OP_READ] * BB_SPEED_SLOW_PERCENT / 100.0f));
+		if (slow) {
+			if (report->num_slow_regions++ < 8)
+				uprintf("%sSlow region at %0.0f MB: %0.1f MB/s write, %0.1f MB/s read (pass %d)\n", bb_prefix,
+					(i % speed_nb_regions) * region_mb, s[OP_WRITE], s[OP_READ], i / speed_nb_regions + 1);
+		}
+		if (speed_fd != NULL)
+			fprintf(speed_fd, "%d,%0.0f,%0.0f,%0.1f,%0.1f,%0.2f,%0.2f,%d\n", i / speed_nb_regions + 1,
+				(i % speed_nb_regions) * region_mb, region_mb, s[OP_WRITE], s[OP_READ],
+				(speed_map[i].nb_reads == 0)?0.0:(1000.0 * speed_map[i].read_latency) /
+				((double)speed_map[i].nb_reads * freq.QuadPart),
+				(1000.0 * speed_map[i].read_max_latency) / freq.QuadPart, slow?1:0);
+	}
+	if (speed_fd != NULL)
+		fflush(speed_fd);
+
+	if (total_ticks[OP_WRITE] != 0) {
+		uprintf("%sWrite speed: %0.1f MB/s burst, %0.1f MB/s sustained - Read speed: %0.1f MB/s\n", bb_prefix,
+			report->burst_write_speed, report->sustained_write_speed, report->read_speed);
+		fprintf(log_fd, "Write speed: %0.1f MB/s burst, %0.1f MB/s sustained - Read speed: %0.1f MB/s\n",
+			report->burst_write_speed, report->sustained_write_speed, report->read_speed);
+	} else {
+		uprintf("%sRead speed: %0.1f MB/s\n", bb_prefix, report->read_speed);
+		fprintf(log_fd, "Read speed: %0.1f MB/s\n", report->read_speed);
+	}
+	if (report->num_slow_regions != 0) {
+		uprintf("%s%u slow region%s (below %d%% of the median speed of %0.1f MB/s write, %0.1f MB/s read)\n",
+			bb_prefix, report->num_slow_regions, (report->num_slow_regions == 1)?"":"s",
+			BB_SPEED_SLOW_PERCENT, median[OP_WRITE], median[OP_READ]);
+		fprintf(log_fd, "%u slow region%s of %0.0f MB found\n", report->num_slow_regions,
+			(report->num_slow_regions == 1)?"":"s", region_mb);
+	}
+	fflush(log_fd);
+
+out:
+	for (op = OP_READ; op <= OP_WRITE; op++)
+		safe_free(speed[op]);
+	safe_free(sorted);
+}
+
 /*
  * This routine reports a new bad block.  If the bad block has already
  * been seen before, then it returns 0; otherwise it returns 1.
@@ -325,6 +486,11 @@ static void print_status(void)
 
 	percent = calc_percent((unsigned long) currently_testing,
 					(unsigned long) num_blocks);
+	if (read_only) {
+		PrintStatus(0, FALSE, "Bad Blocks: READ ONLY - %0.2f%% (%d errors)", percent, num_read_errors);
+		UpdateProgress(OP_BADBLOCKS, percent);
+		return;
+	}
 	percent = (percent/2.0f) + ((cur_op==OP_READ)? 50.0f : 0.0f);
 	PrintStatus(0, FALSE, "Bad Blocks: PASS %d/%d - %0.2f%% (%d/%d/%d errors)",
 				cur_pattern, nr_pattern,
@@ -423,6 +589,24 @@ static int64_t do_write(HANDLE hDrive, unsigned char * buffer, uint64_t tryout,
 	return got;
 }
 
+/*
+ * Wait for the queued writes and, if any of them failed, rewind to the first
+ * failed block and switch to writing one block at a time, as we do when a
+ * synchronous write fails. Returns TRUE if all the queued writes succeeded.
+ */
+static BOOL flush_writes(ASYNC_WRITER* aw, blk_t* current_block, blk_t* tryout,
+			 blk_t* recover_block, size_t blocks_at_once)
+{
+	uint64_t error_block;
+
+	if ((aw == NULL) || AsyncWriteFlush(aw, &error_block))
+		return TRUE;
+	*current_block = (blk_t)error_block;
+	*tryout = 1;
+	*recover_block = *current_block + blocks_at_once;
+	return FALSE;
+}
+
 static unsigned int test_rw(HANDLE hDrive, blk_t last_block, size_t block_size, blk_t first_block,
 	size_t blocks_at_once, int nb_passes)
 {
@@ -432,6 +616,8 @@ static unsigned int test_rw(HANDLE hDrive, blk_t last_block, size_t block_size,
 	unsigned int bb_count = 0;
 	blk_t got, tryout, recover_block = ~0, *blk_id;
 	size_t id_offset;
+	uint64_t ts;
+	ASYNC_WRITER* aw = NULL;
 
 	if ((nb_passes < 1) || (nb_passes > 4)) {
 		uprintf("%sInvalid number of passes\n", bb_prefix);
@@ -448,6 +634,9 @@ static unsigned int test_rw(HANDLE hDrive, blk_t last_block, size_t block_size,
 		return 0;
 	}
 
+	/* Keep several pattern writes in flight. If this fails, we just write synchronously */
+	aw = AsyncWriteOpen(hDrive, (DWORD)(blocks_at_once * block_size), TRUE);
+
 	uprintf("%sChecking from block %lu to %lu\n", bb_prefix,
 		(unsigned long) first_block, (unsigned long) last_block - 1);
 	nr_pattern = nb_passes;
@@ -465,7 +654,10 @@ static unsigned int test_rw(HANDLE hDrive, blk_t last_block, size_t block_size,
 			uprintf("%sWriting test pattern 0x%02X\n", bb_prefix, pattern[pat_idx]);
 		cur_op = OP_WRITE;
 		tryout = blocks_at_once;
-		while (currently_testing < last_block) {
+		speed_start();
+		/* Queued writes must have completed before we can read the blocks back */
+		while ((currently_testing < last_block) ||
+		       (!flush_writes(aw, &currently_testing, &tryout, &recover_block, blocks_at_once))) {
 			if (cancel_ops) goto out;
 			if (max_bb && bb_count >= max_bb) {
 				if (s_flag || v_flag) {
@@ -486,7 +678,18 @@ static unsigned int test_rw(HANDLE hDrive, blk_t last_block, size_t block_size,
 					*blk_id = (blk_t)(currently_testing + i);
 				}
 			}
+			/* Write errors are only reported on completion, so we only queue
+			   writes when we are not recovering from an error */
+			if ((aw != NULL) && (recover_block == ~0)) {
+				if (AsyncWriteSectors(aw, block_size, currently_testing, tryout, buffer)) {
+					speed_record(pat_idx, OP_WRITE, currently_testing, tryout, block_size);
+					currently_testing += tryout;
+				} else
+					flush_writes(aw, &currently_testing, &tryout, &recover_block, blocks_at_once);
+				continue;
+			}
 			got = do_write(hDrive, buffer, tryout, block_size, currently_testing);
+			speed_record(pat_idx, OP_WRITE, currently_testing, got, block_size);
 			if (v_flag > 1)
 				print_status();
 
@@ -504,6 +707,8 @@ static unsigned int test_rw(HANDLE hDrive, blk_t last_block, size_t block_size,
 				recover_block = ~0;
 			}
 		}
+		/* Charge the final flush to the last region */
+		speed_record(pat_idx, OP_WRITE, last_block - 1, 0, block_size);
 
 		num_blocks = 0;
 		if (s_flag | v_flag)
@@ -513,6 +718,7 @@ static unsigned int test_rw(HANDLE hDrive, blk_t last_block, size_t block_size,
 		currently_testing = first_block;
 
 		tryout = blocks_at_once;
+		speed_start();
 		while (currently_testing < last_block) {
 			if (cancel_ops) goto out;
 			if (max_bb && bb_count >= max_bb) {
@@ -532,8 +738,11 @@ static unsigned int test_rw(HANDLE hDrive, blk_t last_block, size_t block_size,
 					*blk_id = (blk_t)(currently_testing + i);
 				}
 			}
+			ts = IOStatsTimestamp();
 			got = do_read(hDrive, read_buffer, tryout, block_size,
 				       currently_testing);
+			speed_latency(pat_idx, currently_testing, IOStatsTimestamp() - ts);
+			speed_record(pat_idx, OP_READ, currently_testing, got, block_size);
 			if (got == 0 && tryout == 1)
 				bb_count += bb_output(currently_testing++, READ_ERROR);
 			currently_testing += got;
@@ -560,21 +769,196 @@ static unsigned int test_rw(HANDLE hDrive, blk_t last_block, size_t block_size,
 		num_blocks = 0;
 	}
 out:
+	AsyncWriteClose(aw);
 	free_buffer(buffer);
 	return bb_count;
 }
 
+/*
+ * Non destructive read-only scan, using large reads with ASYNC_QUEUE_DEPTH of them in
+ * flight when the drive can be reopened for overlapped I/O, so that we can run at the
+ * sequential read speed of the device. Failed reads are retried synchronously, and
+ * bisected down to the unreadable blocks, which are then reported as ranges.
+ */
+typedef HANDLE (WINAPI *ReOpenFile_t)(HANDLE hOriginalFile, DWORD dwDesiredAccess,
+	DWORD dwShareMode, DWORD dwFlags);
+
+typedef struct {
+	OVERLAPPED overlapped;
+	unsigned char* buffer;
+	blk_t block;
+	blk_t nb_blocks;
+	uint64_t timestamp;
+	DWORD got;
+	BOOL pending;
+	BOOL in_flight;
+} bb_read_slot;
+
+static blk_t bad_range_start = 0, bad_range_end = 0;
+
+static void report_bad_range(size_t block_size)
+{
+	if (bad_range_end == bad_range_start)
+		return;
+	uprintf("%sUnreadable blocks %llu to %llu (%llu bytes)\n", bb_prefix, (unsigned long long)bad_range_start,
+		(unsigned long long)bad_range_end - 1, (unsigned long long)(bad_range_end - bad_range_start) * block_size);
+	fprintf(log_fd, "Blocks %llu to %llu: unreadable\n", (unsigned long long)bad_range_start,
+		(unsigned long long)bad_range_end - 1);
+	fflush(log_fd);
+	bad_range_start = bad_range_end = 0;
+}
+
+static unsigned int bisect_read(HANDLE hDrive, unsigned char* buffer, blk_t block, blk_t nb_blocks,
+	size_t block_size)
+{
+	unsigned int bb_count;
+
+	if ((cancel_ops) || (do_read(hDrive, buffer, nb_blocks, block_size, block) == (int64_t)nb_blocks))
+		return 0;
+	if (nb_blocks > 1)
+		return bisect_read(hDrive, buffer, block, nb_blocks / 2, block_size) +
+			bisect_read(hDrive, buffer, block + nb_blocks / 2, nb_blocks - nb_blocks / 2, block_size);
+	bb_count = bb_output(block, READ_ERROR);
+	if (block != bad_range_end) {
+		report_bad_range(block_size);
+		bad_range_start = block;
+	}
+	bad_range_end = block + 1;
+	return bb_count;
+}
+
+static blk_t issue_read(HANDLE hDrive, HANDLE hOverlapped, bb_read_slot* slot, blk_t block,
+	blk_t last_block, blk_t blocks_per_read, size_t block_size)
+{
+	uint64_t offset = block * block_size;
+	int64_t got;
+
+	slot->in_flight = (block < last_block);
+	if (!slot->in_flight)
+		return block;
+	slot->block = block;
+	slot->nb_blocks = min(blocks_per_read, last_block - block);
+	slot->timestamp = IOStatsTimestamp();
+	slot->pending = FALSE;
+	if (hOverlapped != INVALID_HANDLE_VALUE) {
+		slot->overlapped.Internal = 0;
+		slot->overlapped.InternalHigh = 0;
+		slot->overlapped.Offset = (DWORD)offset;
+		slot->overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		slot->got = 0;
+		if (ReadFile(hOverlapped, slot->buffer, (DWORD)(slot->nb_blocks * block_size), NULL, &slot->overlapped) ||
+			(GetLastError() == ERROR_IO_PENDING))
+			slot->pending = TRUE;
+	} else {
+		got = read_sectors(hDrive, block_size, block, slot->nb_blocks, slot->buffer);
+		slot->got = (DWORD)max(got, 0);
+	}
+	return block + slot->nb_blocks;
+}
+
+static void complete_read(HANDLE hOverlapped, bb_read_slot* slot)
+{
+	if (!slot->pending)
+		return;
+	if (!GetOverlappedResult(hOverlapped, &slot->overlapped, &slot->got, TRUE))
+		slot->got = 0;
+	slot->pending = FALSE;
+	IOStatsRecord(IOS_DEVICE_READ, slot->got, slot->timestamp);
+}
+
+static unsigned int test_ro(HANDLE hDrive, blk_t last_block, size_t block_size, blk_t first_block)
+{
+	PF_DECL(ReOpenFile);
+	HANDLE hOverlapped = INVALID_HANDLE_VALUE;
+	bb_read_slot slot[ASYNC_QUEUE_DEPTH];
+	blk_t next_block = first_block, blocks_per_read = BB_READ_ONLY_SIZE / block_size;
+	unsigned int bb_count = 0;
+	int i, depth = 1;
+
+	memset(slot, 0, sizeof(slot));
+	PF_INIT(ReOpenFile, kernel32);
+	if (pfReOpenFile != NULL) {
+		hOverlapped = pfReOpenFile(hDrive, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED);
+		if (hOverlapped == INVALID_HANDLE_VALUE)
+			uprintf("%sCould not reopen drive for overlapped I/O: %s\n", bb_prefix, WindowsErrorString());
+		else
+			depth = ASYNC_QUEUE_DEPTH;
+	}
+	for (i = 0; i < depth; i++) {
+		slot[i].buffer = allocate_buffer(BB_READ_ONLY_SIZE);
+		slot[i].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if ((slot[i].buffer == NULL) || (slot[i].overlapped.hEvent == NULL)) {
+			uprintf("%sError while allocating buffers\n", bb_prefix);
+			cancel_ops = -1;
+			goto out;
+		}
+	}
+
+	uprintf("%sReading blocks %lu to %lu (%d x %d KB)\n", bb_prefix, (unsigned long) first_block,
+		(unsigned long) last_block - 1, depth, BB_READ_ONLY_SIZE / 1024);
+	cur_op = OP_READ;
+	num_blocks = last_block;
+	currently_testing = first_block;
+	bad_range_start = bad_range_end = 0;
+	speed_start();
+	for (i = 0; i < depth; i++)
+		next_block = issue_read(hDrive, hOverlapped, &slot[i], next_block, last_block, blocks_per_read, block_size);
+	// Reads are issued in ascending order, so the first slot that is idle means we are done
+	for (i = 0; slot[i].in_flight; i = (i + 1) % depth) {
+		if (cancel_ops) goto out;
+		if (max_bb && bb_count >= max_bb) {
+			uprintf(abort_msg);
+			fprintf(log_fd, abort_msg);
+			fflush(log_fd);
+			cancel_ops = -1;
+			goto out;
+		}
+		complete_read(hOverlapped, &slot[i]);
+		speed_latency(0, slot[i].block, IOStatsTimestamp() - slot[i].timestamp);
+		speed_record(0, OP_READ, slot[i].block, slot[i].got / block_size, block_size);
+		if (slot[i].got != slot[i].nb_blocks * block_size)
+			bb_count += bisect_read(hDrive, slot[i].buffer, slot[i].block, slot[i].nb_blocks, block_size);
+		currently_testing = slot[i].block + slot[i].nb_blocks;
+		next_block = issue_read(hDrive, hOverlapped, &slot[i], next_block, last_block, blocks_per_read, block_size);
+	}
+	report_bad_range(block_size);
+
+out:
+	if (hOverlapped != INVALID_HANDLE_VALUE) {
+		// Buffers must not be released while reads are still pending
+		CancelIo(hOverlapped);
+		for (i = 0; i < depth; i++) {
+			if (slot[i].pending)
+				GetOverlappedResult(hOverlapped, &slot[i].overlapped, &slot[i].got, TRUE);
+		}
+		CloseHandle(hOverlapped);
+	}
+	for (i = 0; i < depth; i++) {
+		if (slot[i].overlapped.hEvent != NULL)
+			CloseHandle(slot[i].overlapped.hEvent);
+		if (slot[i].buffer != NULL)
+			free_buffer(slot[i].buffer);
+	}
+	num_blocks = 0;
+	return bb_count;
+}
+
 BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, size_t block_size,
-	int nb_passes, badblocks_report *report, FILE* fd)
+	int nb_passes, badblocks_report *report, FILE* fd, FILE* speed_fd)
 {
 	errcode_t error_code;
 	blk_t first_block = 0, last_block = disk_size/block_size;
+	int nb_maps;
 
 	if (report == NULL) return FALSE;
 	num_read_errors = 0;
 	num_write_errors = 0;
 	num_corruption_errors = 0;
 	report->bb_count = 0;
+	report->num_slow_regions = 0;
+	report->burst_write_speed = 0.0f;
+	report->sustained_write_speed = 0.0f;
+	report->read_speed = 0.0f;
 	if (fd != NULL) {
 		log_fd = fd;
 	} else {
@@ -587,11 +971,28 @@ BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, size_t block_size,
 		return FALSE;
 	}
 
+	speed_region_blocks = BB_SPEED_REGION_SIZE / block_size;
+	speed_nb_regions = (uint32_t)((last_block + speed_region_blocks - 1) / speed_region_blocks);
+	while (speed_nb_regions > BB_SPEED_MAX_REGIONS) {
+		speed_region_blocks *= 2;
+		speed_nb_regions = (uint32_t)((last_block + speed_region_blocks - 1) / speed_region_blocks);
+	}
+	read_only = (nb_passes == BB_READ_ONLY);
+	nb_maps = read_only?1:nb_passes;
+	speed_map = (bb_speed_region*)calloc(nb_maps * speed_nb_regions, sizeof(bb_speed_region));
+	if (speed_map == NULL)
+		uprintf("%sCould not allocate the speed map\n", bb_prefix);
+
 	cancel_ops = 0;
 	/* use a timer to update status every second */
 	SetTimer(hMainDialog, TID_BADBLOCKS_UPDATE, 1000, alarm_intr);
-	report->bb_count = test_rw(hPhysicalDrive, last_block, block_size, first_block, BB_BLOCKS_AT_ONCE, nb_passes);
+	if (read_only)
+		report->bb_count = test_ro(hPhysicalDrive, last_block, block_size, first_block);
+	else
+		report->bb_count = test_rw(hPhysicalDrive, last_block, block_size, first_block, BB_BLOCKS_AT_ONCE, nb_passes);
 	KillTimer(hMainDialog, TID_BADBLOCKS_UPDATE);
+	speed_report(nb_maps, block_size, report, speed_fd);
+	safe_free(speed_map);
 	free(bb_list->list);
 	free(bb_list);
 	report->num_read_errors = num_read_errors;
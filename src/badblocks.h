@@ -38,6 +38,11 @@ typedef struct bb_struct_u64_iterate      *bb_u64_iterate;
 #define BB_BAD_BLOCKS_THRESHOLD           256
 #define BB_BLOCKS_AT_ONCE                 64
 #define BB_SYS_PAGE_SIZE                  4096
+#define BB_READ_ONLY                      0					// number of passes for the read-only scan
+#define BB_READ_ONLY_SIZE                 (1024*1024)		// size of the reads for the read-only scan
+#define BB_SPEED_REGION_SIZE              (64*1024*1024)	// min size of a region in the speed map
+#define BB_SPEED_MAX_REGIONS              1024				// regions are enlarged to stay below this
+#define BB_SPEED_SLOW_PERCENT             25				// regions below this % of the median are slow
 
 enum error_types { READ_ERROR, WRITE_ERROR, CORRUPTION_ERROR };
 enum op_type { OP_READ, OP_WRITE };
@@ -50,10 +55,14 @@ typedef struct {
 	uint32_t num_read_errors;
 	uint32_t num_write_errors;
 	uint32_t num_corruption_errors;
+	uint32_t num_slow_regions;
+	float burst_write_speed;		// in MB/s
+	float sustained_write_speed;
+	float read_speed;
 } badblocks_report;
 
 /*
  * Shared prototypes
  */
 BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, size_t block_size,
-	int test_type, badblocks_report *report, FILE* fd);
+	int test_type, badblocks_report *report, FILE* fd, FILE* speed_fd);
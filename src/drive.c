@@ -30,6 +30,7 @@
 #include "rufus.h"
 #include "resource.h"
 #include "sys_types.h"
+#include "file.h"
 
 /*
  * Globals
@@ -328,8 +329,8 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system)
 	PrintStatus(0, TRUE, "Partitioning (%s)...",  PartitionTypeName[partition_style]);
 
 	if ((partition_style == PARTITION_STYLE_GPT) || (!IsChecked(IDC_EXTRA_PARTITION))) {
-		// Go with the MS 1 MB wastage at the beginning...
-		DriveLayoutEx.PartitionEntry[0].StartingOffset.QuadPart = 1024*1024;
+		// Go with the MS 1 MB wastage at the beginning, or align on the erase block if larger
+		DriveLayoutEx.PartitionEntry[0].StartingOffset.QuadPart = max(1024*1024, SelectedDrive.EraseBlockSize);
 	} else {
 		// Align on Cylinder
 		DriveLayoutEx.PartitionEntry[0].StartingOffset.QuadPart = 
@@ -446,6 +447,221 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system)
 	return TRUE;
 }
 
+/*
+ * Probe the flash geometry of a drive, by timing writes of zeroes in the area at the
+ * beginning of the drive that is about to be repartitioned. This must only be called
+ * once the MBR/GPT have been cleared, so that no user data is affected.
+ * - The optimal I/O size is the smallest write size that gets within 10% of the best
+ *   sequential throughput.
+ * - The erase block size is the smallest boundary for which a write that straddles it
+ *   is noticeably slower than a write of the same size that starts on it.
+ * Results are stored in SelectedDrive, and left at 0 if they cannot be determined.
+ * As probing takes a few seconds, and the geometry of a drive doesn't change, the
+ * results are reused for the drives that have already been probed in this session.
+ */
+#define PROBE_MIN_IO_SIZE       (16*1024)
+#define PROBE_MAX_IO_SIZE       (4*1024*1024)
+#define PROBE_MIN_IO_TOTAL      (1024*1024)		// minimum amount of data written for each I/O size
+#define PROBE_MIN_ERASE_SIZE    (64*1024)
+#define PROBE_MAX_ERASE_SIZE    (16*1024*1024)
+#define PROBE_STRADDLE_SIZE     (32*1024)
+#define PROBE_PASSES            3
+#define PROBE_CACHE_SIZE        8
+
+// Drives are identified by what the device reports, rather than by their number,
+// which gets reused when drives are swapped
+static struct {
+	char Id[256];
+	LONGLONG DiskSize;
+	DWORD EraseBlockSize;
+	DWORD OptimalIOSize;
+} ProbeCache[PROBE_CACHE_SIZE];
+static int ProbeCacheNext = 0;
+
+static void GetProbeId(HANDLE hDrive, char* Id, size_t IdSize)
+{
+	STORAGE_PROPERTY_QUERY Query;
+	STORAGE_DEVICE_DESCRIPTOR* pDesc;
+	DWORD Offset[3], size, i;
+	BYTE Buf[1024];
+
+	safe_sprintf(Id, IdSize, "%d:", (int)SelectedDrive.DeviceNumber);
+	memset(&Query, 0, sizeof(Query));
+	memset(Buf, 0, sizeof(Buf));
+	Query.PropertyId = StorageDeviceProperty;
+	Query.QueryType = PropertyStandardQuery;
+	if (!DeviceIoControl(hDrive, IOCTL_STORAGE_QUERY_PROPERTY, &Query, sizeof(Query), Buf, sizeof(Buf)-1, &size, NULL))
+		return;
+	pDesc = (STORAGE_DEVICE_DESCRIPTOR*)Buf;
+	Offset[0] = pDesc->VendorIdOffset;
+	Offset[1] = pDesc->ProductIdOffset;
+	Offset[2] = pDesc->SerialNumberOffset;
+	// Without a serial, fall back to the device number, so that two identical drives don't get mixed up
+	if ((Offset[2] != 0) && (Offset[2] < size) && (Buf[Offset[2]] != 0))
+		Id[0] = 0;
+	for (i = 0; i < ARRAYSIZE(Offset); i++) {
+		if ((Offset[i] != 0) && (Offset[i] < size))
+			safe_strcat(Id, IdSize, (char*)&Buf[Offset[i]]);
+		safe_strcat(Id, IdSize, "|");
+	}
+}
+
+// Time a write of zeroes, in performance counter ticks. Returns 0 on error.
+static uint64_t ProbeWrite(HANDLE hDrive, DWORD SectorSize, uint64_t Offset, DWORD Size, const BYTE* pZero)
+{
+	uint64_t ts = IOStatsTimestamp();
+
+	if (write_sectors(hDrive, SectorSize, Offset/SectorSize, Size/SectorSize, pZero) != Size)
+		return 0;
+	return max(IOStatsTimestamp() - ts, 1);
+}
+
+void ProbeFlashGeometry(HANDLE hDrive)
+{
+	DWORD SectorSize = SelectedDrive.Geometry.BytesPerSector;
+	DWORD size, best_size = 0;
+	uint64_t offset, total, ticks, t, aligned, straddle;
+	double throughput[32], best = 0.0;
+	BYTE* pZero = NULL;
+	char Id[256];
+	int i, n, pass;
+
+	SelectedDrive.EraseBlockSize = 0;
+	SelectedDrive.OptimalIOSize = 0;
+	if ( (SectorSize == 0) || (SectorSize > PROBE_STRADDLE_SIZE/2)
+	  || (SelectedDrive.DiskSize < 4*PROBE_MAX_ERASE_SIZE) )
+		return;
+	GetProbeId(hDrive, Id, sizeof(Id));
+	for (i = 0; i < PROBE_CACHE_SIZE; i++) {
+		if ((ProbeCache[i].DiskSize == SelectedDrive.DiskSize) && (strcmp(ProbeCache[i].Id, Id) == 0)) {
+			SelectedDrive.EraseBlockSize = ProbeCache[i].EraseBlockSize;
+			SelectedDrive.OptimalIOSize = ProbeCache[i].OptimalIOSize;
+			uprintf("Flash geometry (from a previous probe): erase block %d KB, optimal I/O size %d KB\n",
+				SelectedDrive.EraseBlockSize/1024, SelectedDrive.OptimalIOSize/1024);
+			return;
+		}
+	}
+	// VirtualAlloc() gives us a zeroed and page aligned buffer
+	pZero = (BYTE*)VirtualAlloc(NULL, PROBE_MAX_IO_SIZE, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+	if (pZero == NULL)
+		return;
+	PrintStatus(0, TRUE, "Probing flash geometry...");
+
+	// Sequential throughput for each write size
+	for (size = PROBE_MIN_IO_SIZE, n = 0; size <= PROBE_MAX_IO_SIZE; size *= 2, n++) {
+		if (IS_ERROR(FormatStatus)) goto out;
+		total = max(2*size, PROBE_MIN_IO_TOTAL);
+		for (offset = 0, ticks = 0; offset < total; offset += size) {
+			t = ProbeWrite(hDrive, SectorSize, offset, size, pZero);
+			if (t == 0)
+				goto out;
+			ticks += t;
+		}
+		throughput[n] = (double)total / (double)ticks;
+		if (throughput[n] > best)
+			best = throughput[n];
+	}
+	for (i = 0, size = PROBE_MIN_IO_SIZE; i < n; i++, size *= 2) {
+		if (throughput[i] >= 0.9 * best) {
+			best_size = size;
+			break;
+		}
+	}
+
+	// Straddled vs aligned writes, for each candidate erase block size
+	for (size = PROBE_MIN_ERASE_SIZE; size <= PROBE_MAX_ERASE_SIZE; size *= 2) {
+		aligned = straddle = UINT64_MAX;
+		for (pass = 0; pass < PROBE_PASSES; pass++) {
+			if (IS_ERROR(FormatStatus)) goto out;
+			t = ProbeWrite(hDrive, SectorSize, size, PROBE_STRADDLE_SIZE, pZero);
+			if (t == 0)
+				goto out;
+			aligned = min(aligned, t);
+			t = ProbeWrite(hDrive, SectorSize, size - PROBE_STRADDLE_SIZE/2, PROBE_STRADDLE_SIZE, pZero);
+			if (t == 0)
+				goto out;
+			straddle = min(straddle, t);
+		}
+		if (straddle > aligned + aligned/4) {
+			SelectedDrive.EraseBlockSize = size;
+			break;
+		}
+	}
+	SelectedDrive.OptimalIOSize = best_size;
+	if (SelectedDrive.EraseBlockSize == 0)
+		uprintf("Flash geometry: erase block not detected, optimal I/O size %d KB\n", best_size/1024);
+	else
+		uprintf("Flash geometry: erase block %d KB, optimal I/O size %d KB\n",
+			SelectedDrive.EraseBlockSize/1024, best_size/1024);
+	if (best_size != 0) {
+		safe_strcpy(ProbeCache[ProbeCacheNext].Id, sizeof(ProbeCache[ProbeCacheNext].Id), Id);
+		ProbeCache[ProbeCacheNext].DiskSize = SelectedDrive.DiskSize;
+		ProbeCache[ProbeCacheNext].EraseBlockSize = SelectedDrive.EraseBlockSize;
+		ProbeCache[ProbeCacheNext].OptimalIOSize = best_size;
+		ProbeCacheNext = (ProbeCacheNext + 1) % PROBE_CACHE_SIZE;
+	}
+
+out:
+	if (SelectedDrive.OptimalIOSize == 0)
+		uprintf("Could not probe flash geometry\n");
+	VirtualFree(pZero, 0, MEM_RELEASE);
+}
+
+/*
+ * Pick the cluster size that minimizes the predicted time needed to copy the content
+ * of the scanned ISO, among the ones that still let that content fit on the drive.
+ * The prediction uses the file size histogram from the ISO scan: files smaller than a
+ * cluster use a full cluster, larger ones waste half a cluster on average, and each
+ * cluster allocated also carries a fixed cost for the FS metadata update.
+ * Returns 0 if no cluster size could be selected.
+ */
+#define CLUSTER_ALLOC_COST 4096		// cost of allocating a cluster, in bytes written
+ULONG GetOptimizedClusterSize(int FSType, const RUFUS_ISO_REPORT* report)
+{
+	int i, c;
+	ULONG j, best = 0;
+	uint64_t used, meta, nb_clusters, cost, best_cost = UINT64_MAX;
+
+	if ((report == NULL) || (report->nb_files == 0) || (FSType < 0) || (FSType >= FS_MAX))
+		return 0;
+
+	for (c=9,j=0x200; j<0x10000000; c++,j<<=1) {
+		if (!(j & SelectedDrive.ClusterSize[FSType].Allowed))
+			continue;
+		used = (uint64_t)report->nb_dirs * j;
+		for (i=1; i<ISO_HISTOGRAM_SIZE; i++) {
+			if (i <= c)
+				used += (uint64_t)report->size_count[i] * j;
+			else
+				used += report->size_bytes[i] + (uint64_t)report->size_count[i] * (j/2);
+		}
+		nb_clusters = SelectedDrive.DiskSize / j;
+		switch (FSType) {
+		case FS_FAT16:
+			meta = 2 * 2 * nb_clusters;
+			break;
+		case FS_FAT32:
+			meta = 2 * 4 * nb_clusters;
+			break;
+		case FS_EXFAT:
+			meta = 4 * nb_clusters + nb_clusters / 8;
+			break;
+		default:	// NTFS: 1 KB MFT record per file or directory, and the cluster bitmap
+			meta = 1024 * (uint64_t)(report->nb_files + report->nb_dirs) + nb_clusters / 8;
+			break;
+		}
+		// Leave some headroom for the reserved sectors and the root directory
+		if (used + meta > SelectedDrive.DiskSize - SelectedDrive.DiskSize / 32)
+			continue;
+		cost = used + meta + (used / j) * CLUSTER_ALLOC_COST;
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = j;
+		}
+	}
+	return best;
+}
+
 /*
  * Convert a partition type to its human readable form using
  * (slightly modified) entries from GNU fdisk
@@ -459,3 +675,423 @@ const char* GetPartitionType(BYTE Type)
 	}
 	return "Unknown";
 }
+
+/*
+ * Asynchronous write engine, that keeps up to ASYNC_QUEUE_DEPTH writes in flight
+ * instead of waiting for each write to complete before issuing the next one.
+ * If we are allowed to, we reopen the device for overlapped I/O, so that all the
+ * requests reach the device at once (which UAS and NVMe enclosures can service in
+ * parallel). Otherwise (XP, or a dismounted volume that must not be reopened, as
+ * this would remount it), a writer thread issues the requests on the original
+ * handle, so that at least the I/O is pipelined with the caller's processing.
+ * Writes may complete in any order, and no other I/O should be issued on the
+ * drive handle until AsyncWriteFlush() has been called. This is also how callers
+ * enforce ordering, e.g. to write boot records only after the data is on disk.
+ */
+typedef HANDLE (WINAPI *ReOpenFile_t)(HANDLE hOriginalFile, DWORD dwDesiredAccess,
+	DWORD dwShareMode, DWORD dwFlags);
+
+typedef struct {
+	OVERLAPPED Overlapped;		// the event is signaled on completion in both modes
+	BYTE* Buffer;
+	DWORD Size;
+	DWORD Written;
+	DWORD Error;
+	uint64_t StartSector;
+	uint64_t Timestamp;
+	BOOL InFlight;
+	BOOL Success;
+	BOOL Zeroed;
+} ASYNC_SLOT;
+
+struct ASYNC_WRITER {
+	HANDLE hDrive;
+	HANDLE hOverlapped;			// INVALID_HANDLE_VALUE when using the writer thread
+	HANDLE hThread;
+	HANDLE hQueue;				// writer thread semaphore, one count per queued write
+	volatile BOOL Quit;
+	DWORD MaxSize;
+	int Next;
+	BOOL Error;
+	uint64_t ErrorSector;
+	uint64_t BytesDone;
+	ASYNC_SLOT Slot[ASYNC_QUEUE_DEPTH];
+};
+
+static DWORD WINAPI AsyncWriterThread(LPVOID param)
+{
+	ASYNC_WRITER* aw = (ASYNC_WRITER*)param;
+	ASYNC_SLOT* slot;
+	OVERLAPPED Overlapped;
+	int i = 0;
+
+	while (1) {
+		WaitForSingleObject(aw->hQueue, INFINITE);
+		if (aw->Quit)
+			break;
+		// Requests are queued in slot order
+		slot = &aw->Slot[i];
+		i = (i+1) % ASYNC_QUEUE_DEPTH;
+		// On a synchronous handle, this is a positioned write that returns on completion
+		memset(&Overlapped, 0, sizeof(Overlapped));
+		Overlapped.Offset = slot->Overlapped.Offset;
+		Overlapped.OffsetHigh = slot->Overlapped.OffsetHigh;
+		slot->Success = WriteFile(aw->hDrive, slot->Buffer, slot->Size, &slot->Written, &Overlapped);
+		slot->Error = slot->Success?0:GetLastError();
+		SetEvent(slot->Overlapped.hEvent);
+	}
+	return 0;
+}
+
+// Wait for a queued write to complete, and process its result
+static BOOL AsyncWriteComplete(ASYNC_WRITER* aw, ASYNC_SLOT* slot)
+{
+	BOOL r;
+
+	if (!slot->InFlight)
+		return TRUE;
+	if (aw->hOverlapped != INVALID_HANDLE_VALUE) {
+		r = GetOverlappedResult(aw->hOverlapped, &slot->Overlapped, &slot->Written, TRUE);
+	} else {
+		WaitForSingleObject(slot->Overlapped.hEvent, INFINITE);
+		r = slot->Success;
+		SetLastError(slot->Error);
+	}
+	slot->InFlight = FALSE;
+	IOStatsRecord(IOS_DEVICE_WRITE, slot->Written, slot->Timestamp);
+	if ((!r) || (slot->Written != slot->Size)) {
+		uprintf("AsyncWrite: Write error at sector %lld - %s\n", slot->StartSector, WindowsErrorString());
+		uprintf("  Wrote: %d, Expected: %d\n", slot->Written, slot->Size);
+		if ((!aw->Error) || (slot->StartSector < aw->ErrorSector))
+			aw->ErrorSector = slot->StartSector;
+		aw->Error = TRUE;
+		return FALSE;
+	}
+	aw->BytesDone += slot->Written;
+	return TRUE;
+}
+
+/*
+ * Set up asynchronous writes of up to MaxSize bytes on hDrive. If bReopen is FALSE,
+ * the drive handle is not duplicated and the writes are issued by a writer thread.
+ * Returns NULL on error.
+ */
+ASYNC_WRITER* AsyncWriteOpen(HANDLE hDrive, DWORD MaxSize, BOOL bReopen)
+{
+	PF_DECL(ReOpenFile);
+	ASYNC_WRITER* aw;
+	int i;
+
+	aw = (ASYNC_WRITER*)calloc(1, sizeof(ASYNC_WRITER));
+	if (aw == NULL)
+		return NULL;
+	aw->hDrive = hDrive;
+	aw->hOverlapped = INVALID_HANDLE_VALUE;
+	aw->MaxSize = MaxSize;
+	for (i=0; i<ASYNC_QUEUE_DEPTH; i++) {
+		// VirtualAlloc() gives us page aligned and zeroed buffers
+		aw->Slot[i].Buffer = (BYTE*)VirtualAlloc(NULL, MaxSize, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+		aw->Slot[i].Zeroed = TRUE;
+		aw->Slot[i].Overlapped.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+		if ((aw->Slot[i].Buffer == NULL) || (aw->Slot[i].Overlapped.hEvent == NULL)) {
+			uprintf("AsyncWrite: Could not allocate buffers: %s\n", WindowsErrorString());
+			goto error;
+		}
+	}
+
+	if (bReopen) {
+		// ReOpenFile() is only available on Vista and later
+		PF_INIT(ReOpenFile, kernel32);
+		if (pfReOpenFile != NULL) {
+			aw->hOverlapped = pfReOpenFile(hDrive, GENERIC_READ|GENERIC_WRITE,
+				FILE_SHARE_READ|FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED);
+			if (aw->hOverlapped == INVALID_HANDLE_VALUE)
+				uprintf("AsyncWrite: Could not reopen drive for overlapped I/O: %s\n", WindowsErrorString());
+		}
+	}
+	if (aw->hOverlapped == INVALID_HANDLE_VALUE) {
+		aw->hQueue = CreateSemaphore(NULL, 0, ASYNC_QUEUE_DEPTH, NULL);
+		if (aw->hQueue != NULL)
+			aw->hThread = CreateThread(NULL, 0, AsyncWriterThread, aw, 0, NULL);
+		if (aw->hThread == NULL) {
+			uprintf("AsyncWrite: Could not create writer thread: %s\n", WindowsErrorString());
+			goto error;
+		}
+	}
+	uprintf("Using %s asynchronous writes (%d x %d KB)\n", (aw->hThread == NULL)?"overlapped":"threaded",
+		ASYNC_QUEUE_DEPTH, MaxSize/1024);
+	return aw;
+
+error:
+	AsyncWriteClose(aw);
+	return NULL;
+}
+
+/*
+ * Queue the write of nSectors from pBuf, or of zeroes if pBuf is NULL. The data is
+ * copied, so that the buffer can be reused on return. This only waits if the maximum
+ * number of writes is already in flight. Returns FALSE if any write has failed.
+ */
+BOOL AsyncWriteSectors(ASYNC_WRITER* aw, uint64_t SectorSize, uint64_t StartSector,
+	uint64_t nSectors, const void* pBuf)
+{
+	ASYNC_SLOT* slot;
+	uint64_t Offset = StartSector*SectorSize;
+
+	if ((nSectors*SectorSize) > aw->MaxSize) {
+		uprintf("AsyncWrite: nSectors x SectorSize is too big\n");
+		return FALSE;
+	}
+
+	// Reuse the slot of the oldest request
+	slot = &aw->Slot[aw->Next];
+	AsyncWriteComplete(aw, slot);
+	aw->Next = (aw->Next+1) % ASYNC_QUEUE_DEPTH;
+
+	slot->Size = (DWORD)(nSectors*SectorSize);
+	if (pBuf == NULL) {
+		if (!slot->Zeroed)
+			memset(slot->Buffer, 0, aw->MaxSize);
+		slot->Zeroed = TRUE;
+	} else {
+		memcpy(slot->Buffer, pBuf, slot->Size);
+		slot->Zeroed = FALSE;
+	}
+	slot->StartSector = StartSector;
+	slot->Written = 0;
+	slot->Overlapped.Internal = 0;
+	slot->Overlapped.InternalHigh = 0;
+	slot->Overlapped.Offset = (DWORD)Offset;
+	slot->Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+	slot->Timestamp = IOStatsTimestamp();
+	slot->InFlight = TRUE;
+
+	if (aw->hThread != NULL) {
+		ResetEvent(slot->Overlapped.hEvent);
+		ReleaseSemaphore(aw->hQueue, 1, NULL);
+	} else if ( (!WriteFile(aw->hOverlapped, slot->Buffer, slot->Size, NULL, &slot->Overlapped))
+		&& (GetLastError() != ERROR_IO_PENDING) ) {
+		slot->Success = FALSE;
+		slot->Error = GetLastError();
+		slot->InFlight = FALSE;
+		uprintf("AsyncWrite: Could not queue write at sector %lld - %s\n", StartSector, WindowsErrorString());
+		if ((!aw->Error) || (StartSector < aw->ErrorSector))
+			aw->ErrorSector = StartSector;
+		aw->Error = TRUE;
+	}
+	return !aw->Error;
+}
+
+/*
+ * Wait for all the queued writes to complete. Returns FALSE if any write failed since
+ * the last flush, in which case the lowest failed sector is returned in ErrorSector.
+ */
+BOOL AsyncWriteFlush(ASYNC_WRITER* aw, uint64_t* ErrorSector)
+{
+	int i;
+	BOOL r;
+
+	if (aw == NULL)
+		return FALSE;
+	for (i=0; i<ASYNC_QUEUE_DEPTH; i++)
+		AsyncWriteComplete(aw, &aw->Slot[i]);
+	r = !aw->Error;
+	if ((!r) && (ErrorSector != NULL))
+		*ErrorSector = aw->ErrorSector;
+	aw->Error = FALSE;
+	return r;
+}
+
+// Number of bytes successfully written so far, for progress reporting
+uint64_t AsyncWriteCompleted(ASYNC_WRITER* aw)
+{
+	return (aw == NULL)?0:aw->BytesDone;
+}
+
+// Flush and release the engine. Returns FALSE if any write failed since the last flush.
+BOOL AsyncWriteClose(ASYNC_WRITER* aw)
+{
+	int i;
+	BOOL r;
+
+	if (aw == NULL)
+		return FALSE;
+	r = AsyncWriteFlush(aw, NULL);
+	if (aw->hThread != NULL) {
+		aw->Quit = TRUE;
+		ReleaseSemaphore(aw->hQueue, 1, NULL);
+		WaitForSingleObject(aw->hThread, INFINITE);
+		CloseHandle(aw->hThread);
+	}
+	if (aw->hQueue != NULL)
+		CloseHandle(aw->hQueue);
+	safe_closehandle(aw->hOverlapped);
+	for (i=0; i<ASYNC_QUEUE_DEPTH; i++) {
+		if (aw->Slot[i].Buffer != NULL)
+			VirtualFree(aw->Slot[i].Buffer, 0, MEM_RELEASE);
+		if (aw->Slot[i].Overlapped.hEvent != NULL)
+			CloseHandle(aw->Slot[i].Overlapped.hEvent);
+	}
+	free(aw);
+	return r;
+}
+
+/*
+ * Discard (TRIM) a range of sectors or, if hDrive is a file, deallocate that range,
+ * so that it reads back as zeroes without having to write them. Not all devices that
+ * support TRIM return zeroes for discarded sectors, so this is only reported as
+ * successful if the device guarantees it (thin provisioning "read zeroes"), or else
+ * if the whole range reads back as zeroes. Sample sectors are also filled with a
+ * pattern beforehand, so that a device that just ignores the request gets caught.
+ * On failure, the content of the range is undefined, and it must be zeroed by the caller.
+ */
+#define DISCARD_SAMPLES         3
+#define DISCARD_READBACK_SIZE   (1024*1024)
+#if !defined(IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES)
+#define IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES \
+	CTL_CODE(IOCTL_STORAGE_BASE, 0x0501, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#endif
+#define DeviceDsmAction_Trim_REDEF          1
+#define StorageDeviceTrimProperty_REDEF     8
+#define StorageDeviceLBProvisioningProperty_REDEF 11
+
+typedef struct {
+	DWORD Size;
+	DWORD Action;
+	DWORD Flags;
+	DWORD ParameterBlockOffset;
+	DWORD ParameterBlockLength;
+	DWORD DataSetRangesOffset;
+	DWORD DataSetRangesLength;
+} DEVICE_MANAGE_DATA_SET_ATTRIBUTES_REDEF;
+
+typedef struct {
+	LONGLONG StartingOffset;
+	DWORDLONG LengthInBytes;
+} DEVICE_DATA_SET_RANGE_REDEF;
+
+typedef struct {
+	DWORD Version;
+	DWORD Size;
+	BOOLEAN TrimEnabled;
+} DEVICE_TRIM_DESCRIPTOR_REDEF;
+
+typedef struct {
+	DWORD Version;
+	DWORD Size;
+	BYTE ThinProvisioningEnabled:1;
+	BYTE ThinProvisioningReadZeros:1;
+	BYTE AnchorSupported:1;
+	BYTE UnmapGranularityAlignmentValid:1;
+	BYTE Reserved0:4;
+	BYTE Reserved1[7];
+	DWORDLONG OptimalUnmapGranularity;
+	DWORDLONG UnmapGranularityAlignment;
+} DEVICE_LB_PROVISIONING_DESCRIPTOR_REDEF;
+
+// Returns TRUE if the device reports that discarded sectors read back as zeroes
+static BOOL DiscardReadsZeroes(HANDLE hDrive)
+{
+	STORAGE_PROPERTY_QUERY Query;
+	DEVICE_LB_PROVISIONING_DESCRIPTOR_REDEF Provisioning;
+	DWORD size;
+
+	memset(&Query, 0, sizeof(Query));
+	memset(&Provisioning, 0, sizeof(Provisioning));
+	Query.PropertyId = StorageDeviceLBProvisioningProperty_REDEF;
+	Query.QueryType = PropertyStandardQuery;
+	return (DeviceIoControl(hDrive, IOCTL_STORAGE_QUERY_PROPERTY, &Query, sizeof(Query),
+		&Provisioning, sizeof(Provisioning), &size, NULL)) && (size > 2*sizeof(DWORD))
+		&& (Provisioning.ThinProvisioningEnabled) && (Provisioning.ThinProvisioningReadZeros);
+}
+
+BOOL DiscardSectors(HANDLE hDrive, uint64_t SectorSize, uint64_t StartSector, uint64_t nSectors)
+{
+	struct {
+		DEVICE_MANAGE_DATA_SET_ATTRIBUTES_REDEF Attributes;
+		DEVICE_DATA_SET_RANGE_REDEF Range;
+	} Dsm;
+	STORAGE_PROPERTY_QUERY Query;
+	DEVICE_TRIM_DESCRIPTOR_REDEF Trim;
+	FILE_ZERO_DATA_INFORMATION ZeroData;
+	uint64_t i, n, Sample[DISCARD_SAMPLES];
+	BYTE* pBuf = NULL;
+	DWORD j, size;
+	BOOL r = FALSE, bReadsZeroes;
+
+	if ((nSectors == 0) || (SectorSize == 0))
+		return FALSE;
+
+	// Don't bother with devices that report that they don't support TRIM
+	memset(&Query, 0, sizeof(Query));
+	memset(&Trim, 0, sizeof(Trim));
+	Query.PropertyId = StorageDeviceTrimProperty_REDEF;
+	Query.QueryType = PropertyStandardQuery;
+	if ( (DeviceIoControl(hDrive, IOCTL_STORAGE_QUERY_PROPERTY, &Query, sizeof(Query), &Trim, sizeof(Trim), &size, NULL))
+	  && (size >= sizeof(Trim)) && (!Trim.TrimEnabled) )
+		return FALSE;
+
+	// VirtualAlloc() gives us a page aligned buffer
+	pBuf = (BYTE*)VirtualAlloc(NULL, (SIZE_T)max(SectorSize, DISCARD_READBACK_SIZE), MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+	if (pBuf == NULL)
+		return FALSE;
+
+	// Fill the first, middle and last sectors with a pattern, so that a device that
+	// just ignores the request (or returns stale data) doesn't pass the check
+	Sample[0] = StartSector;
+	Sample[1] = StartSector + nSectors/2;
+	Sample[2] = StartSector + nSectors - 1;
+	memset(pBuf, 0xA5, (size_t)SectorSize);
+	for (i=0; i<DISCARD_SAMPLES; i++) {
+		if (write_sectors(hDrive, SectorSize, Sample[i], 1, pBuf) != (int64_t)SectorSize)
+			goto out;
+	}
+
+	memset(&Dsm, 0, sizeof(Dsm));
+	Dsm.Attributes.Size = sizeof(Dsm.Attributes);
+	Dsm.Attributes.Action = DeviceDsmAction_Trim_REDEF;
+	Dsm.Attributes.DataSetRangesOffset = sizeof(Dsm.Attributes);
+	Dsm.Attributes.DataSetRangesLength = sizeof(Dsm.Range);
+	Dsm.Range.StartingOffset = StartSector*SectorSize;
+	Dsm.Range.LengthInBytes = nSectors*SectorSize;
+	ZeroData.FileOffset.QuadPart = StartSector*SectorSize;
+	ZeroData.BeyondFinalZero.QuadPart = (StartSector + nSectors)*SectorSize;
+	if (DeviceIoControl(hDrive, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &Dsm, sizeof(Dsm), NULL, 0, &size, NULL)) {
+		bReadsZeroes = DiscardReadsZeroes(hDrive);
+		uprintf("Discarded %lld sectors%s\n", nSectors, bReadsZeroes?"":" - device does not guarantee zeroes");
+	} else if (DeviceIoControl(hDrive, FSCTL_SET_ZERO_DATA, &ZeroData, sizeof(ZeroData), NULL, 0, &size, NULL)) {
+		// Deallocated ranges of a file always read as zeroes
+		bReadsZeroes = TRUE;
+		uprintf("Deallocated %lld sectors\n", nSectors);
+	} else {
+		goto out;
+	}
+
+	for (i=0; i<DISCARD_SAMPLES; i++) {
+		if (read_sectors(hDrive, SectorSize, Sample[i], 1, pBuf) != (int64_t)SectorSize)
+			goto out;
+		for (j=0; (j<SectorSize) && (pBuf[j]==0); j++);
+		if (j < SectorSize) {
+			uprintf("Discarded sectors do not read back as zeroes\n");
+			goto out;
+		}
+	}
+	// Without a guarantee from the device, only trust what we read back, for the whole range
+	for (i=0; (!bReadsZeroes) && (i<nSectors); i+=n) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		n = min(max(DISCARD_READBACK_SIZE / SectorSize, 1), nSectors - i);
+		if (read_sectors(hDrive, SectorSize, StartSector + i, n, pBuf) != (int64_t)(n * SectorSize))
+			goto out;
+		for (j=0; (j<n*SectorSize) && (pBuf[j]==0); j++);
+		if (j < n*SectorSize) {
+			uprintf("Discarded sectors do not read back as zeroes at sector %lld\n", StartSector + i + j/SectorSize);
+			goto out;
+		}
+	}
+	r = TRUE;
+
+out:
+	VirtualFree(pBuf, 0, MEM_RELEASE);
+	return r;
+}
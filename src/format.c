@@ -306,16 +306,17 @@ static DWORD GetVolumeID(void)
  *
  * return( FatSz );
  */
-static DWORD GetFATSizeSectors(DWORD DskSize, DWORD ReservedSecCnt, DWORD SecPerClus, DWORD NumFATs, DWORD BytesPerSect)
+static DWORD GetFATSizeSectors(DWORD DskSize, DWORD ReservedSecCnt, DWORD SecPerClus, DWORD NumFATs, DWORD BytesPerSect, DWORD FatBits)
 {
 	ULONGLONG Numerator, Denominator;
-	ULONGLONG FatElementSize = 4;
 	ULONGLONG FatSz;
 
 	// This is based on 
 	// http://hjem.get2net.dk/rune_moeller_barnkob/filesystems/fat.html
-	Numerator = FatElementSize * (DskSize - ReservedSecCnt);
-	Denominator = (SecPerClus * BytesPerSect) + (FatElementSize * NumFATs);
+	// but expressed in bits, so that it also applies to FAT12 and FAT16, and accounting
+	// for the 2 reserved FAT entries, which the original formula leaves out
+	Numerator = FatBits * ((ULONGLONG)(DskSize - ReservedSecCnt) + 2*SecPerClus);
+	Denominator = (SecPerClus * BytesPerSect * 8) + (FatBits * NumFATs);
 	FatSz = Numerator / Denominator;
 	// round up
 	FatSz += 1;
@@ -324,86 +325,106 @@ static DWORD GetFATSizeSectors(DWORD DskSize, DWORD ReservedSecCnt, DWORD SecPer
 }
 
 /*
- * Large FAT32 volume formatting from fat32format by Tom Thornhill
+ * A dismounted volume handle only services one request at a time, and it must not be
+ * reopened, as this would remount the volume. The disk that the volume is on can be
+ * reopened for overlapped I/O though, so when we have its handle, we write through the
+ * disk instead, which keeps several writes in flight on the device. StartSector is set
+ * to the sector where the volume starts on the handle that the writes must go to.
+ */
+static ASYNC_WRITER* AsyncWriteOpenVolume(HANDLE hVolume, HANDLE hDisk, DWORD MaxSize,
+	DWORD BytesPerSect, uint64_t* StartSector)
+{
+	PARTITION_INFORMATION_EX pi;
+	DWORD size;
+	ASYNC_WRITER* aw;
+
+	*StartSector = 0;
+	if ( (hDisk != NULL) && (hDisk != INVALID_HANDLE_VALUE)
+	  && (DeviceIoControl(hVolume, IOCTL_DISK_GET_PARTITION_INFO_EX, NULL, 0, &pi, sizeof(pi), &size, NULL))
+	  && ((pi.StartingOffset.QuadPart % BytesPerSect) == 0) ) {
+		aw = AsyncWriteOpen(hDisk, MaxSize, TRUE);
+		if (aw != NULL) {
+			*StartSector = pi.StartingOffset.QuadPart / BytesPerSect;
+			return aw;
+		}
+	}
+	return AsyncWriteOpen(hVolume, MaxSize, FALSE);
+}
+
+/*
+ * Native FAT12/FAT16/FAT32 formatting, originally based on fat32format by Tom Thornhill
  * http://www.ridgecrop.demon.co.uk/index.htm?fat32format.htm
+ * Only the reserved sectors, FATs and root directory get written (along with the cluster
+ * heap for a slow format), so formatting time only depends on the size of the metadata.
+ * The geometry is provided by the caller and all the writes go through the asynchronous
+ * write engine, so any handle that can be written to, device or image file, can be used.
  */
-// TODO: disable slow format for > 32 GB FAT32
-static BOOL FormatFAT32(DWORD DriveIndex)
+#define FAT_ZERO_BURST_SIZE     (4*1024*1024)	// size of the writes used to zero the system area
+typedef struct {
+	int FSType;				// FS_FAT16 (FAT12 or FAT16, according to the cluster count) or FS_FAT32
+	DWORD BytesPerSect;
+	DWORD ClusterSize;
+	ULONGLONG TotalSectors;
+	DWORD HiddenSectors;	// start of the volume on the disk
+	DWORD AlignSectors;		// alignment of the FATs and cluster heap relative to the disk, 0 for none
+	DWORD BurstSize;		// in bytes
+	HANDLE hDisk;			// disk the volume is on, for the zeroing writes, or INVALID_HANDLE_VALUE
+	WORD SectorsPerTrack;
+	WORD NumHeads;
+	char Label[12];			// 11 characters, space padded
+	BOOL bQuick;
+} FAT_PARAMS;
+
+static BOOL CreateFAT(HANDLE hVolume, FAT_PARAMS* p)
 {
 	BOOL r = FALSE;
-	char DriveLetter;
 	DWORD i;
-	HANDLE hLogicalVolume;
-	DWORD cbRet;
-	DISK_GEOMETRY dgDrive;
-	PARTITION_INFORMATION piDrive;
 	// Recommended values
-	DWORD ReservedSectCount = 32;
+	DWORD ReservedSectCount = (p->FSType == FS_FAT32)?32:1;
 	DWORD NumFATs = 2;
 	DWORD BackupBootSect = 6;
-	DWORD VolumeId = 0; // calculated before format
-	WCHAR wLabel[64], wDriveName[] = L"#:\\";
-	DWORD BurstSize = 128; // Zero in blocks of 64K typically
+	DWORD RootEntCnt = (p->FSType == FS_FAT32)?0:512;
+	DWORD VolumeId = GetVolumeID();
+	DWORD BurstSize, PadSectors, FatBits, AlignedFatSize;
+	HANDLE hDisk = p->hDisk;
+	uint64_t Offset;
+	SYSTEMTIME st;
 
 	// Calculated later
-	DWORD FatSize = 0; 
-	DWORD BytesPerSect = 0;
-	DWORD ClusterSize = 0;
-	DWORD SectorsPerCluster = 0;
-	DWORD TotalSectors = 0;
+	DWORD FatSize = 0;
+	DWORD BytesPerSect = p->BytesPerSect;
+	DWORD SectorsPerCluster = p->ClusterSize / p->BytesPerSect;
+	DWORD TotalSectors = (DWORD)p->TotalSectors;
+	DWORD RootDirSectors = 0;
 	DWORD SystemAreaSize = 0;
-	DWORD UserAreaSize = 0;
-	ULONGLONG qTotalSectors = 0;
+	DWORD ZeroSize = 0;
+	DWORD DataStart = 0;
+	DWORD AlignSectors = p->AlignSectors;
 
 	// Structures to be written to the disk
 	FAT_BOOTSECTOR32 *pFAT32BootSect = NULL;
+	FAT_BOOTSECTOR16 *pFAT16BootSect = NULL;
 	FAT_FSINFO *pFAT32FsInfo = NULL;
-	DWORD *pFirstSectOfFat = NULL;
-	BYTE* pZeroSect = NULL;
-	char VolId[12] = "NO NAME    ";
+	BYTE *pFirstSectOfFat = NULL;
+	BYTE *pFirstSectOfRoot = NULL;
+	FAT_DIRENT *pLabel;
+	ASYNC_WRITER* aw = NULL;
 
 	// Debug temp vars
-	ULONGLONG FatNeeded, ClusterCount;
+	ULONGLONG FatNeeded, ClusterCount, MinClusterCount;
 
-	PrintStatus(0, TRUE, "Formatting...");
-	uprintf("Using large FAT32 format method\n");
-	VolumeId = GetVolumeID();
+	if ((SectorsPerCluster == 0) || (SectorsPerCluster > 128) || ((SectorsPerCluster & (SectorsPerCluster-1)) != 0))
+		die("Invalid cluster size\n", APPERR(ERROR_INVALID_CLUSTER_SIZE));
 
-	// Open the drive (volume should already be locked)
-	hLogicalVolume = GetDriveHandle(DriveIndex, &DriveLetter, TRUE, FALSE);
-	if (IS_ERROR(FormatStatus)) goto out;
-	if (hLogicalVolume == INVALID_HANDLE_VALUE)
-		die("Could not access logical volume\n", ERROR_OPEN_FAILED);
-
-	// Make sure we get exclusive access
-	if (!UnmountDrive(hLogicalVolume))
-		return r;
-
-	// Work out drive params
-	if (!DeviceIoControl (hLogicalVolume, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &dgDrive,
-		sizeof(dgDrive), &cbRet, NULL)) {
-		die("Failed to get device geometry\n", ERROR_NOT_SUPPORTED);
-	}
-	if (IS_ERROR(FormatStatus)) goto out;
-	if (!DeviceIoControl (hLogicalVolume, IOCTL_DISK_GET_PARTITION_INFO, NULL, 0, &piDrive,
-		sizeof(piDrive), &cbRet, NULL)) {
-		die("Failed to get parition info\n", ERROR_NOT_SUPPORTED);
-	}
-
-	BytesPerSect = dgDrive.BytesPerSector;
-
-	// Checks on Disk Size
-	qTotalSectors = piDrive.PartitionLength.QuadPart/dgDrive.BytesPerSector;
-	// Low end limit - 65536 sectors
-	if (qTotalSectors < 65536) {
+	if ((p->FSType == FS_FAT32) && (p->TotalSectors < 65536)) {
 		// Most FAT32 implementations would probably mount this volume just fine,
 		// but the spec says that we shouldn't do this, so we won't
 		die("This drive is too small for FAT32 - there must be at least 64K clusters\n", APPERR(ERROR_INVALID_CLUSTER_SIZE));
 	}
 
-	if (qTotalSectors >= 0xffffffff) {
+	if (p->TotalSectors >= 0xffffffff) {
 		// This is a more fundamental limitation on FAT32 - the total sector count in the root dir
-		// s 32bit. With a bit of creativity, FAT32 could be extended to handle at least 2^28 clusters
+		// is 32bit. With a bit of creativity, FAT32 could be extended to handle at least 2^28 clusters
 		// There would need to be an extra field in the FSInfo sector, and the old sector count could
 		// be set to 0xffffffff. This is non standard though, the Windows FAT driver FASTFAT.SYS won't
 		// understand this. Perhaps a future version of FAT32 and FASTFAT will handle this.
@@ -412,50 +433,137 @@ static BOOL FormatFAT32(DWORD DriveIndex)
 
 	pFAT32BootSect = (FAT_BOOTSECTOR32*) calloc(BytesPerSect, 1);
 	pFAT32FsInfo = (FAT_FSINFO*) calloc(BytesPerSect, 1);
-	pFirstSectOfFat = (DWORD*) calloc(BytesPerSect, 1);
-	if (!pFAT32BootSect || !pFAT32FsInfo || !pFirstSectOfFat) {
+	pFirstSectOfFat = (BYTE*) calloc(BytesPerSect, 1);
+	pFirstSectOfRoot = (BYTE*) calloc(BytesPerSect, 1);
+	if (!pFAT32BootSect || !pFAT32FsInfo || !pFirstSectOfFat || !pFirstSectOfRoot) {
 		die("Failed to allocate memory\n", ERROR_NOT_ENOUGH_MEMORY);
 	}
+	// The FAT12/16 boot sector only differs after the common BPB fields
+	pFAT16BootSect = (FAT_BOOTSECTOR16*) pFAT32BootSect;
+
+	// Work out the FAT type and size. For FAT12/16, the root directory is not part of
+	// the cluster heap, and we use FAT12 when the cluster count is too low for FAT16.
+	FatBits = (p->FSType == FS_FAT32)?32:16;
+	RootDirSectors = (RootEntCnt * sizeof(FAT_DIRENT) + BytesPerSect - 1) / BytesPerSect;
+	while (1) {
+		FatSize = GetFATSizeSectors(TotalSectors, ReservedSectCount + RootDirSectors,
+			SectorsPerCluster, NumFATs, BytesPerSect, FatBits);
+		ClusterCount = (TotalSectors - ReservedSectCount - (NumFATs*FatSize) - RootDirSectors) / SectorsPerCluster;
+		if ((FatBits != 16) || (ClusterCount >= 4085))
+			break;
+		FatBits = 12;
+	}
+	MinClusterCount = (FatBits == 32)?65525:((FatBits == 16)?4085:0);
+
+	// Pad the reserved sectors so that the FATs (FAT32) or the cluster heap (FAT12/16) start
+	// on a flash friendly boundary relative to the start of the drive, unless the drive is
+	// so small that this would waste a significant amount of space
+	if ((AlignSectors != 0) && (AlignSectors <= TotalSectors / 64)) {
+		if (FatBits == 32) {
+			PadSectors = (p->HiddenSectors + ReservedSectCount) % AlignSectors;
+			// Rounding the FAT size up keeps the second FAT and the cluster heap aligned too
+			AlignedFatSize = ((FatSize + AlignSectors - 1) / AlignSectors) * AlignSectors;
+		} else {
+			PadSectors = (p->HiddenSectors + ReservedSectCount + (NumFATs*FatSize) + RootDirSectors) % AlignSectors;
+			AlignedFatSize = FatSize;
+		}
+		PadSectors = (AlignSectors - PadSectors) % AlignSectors;
+		// Don't align if this would leave too few clusters for the FAT type
+		ClusterCount = (TotalSectors - ReservedSectCount - PadSectors - (NumFATs*AlignedFatSize)
+			- RootDirSectors) / SectorsPerCluster;
+		if ((ReservedSectCount + PadSectors <= 0xFFFF) && (ClusterCount >= MinClusterCount)) {
+			ReservedSectCount += PadSectors;
+			FatSize = AlignedFatSize;
+			uprintf("Aligning %s on %d KB boundaries\n", (FatBits == 32)?"FATs and cluster heap":"cluster heap",
+				AlignSectors*BytesPerSect/1024);
+		}
+	}
+	DataStart = ReservedSectCount + (NumFATs*FatSize) + RootDirSectors;
+	ClusterCount = (TotalSectors - DataStart) / SectorsPerCluster;
+	// FAT12 can't go past 4084 clusters, which the smaller FAT12 FAT can push us over. The
+	// type is inferred from the cluster count of the BPB, so the sectors that don't fit must
+	// also be left out of the volume, or it would be seen as FAT16.
+	if ((FatBits == 12) && (ClusterCount > 4084)) {
+		ClusterCount = 4084;
+		TotalSectors = DataStart + (DWORD)ClusterCount * SectorsPerCluster;
+		uprintf("Reducing FAT12 volume to %d sectors\n", TotalSectors);
+	}
+
+	// Sanity check for a cluster count of >2^28, since the upper 4 bits of the cluster values in 
+	// the FAT are reserved.
+	if (ClusterCount > 0x0FFFFFF5) {
+		die("This drive has more than 2^28 clusters, try to specify a larger cluster size or use the default\n",
+			ERROR_INVALID_CLUSTER_SIZE);
+	}
+
+	// Sanity check - < 64K clusters means that the volume will be misdetected as FAT16
+	if ((FatBits == 32) && (ClusterCount < MinClusterCount)) {
+		die("FAT32 must have at least 65536 clusters, try to specify a smaller cluster size or use the default\n",
+			ERROR_INVALID_CLUSTER_SIZE);
+	}
+
+	// Likewise, >= 64K clusters means that a FAT16 volume would be misdetected as FAT32
+	if ((FatBits == 16) && (ClusterCount >= 65525)) {
+		die("FAT16 must have less than 65525 clusters, try to specify a larger cluster size or use the default\n",
+			ERROR_INVALID_CLUSTER_SIZE);
+	}
+
+	if (ClusterCount == 0)
+		die("This drive is too small for FAT\n", APPERR(ERROR_INVALID_VOLUME_SIZE));
 
-	// fill out the boot sector and fs info
+	// Sanity check, make sure the fat is big enough
+	// Convert the cluster count into a Fat sector count, and check the fat size value we calculated 
+	// earlier is OK.
+	FatNeeded = ((ClusterCount + 2) * FatBits + 7) / 8;
+	FatNeeded += (BytesPerSect-1);
+	FatNeeded /= BytesPerSect;
+	if (FatNeeded > FatSize) {
+		die("This drive is too big for FAT format\n", APPERR(ERROR_INVALID_VOLUME_SIZE));
+	}
+
+	// fill out the boot sector
 	pFAT32BootSect->sJmpBoot[0]=0xEB;
-	pFAT32BootSect->sJmpBoot[1]=0x5A;
+	pFAT32BootSect->sJmpBoot[1]=(FatBits == 32)?0x58:0x3C;
 	pFAT32BootSect->sJmpBoot[2]=0x90;
 	strncpy((char*)pFAT32BootSect->sOEMName, "MSWIN4.1", 8);
 	pFAT32BootSect->wBytsPerSec = (WORD) BytesPerSect;
-
-	ClusterSize = (DWORD)ComboBox_GetItemData(hClusterSize, ComboBox_GetCurSel(hClusterSize));
-	SectorsPerCluster = ClusterSize / BytesPerSect;
-
 	pFAT32BootSect->bSecPerClus = (BYTE) SectorsPerCluster ;
 	pFAT32BootSect->wRsvdSecCnt = (WORD) ReservedSectCount;
 	pFAT32BootSect->bNumFATs = (BYTE) NumFATs;
-	pFAT32BootSect->wRootEntCnt = 0;
+	pFAT32BootSect->wRootEntCnt = (WORD) RootEntCnt;
 	pFAT32BootSect->wTotSec16 = 0;
 	pFAT32BootSect->bMedia = 0xF8;
 	pFAT32BootSect->wFATSz16 = 0;
-	pFAT32BootSect->wSecPerTrk = (WORD) dgDrive.SectorsPerTrack;
-	pFAT32BootSect->wNumHeads = (WORD) dgDrive.TracksPerCylinder;
-	pFAT32BootSect->dHiddSec = (DWORD) piDrive.HiddenSectors;
-	TotalSectors = (DWORD)  (piDrive.PartitionLength.QuadPart/dgDrive.BytesPerSector);
+	pFAT32BootSect->wSecPerTrk = p->SectorsPerTrack;
+	pFAT32BootSect->wNumHeads = p->NumHeads;
+	pFAT32BootSect->dHiddSec = p->HiddenSectors;
 	pFAT32BootSect->dTotSec32 = TotalSectors;
-
-	FatSize = GetFATSizeSectors(pFAT32BootSect->dTotSec32, pFAT32BootSect->wRsvdSecCnt, 
-		pFAT32BootSect->bSecPerClus, pFAT32BootSect->bNumFATs, BytesPerSect);
-
-	pFAT32BootSect->dFATSz32 = FatSize;
-	pFAT32BootSect->wExtFlags = 0;
-	pFAT32BootSect->wFSVer = 0;
-	pFAT32BootSect->dRootClus = 2;
-	pFAT32BootSect->wFSInfo = 1;
-	pFAT32BootSect->wBkBootSec = (WORD) BackupBootSect;
-	pFAT32BootSect->bDrvNum = 0x80;
-	pFAT32BootSect->Reserved1 = 0;
-	pFAT32BootSect->bBootSig = 0x29;
-
-	pFAT32BootSect->dBS_VolID = VolumeId;
-	memcpy(pFAT32BootSect->sVolLab, VolId, 11);
-	memcpy(pFAT32BootSect->sBS_FilSysType, "FAT32   ", 8);
+	if (FatBits == 32) {
+		pFAT32BootSect->dFATSz32 = FatSize;
+		pFAT32BootSect->wExtFlags = 0;
+		pFAT32BootSect->wFSVer = 0;
+		pFAT32BootSect->dRootClus = 2;
+		pFAT32BootSect->wFSInfo = 1;
+		pFAT32BootSect->wBkBootSec = (WORD) BackupBootSect;
+		pFAT32BootSect->bDrvNum = 0x80;
+		pFAT32BootSect->Reserved1 = 0;
+		pFAT32BootSect->bBootSig = 0x29;
+		pFAT32BootSect->dBS_VolID = VolumeId;
+		memcpy(pFAT32BootSect->sVolLab, p->Label, 11);
+		memcpy(pFAT32BootSect->sBS_FilSysType, "FAT32   ", 8);
+	} else {
+		if (TotalSectors < 0x10000) {
+			pFAT16BootSect->wTotSec16 = (WORD) TotalSectors;
+			pFAT16BootSect->dTotSec32 = 0;
+		}
+		pFAT16BootSect->wFATSz16 = (WORD) FatSize;
+		pFAT16BootSect->bDrvNum = 0x80;
+		pFAT16BootSect->Reserved1 = 0;
+		pFAT16BootSect->bBootSig = 0x29;
+		pFAT16BootSect->dBS_VolID = VolumeId;
+		memcpy(pFAT16BootSect->sVolLab, p->Label, 11);
+		memcpy(pFAT16BootSect->sBS_FilSysType, (FatBits == 16)?"FAT16   ":"FAT12   ", 8);
+	}
 	((BYTE*)pFAT32BootSect)[510] = 0x55;
 	((BYTE*)pFAT32BootSect)[511] = 0xaa;
 
@@ -474,127 +582,710 @@ static BOOL FormatFAT32(DWORD DriveIndex)
 	// FSInfo sect
 	pFAT32FsInfo->dLeadSig = 0x41615252;
 	pFAT32FsInfo->dStrucSig = 0x61417272;
-	pFAT32FsInfo->dFree_Count = (DWORD) -1;
-	pFAT32FsInfo->dNxt_Free = (DWORD) -1;
+	pFAT32FsInfo->dFree_Count = (DWORD) (ClusterCount - 1);	// we used cluster 2 for the root dir
+	pFAT32FsInfo->dNxt_Free = 3; // clusters 0-1 resered, we used cluster 2 for the root dir
 	pFAT32FsInfo->dTrailSig = 0xaa550000;
 
 	// First FAT Sector
-	pFirstSectOfFat[0] = 0x0ffffff8;  // Reserved cluster 1 media id in low byte
-	pFirstSectOfFat[1] = 0x0fffffff;  // Reserved cluster 2 EOC
-	pFirstSectOfFat[2] = 0x0fffffff;  // end of cluster chain for root dir
+	if (FatBits == 32) {
+		((DWORD*)pFirstSectOfFat)[0] = 0x0ffffff8;  // Reserved cluster 1 media id in low byte
+		((DWORD*)pFirstSectOfFat)[1] = 0x0fffffff;  // Reserved cluster 2 EOC
+		((DWORD*)pFirstSectOfFat)[2] = 0x0fffffff;  // end of cluster chain for root dir
+	} else {
+		// Media id, followed by 0xFFF (FAT12) or 0xFFFF (FAT16) for the reserved clusters
+		pFirstSectOfFat[0] = 0xf8;
+		pFirstSectOfFat[1] = 0xff;
+		pFirstSectOfFat[2] = 0xff;
+		if (FatBits == 16)
+			pFirstSectOfFat[3] = 0xff;
+	}
+
+	// The volume label is also an entry of the root directory
+	if (memcmp(p->Label, "NO NAME    ", 11) != 0) {
+		GetLocalTime(&st);
+		pLabel = (FAT_DIRENT*)pFirstSectOfRoot;
+		memcpy(pLabel->sName, p->Label, 11);
+		pLabel->bAttr = 0x08;	// ATTR_VOLUME_ID
+		pLabel->wWrtTime = (st.wHour << 11) | (st.wMinute << 5) | (st.wSecond / 2);
+		pLabel->wWrtDate = ((st.wYear - 1980) << 9) | (st.wMonth << 5) | st.wDay;
+	}
 
 	// Write boot sector, fats
 	// Sector 0 Boot Sector
-	// Sector 1 FSInfo 
+	// Sector 1 FSInfo (FAT32)
 	// Sector 2 More boot code - we write zeros here
 	// Sector 3 unused
 	// Sector 4 unused
 	// Sector 5 unused
-	// Sector 6 Backup boot sector
-	// Sector 7 Backup FSInfo sector
+	// Sector 6 Backup boot sector (FAT32)
+	// Sector 7 Backup FSInfo sector (FAT32)
 	// Sector 8 Backup 'more boot code'
 	// zero'd sectors upto ReservedSectCount
 	// FAT1  ReservedSectCount to ReservedSectCount + FatSize
 	// ...
 	// FATn  ReservedSectCount to ReservedSectCount + FatSize
-	// RootDir - allocated to cluster2
-
-	UserAreaSize = TotalSectors - ReservedSectCount - (NumFATs*FatSize);
-	ClusterCount = UserAreaSize / SectorsPerCluster;
-
-	// Sanity check for a cluster count of >2^28, since the upper 4 bits of the cluster values in 
-	// the FAT are reserved.
-	if (ClusterCount > 0x0FFFFFFF) {
-		die("This drive has more than 2^28 clusters, try to specify a larger cluster size or use the default\n",
-			ERROR_INVALID_CLUSTER_SIZE);
-	}
-
-	// Sanity check - < 64K clusters means that the volume will be misdetected as FAT16
-	if (ClusterCount < 65536) {
-		die("FAT32 must have at least 65536 clusters, try to specify a smaller cluster size or use the default\n",
-			ERROR_INVALID_CLUSTER_SIZE);
-	}
-
-	// Sanity check, make sure the fat is big enough
-	// Convert the cluster count into a Fat sector count, and check the fat size value we calculated 
-	// earlier is OK.
-	FatNeeded = ClusterCount * 4;
-	FatNeeded += (BytesPerSect-1);
-	FatNeeded /= BytesPerSect;
-	if (FatNeeded > FatSize) {
-		die("This drive is too big for large FAT32 format\n", APPERR(ERROR_INVALID_VOLUME_SIZE));
-	}
+	// RootDir - fixed area (FAT12/16) or allocated to cluster2 (FAT32)
 
 	// Now we're commited - print some info first
-	uprintf("Size : %gGB %u sectors\n", (double) (piDrive.PartitionLength.QuadPart / (1000*1000*1000)), TotalSectors);
-	uprintf("Cluster size %d bytes, %d Bytes Per Sector\n", SectorsPerCluster*BytesPerSect, BytesPerSect);
+	uprintf("Size : %gGB %u sectors\n", (double) (p->TotalSectors * BytesPerSect / (1000*1000*1000)), TotalSectors);
+	uprintf("FAT%d, Cluster size %d bytes, %d Bytes Per Sector\n", FatBits, SectorsPerCluster*BytesPerSect, BytesPerSect);
 	uprintf("Volume ID is %x:%x\n", VolumeId>>16, VolumeId&0xffff);
 	uprintf("%d Reserved Sectors, %d Sectors per FAT, %d FATs\n", ReservedSectCount, FatSize, NumFATs);
-	uprintf("%d Total clusters\n", ClusterCount);
-
-	// Fix up the FSInfo sector
-	pFAT32FsInfo->dFree_Count = (UserAreaSize/SectorsPerCluster) - 1;
-	pFAT32FsInfo->dNxt_Free = 3; // clusters 0-1 resered, we used cluster 2 for the root dir
-
-	uprintf("%d Free Clusters\n", pFAT32FsInfo->dFree_Count);
-	// Work out the Cluster count
-
-	// First zero out ReservedSect + FatSize * NumFats + SectorsPerCluster
-	SystemAreaSize = ReservedSectCount + (NumFATs*FatSize) + SectorsPerCluster;
-	uprintf("Clearing out %d sectors for reserved sectors, FATs and root cluster...\n", SystemAreaSize);
-
-	// Not the most effective, but easy on RAM
-	pZeroSect = (BYTE*)calloc(BytesPerSect, BurstSize);
-	if (!pZeroSect) {
-		die("Failed to allocate memory\n", ERROR_NOT_ENOUGH_MEMORY);
+	uprintf("%d Total clusters\n", (DWORD)ClusterCount);
+	if (FatBits == 32)
+		uprintf("%d Free Clusters\n", pFAT32FsInfo->dFree_Count);
+
+	// First zero out ReservedSect + FatSize * NumFats + RootDir (or root cluster), or the whole
+	// volume for a slow format
+	SystemAreaSize = p->bQuick?(DataStart + ((FatBits == 32)?SectorsPerCluster:0)):TotalSectors;
+	uprintf("Clearing out %d sectors for %s...\n", SystemAreaSize,
+		p->bQuick?"reserved sectors, FATs and root directory":"the whole volume");
+
+	// On large volumes, the FATs alone can amount to hundreds of MB. If the device guarantees
+	// that discarded sectors read as zeroes, or if the whole area reads back as zeroes once
+	// discarded (or the target is a file), we don't need to write these.
+	ZeroSize = SystemAreaSize;
+	if ((p->bQuick) && (DiscardSectors(hVolume, BytesPerSect, 0, SystemAreaSize))) {
+		uprintf("Cleared the system area through discard\n");
+		ZeroSize = 0;
 	}
 
-	format_percent = 0.0f;
-	for (i=0; i<(SystemAreaSize+BurstSize-1); i+=BurstSize) {
-		format_percent = (100.0f*i)/(1.0f*(SystemAreaSize+BurstSize));
-		PrintStatus(0, FALSE, "Formatting: %d%% completed.", (int)format_percent);
-		UpdateProgress(OP_FORMAT, format_percent);
-		if (IS_ERROR(FormatStatus)) goto out;	// For cancellation
-		if (write_sectors(hLogicalVolume, BytesPerSect, i, BurstSize, pZeroSect) != (BytesPerSect*BurstSize)) {
+	// Else zero in large bursts, with several writes in flight, through the disk if we can
+	BurstSize = max(FAT_ZERO_BURST_SIZE, p->BurstSize) / BytesPerSect;
+	while (ZeroSize != 0) {
+		aw = AsyncWriteOpenVolume(hVolume, hDisk, BurstSize*BytesPerSect, BytesPerSect, &Offset);
+		if (aw == NULL) {
+			die("Failed to allocate memory\n", ERROR_NOT_ENOUGH_MEMORY);
+		}
+		format_percent = 0.0f;
+		for (i=0; i<ZeroSize; i+=BurstSize) {
+			format_percent = (100.0f*AsyncWriteCompleted(aw))/(1.0f*ZeroSize*BytesPerSect);
+			PrintStatus(0, FALSE, "Formatting: %d%% completed.", (int)format_percent);
+			UpdateProgress(OP_FORMAT, format_percent);
+			if (IS_ERROR(FormatStatus)) goto out;	// For cancellation
+			if (!AsyncWriteSectors(aw, BytesPerSect, Offset + i, min(BurstSize, ZeroSize-i), NULL))
+				break;
+		}
+		// The boot records must only be written once the zeroes are on the media
+		if (AsyncWriteClose(aw)) {
+			aw = NULL;
+			break;
+		}
+		aw = NULL;
+		if ((hDisk == NULL) || (hDisk == INVALID_HANDLE_VALUE)) {
 			die("Error clearing reserved sectors\n", ERROR_WRITE_FAULT);
 		}
+		uprintf("Could not clear the system area through the disk - retrying through the volume\n");
+		hDisk = INVALID_HANDLE_VALUE;
 	}
 
 	uprintf ("Initialising reserved sectors and FATs...\n");
+	aw = AsyncWriteOpen(hVolume, BytesPerSect, FALSE);
+	if (aw == NULL) {
+		die("Failed to allocate memory\n", ERROR_NOT_ENOUGH_MEMORY);
+	}
 	// Now we should write the boot sector and fsinfo twice, once at 0 and once at the backup boot sect position
-	for (i=0; i<2; i++) {
-		int SectorStart = (i==0) ? 0 : BackupBootSect;
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart, 1, pFAT32BootSect);
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart+1, 1, pFAT32FsInfo);
+	for (i=0; i<((FatBits == 32)?2:1); i++) {
+		DWORD SectorStart = (i==0) ? 0 : BackupBootSect;
+		AsyncWriteSectors(aw, BytesPerSect, SectorStart, 1, pFAT32BootSect);
+		if (FatBits == 32)
+			AsyncWriteSectors(aw, BytesPerSect, SectorStart+1, 1, pFAT32FsInfo);
 	}
 
 	// Write the first fat sector in the right places
 	for ( i=0; i<NumFATs; i++ ) {
-		int SectorStart = ReservedSectCount + (i * FatSize );
+		DWORD SectorStart = ReservedSectCount + (i * FatSize );
 		uprintf("FAT #%d sector at address: %d\n", i, SectorStart);
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart, 1, pFirstSectOfFat);
+		AsyncWriteSectors(aw, BytesPerSect, SectorStart, 1, pFirstSectOfFat);
+	}
+
+	// Write the first sector of the root directory, which holds the label
+	AsyncWriteSectors(aw, BytesPerSect, DataStart - RootDirSectors, 1, pFirstSectOfRoot);
+	if (!AsyncWriteClose(aw)) {
+		aw = NULL;
+		die("Error writing boot records and FATs\n", ERROR_WRITE_FAULT);
 	}
+	aw = NULL;
+	r = TRUE;
+
+out:
+	if (aw != NULL)
+		AsyncWriteClose(aw);
+	safe_free(pFAT32BootSect);
+	safe_free(pFAT32FsInfo);
+	safe_free(pFirstSectOfFat);
+	safe_free(pFirstSectOfRoot);
+	return r;
+}
+
+/*
+ * Format a FAT volume with the native formatter, which doesn't need to go through
+ * fmifs.dll and remount the volume, and is the only option for FAT32 above 32 GB
+ */
+static BOOL FormatFAT(DWORD DriveIndex, HANDLE hPhysicalDrive, int fs)
+{
+	BOOL r = FALSE, bUsedDefault;
+	char DriveLetter, OemChar[4];
+	DWORD i, j, cbRet;
+	int n;
+	HANDLE hLogicalVolume;
+	DISK_GEOMETRY dgDrive;
+	PARTITION_INFORMATION piDrive;
+	WCHAR wLabel[64];
+	FAT_PARAMS params;
+
+	PrintStatus(0, TRUE, "Formatting...");
+	uprintf("Using native FAT format method\n");
+
+	// Open the drive (volume should already be locked)
+	hLogicalVolume = GetDriveHandle(DriveIndex, &DriveLetter, TRUE, FALSE);
+	if (IS_ERROR(FormatStatus)) goto out;
+	if (hLogicalVolume == INVALID_HANDLE_VALUE)
+		die("Could not access logical volume\n", ERROR_OPEN_FAILED);
+
+	// Make sure we get exclusive access
+	if (!UnmountDrive(hLogicalVolume))
+		goto out;
 
-	// Set the FAT32 volume label
+	// Work out drive params
+	if (!DeviceIoControl (hLogicalVolume, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &dgDrive,
+		sizeof(dgDrive), &cbRet, NULL)) {
+		die("Failed to get device geometry\n", ERROR_NOT_SUPPORTED);
+	}
+	if (IS_ERROR(FormatStatus)) goto out;
+	if (!DeviceIoControl (hLogicalVolume, IOCTL_DISK_GET_PARTITION_INFO, NULL, 0, &piDrive,
+		sizeof(piDrive), &cbRet, NULL)) {
+		die("Failed to get parition info\n", ERROR_NOT_SUPPORTED);
+	}
+
+	memset(&params, 0, sizeof(params));
+	params.FSType = fs;
+	params.BytesPerSect = dgDrive.BytesPerSector;
+	params.ClusterSize = (DWORD)ComboBox_GetItemData(hClusterSize, ComboBox_GetCurSel(hClusterSize));
+	if (params.ClusterSize == 0)
+		params.ClusterSize = SelectedDrive.ClusterSize[fs].Default;
+	params.TotalSectors = piDrive.PartitionLength.QuadPart / dgDrive.BytesPerSector;
+	params.HiddenSectors = piDrive.HiddenSectors;
+	// Use the probed erase block size, or FAT32_DEFAULT_ALIGNMENT, for the alignment
+	params.AlignSectors = ((SelectedDrive.EraseBlockSize != 0)?SelectedDrive.EraseBlockSize:FAT32_DEFAULT_ALIGNMENT)
+		/ dgDrive.BytesPerSector;
+	params.BurstSize = SelectedDrive.OptimalIOSize;
+	params.hDisk = hPhysicalDrive;
+	params.SectorsPerTrack = (WORD)dgDrive.SectorsPerTrack;
+	params.NumHeads = (WORD)dgDrive.TracksPerCylinder;
+	params.bQuick = IsChecked(IDC_QUICKFORMAT);
+
+	// The label is written directly, which spares us a remount through SetVolumeLabel(), so we
+	// must do the conversion to the OEM codepage ourselves. Characters that it can't represent
+	// are rejected rather than approximated, as the label must match the one that the Syslinux
+	// configs get patched with.
 	GetWindowTextW(hLabel, wLabel, ARRAYSIZE(wLabel));
 	ToValidLabel(wLabel, TRUE);
-	wDriveName[0] = DriveLetter;
-	// Handle must be closed for SetVolumeLabel to work
-	safe_closehandle(hLogicalVolume);
-
-	PrintStatus(0, TRUE, "Setting Label (This can take while)...");
-	if (!SetVolumeLabelW(wDriveName, wLabel)) {
-		uprintf("Could not set label: %s\n", WindowsErrorString());
+	for (i=0, j=0; wLabel[i]!=0; i++) {
+		n = WideCharToMultiByte(CP_OEMCP, WC_NO_BEST_FIT_CHARS, &wLabel[i], 1, OemChar, sizeof(OemChar), NULL, &bUsedDefault);
+		if ((n <= 0) || (bUsedDefault)) {
+			uprintf("Label character U+%04X cannot be represented in the OEM codepage - replaced with '_'\n", wLabel[i]);
+			wLabel[i] = L'_';
+			OemChar[0] = '_';
+			n = 1;
+		}
+		if (j + n > 11) {
+			wLabel[i] = 0;
+			break;
+		}
+		memcpy(&params.Label[j], OemChar, n);
+		j += n;
 	}
+	wchar_to_utf8_no_alloc(wLabel, iso_report.usb_label, sizeof(iso_report.usb_label));
+	if (j == 0)
+		safe_strcpy(params.Label, sizeof(params.Label), "NO NAME");
+	for (i=(DWORD)strlen(params.Label); i<11; i++)
+		params.Label[i] = ' ';
+
+	if (!CreateFAT(hLogicalVolume, &params))
+		goto out;
 	uprintf("Format completed.\n");
 	r = TRUE;
 
 out:
 	safe_closehandle(hLogicalVolume);
-	safe_free(pFAT32BootSect);
-	safe_free(pFAT32FsInfo);
-	safe_free(pFirstSectOfFat);
-	safe_free(pZeroSect);
+	return r;
+}
+
+/*
+ * Persistence file creation for casper based live images (Ubuntu and derivatives).
+ * Rather than writing gigabytes of zeroes through the file system, we allocate a
+ * contiguous cluster chain straight into the FAT, write only the metadata blocks of
+ * an ext2 file system into it, and leave the rest of the clusters untouched.
+ */
+#define PERSISTENCE_SHORT_NAME  "CASPER~"
+#define PERSISTENCE_MIN_SIZE    (64*1024*1024ULL)
+#define PERSISTENCE_MAX_SIZE    (4095*1024*1024ULL)	// FAT32 file size limit, rounded down
+#define PERSISTENCE_FREE_SPACE  (64*1024*1024ULL)	// space left free on the FAT32 volume
+#define EXT2_BLOCK_SIZE         4096
+#define EXT2_BLOCKS_PER_GROUP   (8*EXT2_BLOCK_SIZE)
+#define EXT2_INODE_SIZE         128
+#define EXT2_INODE_RATIO        16384			// bytes per inode
+#define EXT2_ROOT_INO           2
+#define EXT2_FIRST_INO          11				// lost+found
+static const WCHAR persistence_name[] = L"casper-rw";
+static const struct { const char* path; const char* token; } persistence_cfg[] = {
+	{ "\\isolinux\\txt.cfg", "append" },
+	{ "\\isolinux\\isolinux.cfg", "append" },
+	{ "\\syslinux\\txt.cfg", "append" },
+	{ "\\syslinux\\syslinux.cfg", "append" },
+	{ "\\boot\\grub\\grub.cfg", "linux" },
+	{ "\\boot\\grub\\loopback.cfg", "linux" },
+};
+
+// Superblock backups are in groups 0, 1 and powers of 3, 5 and 7 (sparse_super)
+static BOOL Ext2GroupHasSuper(DWORD group)
+{
+	DWORD base, p;
+
+	if (group <= 1)
+		return TRUE;
+	for (base=3; base<=7; base+=2) {
+		for (p=base; p<group; p*=base);
+		if (p == group)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Write nb_blocks ext2 blocks, from buf or zeroes if buf is NULL
+static BOOL Ext2WriteBlocks(ASYNC_WRITER* aw, DWORD BytesPerSect, uint64_t StartSector,
+	DWORD block, DWORD nb_blocks, const void* buf)
+{
+	DWORD n, SectorsPerBlock = EXT2_BLOCK_SIZE / BytesPerSect;
+
+	while (nb_blocks != 0) {
+		n = min(nb_blocks, ASYNC_WRITE_SIZE / EXT2_BLOCK_SIZE);
+		if (!AsyncWriteSectors(aw, BytesPerSect, StartSector + (uint64_t)block*SectorsPerBlock,
+			(uint64_t)n*SectorsPerBlock, buf))
+			return FALSE;
+		block += n;
+		nb_blocks -= n;
+		if (buf != NULL)
+			buf = (const BYTE*)buf + (size_t)n*EXT2_BLOCK_SIZE;
+	}
+	return TRUE;
+}
+
+static __inline void SetBits(BYTE* bitmap, DWORD start, DWORD end)
+{
+	for (; start<end; start++)
+		bitmap[start/8] |= 1<<(start%8);
+}
+
+/*
+ * Create an ext2 file system of Size bytes, starting at StartSector, by writing only
+ * its superblocks, group descriptors, bitmaps, inode tables and root directories.
+ */
+static BOOL CreateExt2(ASYNC_WRITER* aw, DWORD BytesPerSect, uint64_t StartSector, uint64_t Size)
+{
+	BOOL r = FALSE;
+	EXT2_SUPERBLOCK* sb = NULL;
+	EXT2_GROUP_DESC* gd = NULL;
+	EXT2_INODE* inode;
+	EXT2_DIR_ENTRY* de;
+	BYTE* block = NULL;
+	DWORD i, g, nb_blocks, nb_groups, ipg, itb, gdtb, first, count, overhead, now;
+	DWORD root_block = 0, free_blocks = 0, free_inodes = 0;
+	FILETIME ft;
+	LARGE_INTEGER li;
+
+	nb_blocks = (DWORD)(Size / EXT2_BLOCK_SIZE);
+	nb_groups = (nb_blocks + EXT2_BLOCKS_PER_GROUP - 1) / EXT2_BLOCKS_PER_GROUP;
+	// Inodes per group, rounded to fill the inode table blocks
+	ipg = (DWORD)((Size / EXT2_INODE_RATIO + nb_groups - 1) / nb_groups);
+	ipg = (ipg + (EXT2_BLOCK_SIZE/EXT2_INODE_SIZE) - 1) & ~((EXT2_BLOCK_SIZE/EXT2_INODE_SIZE) - 1);
+	ipg = min(ipg, 8*EXT2_BLOCK_SIZE);
+	itb = ipg * EXT2_INODE_SIZE / EXT2_BLOCK_SIZE;
+	gdtb = (nb_groups * sizeof(EXT2_GROUP_DESC) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+	// Drop a last group that would be too small to be of any use
+	count = nb_blocks - (nb_groups-1) * EXT2_BLOCKS_PER_GROUP;
+	overhead = (Ext2GroupHasSuper(nb_groups-1)?1+gdtb:0) + 2 + itb;
+	if ((nb_groups > 1) && (count < overhead + 64)) {
+		nb_blocks -= count;
+		nb_groups--;
+	}
+	uprintf("Creating ext2 file system: %d blocks, %d groups, %d inodes\n", nb_blocks, nb_groups, ipg*nb_groups);
+
+	sb = (EXT2_SUPERBLOCK*)calloc(1, sizeof(EXT2_SUPERBLOCK));
+	gd = (EXT2_GROUP_DESC*)calloc(gdtb, EXT2_BLOCK_SIZE);
+	block = (BYTE*)calloc(1, EXT2_BLOCK_SIZE);
+	if ((sb == NULL) || (gd == NULL) || (block == NULL))
+		goto out;
+
+	// Lay out the groups
+	for (g=0; g<nb_groups; g++) {
+		first = g * EXT2_BLOCKS_PER_GROUP;
+		count = min(EXT2_BLOCKS_PER_GROUP, nb_blocks - first);
+		if (Ext2GroupHasSuper(g))
+			first += 1 + gdtb;
+		gd[g].bg_block_bitmap = first;
+		gd[g].bg_inode_bitmap = first + 1;
+		gd[g].bg_inode_table = first + 2;
+		first += 2 + itb;
+		gd[g].bg_free_inodes_count = (WORD)ipg;
+		if (g == 0) {
+			// The root and lost+found directories have one block each
+			root_block = first;
+			first += 2;
+			gd[g].bg_free_inodes_count -= EXT2_FIRST_INO;
+			gd[g].bg_used_dirs_count = 2;
+		}
+		gd[g].bg_free_blocks_count = (WORD)(count - (first - g * EXT2_BLOCKS_PER_GROUP));
+		free_blocks += gd[g].bg_free_blocks_count;
+		free_inodes += gd[g].bg_free_inodes_count;
+	}
+
+	GetSystemTimeAsFileTime(&ft);
+	li.LowPart = ft.dwLowDateTime;
+	li.HighPart = ft.dwHighDateTime;
+	now = (DWORD)((li.QuadPart - 116444736000000000LL) / 10000000);
+
+	sb->s_inodes_count = ipg * nb_groups;
+	sb->s_blocks_count = nb_blocks;
+	sb->s_free_blocks_count = free_blocks;
+	sb->s_free_inodes_count = free_inodes;
+	sb->s_first_data_block = 0;
+	sb->s_log_block_size = 2;			// 1024 << 2
+	sb->s_log_frag_size = 2;
+	sb->s_blocks_per_group = EXT2_BLOCKS_PER_GROUP;
+	sb->s_frags_per_group = EXT2_BLOCKS_PER_GROUP;
+	sb->s_inodes_per_group = ipg;
+	sb->s_wtime = now;
+	sb->s_lastcheck = now;
+	sb->s_max_mnt_count = 0xFFFF;
+	sb->s_magic = 0xEF53;
+	sb->s_state = 1;					// clean
+	sb->s_errors = 1;					// continue
+	sb->s_rev_level = 1;				// dynamic
+	sb->s_first_ino = EXT2_FIRST_INO;
+	sb->s_inode_size = EXT2_INODE_SIZE;
+	sb->s_feature_incompat = 0x0002;	// filetype
+	sb->s_feature_ro_compat = 0x0003;	// sparse_super, large_file
+	QueryPerformanceCounter(&li);
+	for (i=0; i<sizeof(sb->s_uuid); i++)
+		sb->s_uuid[i] = (BYTE)((GetVolumeID() >> (8*(i%4))) ^ (li.QuadPart >> (4*(i%16))) ^ (StartSector >> (i%8)));
+	sb->s_uuid[6] = (sb->s_uuid[6] & 0x0F) | 0x40;
+	sb->s_uuid[8] = (sb->s_uuid[8] & 0x3F) | 0x80;
+	WideCharToMultiByte(CP_ACP, 0, persistence_name, -1, (char*)sb->s_volume_name, sizeof(sb->s_volume_name), NULL, NULL);
+
+	for (g=0; g<nb_groups; g++) {
+		first = g * EXT2_BLOCKS_PER_GROUP;
+		count = min(EXT2_BLOCKS_PER_GROUP, nb_blocks - first);
+		if (Ext2GroupHasSuper(g)) {
+			// The primary superblock is at offset 1024, the backups at the start of their block
+			memset(block, 0, EXT2_BLOCK_SIZE);
+			sb->s_block_group_nr = (WORD)g;
+			memcpy(&block[(g == 0)?1024:0], sb, sizeof(EXT2_SUPERBLOCK));
+			if ( (!Ext2WriteBlocks(aw, BytesPerSect, StartSector, first, 1, block))
+			  || (!Ext2WriteBlocks(aw, BytesPerSect, StartSector, first + 1, gdtb, gd)) )
+				goto out;
+		}
+		// Block bitmap, with the bits past the end of the group set
+		memset(block, 0, EXT2_BLOCK_SIZE);
+		SetBits(block, 0, count - gd[g].bg_free_blocks_count);
+		SetBits(block, count, 8*EXT2_BLOCK_SIZE);
+		if (!Ext2WriteBlocks(aw, BytesPerSect, StartSector, gd[g].bg_block_bitmap, 1, block))
+			goto out;
+		// Inode bitmap
+		memset(block, 0, EXT2_BLOCK_SIZE);
+		SetBits(block, 0, ipg - gd[g].bg_free_inodes_count);
+		SetBits(block, ipg, 8*EXT2_BLOCK_SIZE);
+		if (!Ext2WriteBlocks(aw, BytesPerSect, StartSector, gd[g].bg_inode_bitmap, 1, block))
+			goto out;
+		if (g != 0) {
+			if (!Ext2WriteBlocks(aw, BytesPerSect, StartSector, gd[g].bg_inode_table, itb, NULL))
+				goto out;
+			continue;
+		}
+
+		// Group 0: the first inode table block holds the root and lost+found inodes
+		memset(block, 0, EXT2_BLOCK_SIZE);
+		for (i=0; i<2; i++) {
+			inode = (EXT2_INODE*)&block[(((i == 0)?EXT2_ROOT_INO:EXT2_FIRST_INO) - 1) * EXT2_INODE_SIZE];
+			inode->i_mode = (i == 0)?040755:040700;
+			inode->i_size = EXT2_BLOCK_SIZE;
+			inode->i_atime = inode->i_ctime = inode->i_mtime = now;
+			inode->i_links_count = (i == 0)?3:2;
+			inode->i_blocks = EXT2_BLOCK_SIZE / 512;
+			inode->i_block[0] = root_block + i;
+		}
+		if ( (!Ext2WriteBlocks(aw, BytesPerSect, StartSector, gd[g].bg_inode_table, 1, block))
+		  || (!Ext2WriteBlocks(aw, BytesPerSect, StartSector, gd[g].bg_inode_table + 1, itb - 1, NULL)) )
+			goto out;
+
+		// Root directory: ".", ".." and "lost+found"
+		memset(block, 0, EXT2_BLOCK_SIZE);
+		de = (EXT2_DIR_ENTRY*)&block[0];
+		de->inode = EXT2_ROOT_INO; de->rec_len = 12; de->name_len = 1; de->file_type = 2;
+		memcpy(de->name, ".", 1);
+		de = (EXT2_DIR_ENTRY*)&block[12];
+		de->inode = EXT2_ROOT_INO; de->rec_len = 12; de->name_len = 2; de->file_type = 2;
+		memcpy(de->name, "..", 2);
+		de = (EXT2_DIR_ENTRY*)&block[24];
+		de->inode = EXT2_FIRST_INO; de->rec_len = EXT2_BLOCK_SIZE - 24; de->name_len = 10; de->file_type = 2;
+		memcpy(de->name, "lost+found", 10);
+		if (!Ext2WriteBlocks(aw, BytesPerSect, StartSector, root_block, 1, block))
+			goto out;
+		// lost+found: "." and ".."
+		memset(block, 0, EXT2_BLOCK_SIZE);
+		de = (EXT2_DIR_ENTRY*)&block[0];
+		de->inode = EXT2_FIRST_INO; de->rec_len = 12; de->name_len = 1; de->file_type = 2;
+		memcpy(de->name, ".", 1);
+		de = (EXT2_DIR_ENTRY*)&block[12];
+		de->inode = EXT2_ROOT_INO; de->rec_len = EXT2_BLOCK_SIZE - 12; de->name_len = 2; de->file_type = 2;
+		memcpy(de->name, "..", 2);
+		if (!Ext2WriteBlocks(aw, BytesPerSect, StartSector, root_block + 1, 1, block))
+			goto out;
+	}
+	r = TRUE;
+
+out:
+	safe_free(sb);
+	safe_free(gd);
+	safe_free(block);
+	return r;
+}
+
+/*
+ * Create a contiguous casper-rw persistence file at the root of a FAT32 volume,
+ * and enable persistence in the boot configuration files.
+ */
+static BOOL CreatePersistence(DWORD DriveIndex, HANDLE hPhysicalDrive, const char* drive_name)
+{
+	BOOL r = FALSE, found = FALSE, enable = FALSE, prev_lfn = FALSE, written;
+	char DriveLetter, path[64];
+	HANDLE hLogicalVolume = INVALID_HANDLE_VALUE;
+	FAT_BOOTSECTOR32* pBootSect = NULL;
+	FAT_FSINFO* pFsInfo = NULL;
+	FAT_DIRENT* pDirent;
+	FAT_LFN_DIRENT* pLfn;
+	FAT_LFN_DIRENT lfn;
+	DWORD* pFAT = NULL;
+	BYTE* pCluster = NULL;
+	ASYNC_WRITER* aw = NULL;
+	DWORD i, j, c, BytesPerSect, ClusterSize, DataStart, NbClusters, FatSize;
+	DWORD NbFree = 0, RunStart = 0, RunSize = 0, BestStart = 0, BestSize = 0;
+	DWORD NbAlloc, DirCluster = 0, DirSlot = 0, ShortNames = 0, Loops;
+	DWORD FirstSect, LastSect;
+	BYTE Checksum;
+	uint64_t Size, Offset;
+	SYSTEMTIME st;
+	WORD DosDate, DosTime;
+	LARGE_INTEGER li;
+
+	PrintStatus(0, TRUE, "Creating persistence file...");
+	BytesPerSect = SelectedDrive.Geometry.BytesPerSector;
+	hLogicalVolume = GetDriveHandle(DriveIndex, &DriveLetter, TRUE, TRUE);
+	if (hLogicalVolume == INVALID_HANDLE_VALUE)
+		die("Could not lock volume for persistence file creation\n", ERROR_OPEN_FAILED);
+	if (!UnmountDrive(hLogicalVolume))
+		die("Could not dismount volume for persistence file creation\n", ERROR_OPEN_FAILED);
+
+	pBootSect = (FAT_BOOTSECTOR32*)calloc(BytesPerSect, 1);
+	pFsInfo = (FAT_FSINFO*)calloc(BytesPerSect, 1);
+	if ((pBootSect == NULL) || (pFsInfo == NULL))
+		die("Failed to allocate memory\n", ERROR_NOT_ENOUGH_MEMORY);
+	if (read_sectors(hLogicalVolume, BytesPerSect, 0, 1, pBootSect) != BytesPerSect)
+		die("Could not read boot sector\n", ERROR_READ_FAULT);
+	if ( (memcmp(pBootSect->sBS_FilSysType, "FAT32   ", 8) != 0) || (pBootSect->wBytsPerSec != BytesPerSect)
+	  || (pBootSect->bSecPerClus == 0) || (pBootSect->bNumFATs == 0) ) {
+		uprintf("Persistence requires a FAT32 volume - skipping\n");
+		r = TRUE;
+		goto out;
+	}
+	ClusterSize = BytesPerSect * pBootSect->bSecPerClus;
+	FatSize = pBootSect->dFATSz32;
+	DataStart = pBootSect->wRsvdSecCnt + pBootSect->bNumFATs * FatSize;
+	NbClusters = min((pBootSect->dTotSec32 - DataStart) / pBootSect->bSecPerClus, FatSize * (BytesPerSect/4) - 2);
+
+	pFAT = (DWORD*)malloc((size_t)FatSize * BytesPerSect);
+	pCluster = (BYTE*)malloc(ClusterSize);
+	if ((pFAT == NULL) || (pCluster == NULL))
+		die("Failed to allocate memory\n", ERROR_NOT_ENOUGH_MEMORY);
+	if (read_sectors(hLogicalVolume, BytesPerSect, pBootSect->wRsvdSecCnt, FatSize, pFAT) != (int64_t)FatSize * BytesPerSect)
+		die("Could not read FAT\n", ERROR_READ_FAULT);
+
+	// Look for an existing file and for two free consecutive entries in the root directory
+	memset(&lfn, 0xFF, sizeof(lfn));
+	for (i=0; i<ARRAYSIZE(persistence_name); i++) {
+		if (i < 5) lfn.wName1[i] = persistence_name[i];
+		else if (i < 11) lfn.wName2[i-5] = persistence_name[i];
+		else lfn.wName3[i-11] = persistence_name[i];
+	}
+	for (c=pBootSect->dRootClus, Loops=0; (c >= 2) && (c < NbClusters+2) && (Loops < NbClusters); c=pFAT[c]&0x0FFFFFFF, Loops++) {
+		if (read_sectors(hLogicalVolume, BytesPerSect, DataStart + (uint64_t)(c-2)*pBootSect->bSecPerClus,
+			pBootSect->bSecPerClus, pCluster) != ClusterSize)
+			die("Could not read root directory\n", ERROR_READ_FAULT);
+		for (i=0; i<ClusterSize/sizeof(FAT_DIRENT); i++) {
+			pDirent = &((FAT_DIRENT*)pCluster)[i];
+			pLfn = (FAT_LFN_DIRENT*)pDirent;
+			if (pDirent->sName[0] == 0x00) {
+				// End of directory: the remainder of the entries are free
+				if ((DirCluster == 0) && (i+1 < ClusterSize/sizeof(FAT_DIRENT))) {
+					DirCluster = c;
+					DirSlot = i;
+				}
+				break;
+			}
+			if (pDirent->sName[0] == 0xE5) {
+				if ((DirCluster == 0) && (i+1 < ClusterSize/sizeof(FAT_DIRENT))
+				  && ((pDirent[1].sName[0] == 0xE5) || (pDirent[1].sName[0] == 0x00))) {
+					DirCluster = c;
+					DirSlot = i;
+				}
+				prev_lfn = FALSE;
+				continue;
+			}
+			if ( (pLfn->bAttr == 0x0F) && (pLfn->bOrd == 0x41) && (memcmp(pLfn->wName1, lfn.wName1, sizeof(lfn.wName1)) == 0)
+			  && (memcmp(pLfn->wName2, lfn.wName2, sizeof(lfn.wName2)) == 0)
+			  && (memcmp(pLfn->wName3, lfn.wName3, sizeof(lfn.wName3)) == 0) )
+				found = TRUE;
+			if (pDirent->bAttr != 0x0F) {
+				// A file that was copied without its long name only has its 8.3 one
+				if (memcmp(pDirent->sName, "CASPER-R   ", 11) == 0)
+					found = TRUE;
+				if ( (memcmp(pDirent->sName, PERSISTENCE_SHORT_NAME, 7) == 0)
+				  && (pDirent->sName[7] >= '1') && (pDirent->sName[7] <= '9') ) {
+					if ((!prev_lfn) && (memcmp(&pDirent->sName[8], "   ", 3) == 0))
+						found = TRUE;
+					ShortNames |= 1 << (pDirent->sName[7] - '0');
+				}
+			}
+			prev_lfn = (pLfn->bAttr == 0x0F);
+		}
+		if ((i < ClusterSize/sizeof(FAT_DIRENT)) || ((pFAT[c]&0x0FFFFFFF) >= 0x0FFFFFF8))
+			break;
+	}
+	if (found) {
+		uprintf("A persistence file already exists - reusing it\n");
+		enable = TRUE;
+		r = TRUE;
+		goto out;
+	}
+	for (j=1; (j<=9) && (ShortNames & (1<<j)); j++);
+	if ((DirCluster == 0) || (j > 9)) {
+		uprintf("No room for a persistence file in the root directory - skipping\n");
+		r = TRUE;
+		goto out;
+	}
+
+	// Find the largest run of free clusters
+	for (c=2; c<NbClusters+2; c++) {
+		if ((pFAT[c] & 0x0FFFFFFF) != 0) {
+			RunSize = 0;
+			continue;
+		}
+		NbFree++;
+		if (RunSize++ == 0)
+			RunStart = c;
+		if (RunSize > BestSize) {
+			BestStart = RunStart;
+			BestSize = RunSize;
+		}
+	}
+	Size = min((uint64_t)BestSize, (uint64_t)NbFree - min(NbFree, PERSISTENCE_FREE_SPACE / ClusterSize)) * ClusterSize;
+	Size = min(Size, PERSISTENCE_MAX_SIZE) & ~(1024*1024ULL - 1);
+	if (Size < PERSISTENCE_MIN_SIZE) {
+		uprintf("Not enough contiguous free space for a persistence file - skipping\n");
+		r = TRUE;
+		goto out;
+	}
+	NbAlloc = (DWORD)(Size / ClusterSize);
+	li.QuadPart = Size;
+	uprintf("Allocating %s persistence file at cluster %d (%d clusters)\n",
+		SizeToHumanReadable(li), BestStart, NbAlloc);
+
+	// Write the ext2 metadata first, so that the file is never visible half initialized.
+	// The inode tables can be large, so this goes through the disk if we can.
+	while (1) {
+		aw = AsyncWriteOpenVolume(hLogicalVolume, hPhysicalDrive, ASYNC_WRITE_SIZE, BytesPerSect, &Offset);
+		if (aw == NULL)
+			die("Could not set up persistence file writes\n", ERROR_NOT_ENOUGH_MEMORY);
+		written = CreateExt2(aw, BytesPerSect, Offset + DataStart + (uint64_t)(BestStart-2)*pBootSect->bSecPerClus, Size);
+		written = AsyncWriteClose(aw) && written;
+		aw = NULL;
+		if (written)
+			break;
+		if (hPhysicalDrive == INVALID_HANDLE_VALUE)
+			die("Could not write persistence file system\n", ERROR_WRITE_FAULT);
+		uprintf("Could not write the persistence file system through the disk - retrying through the volume\n");
+		hPhysicalDrive = INVALID_HANDLE_VALUE;
+	}
+
+	// Chain the clusters, and update all the FATs
+	for (c=BestStart; c<BestStart+NbAlloc; c++)
+		pFAT[c] = (pFAT[c] & 0xF0000000) | ((c == BestStart+NbAlloc-1)?0x0FFFFFFF:c+1);
+	FirstSect = BestStart*4 / BytesPerSect;
+	LastSect = (BestStart+NbAlloc-1)*4 / BytesPerSect;
+	for (i=0; i<pBootSect->bNumFATs; i++) {
+		if (write_sectors(hLogicalVolume, BytesPerSect, pBootSect->wRsvdSecCnt + i*FatSize + FirstSect,
+			LastSect - FirstSect + 1, &((BYTE*)pFAT)[FirstSect*BytesPerSect]) != (int64_t)(LastSect - FirstSect + 1) * BytesPerSect)
+			die("Could not update FAT\n", ERROR_WRITE_FAULT);
+	}
+
+	// Add the directory entries: long file name, then short name
+	if (read_sectors(hLogicalVolume, BytesPerSect, DataStart + (uint64_t)(DirCluster-2)*pBootSect->bSecPerClus,
+		pBootSect->bSecPerClus, pCluster) != ClusterSize)
+		die("Could not read root directory\n", ERROR_READ_FAULT);
+	pDirent = &((FAT_DIRENT*)pCluster)[DirSlot+1];
+	memset(pDirent, 0, sizeof(FAT_DIRENT));
+	memcpy(pDirent->sName, PERSISTENCE_SHORT_NAME "0   ", 11);
+	pDirent->sName[7] = (BYTE)('0' + j);
+	pDirent->bAttr = FILE_ATTRIBUTE_ARCHIVE;
+	GetLocalTime(&st);
+	DosDate = ((st.wYear - 1980) << 9) | (st.wMonth << 5) | st.wDay;
+	DosTime = (st.wHour << 11) | (st.wMinute << 5) | (st.wSecond / 2);
+	pDirent->wCrtDate = pDirent->wLstAccDate = pDirent->wWrtDate = DosDate;
+	pDirent->wCrtTime = pDirent->wWrtTime = DosTime;
+	pDirent->wFstClusHI = (WORD)(BestStart >> 16);
+	pDirent->wFstClusLO = (WORD)BestStart;
+	pDirent->dFileSize = (DWORD)Size;
+	for (i=0, Checksum=0; i<11; i++)
+		Checksum = ((Checksum & 1) << 7) + (Checksum >> 1) + pDirent->sName[i];
+	lfn.bOrd = 0x41;
+	lfn.bAttr = 0x0F;
+	lfn.bType = 0;
+	lfn.bChksum = Checksum;
+	lfn.wFstClusLO = 0;
+	memcpy(&((FAT_DIRENT*)pCluster)[DirSlot], &lfn, sizeof(lfn));
+	if (write_sectors(hLogicalVolume, BytesPerSect, DataStart + (uint64_t)(DirCluster-2)*pBootSect->bSecPerClus,
+		pBootSect->bSecPerClus, pCluster) != ClusterSize)
+		die("Could not write root directory\n", ERROR_WRITE_FAULT);
+	enable = TRUE;
+
+	// Keep the free cluster count in sync
+	if ( (pBootSect->wFSInfo != 0) && (read_sectors(hLogicalVolume, BytesPerSect, pBootSect->wFSInfo, 1, pFsInfo) == BytesPerSect)
+	  && (pFsInfo->dLeadSig == 0x41615252) && (pFsInfo->dStrucSig == 0x61417272) ) {
+		if ((pFsInfo->dFree_Count != 0xFFFFFFFF) && (pFsInfo->dFree_Count >= NbAlloc))
+			pFsInfo->dFree_Count -= NbAlloc;
+		pFsInfo->dNxt_Free = 0xFFFFFFFF;
+		write_sectors(hLogicalVolume, BytesPerSect, pBootSect->wFSInfo, 1, pFsInfo);
+	}
+	r = TRUE;
+
+out:
+	if (aw != NULL)
+		AsyncWriteClose(aw);
+	safe_unlockclose(hLogicalVolume);
+	// The configuration files can only be patched once the volume is released. Those
+	// that already enable persistence (e.g. from an earlier run) are left alone.
+	for (i=0; enable && (i<ARRAYSIZE(persistence_cfg)); i++) {
+		safe_sprintf(path, sizeof(path), "%s%s", drive_name, persistence_cfg[i].path);
+		if ( (GetFileAttributesU(path) != INVALID_FILE_ATTRIBUTES)
+		  && (!find_in_token_data(path, persistence_cfg[i].token, "persistent"))
+		  && (replace_in_token_data(path, persistence_cfg[i].token, "boot=casper", "boot=casper persistent", TRUE) != NULL) )
+			uprintf("Enabled persistence in %s\n", path);
+	}
+	safe_free(pBootSect);
+	safe_free(pFsInfo);
+	safe_free(pFAT);
+	safe_free(pCluster);
 	return r;
 }
 
@@ -688,9 +1379,12 @@ static BOOL AnalyzeMBR(HANDLE hPhysicalDrive)
 
 	fake_fd._ptr = (char*)hPhysicalDrive;
 	fake_fd._bufsiz = SelectedDrive.Geometry.BytesPerSector;
+	// Cache the sectors, so that the MBR is only read once for all the checks below
+	begin_sector_cache(&fake_fd);
 
 	if (!is_br(&fake_fd)) {
 		uprintf("Drive does not have an x86 master boot record\n");
+		flush_sector_cache(&fake_fd);
 		return FALSE;
 	}
 	if (is_dos_mbr(&fake_fd)) {
@@ -711,6 +1405,7 @@ static BOOL AnalyzeMBR(HANDLE hPhysicalDrive)
 	} else {
 		uprintf("Unknown boot record\n");
 	}
+	flush_sector_cache(&fake_fd);
 	return TRUE;
 }
 
@@ -720,9 +1415,11 @@ static BOOL AnalyzePBR(HANDLE hLogicalVolume)
 
 	fake_fd._ptr = (char*)hLogicalVolume;
 	fake_fd._bufsiz = SelectedDrive.Geometry.BytesPerSector;
+	begin_sector_cache(&fake_fd);
 
 	if (!is_br(&fake_fd)) {
 		uprintf("Volume does not have an x86 partition boot record\n");
+		flush_sector_cache(&fake_fd);
 		return FALSE;
 	}
 	if (is_fat_16_br(&fake_fd) || is_fat_32_br(&fake_fd)) {
@@ -740,6 +1437,7 @@ static BOOL AnalyzePBR(HANDLE hLogicalVolume)
 			uprintf("Drive has a unknown FAT16 or FAT32 partition boot record\n");
 		}
 	}
+	flush_sector_cache(&fake_fd);
 	return TRUE;
 }
 
@@ -852,6 +1550,8 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 
 	fake_fd._ptr = (char*)hPhysicalDrive;
 	fake_fd._bufsiz = SelectedDrive.Geometry.BytesPerSector;
+	// Batch all the MBR modifications, so that each sector is only written once
+	begin_sector_cache(&fake_fd);
 	fs = (int)ComboBox_GetItemData(hFileSystem, ComboBox_GetCurSel(hFileSystem));
 	dt = (int)ComboBox_GetItemData(hBootType, ComboBox_GetCurSel(hBootType));
 	if ( (dt == DT_SYSLINUX) || ((dt == DT_ISO) && ((fs == FS_FAT16) || (fs == FS_FAT32))) ) {
@@ -865,6 +1565,8 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 			r = write_win7_mbr(&fake_fd);
 		}
 	}
+	if (!flush_sector_cache(&fake_fd))
+		r = FALSE;
 
 out:
 	safe_free(buf);
@@ -877,11 +1579,14 @@ out:
 static BOOL WritePBR(HANDLE hLogicalVolume)
 {
 	int i;
+	BOOL r = FALSE;
 	FILE fake_fd = { 0 };
 	BOOL bFreeDOS = (ComboBox_GetItemData(hBootType, ComboBox_GetCurSel(hBootType)) == DT_FREEDOS);
 
 	fake_fd._ptr = (char*)hLogicalVolume;
 	fake_fd._bufsiz = SelectedDrive.Geometry.BytesPerSector;
+	// Batch all the PBR modifications, so that each sector is only written once
+	begin_sector_cache(&fake_fd);
 
 	switch (ComboBox_GetItemData(hFileSystem, ComboBox_GetCurSel(hFileSystem))) {
 	case FS_FAT16:
@@ -898,7 +1603,8 @@ static BOOL WritePBR(HANDLE hLogicalVolume)
 		// Disk Drive ID needs to be corrected on XP
 		if (!write_partition_physical_disk_drive_id_fat16(&fake_fd))
 			break;
-		return TRUE;
+		r = TRUE;
+		break;
 	case FS_FAT32:
 		for (i=0; i<2; i++) {
 			if (!is_fat_32_fs(&fake_fd)) {
@@ -915,7 +1621,8 @@ static BOOL WritePBR(HANDLE hLogicalVolume)
 				break;
 			fake_fd._cnt += 6 * (int)SelectedDrive.Geometry.BytesPerSector;
 		}
-		return TRUE;
+		r = TRUE;
+		break;
 	case FS_NTFS:
 		if (!is_ntfs_fs(&fake_fd)) {
 			uprintf("New volume does not have an NTFS boot sector\n");
@@ -926,13 +1633,17 @@ static BOOL WritePBR(HANDLE hLogicalVolume)
 		// Note: NTFS requires a full remount after writing the PBR. We dismount when we lock
 		// and also go through a forced remount, so that shouldn't be an issue.
 		// But with NTFS, if you don't remount, you don't boot!
-		return TRUE;
+		r = TRUE;
+		break;
 	default:
 		uprintf("unsupported FS for FS BR processing\n");
 		break;
 	}
-	FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
-	return FALSE;
+	if (!flush_sector_cache(&fake_fd))
+		r = FALSE;
+	if (!r)
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+	return r;
 }
 
 /*
@@ -1098,23 +1809,57 @@ static BOOL RemountVolume(char drive_letter)
  */
 DWORD WINAPI FormatThread(LPVOID param)
 {
-	int r, pt, bt, fs, dt;
+	int r, pt, bt, fs, dt, nb_passes;
 	BOOL ret;
 	DWORD num = (DWORD)(uintptr_t)param;
 	HANDLE hPhysicalDrive = INVALID_HANDLE_VALUE;
 	HANDLE hLogicalVolume = INVALID_HANDLE_VALUE;
 	SYSTEMTIME lt;
 	char drive_name[] = "?:\\";
+	WCHAR wDriveRoot[] = L"?:\\", wLabel[64];
 	char bb_msg[512];
-	char logfile[MAX_PATH], *userdir;
-	char wim_image[] = "?:\\sources\\install.wim";
+	char logfile[MAX_PATH], speedfile[MAX_PATH], *userdir, *label;
+	char wim_image[] = "?:\\sources\\install.wim", ldlinux_path[16];
 	char efi_dst[] = "?:\\efi\\boot\\bootx64.efi";
-	FILE* log_fd;
+	FILE *log_fd, *speed_fd;
 
 	fs = (int)ComboBox_GetItemData(hFileSystem, ComboBox_GetCurSel(hFileSystem));
 	dt = (int)ComboBox_GetItemData(hBootType, ComboBox_GetCurSel(hBootType));
 	pt = GETPARTTYPE((int)ComboBox_GetItemData(hPartitionScheme, ComboBox_GetCurSel(hPartitionScheme)));
 	bt = GETBIOSTYPE((int)ComboBox_GetItemData(hPartitionScheme, ComboBox_GetCurSel(hPartitionScheme)));
+	IOStatsReset();
+
+	if (resume_extraction) {
+		// The drive was formatted, and had its boot records and bootloader installed, by
+		// an earlier run that got interrupted during the ISO copy => just resume the copy
+		if (!GetDriveLabel(num, drive_name, &label)) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
+			goto out;
+		}
+		uprintf("Resuming ISO copy onto %c: (%s)\n", drive_name[0], label);
+		goto copy_files;
+	}
+	if (update_extraction) {
+		// The existing volume is kept, and only gets the label for the new ISO, which is also
+		// what the Syslinux configs are patched with. The boot records and bootloader may not
+		// suit the new ISO (e.g. a different Syslinux version), so they are installed again.
+		if (!GetDriveLabel(num, drive_name, &label)) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
+			goto out;
+		}
+		uprintf("Updating ISO copy on %c: (%s)\n", drive_name[0], label);
+		GetWindowTextW(hLabel, wLabel, ARRAYSIZE(wLabel));
+		ToValidLabel(wLabel, (fs == FS_FAT16) || (fs == FS_FAT32));
+		wDriveRoot[0] = (WCHAR)drive_name[0];
+		if (!SetVolumeLabelW(wDriveRoot, wLabel))
+			uprintf("Could not set volume label: %s\n", WindowsErrorString());
+		hPhysicalDrive = GetDriveHandle(num, NULL, TRUE, TRUE);
+		if (hPhysicalDrive == INVALID_HANDLE_VALUE) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
+			goto out;
+		}
+		goto boot_records;
+	}
 
 	hPhysicalDrive = GetDriveHandle(num, NULL, TRUE, TRUE);
 	if (hPhysicalDrive == INVALID_HANDLE_VALUE) {
@@ -1138,6 +1883,8 @@ DWORD WINAPI FormatThread(LPVOID param)
 	AnalyzePBR(hLogicalVolume);
 
 	if (IsChecked(IDC_BADBLOCKS)) {
+		IOStatsSetPhase(OP_BADBLOCKS);
+		nb_passes = (int)ComboBox_GetItemData(hNBPasses, ComboBox_GetCurSel(hNBPasses));
 		do {
 			// create a log file for bad blocks report. Since %USERPROFILE% may
 			// have localised characters, we use the UTF-8 API.
@@ -1156,18 +1903,32 @@ DWORD WINAPI FormatThread(LPVOID param)
 				lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
 				fflush(log_fd);
 			}
+			// The speed map is kept regardless of the outcome, as it can reveal a degraded drive
+			safe_strcpy(speedfile, MAX_PATH, logfile);
+			safe_strcpy(&speedfile[strlen(speedfile)-4], sizeof(speedfile)-strlen(speedfile)+4, "_speed.csv");
+			speed_fd = fopenU(speedfile, "w");
+			if (speed_fd == NULL)
+				uprintf("Could not create speed map file for bad blocks check\n");
 
 			if (!BadBlocks(hPhysicalDrive, SelectedDrive.DiskSize,
-				SelectedDrive.Geometry.BytesPerSector, ComboBox_GetCurSel(hNBPasses)+1, &report, log_fd)) {
+				SelectedDrive.Geometry.BytesPerSector, nb_passes, &report, log_fd, speed_fd)) {
 				uprintf("Bad blocks: Check failed.\n");
 				if (!FormatStatus)
 					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|
 						APPERR(ERROR_BADBLOCKS_FAILURE);
-				ClearMBRGPT(hPhysicalDrive, SelectedDrive.DiskSize, SelectedDrive.Geometry.BytesPerSector);
+				// The read-only scan leaves the drive untouched
+				if (nb_passes != BB_READ_ONLY)
+					ClearMBRGPT(hPhysicalDrive, SelectedDrive.DiskSize, SelectedDrive.Geometry.BytesPerSector);
 				fclose(log_fd);
 				_unlink(logfile);
+				if (speed_fd != NULL)
+					fclose(speed_fd);
 				goto out;
 			}
+			if (speed_fd != NULL) {
+				fclose(speed_fd);
+				uprintf("Bad Blocks: Speed map saved as '%s'\n", speedfile);
+			}
 			uprintf("Bad Blocks: Check completed, %u bad block%s found. (%d/%d/%d errors)\n",
 				report.bb_count, (report.bb_count==1)?"":"s",
 				report.num_read_errors, report.num_write_errors, report.num_corruption_errors);
@@ -1178,6 +1939,9 @@ DWORD WINAPI FormatThread(LPVOID param)
 					report.bb_count, (report.bb_count==1)?"":"s",
 					report.num_read_errors, report.num_write_errors, 
 					report.num_corruption_errors);
+				if (report.num_slow_regions)
+					safe_sprintf(&bb_msg[strlen(bb_msg)], sizeof(bb_msg)-strlen(bb_msg)-1,
+						"  %u slow region%s\n", report.num_slow_regions, (report.num_slow_regions==1)?"":"s");
 				fprintf(log_fd, "%s", bb_msg);
 				GetLocalTime(&lt);
 				fprintf(log_fd, "Rufus bad blocks check ended on: %04d.%02d.%02d %02d:%02d:%02d\n",
@@ -1190,6 +1954,11 @@ DWORD WINAPI FormatThread(LPVOID param)
 				// We didn't get any errors => delete the log file
 				fclose(log_fd);
 				_unlink(logfile);
+				// The drive has not been modified yet, so this is the last chance to keep its data
+				if ((nb_passes == BB_READ_ONLY) && (MessageBoxU(hMainDialog, "Read only check completed: "
+					"no bad blocks found.\n\nDo you want to proceed with formatting? ALL DATA ON THE DEVICE "
+					"WILL BE DESTROYED.", "Bad blocks check", MB_OKCANCEL|MB_ICONQUESTION) != IDOK))
+					r = IDABORT;
 			}
 		} while (r == IDRETRY);
 		if (r == IDABORT) {
@@ -1202,6 +1971,7 @@ DWORD WINAPI FormatThread(LPVOID param)
 
 	// Especially after destructive badblocks test, you must zero the MBR/GPT completely
 	// before repartitioning. Else, all kind of bad things can happen.
+	IOStatsSetPhase(OP_ZERO_MBR);
 	if (!ClearMBRGPT(hPhysicalDrive, SelectedDrive.DiskSize, SelectedDrive.Geometry.BytesPerSector)) {
 		uprintf("unable to zero MBR/GPT\n");
 		if (!FormatStatus)
@@ -1210,6 +1980,25 @@ DWORD WINAPI FormatThread(LPVOID param)
 	}
 	UpdateProgress(OP_ZERO_MBR, -1.0f);
 
+	// Virtual disk and isohybrid images are written as is, and replace the partitioning and formatting
+	if ((IsChecked(IDC_BOOT)) && (dt == DT_ISO) && ((iso_report.is_vhd) || (write_as_image))) {
+		IOStatsSetPhase(OP_DOS);
+		if (iso_report.is_vhd) {
+			PrintStatus(0, TRUE, "Writing VHD image...");
+			WriteVHD(hPhysicalDrive, iso_path);
+		} else {
+			PrintStatus(0, TRUE, "Writing ISO image...");
+			WriteRawImage(hPhysicalDrive, iso_path);
+		}
+		goto out;
+	}
+
+	// With the partition tables gone, the beginning of the drive can be used to probe
+	// the flash geometry, that partitioning and copy operations use for their I/O.
+	// Images that are written as is don't need it.
+	ProbeFlashGeometry(hPhysicalDrive);
+
+	IOStatsSetPhase(OP_PARTITION);
 	if (!CreatePartition(hPhysicalDrive, pt, fs)) {
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_PARTITION_FAILURE;
 		goto out;
@@ -1219,16 +2008,18 @@ DWORD WINAPI FormatThread(LPVOID param)
 	// Add a small delay after partitioning to be safe
 	Sleep(200);
 
-	// If FAT32 is requested and we have a large drive (>32 GB) use 
-	// large FAT32 format, else use MS's FormatEx.
-	ret = ((fs == FS_FAT32) && (SelectedDrive.DiskSize > LARGE_FAT32_SIZE))?
-		FormatFAT32(num):FormatDrive(drive_name[0]);
+	// FAT file systems are created by our native formatter, NTFS and exFAT by MS's FormatEx
+	IOStatsSetPhase(OP_FORMAT);
+	ret = ((fs == FS_FAT16) || (fs == FS_FAT32))?FormatFAT(num, hPhysicalDrive, fs):FormatDrive(drive_name[0]);
 	if (!ret) {
-		// Error will be set by FormatDrive() in FormatStatus
+		// Error will be set by FormatFAT()/FormatDrive() in FormatStatus
 		uprintf("Format error: %s\n", StrError(FormatStatus));
 		goto out;
 	}
 
+	// Boot records and bootloader installation
+boot_records:
+	IOStatsSetPhase(OP_FIX_MBR);
 	if (pt == PARTITION_STYLE_MBR) {
 		PrintStatus(0, TRUE, "Writing master boot record...");
 		if (!WriteMBR(hPhysicalDrive)) {
@@ -1267,6 +2058,13 @@ DWORD WINAPI FormatThread(LPVOID param)
 			// We must close and unlock the volume to write files to it
 			safe_unlockclose(hLogicalVolume);
 		} else if ( (dt == DT_SYSLINUX) || ((dt == DT_ISO) && ((fs == FS_FAT16) || (fs == FS_FAT32))) ) {
+			if (update_extraction) {
+				// The previous ldlinux.sys is read-only, and would prevent the installation
+				safe_sprintf(ldlinux_path, sizeof(ldlinux_path), "%c:\\ldlinux.sys", drive_name[0]);
+				SetFileAttributesA(ldlinux_path, FILE_ATTRIBUTE_NORMAL);
+				if ((!DeleteFileU(ldlinux_path)) && (GetLastError() != ERROR_FILE_NOT_FOUND))
+					uprintf("Could not delete previous %s: %s\n", ldlinux_path, WindowsErrorString());
+			}
 			PrintStatus(0, TRUE, "Installing Syslinux...");
 			if (!InstallSyslinux(num, drive_name)) {
 				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INSTALL_FAILURE;
@@ -1283,7 +2081,9 @@ DWORD WINAPI FormatThread(LPVOID param)
 	if (!RemountVolume(drive_name[0]))
 		goto out;
 
+copy_files:
 	if (IsChecked(IDC_BOOT)) {
+		IOStatsSetPhase(OP_DOS);
 		if ((dt == DT_WINME) || (dt == DT_FREEDOS)) {
 			UpdateProgress(OP_DOS, -1.0f);
 			PrintStatus(0, TRUE, "Copying DOS files...");
@@ -1302,6 +2102,10 @@ DWORD WINAPI FormatThread(LPVOID param)
 						FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANNOT_COPY;
 					goto out;
 				}
+				if ((enable_persistence) && (iso_report.has_casper) && (fs == FS_FAT32)) {
+					if (!CreatePersistence(num, hPhysicalDrive, drive_name))
+						goto out;
+				}
 				if ((bt == BT_UEFI) && (!iso_report.has_efi) && (iso_report.has_win7_efi)) {
 					// TODO: progress
 					PrintStatus(0, TRUE, "Win7 EFI boot setup (this may take a while)...");
@@ -1326,6 +2130,7 @@ DWORD WINAPI FormatThread(LPVOID param)
 					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_CANT_PATCH);
 			}
 		}
+		IOStatsSetPhase(OP_FINALIZE);
 		UpdateProgress(OP_FINALIZE, -1.0f);
 		PrintStatus(0, TRUE, "Finalizing...");
 		if (IsChecked(IDC_SET_ICON))
@@ -1343,6 +2148,7 @@ out:
 	SendMessage(hISOProgressDlg, UM_ISO_EXIT, 0, 0);
 	safe_unlockclose(hLogicalVolume);
 	safe_unlockclose(hPhysicalDrive);
+	IOStatsReport();
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, 0, 0);
 	ExitThread(0);
 }
@@ -105,7 +105,7 @@ typedef BOOLEAN (WINAPI* EnableVolumeCompression_t)(
 	ULONG           CompressionFlags	// FILE_SYSTEM_PROP_FLAG
 );
 
-/* Large FAT32 */
+/* FAT12/16/32 */
 #pragma pack(push, 1)
 typedef struct tagFAT_BOOTSECTOR32
 {
@@ -140,6 +140,32 @@ typedef struct tagFAT_BOOTSECTOR32
 	BYTE sBS_FilSysType[8];
 } FAT_BOOTSECTOR32;
 
+typedef struct tagFAT_BOOTSECTOR16
+{
+	// Common fields.
+	BYTE sJmpBoot[3];
+	BYTE sOEMName[8];
+	WORD wBytsPerSec;
+	BYTE bSecPerClus;
+	WORD wRsvdSecCnt;
+	BYTE bNumFATs;
+	WORD wRootEntCnt;
+	WORD wTotSec16;           // if zero, use dTotSec32 instead
+	BYTE bMedia;
+	WORD wFATSz16;
+	WORD wSecPerTrk;
+	WORD wNumHeads;
+	DWORD dHiddSec;
+	DWORD dTotSec32;
+	// Fat 12/16 only
+	BYTE bDrvNum;
+	BYTE Reserved1;
+	BYTE bBootSig;           // == 0x29 if next three fields are ok
+	DWORD dBS_VolID;
+	BYTE sVolLab[11];
+	BYTE sBS_FilSysType[8];
+} FAT_BOOTSECTOR16;
+
 typedef struct {
 	DWORD dLeadSig;         // 0x41615252
 	BYTE sReserved1[480];   // zeros
@@ -149,6 +175,111 @@ typedef struct {
 	BYTE sReserved2[12];    // zeros
 	DWORD dTrailSig;        // 0xAA550000
 } FAT_FSINFO;
+
+typedef struct {
+	BYTE sName[11];
+	BYTE bAttr;
+	BYTE bNTRes;
+	BYTE bCrtTimeTenth;
+	WORD wCrtTime;
+	WORD wCrtDate;
+	WORD wLstAccDate;
+	WORD wFstClusHI;
+	WORD wWrtTime;
+	WORD wWrtDate;
+	WORD wFstClusLO;
+	DWORD dFileSize;
+} FAT_DIRENT;
+
+typedef struct {
+	BYTE bOrd;              // sequence number, 0x40 for the last entry
+	WORD wName1[5];
+	BYTE bAttr;             // == 0x0F
+	BYTE bType;
+	BYTE bChksum;           // checksum of the short name
+	WORD wName2[6];
+	WORD wFstClusLO;        // zero
+	WORD wName3[2];
+} FAT_LFN_DIRENT;
+
+/* The subset of ext2 we need to create a persistence file */
+typedef struct {
+	DWORD s_inodes_count;
+	DWORD s_blocks_count;
+	DWORD s_r_blocks_count;
+	DWORD s_free_blocks_count;
+	DWORD s_free_inodes_count;
+	DWORD s_first_data_block;
+	DWORD s_log_block_size;
+	DWORD s_log_frag_size;
+	DWORD s_blocks_per_group;
+	DWORD s_frags_per_group;
+	DWORD s_inodes_per_group;
+	DWORD s_mtime;
+	DWORD s_wtime;
+	WORD s_mnt_count;
+	WORD s_max_mnt_count;
+	WORD s_magic;           // 0xEF53
+	WORD s_state;
+	WORD s_errors;
+	WORD s_minor_rev_level;
+	DWORD s_lastcheck;
+	DWORD s_checkinterval;
+	DWORD s_creator_os;
+	DWORD s_rev_level;
+	WORD s_def_resuid;
+	WORD s_def_resgid;
+	DWORD s_first_ino;
+	WORD s_inode_size;
+	WORD s_block_group_nr;
+	DWORD s_feature_compat;
+	DWORD s_feature_incompat;
+	DWORD s_feature_ro_compat;
+	BYTE s_uuid[16];
+	BYTE s_volume_name[16];
+	BYTE s_last_mounted[64];
+	BYTE s_reserved[824];   // zeros
+} EXT2_SUPERBLOCK;
+
+typedef struct {
+	DWORD bg_block_bitmap;
+	DWORD bg_inode_bitmap;
+	DWORD bg_inode_table;
+	WORD bg_free_blocks_count;
+	WORD bg_free_inodes_count;
+	WORD bg_used_dirs_count;
+	WORD bg_pad;
+	DWORD bg_reserved[3];
+} EXT2_GROUP_DESC;
+
+typedef struct {
+	WORD i_mode;
+	WORD i_uid;
+	DWORD i_size;
+	DWORD i_atime;
+	DWORD i_ctime;
+	DWORD i_mtime;
+	DWORD i_dtime;
+	WORD i_gid;
+	WORD i_links_count;
+	DWORD i_blocks;         // in 512 bytes units
+	DWORD i_flags;
+	DWORD i_osd1;
+	DWORD i_block[15];
+	DWORD i_generation;
+	DWORD i_file_acl;
+	DWORD i_dir_acl;
+	DWORD i_faddr;
+	BYTE i_osd2[12];
+} EXT2_INODE;
+
+typedef struct {
+	DWORD inode;
+	WORD rec_len;
+	BYTE name_len;
+	BYTE file_type;
+	char name[12];          // padded to 4 bytes
+} EXT2_DIR_ENTRY;
 #pragma pack(pop)
 
 #define die(msg, err) do { uprintf(msg); \
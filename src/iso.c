@@ -42,10 +42,28 @@
 #include "msapi_utf8.h"
 #include "resource.h"
 
-// How often should we update the progress bar (in 2K blocks) as updating
-// the progress bar for every block will bring extraction to a crawl
-#define PROGRESS_THRESHOLD        128
 #define FOUR_GIGABYTES            4294967296LL
+// Syslinux config files up to this size are patched in memory before being written
+#define MAX_CFG_PATCH_SIZE        (1024*1024)
+// Size of the copy buffer, when the optimal I/O size of the target is unknown, and maximum
+#define DEFAULT_COPY_SIZE         (64*1024)
+#define MAX_COPY_SIZE             (4*1024*1024)
+// Extraction journal: signature, number of most recent entries that get verified
+// against the target on resume, and number of sectors used to identify the ISO
+#define JOURNAL_MAGIC             "RUFUS-JOURNAL-1"
+#define JOURNAL_VERIFY_COUNT      4
+#define JOURNAL_KEY_SECTORS       16
+#define MANIFEST_TIME_SLACK       (2*10000000ULL)	// FAT write times only have a 2 seconds resolution
+#define FNV64_INIT                0xcbf29ce484222325ULL
+#define FNV64_PRIME               0x100000001b3ULL
+// Granularity of the list of file extents collected during scan
+#define EXTENT_LIST_INCREMENT     1024
+// El Torito boot record volume descriptor and boot catalog values
+#define ELTORITO_ID               "EL TORITO SPECIFICATION"
+#define ELTORITO_CATALOG_OFFSET   0x47
+#define ELTORITO_PLATFORM_EFI     0xEF
+#define ELTORITO_HEADER_MORE      0x90
+#define ELTORITO_HEADER_LAST      0x91
 
 // Needed for UDF ISO access
 CdIo_t* cdio_open (const char* psz_source, driver_id_t driver_id) {return NULL;}
@@ -58,6 +76,8 @@ static const char* psz_extract_dir;
 static const char* bootmgr_efi_name = "bootmgr.efi";
 static const char* ldlinux_name = "ldlinux.sys";
 static const char* efi_dirname = "/efi/boot";
+static const char* casper_dirname = "/casper";
+static const char* install_wim_path = "/sources/install.wim";
 static const char* isolinux_name[] = { "isolinux.cfg", "syslinux.cfg", "extlinux.conf"};
 static const char* pe_dirname[] = { "/i386", "/minint" };
 static const char* pe_file[] = { "ntdetect.com", "setupldr.bin", "txtsetup.sif" };
@@ -65,8 +85,59 @@ static const char* old_c32_name[NB_OLD_C32] = OLD_C32_NAMES;
 static const int64_t old_c32_threshold[NB_OLD_C32] = OLD_C32_THRESHOLD;
 static uint8_t i_joliet_level = 0;
 static uint64_t total_blocks, nb_blocks;
+// Extraction progress, as published by the extraction thread: blocks copied, files reached and
+// name of the current file. The UI thread samples these on its own timer (see RefreshISOProgress),
+// so that the copy never has to wait for the UI to process a message.
+static volatile LONG progress_active = FALSE, progress_blocks, progress_files;
+static volatile PVOID progress_name = NULL;
+static uint8_t* copy_buf = NULL;
+static size_t copy_buf_blocks;
 static BOOL scan_only = FALSE;
 static StrArray config_path;
+static StrArray journal;
+static FILE* journal_fd = NULL;
+static size_t journal_pos;
+static uint64_t journal_hash;
+static BOOL journal_resume = FALSE;
+static char journal_path[MAX_PATH];
+
+// File extents, as collected during scan, and the ones shared by multiple entries
+typedef struct {
+	lsn_t lsn;
+	int64_t size;
+	uint32_t seq;
+	char* path;
+} file_extent_t;
+typedef struct {
+	lsn_t lsn;
+	int64_t size;
+	StrArray path;		// all the entries using this extent, in extraction order
+	uint32_t index;		// number of these entries processed so far during extraction
+	BOOL written;
+	uint64_t hash;
+} shared_extent_t;
+static file_extent_t* extent_list = NULL;
+static size_t extent_list_size = 0, nb_extents = 0;
+static shared_extent_t* shared_extent = NULL;
+static size_t nb_shared_extents = 0;
+static uint64_t shared_bytes_saved;
+
+// Incremental update: lowercase paths of all the ISO entries, sorted once the scan is complete,
+// and state of the comparison of the file being extracted with the one already on the target
+static StrArray iso_entry;
+static uint8_t* update_buf = NULL;
+static BOOL update_match;
+static uint64_t update_bytes_kept;
+static uint32_t update_files_kept, update_files_deleted;
+// The journal of the last complete extraction onto a volume is kept as its manifest, so that an
+// update can tell which files changed from the hash of the ISO file, without reading the target
+static StrArray manifest;
+static uint64_t manifest_time, update_hash;
+static BOOL update_hash_known;
+static char manifest_path[MAX_PATH];
+// Files that are not part of the ISO but must be kept at the root of the target (autorun.inf is
+// not one of them, as it must be recreated with the new label, and ldlinux.sys is reinstalled)
+static const char* update_keep_name[] = { "casper-rw" };
 
 // TODO: Timestamp & permissions preservation
 
@@ -99,6 +170,35 @@ static void log_handler (cdio_log_level_t level, const char *message)
 	}
 }
 
+// Compressed images (.iso.gz, .iso.zst) are indexed on first read. Keep these
+// indexes in our local application data directory, so that they can be reused
+static void set_index_dir(void)
+{
+	static BOOL index_dir_set = FALSE;
+	wchar_t wpath[MAX_PATH];
+	char path[MAX_PATH];
+	int r;
+
+	if (index_dir_set)
+		return;
+	if (SHGetFolderPathW(NULL, CSIDL_LOCAL_APPDATA, NULL, SHGFP_TYPE_CURRENT, wpath) == S_OK) {
+		wchar_to_utf8_no_alloc(wpath, path, sizeof(path));
+		safe_strcat(path, sizeof(path), "\\Rufus");
+		r = SHCreateDirectoryExU(NULL, path, NULL);
+		if ((r == ERROR_SUCCESS) || (r == ERROR_ALREADY_EXISTS)) {
+			cdio_zstream_set_index_dir(path);
+			index_dir_set = TRUE;
+			return;
+		}
+	}
+	if (GetTempPathW(ARRAYSIZE(wpath), wpath) == 0)
+		return;
+	wchar_to_utf8_no_alloc(wpath, path, sizeof(path));
+	uprintf("Could not access the application data directory: keeping image indexes in '%s'\n", path);
+	cdio_zstream_set_index_dir(path);
+	index_dir_set = TRUE;
+}
+
 /*
  * Scan and set ISO properties
  * Returns true if the the current file does not need to be processed further
@@ -136,6 +236,10 @@ static __inline BOOL check_iso_props(const char* psz_dirname, BOOL* is_syslinux_
 		if (safe_stricmp(psz_dirname, efi_dirname) == 0)
 			iso_report.has_efi = TRUE;
 
+		// Check for a casper (Ubuntu style) live image, that can use a persistence file
+		if (safe_stricmp(psz_dirname, casper_dirname) == 0)
+			iso_report.has_casper = TRUE;
+
 		// Check for PE (XP) specific files in "/i386" or "/minint"
 		for (i=0; i<ARRAYSIZE(pe_dirname); i++)
 			if (safe_stricmp(psz_dirname, pe_dirname[i]) == 0)
@@ -154,6 +258,11 @@ static __inline BOOL check_iso_props(const char* psz_dirname, BOOL* is_syslinux_
 		}
 		if (i_file_length >= FOUR_GIGABYTES)
 			iso_report.has_4GB_file = TRUE;
+		// Maintain the file size histogram, for cluster size selection
+		for (j=0; (j<ISO_HISTOGRAM_SIZE-1) && ((i_file_length>>j) != 0); j++);
+		iso_report.nb_files++;
+		iso_report.size_count[j]++;
+		iso_report.size_bytes[j] += i_file_length;
 		// Compute projected size needed
 		total_blocks += i_file_length/UDF_BLOCKSIZE;
 		// NB: ISO_BLOCKSIZE = UDF_BLOCKSIZE
@@ -169,19 +278,828 @@ static __inline BOOL check_iso_props(const char* psz_dirname, BOOL* is_syslinux_
 	return FALSE;
 }
 
+// Find out, during the scan, whether our own WIM reader can extract files from the Windows
+// install image, as we won't be able to fall back to 7-Zip or wimgapi.dll if they are missing
+static void check_install_wim(const char* psz_iso_name, udf_dirent_t* p_udf_dirent, iso9660_t* p_iso, lsn_t lsn)
+{
+	uint8_t buf[ISO_BLOCKSIZE];
+	BOOL r;
+
+	if ((!scan_only) || (safe_stricmp(psz_iso_name, install_wim_path) != 0))
+		return;
+	if (p_udf_dirent != NULL)
+		r = (udf_read_block(p_udf_dirent, buf, 1) == UDF_BLOCKSIZE);
+	else
+		r = (iso9660_iso_seek_read(p_iso, buf, lsn, 1) == ISO_BLOCKSIZE);
+	iso_report.has_native_wim = r && WimIsNativelySupported(buf, sizeof(buf));
+	uprintf("%s can%s be extracted natively\n", psz_iso_name, iso_report.has_native_wim?"":"not");
+}
+
+// Apply the ISO -> USB label substitution to a syslinux config held in memory,
+// and write the (possibly patched) data to the target file in one go
+static BOOL write_syslinux_cfg(HANDLE file_handle, const char* psz_fullpath, char** cfg_buf, size_t cfg_size)
+{
+	BOOL r;
+	DWORD wr_size;
+	uint64_t ts;
+
+	// Workaround for isolinux config files requiring an ISO label for kernel
+	// append that may be different from our USB label.
+	if (replace_in_token_data_buffer("append", iso_report.label, iso_report.usb_label, TRUE, cfg_buf, &cfg_size) != NULL)
+		uprintf("Patched %s: '%s' -> '%s'\n", psz_fullpath, iso_report.label, iso_report.usb_label);
+	ts = IOStatsTimestamp();
+	ISO_BLOCKING(r = WriteFile(file_handle, *cfg_buf, (DWORD)cfg_size, &wr_size, NULL));
+	IOStatsRecord(IOS_FILE_WRITE, wr_size, ts);
+	if ((!r) || (cfg_size != wr_size)) {
+		uprintf("  Error writing file: %s\n", WindowsErrorString());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Account for nb copied blocks
+static __inline void update_progress(uint64_t nb)
+{
+	nb_blocks += nb;
+	InterlockedExchange(&progress_blocks, (LONG)nb_blocks);
+}
+
+// Publish the name of the file being extracted. A name that the UI thread hasn't picked up yet
+// is simply replaced, and it is always freed by whichever side ends up owning it.
+static void publish_name(const char* name)
+{
+	free(InterlockedExchangePointer(&progress_name, safe_strdup(name)));
+}
+
+/*
+ * Refresh the extraction progress from what the extraction thread published.
+ * This must only be called from the UI thread.
+ */
+void RefreshISOProgress(void)
+{
+	char* name;
+	LONG blocks;
+
+	if ((!progress_active) || (total_blocks == 0))
+		return;
+	name = (char*)InterlockedExchangePointer(&progress_name, NULL);
+	if (name != NULL) {
+		SetWindowTextU(hISOFileName, name);
+		free(name);
+	}
+	blocks = InterlockedCompareExchange(&progress_blocks, 0, 0);
+	SendMessage(hISOProgressBar, PBM_SETPOS, (WPARAM)((MAX_PROGRESS*(uint64_t)blocks)/total_blocks), 0);
+	UpdateProgress(OP_DOS, 100.0f*blocks/total_blocks);
+	if (!IS_ERROR(FormatStatus))
+		PrintStatus(0, FALSE, "Copying ISO files (%d/%d)...",
+			InterlockedCompareExchange(&progress_files, 0, 0), iso_report.nb_files);
+}
+
+/*
+ * Shared extents
+ * Some images (hard links in Rock Ridge images, deduplicated Windows images) have
+ * multiple directory entries pointing to the same data. We detect these during scan
+ * and, on extraction, read the data only once and write it to all the destinations.
+ * Only ISO9660 images are handled, as the UDF API does not expose the file extents.
+ */
+static void shared_extent_free(void)
+{
+	size_t i;
+
+	for (i=0; i<nb_extents; i++)
+		safe_free(extent_list[i].path);
+	safe_free(extent_list);
+	extent_list_size = 0;
+	nb_extents = 0;
+	for (i=0; i<nb_shared_extents; i++)
+		StrArrayDestroy(&shared_extent[i].path);
+	safe_free(shared_extent);
+	nb_shared_extents = 0;
+}
+
+// Record the extent of a file, during scan
+static void shared_extent_add(lsn_t lsn, int64_t size, const char* psz_path)
+{
+	file_extent_t* new_list;
+
+	if (nb_extents >= extent_list_size) {
+		new_list = (file_extent_t*)realloc(extent_list, (extent_list_size + EXTENT_LIST_INCREMENT) * sizeof(file_extent_t));
+		if (new_list == NULL)
+			return;
+		extent_list = new_list;
+		extent_list_size += EXTENT_LIST_INCREMENT;
+	}
+	extent_list[nb_extents].lsn = lsn;
+	extent_list[nb_extents].size = size;
+	extent_list[nb_extents].seq = (uint32_t)nb_extents;
+	extent_list[nb_extents].path = safe_strdup(psz_path);
+	if (extent_list[nb_extents].path != NULL)
+		nb_extents++;
+}
+
+static int extent_cmp(const void* p1, const void* p2)
+{
+	const file_extent_t *e1 = (const file_extent_t*)p1, *e2 = (const file_extent_t*)p2;
+
+	if (e1->lsn != e2->lsn)
+		return (e1->lsn < e2->lsn)?-1:1;
+	if (e1->size != e2->size)
+		return (e1->size < e2->size)?-1:1;
+	return (e1->seq < e2->seq)?-1:((e1->seq > e2->seq)?1:0);
+}
+
+// Once the scan is complete, only keep the extents that are used by more than one entry
+static void shared_extent_build(void)
+{
+	size_t i, j, k, nb_dups = 0;
+	uint64_t dup_size = 0;
+
+	if (nb_extents == 0)
+		return;
+	qsort(extent_list, nb_extents, sizeof(file_extent_t), extent_cmp);
+	for (i=0; i<nb_extents; i=j) {
+		for (j=i+1; (j<nb_extents) && (extent_list[j].lsn == extent_list[i].lsn)
+			&& (extent_list[j].size == extent_list[i].size); j++);
+		if (j - i > 1)
+			nb_shared_extents++;
+	}
+	if (nb_shared_extents != 0)
+		shared_extent = (shared_extent_t*)calloc(nb_shared_extents, sizeof(shared_extent_t));
+	if (shared_extent == NULL) {
+		nb_shared_extents = 0;
+		goto out;
+	}
+	for (i=0, k=0; i<nb_extents; i=j) {
+		for (j=i+1; (j<nb_extents) && (extent_list[j].lsn == extent_list[i].lsn)
+			&& (extent_list[j].size == extent_list[i].size); j++);
+		if (j - i <= 1)
+			continue;
+		shared_extent[k].lsn = extent_list[i].lsn;
+		shared_extent[k].size = extent_list[i].size;
+		StrArrayCreate(&shared_extent[k].path, j - i);
+		for (; i<j; i++)
+			StrArrayAdd(&shared_extent[k].path, extent_list[i].path);
+		nb_dups += shared_extent[k].path.Index - 1;
+		dup_size += (shared_extent[k].path.Index - 1) * shared_extent[k].size;
+		k++;
+	}
+	uprintf("%d files are duplicates of other files, using %d shared extents%s\n",
+		(int)nb_dups, (int)nb_shared_extents, size_to_hr(dup_size));
+
+out:
+	// The list of all extents is no longer needed
+	for (i=0; i<nb_extents; i++)
+		safe_free(extent_list[i].path);
+	safe_free(extent_list);
+	extent_list_size = 0;
+	nb_extents = 0;
+}
+
+static shared_extent_t* shared_extent_lookup(lsn_t lsn, int64_t size)
+{
+	size_t lo = 0, hi = nb_shared_extents, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((shared_extent[mid].lsn < lsn) || ((shared_extent[mid].lsn == lsn) && (shared_extent[mid].size < size)))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ((lo < nb_shared_extents) && (shared_extent[lo].lsn == lsn) && (shared_extent[lo].size == size))
+		return &shared_extent[lo];
+	return NULL;
+}
+
+// Create all the destinations of a shared extent that come after the current entry,
+// along with their parent directories, as these may not have been reached yet
+static BOOL shared_extent_open(shared_extent_t* ext, HANDLE** handles, size_t* nb_handles)
+{
+	size_t i, j;
+	char psz_fullpath[1024];
+
+	*nb_handles = 0;
+	*handles = NULL;
+	if (ext->path.Index <= ext->index + 1)
+		return TRUE;
+	*handles = (HANDLE*)calloc(ext->path.Index - ext->index - 1, sizeof(HANDLE));
+	if (*handles == NULL)
+		return FALSE;
+	for (i=ext->index+1; i<ext->path.Index; i++) {
+		safe_sprintf(psz_fullpath, sizeof(psz_fullpath), "%s%s", psz_extract_dir, ext->path.Table[i]);
+		for (j=strlen(psz_extract_dir)+1; psz_fullpath[j]!=0; j++) {
+			if (psz_fullpath[j] == '/') {
+				psz_fullpath[j] = 0;
+				_mkdirU(psz_fullpath);
+				psz_fullpath[j] = '/';
+			}
+		}
+		(*handles)[*nb_handles] = CreateFileU(psz_fullpath, GENERIC_READ | GENERIC_WRITE,
+			FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if ((*handles)[*nb_handles] == INVALID_HANDLE_VALUE) {
+			uprintf("  Unable to create file %s: %s\n", psz_fullpath, WindowsErrorString());
+			return FALSE;
+		}
+		uprintf("  Also writing: %s\n", ext->path.Table[i]);
+		(*nb_handles)++;
+	}
+	return TRUE;
+}
+
+static void shared_extent_close(HANDLE* handles, size_t nb_handles)
+{
+	size_t i;
+
+	for (i=0; i<nb_handles; i++)
+		ISO_BLOCKING(safe_closehandle(handles[i]));
+	safe_free(handles);
+}
+
+/*
+ * Extraction journal
+ * Every file that has been fully copied gets appended, along with its size and hash, to
+ * a journal that is kept in the local temp directory and keyed on both the ISO and the
+ * volume serial of the target. As the ISO is always walked in the same order, resuming
+ * an interrupted copy only requires walking the journal alongside the ISO, and skipping
+ * the files that match until we find the first one that doesn't.
+ */
+static uint64_t fnv64(uint64_t hash, const void* buf, size_t len)
+{
+	size_t i;
+	for (i=0; i<len; i++) {
+		hash ^= ((const uint8_t*)buf)[i];
+		hash *= FNV64_PRIME;
+	}
+	return hash;
+}
+
+// Journals and manifests are kept in the temp directory, and are tied to the serial of the volume
+static BOOL get_volume_temp_dir(char drive_letter, DWORD* serial, char* temp_dir, size_t temp_dir_size)
+{
+	char root[] = "?:\\";
+	wchar_t wtemp[MAX_PATH];
+
+	root[0] = drive_letter;
+	if (!GetVolumeInformationA(root, NULL, 0, serial, NULL, NULL, NULL, 0))
+		return FALSE;
+	if (GetTempPathW(ARRAYSIZE(wtemp), wtemp) == 0)
+		return FALSE;
+	return (wchar_to_utf8_no_alloc(wtemp, temp_dir, (int)temp_dir_size) > 0);
+}
+
+static BOOL get_journal_path(const char* src_iso, char drive_letter, char* path, size_t path_size)
+{
+	FILE* fd;
+	int64_t iso_size;
+	uint8_t* buf;
+	size_t size;
+	uint64_t key = FNV64_INIT;
+	DWORD serial;
+	char temp_dir[MAX_PATH];
+
+	// Identify the ISO from its size and its volume descriptors, which include the
+	// creation date, rather than hashing it whole
+	fd = fopenU(src_iso, "rb");
+	if (fd == NULL)
+		return FALSE;
+	buf = (uint8_t*)malloc(JOURNAL_KEY_SECTORS * ISO_BLOCKSIZE);
+	if (buf == NULL) {
+		fclose(fd);
+		return FALSE;
+	}
+	_fseeki64(fd, 0, SEEK_END);
+	iso_size = _ftelli64(fd);
+	_fseeki64(fd, 16 * ISO_BLOCKSIZE, SEEK_SET);
+	size = fread(buf, 1, JOURNAL_KEY_SECTORS * ISO_BLOCKSIZE, fd);
+	fclose(fd);
+	key = fnv64(key, &iso_size, sizeof(iso_size));
+	key = fnv64(key, buf, size);
+	free(buf);
+
+	if (!get_volume_temp_dir(drive_letter, &serial, temp_dir, sizeof(temp_dir)))
+		return FALSE;
+	safe_sprintf(path, path_size, "%srufus_%016llx_%08X.jnl", temp_dir, key, serial);
+	return TRUE;
+}
+
+// Unlike the journal, the manifest does not depend on the ISO, as an update is for a different one
+static BOOL get_manifest_path(char drive_letter, char* path, size_t path_size)
+{
+	DWORD serial;
+	char temp_dir[MAX_PATH];
+
+	if (!get_volume_temp_dir(drive_letter, &serial, temp_dir, sizeof(temp_dir)))
+		return FALSE;
+	safe_sprintf(path, path_size, "%srufus_%08X.lst", temp_dir, serial);
+	return TRUE;
+}
+
+// Parse a "<size> <hash> <path>" journal entry
+static BOOL parse_journal_entry(const char* entry, int64_t* size, uint64_t* hash, const char** path)
+{
+	char* end;
+
+	*size = _strtoi64(entry, &end, 10);
+	if (*end != ' ')
+		return FALSE;
+	*hash = _strtoui64(&end[1], &end, 16);
+	if (*end != ' ')
+		return FALSE;
+	*path = &end[1];
+	return TRUE;
+}
+
+// Returns TRUE if there is a journal for a resumable extraction of this ISO onto this drive
+BOOL JournalCheck(const char* src_iso, char drive_letter)
+{
+	FILE* fd;
+	BOOL r = FALSE;
+	char path[MAX_PATH], line[32];
+
+	if ((src_iso == NULL) || (!get_journal_path(src_iso, drive_letter, path, sizeof(path))))
+		return FALSE;
+	fd = fopenU(path, "r");
+	if (fd == NULL)
+		return FALSE;
+	// Need the header and at least one entry for a resume to be worth it
+	if ( (fgets(line, sizeof(line), fd) != NULL) && (strncmp(line, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)-1) == 0)
+	  && (fgets(line, sizeof(line), fd) != NULL) )
+		r = TRUE;
+	fclose(fd);
+	return r;
+}
+
+void JournalDelete(const char* src_iso, char drive_letter)
+{
+	char path[MAX_PATH];
+
+	if ((src_iso != NULL) && (get_journal_path(src_iso, drive_letter, path, sizeof(path))))
+		DeleteFileU(path);
+}
+
+// (Re)write the journal header, followed by the first nb_entries of the loaded journal
+static BOOL journal_rewrite(size_t nb_entries)
+{
+	size_t i;
+
+	if (journal_fd != NULL)
+		fclose(journal_fd);
+	journal_fd = fopenU(journal_path, "w");
+	if (journal_fd == NULL)
+		return FALSE;
+	fprintf(journal_fd, "%s\n", JOURNAL_MAGIC);
+	for (i=0; (i<nb_entries)&&(journal.Table!=NULL); i++)
+		fprintf(journal_fd, "%s\n", journal.Table[i]);
+	fflush(journal_fd);
+	return TRUE;
+}
+
+static void journal_open(const char* src_iso, const char* dest_dir)
+{
+	FILE* fd;
+	char line[1200];
+	size_t len;
+
+	journal_resume = FALSE;
+	journal_pos = 0;
+	StrArrayCreate(&journal, 1024);
+	if (!get_manifest_path(dest_dir[0], manifest_path, sizeof(manifest_path)))
+		manifest_path[0] = 0;
+	if (!get_journal_path(src_iso, dest_dir[0], journal_path, sizeof(journal_path))) {
+		uprintf("Could not create an extraction journal - copy will not be resumable\n");
+		return;
+	}
+	if (resume_extraction) {
+		fd = fopenU(journal_path, "r");
+		if ((fd != NULL) && (fgets(line, sizeof(line), fd) != NULL)
+		  && (strncmp(line, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)-1) == 0)) {
+			while (fgets(line, sizeof(line), fd) != NULL) {
+				len = safe_strlen(line);
+				// Ignore a truncated last line
+				if ((len == 0) || (line[len-1] != '\n'))
+					break;
+				line[len-1] = 0;
+				StrArrayAdd(&journal, line);
+			}
+			journal_resume = (journal.Table != NULL) && (journal.Index != 0);
+		}
+		if (fd != NULL)
+			fclose(fd);
+		uprintf("Resuming extraction from journal %s (%d files)\n", journal_path, (int)journal.Index);
+	}
+	if (!journal_rewrite(journal.Index))
+		uprintf("Could not create journal %s - copy will not be resumable\n", journal_path);
+}
+
+// Stop skipping files, and only keep the journal entries that were found to match
+static void journal_stop_resume(const char* psz_path)
+{
+	uprintf("Resuming copy from %s\n", psz_path);
+	journal_resume = FALSE;
+	if (journal_pos < journal.Index)
+		journal_rewrite(journal_pos);
+}
+
+// Returns TRUE if the file was found to be already copied, as per the journal
+static BOOL journal_skip(const char* psz_path, int64_t i_file_length)
+{
+	HANDLE file_handle;
+	LARGE_INTEGER li;
+	DWORD rd_size;
+	int64_t size;
+	uint64_t hash, file_hash = FNV64_INIT;
+	const char* path;
+	char* psz_fullpath;
+	BOOL r = FALSE;
+
+	if (!journal_resume)
+		return FALSE;
+	if ( (journal_pos >= journal.Index) || (!parse_journal_entry(journal.Table[journal_pos], &size, &hash, &path))
+	  || (size != i_file_length) || (strcmp(path, psz_path) != 0) ) {
+		journal_stop_resume(psz_path);
+		return FALSE;
+	}
+
+	// Check that the file is present on the target, with the expected size. The most
+	// recent entries, which could have been caught in the write cache when the copy was
+	// interrupted, are also read back and hashed.
+	psz_fullpath = (char*)malloc(strlen(psz_extract_dir) + strlen(psz_path) + 1);
+	if (psz_fullpath == NULL)
+		goto out;
+	strcpy(psz_fullpath, psz_extract_dir);
+	strcat(psz_fullpath, psz_path);
+	file_handle = CreateFileU(psz_fullpath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	free(psz_fullpath);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		goto out;
+	if ((!GetFileSizeEx(file_handle, &li)) || (li.QuadPart != i_file_length)) {
+		CloseHandle(file_handle);
+		goto out;
+	}
+	if (journal_pos + JOURNAL_VERIFY_COUNT >= journal.Index) {
+		do {
+			if ((FormatStatus) || (!ReadFile(file_handle, copy_buf, (DWORD)(copy_buf_blocks * ISO_BLOCKSIZE), &rd_size, NULL))) {
+				CloseHandle(file_handle);
+				goto out;
+			}
+			file_hash = fnv64(file_hash, copy_buf, rd_size);
+		} while (rd_size != 0);
+		if (file_hash != hash) {
+			uprintf("Journal: %s failed hash verification\n", psz_path);
+			CloseHandle(file_handle);
+			goto out;
+		}
+	}
+	CloseHandle(file_handle);
+	journal_pos++;
+	r = TRUE;
+
+out:
+	if (!r)
+		journal_stop_resume(psz_path);
+	return r;
+}
+
+static void journal_record(const char* psz_path, int64_t i_file_length)
+{
+	size_t i;
+	char* path;
+
+	if (journal_fd == NULL)
+		return;
+	// Entries always use forward slashes, as this is what we get when walking the ISO
+	path = safe_strdup(psz_path);
+	if (path == NULL)
+		return;
+	for (i=0; path[i]!=0; i++) if (path[i] == '\\') path[i] = '/';
+	fprintf(journal_fd, "%lld %016llx %s\n", i_file_length, journal_hash, path);
+	free(path);
+	// Flush, so that the entry survives an unexpected termination of the application
+	fflush(journal_fd);
+}
+
+// Close the journal and, if the extraction was successful, keep it as the manifest of the volume
+static void journal_close(BOOL success)
+{
+	if (journal_fd != NULL) {
+		fclose(journal_fd);
+		journal_fd = NULL;
+		if ((success) && ((manifest_path[0] == 0) ||
+			(!MoveFileExU(journal_path, manifest_path, MOVEFILE_REPLACE_EXISTING))))
+			DeleteFileU(journal_path);
+	}
+	StrArrayDestroy(&journal);
+	journal_resume = FALSE;
+}
+
+/*
+ * Incremental update
+ * Rather than formatting the target, the files from the target that are no longer part of the
+ * ISO are deleted, and the files that exist on both sides are compared as they are extracted,
+ * so that only the chunks that differ, along with the new files, actually get written.
+ */
+
+// Paths are compared in lowercase. Only ASCII is lowercased, as tolower() would alter UTF-8
+// sequences according to the locale
+static void to_lower_ascii(char* str)
+{
+	for (; *str != 0; str++) {
+		if ((*str >= 'A') && (*str <= 'Z'))
+			*str += 'a' - 'A';
+	}
+}
+
+static void iso_entry_add(const char* psz_path)
+{
+	StrArrayAdd(&iso_entry, psz_path);
+	if ((iso_entry.Table == NULL) || (iso_entry.Index == 0))
+		return;
+	to_lower_ascii(iso_entry.Table[iso_entry.Index-1]);
+}
+
+static int iso_entry_cmp(const void* p1, const void* p2)
+{
+	return strcmp(*(const char**)p1, *(const char**)p2);
+}
+
+static BOOL iso_entry_lookup(const char* psz_path)
+{
+	return (iso_entry.Table != NULL) &&
+		(bsearch(&psz_path, iso_entry.Table, iso_entry.Index, sizeof(char*), iso_entry_cmp) != NULL);
+}
+
+// Delete the files and directories below wpath that are not part of the ISO. wpath and path
+// hold the same location, in UTF-16 (from the target root) and lowercase UTF-8 (from the ISO root)
+static void update_cleanup(wchar_t* wpath, size_t wpath_size, char* path, size_t path_size)
+{
+	WIN32_FIND_DATAW fd;
+	HANDLE h;
+	size_t i, wlen = wcslen(wpath), len = strlen(path);
+
+	if (wlen + 3 > wpath_size)
+		return;
+	wcscpy(&wpath[wlen], L"\\*");
+	h = FindFirstFileW(wpath, &fd);
+	if (h == INVALID_HANDLE_VALUE)
+		goto out;
+	do {
+		if (FormatStatus)
+			break;
+		if ((wcscmp(fd.cFileName, L".") == 0) || (wcscmp(fd.cFileName, L"..") == 0)
+			|| (wlen + 1 + wcslen(fd.cFileName) + 3 > wpath_size))
+			continue;
+		wpath[wlen] = L'\\';
+		wcscpy(&wpath[wlen+1], fd.cFileName);
+		path[len] = '/';
+		if (wchar_to_utf8_no_alloc(fd.cFileName, &path[len+1], (int)(path_size - len - 1)) <= 0)
+			continue;
+		to_lower_ascii(&path[len+1]);
+		if (iso_entry_lookup(path)) {
+			if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				update_cleanup(wpath, wpath_size, path, path_size);
+			continue;
+		}
+		// Leave the system files (ldlinux.sys, System Volume Information) and our own additions alone
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM)
+			continue;
+		if (len == 0) {
+			for (i=0; (i<ARRAYSIZE(update_keep_name)) && (strcmp(&path[1], update_keep_name[i]) != 0); i++);
+			if (i < ARRAYSIZE(update_keep_name))
+				continue;
+		}
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			update_cleanup(wpath, wpath_size, path, path_size);
+			if (!RemoveDirectoryW(wpath))
+				uprintf("Could not delete %s: %s\n", path, WindowsErrorString());
+		} else {
+			if (fd.dwFileAttributes & FILE_ATTRIBUTE_READONLY)
+				SetFileAttributesW(wpath, FILE_ATTRIBUTE_NORMAL);
+			if (DeleteFileW(wpath)) {
+				uprintf("Deleted: %s\n", path);
+				update_files_deleted++;
+			} else {
+				uprintf("Could not delete %s: %s\n", path, WindowsErrorString());
+			}
+		}
+	} while (FindNextFileW(h, &fd));
+	FindClose(h);
+
+out:
+	wpath[wlen] = 0;
+	path[len] = 0;
+}
+
+// Manifest entries use the journal format, and are sorted by path
+static const char* manifest_entry_path(const char* entry)
+{
+	const char* p = strchr(entry, ' ');
+
+	p = (p == NULL) ? NULL : strchr(&p[1], ' ');
+	return (p == NULL) ? entry : &p[1];
+}
+
+static int manifest_cmp(const void* p1, const void* p2)
+{
+	return strcmp(manifest_entry_path(*(const char**)p1), manifest_entry_path(*(const char**)p2));
+}
+
+static int manifest_key_cmp(const void* key, const void* p)
+{
+	return strcmp((const char*)key, manifest_entry_path(*(const char**)p));
+}
+
+static void manifest_load(void)
+{
+	FILE* fd = NULL;
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	wchar_t wpath[MAX_PATH];
+	char line[1200];
+	size_t len;
+
+	StrArrayCreate(&manifest, 1024);
+	if ( (manifest_path[0] == 0) || (utf8_to_wchar_no_alloc(manifest_path, wpath, ARRAYSIZE(wpath)) <= 0)
+	  || (!GetFileAttributesExW(wpath, GetFileExInfoStandard, &attr)) ) {
+		uprintf("No manifest for this volume - the files that have the same size will be read back\n");
+		return;
+	}
+	manifest_time = ((uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+	fd = fopenU(manifest_path, "r");
+	if ((fd == NULL) || (fgets(line, sizeof(line), fd) == NULL) || (strncmp(line, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)-1) != 0))
+		goto out;
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		len = safe_strlen(line);
+		if ((len == 0) || (line[len-1] != '\n'))
+			break;
+		line[len-1] = 0;
+		StrArrayAdd(&manifest, line);
+	}
+	if (manifest.Table != NULL)
+		qsort(manifest.Table, manifest.Index, sizeof(char*), manifest_cmp);
+	uprintf("Using manifest %s (%d files)\n", manifest_path, (int)manifest.Index);
+
+out:
+	if (fd != NULL)
+		fclose(fd);
+}
+
+// Get the hash that the manifest has for a file of the target, provided that the file has the
+// expected size, and was not modified after the manifest was written
+static BOOL manifest_lookup(const char* psz_path, int64_t i_file_length, const FILETIME* ft, uint64_t* hash)
+{
+	char path[1024], **entry;
+	const char* entry_path;
+	int64_t size;
+	size_t i;
+
+	if ( (manifest.Table == NULL) || (manifest.Index == 0)
+	  || ((((uint64_t)ft->dwHighDateTime << 32) | ft->dwLowDateTime) > manifest_time + MANIFEST_TIME_SLACK) )
+		return FALSE;
+	safe_strcpy(path, sizeof(path), psz_path);
+	for (i=0; path[i]!=0; i++) if (path[i] == '\\') path[i] = '/';
+	entry = (char**)bsearch(path, manifest.Table, manifest.Index, sizeof(char*), manifest_key_cmp);
+	return (entry != NULL) && (parse_journal_entry(*entry, &size, hash, &entry_path)) && (size == i_file_length);
+}
+
+// Open a target file for extraction. In update mode, an existing file is opened as is rather than
+// truncated and, if it has the same size as the ISO file, it is compared using the hash from the
+// manifest or, failing that, with the extracted data.
+static HANDLE open_target(const char* psz_fullpath, BOOL update, int64_t i_file_length)
+{
+	LARGE_INTEGER li;
+	FILETIME ft;
+	HANDLE h = CreateFileU(psz_fullpath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE,
+		NULL, update?OPEN_ALWAYS:CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	update_match = (update) && (h != INVALID_HANDLE_VALUE) && (GetLastError() == ERROR_ALREADY_EXISTS);
+	// A file that differs in size is just overwritten
+	if ((update_match) && ((!GetFileSizeEx(h, &li)) || (li.QuadPart != i_file_length)))
+		update_match = FALSE;
+	update_hash_known = (update_match) && (GetFileTime(h, NULL, NULL, &ft))
+		&& (manifest_lookup(&psz_fullpath[strlen(psz_extract_dir)], i_file_length, &ft, &update_hash));
+	return h;
+}
+
+// With a hash from the manifest, the ISO file is hashed before it gets extracted. If the hashes
+// match, the file is left as is, otherwise it is overwritten, without reading the target back.
+static BOOL update_check_hash(uint64_t hash, int64_t i_file_length)
+{
+	update_hash_known = FALSE;
+	update_match = (hash == update_hash);
+	if (update_match)
+		update_bytes_kept += i_file_length;
+	return update_match;
+}
+
+static BOOL iso_hash_file(iso9660_t* p_iso, lsn_t lsn, int64_t i_file_length, uint64_t* hash)
+{
+	size_t i, nb;
+	int64_t i_read;
+	uint64_t ts;
+
+	*hash = FNV64_INIT;
+	for (i = 0; i_file_length > 0; i += nb) {
+		if (FormatStatus)
+			return FALSE;
+		nb = (size_t)MIN(copy_buf_blocks, (i_file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+		ts = IOStatsTimestamp();
+		i_read = iso9660_iso_seek_read(p_iso, copy_buf, lsn + (lsn_t)i, (long)nb);
+		IOStatsRecord(IOS_SOURCE_READ, (i_read < 0)?0:i_read, ts);
+		if (i_read != (int64_t)(nb * ISO_BLOCKSIZE))
+			return FALSE;
+		*hash = fnv64(*hash, copy_buf, (size_t)MIN(i_file_length, i_read));
+		i_file_length -= i_read;
+	}
+	return TRUE;
+}
+
+static BOOL udf_hash_file(udf_dirent_t* p_udf_dirent, int64_t i_file_length, uint64_t* hash)
+{
+	int64_t i_read;
+	uint64_t ts;
+
+	*hash = FNV64_INIT;
+	while (i_file_length > 0) {
+		if (FormatStatus)
+			return FALSE;
+		ts = IOStatsTimestamp();
+		i_read = udf_read_block(p_udf_dirent, copy_buf,
+			(size_t)MIN(copy_buf_blocks, (i_file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE));
+		IOStatsRecord(IOS_SOURCE_READ, (i_read < 0)?0:i_read, ts);
+		if (i_read <= 0)
+			return FALSE;
+		*hash = fnv64(*hash, copy_buf, (size_t)MIN(i_file_length, i_read));
+		i_file_length -= i_read;
+	}
+	// The file is read again if it needs to be extracted
+	udf_rewind(p_udf_dirent);
+	return TRUE;
+}
+
+// Write a chunk of extracted data, unless the target file already has the same data there
+static BOOL write_target(HANDLE h, const void* buf, DWORD size, DWORD* wr_size)
+{
+	LARGE_INTEGER li;
+	DWORD rd_size = 0;
+	BOOL r;
+	uint64_t ts;
+
+	if (update_match) {
+		ts = IOStatsTimestamp();
+		r = ReadFile(h, update_buf, size, &rd_size, NULL);
+		IOStatsRecord(IOS_DEVICE_READ, rd_size, ts);
+		if ((r) && (rd_size == size) && (memcmp(update_buf, buf, size) == 0)) {
+			*wr_size = size;
+			update_bytes_kept += size;
+			return TRUE;
+		}
+		// Overwrite the file from this chunk onwards
+		update_match = FALSE;
+		li.QuadPart = -(LONGLONG)rd_size;
+		if (!SetFilePointerEx(h, li, NULL, FILE_CURRENT))
+			return FALSE;
+	}
+	ts = IOStatsTimestamp();
+	r = WriteFile(h, buf, size, wr_size, NULL);
+	IOStatsRecord(IOS_FILE_WRITE, *wr_size, ts);
+	return r;
+}
+
+// Truncate an updated file that used to be larger, and account for the ones that were left as is
+static BOOL close_target(HANDLE* h, BOOL update, int64_t i_file_length)
+{
+	LARGE_INTEGER li;
+	BOOL r = TRUE;
+
+	if ((update) && (GetFileSizeEx(*h, &li)) && (li.QuadPart != i_file_length)) {
+		update_match = FALSE;
+		li.QuadPart = i_file_length;
+		r = SetFilePointerEx(*h, li, NULL, FILE_BEGIN) && SetEndOfFile(*h);
+		if (!r)
+			uprintf("  Error truncating file: %s\n", WindowsErrorString());
+	}
+	if (update_match) {
+		uprintf("  Unchanged\n");
+		update_files_kept++;
+	}
+	update_match = FALSE;
+	update_hash_known = FALSE;
+	ISO_BLOCKING(safe_closehandle(*h));
+	return r;
+}
+
 // Returns 0 on success, nonzero on error
 static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path)
 {
 	HANDLE file_handle = NULL;
 	DWORD buf_size, wr_size;
-	BOOL r, is_syslinux_cfg, is_old_c32[NB_OLD_C32];
+	BOOL r, is_syslinux_cfg, is_old_c32[NB_OLD_C32], journaled, update;
 	int i_length;
-	size_t i, nul_pos;
-	char* psz_fullpath = NULL;
+	size_t i, nul_pos, cfg_size;
+	char *psz_fullpath = NULL, *cfg_buf = NULL;
 	const char* psz_basename;
 	udf_dirent_t *p_udf_dirent2;
-	uint8_t buf[UDF_BLOCKSIZE];
 	int64_t i_read, i_file_length;
+	uint64_t ts;
 
 	if ((p_udf_dirent == NULL) || (psz_path == NULL))
 		return 1;
@@ -199,8 +1117,10 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 		if (i_length < 0) {
 			goto out;
 		}
+		if (scan_only)
+			iso_entry_add(&psz_fullpath[strlen(psz_extract_dir)]);
 		if (udf_is_dir(p_udf_dirent)) {
-			if (!scan_only) _mkdirU(psz_fullpath);
+			if (scan_only) iso_report.nb_dirs++; else _mkdirU(psz_fullpath);
 			p_udf_dirent2 = udf_opendir(p_udf_dirent);
 			if (p_udf_dirent2 != NULL) {
 				if (udf_extract_files(p_udf, p_udf_dirent2, &psz_fullpath[strlen(psz_extract_dir)]))
@@ -209,6 +1129,18 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 		} else {
 			i_file_length = udf_get_file_length(p_udf_dirent);
 			if (check_iso_props(psz_path, &is_syslinux_cfg, is_old_c32, i_file_length, psz_basename, psz_fullpath)) {
+				check_install_wim(&psz_fullpath[strlen(psz_extract_dir)], p_udf_dirent, NULL, 0);
+				safe_free(psz_fullpath);
+				continue;
+			}
+			InterlockedIncrement(&progress_files);
+			// Patched or replaced files are not journaled, and always get copied again
+			journaled = !is_syslinux_cfg;
+			for (i=0; i<NB_OLD_C32; i++)
+				if (is_old_c32[i] && use_own_c32[i])
+					journaled = FALSE;
+			if ((journaled) && (journal_skip(&psz_fullpath[strlen(psz_extract_dir)], i_file_length))) {
+				update_progress((i_file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
 				safe_free(psz_fullpath);
 				continue;
 			}
@@ -217,7 +1149,7 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			for (i=0; i<nul_pos; i++) if (psz_fullpath[i] == '/') psz_fullpath[i] = '\\';
 			safe_strcpy(&psz_fullpath[nul_pos], 24, size_to_hr(i_file_length));
 			uprintf("Extracting: %s\n", psz_fullpath);
-			SetWindowTextU(hISOFileName, psz_fullpath);
+			publish_name(psz_fullpath);
 			// Remove the appended size for extraction
 			psz_fullpath[nul_pos] = 0;
 			for (i=0; i<NB_OLD_C32; i++) {
@@ -231,44 +1163,73 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			}
 			if (i < NB_OLD_C32)
 				continue;
-			file_handle = CreateFileU(psz_fullpath, GENERIC_READ | GENERIC_WRITE,
-				FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			// Patched files always get rewritten in full
+			update = update_extraction && !is_syslinux_cfg;
+			file_handle = open_target(psz_fullpath, update, i_file_length);
 			if (file_handle == INVALID_HANDLE_VALUE) {
 				uprintf("  Unable to create file: %s\n", WindowsErrorString());
 				goto out;
 			}
+			// Syslinux configs are buffered so that they can be patched before being written
+			if ((is_syslinux_cfg) && (i_file_length <= MAX_CFG_PATCH_SIZE))
+				cfg_buf = (char*)malloc((size_t)i_file_length + 1);
+			cfg_size = 0;
+			journal_hash = FNV64_INIT;
+			if (update_hash_known) {
+				if (!udf_hash_file(p_udf_dirent, i_file_length, &journal_hash)) {
+					uprintf("  Error reading UDF file %s\n", &psz_fullpath[strlen(psz_extract_dir)]);
+					goto out;
+				}
+				if (update_check_hash(journal_hash, i_file_length)) {
+					update_progress((i_file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+					i_file_length = 0;
+				} else {
+					journal_hash = FNV64_INIT;
+				}
+			}
 			while (i_file_length > 0) {
 				if (FormatStatus) goto out;
-				memset(buf, 0, UDF_BLOCKSIZE);
-				i_read = udf_read_block(p_udf_dirent, buf, 1);
-				if (i_read < 0) {
+				ts = IOStatsTimestamp();
+				i_read = udf_read_block(p_udf_dirent, copy_buf,
+					(size_t)MIN(copy_buf_blocks, (i_file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE));
+				IOStatsRecord(IOS_SOURCE_READ, (i_read < 0)?0:i_read, ts);
+				if (i_read <= 0) {
 					uprintf("  Error reading UDF file %s\n", &psz_fullpath[strlen(psz_extract_dir)]);
 					goto out;
 				}
 				buf_size = (DWORD)MIN(i_file_length, i_read);
-				ISO_BLOCKING(r = WriteFile(file_handle, buf, buf_size, &wr_size, NULL));
-				if ((!r) || (buf_size != wr_size)) {
-					uprintf("  Error writing file: %s\n", WindowsErrorString());
-					goto out;
+				if (cfg_buf != NULL) {
+					memcpy(&cfg_buf[cfg_size], copy_buf, buf_size);
+					cfg_size += buf_size;
+				} else {
+					ISO_BLOCKING(r = write_target(file_handle, copy_buf, buf_size, &wr_size));
+					if ((!r) || (buf_size != wr_size)) {
+						uprintf("  Error writing file: %s\n", WindowsErrorString());
+						goto out;
+					}
+					if (journaled)
+						journal_hash = fnv64(journal_hash, copy_buf, buf_size);
 				}
 				i_file_length -= i_read;
-				if (nb_blocks++ % PROGRESS_THRESHOLD == 0) {
-					SendMessage(hISOProgressBar, PBM_SETPOS, (WPARAM)((MAX_PROGRESS*nb_blocks)/total_blocks), 0);
-					UpdateProgress(OP_DOS, 100.0f*nb_blocks/total_blocks);
-				}
+				update_progress((i_read + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
 			}
 			// If you have a fast USB 3.0 device, the default Windows buffering does an
 			// excellent job at compensating for our small blocks read/writes to max out the
 			// device's bandwidth.
 			// The drawback however is with cancellation. With a large file, CloseHandle()
 			// may take forever to complete and is not interruptible. We try to detect this.
-			ISO_BLOCKING(safe_closehandle(file_handle));
-			if (is_syslinux_cfg) {
-				// Workaround for isolinux config files requiring an ISO label for kernel
-				// append that may be different from our USB label.
+			if ((cfg_buf != NULL) && (!write_syslinux_cfg(file_handle, psz_fullpath, &cfg_buf, cfg_size)))
+				goto out;
+			if (!close_target(&file_handle, update, udf_get_file_length(p_udf_dirent)))
+				goto out;
+			if (journaled)
+				journal_record(&psz_fullpath[strlen(psz_extract_dir)], udf_get_file_length(p_udf_dirent));
+			if ((is_syslinux_cfg) && (cfg_buf == NULL)) {
+				// Too large to be buffered => patch the file after it has been written
 				if (replace_in_token_data(psz_fullpath, "append", iso_report.label, iso_report.usb_label, TRUE) != NULL)
 					uprintf("Patched %s: '%s' -> '%s'\n", psz_fullpath, iso_report.label, iso_report.usb_label);
 			}
+			safe_free(cfg_buf);
 		}
 		safe_free(psz_fullpath);
 	}
@@ -279,25 +1240,27 @@ out:
 		udf_dirent_free(p_udf_dirent);
 	ISO_BLOCKING(safe_closehandle(file_handle));
 	safe_free(psz_fullpath);
+	safe_free(cfg_buf);
 	return 1;
 }
 
 // Returns 0 on success, nonzero on error
 static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 {
-	HANDLE file_handle = NULL;
+	HANDLE file_handle = NULL, *shared_handle = NULL;
 	DWORD buf_size, wr_size;
-	BOOL s, is_syslinux_cfg, is_old_c32[NB_OLD_C32];
+	BOOL s, is_syslinux_cfg, is_old_c32[NB_OLD_C32], journaled, shareable, update;
 	int i_length, r = 1;
-	char psz_fullpath[1024], *psz_basename;
+	char psz_fullpath[1024], *psz_basename, *cfg_buf = NULL;
 	const char *psz_iso_name = &psz_fullpath[strlen(psz_extract_dir)];
-	unsigned char buf[ISO_BLOCKSIZE];
 	CdioListNode_t* p_entnode;
 	iso9660_stat_t *p_statbuf;
 	CdioList_t* p_entlist;
-	size_t i, nul_pos;
+	size_t i, j, nb, nul_pos, cfg_size, nb_shared_handles = 0;
+	shared_extent_t* ext;
 	lsn_t lsn;
-	int64_t i_file_length;
+	int64_t i_read, i_file_length;
+	uint64_t ts;
 
 	if ((p_iso == NULL) || (psz_path == NULL))
 		return 1;
@@ -326,13 +1289,48 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 		} else {
 			safe_strcpy(psz_basename, sizeof(psz_fullpath)-i_length-1, p_statbuf->filename);
 		}
+		if (scan_only)
+			iso_entry_add(psz_iso_name);
 		if (p_statbuf->type == _STAT_DIR) {
-			if (!scan_only) _mkdirU(psz_fullpath);
+			if (scan_only) iso_report.nb_dirs++; else _mkdirU(psz_fullpath);
 			if (iso_extract_files(p_iso, psz_iso_name))
 				goto out;
 		} else {
 			i_file_length = p_statbuf->size;
 			if (check_iso_props(psz_path, &is_syslinux_cfg, is_old_c32, i_file_length, psz_basename, psz_fullpath)) {
+				check_install_wim(psz_iso_name, NULL, p_iso, p_statbuf->lsn);
+				// Collect the extents of the files that get copied verbatim, to find the shared ones
+				if ((scan_only) && (i_file_length != 0) && (!is_syslinux_cfg)
+					&& ((*psz_path != 0) || (safe_strcmp(psz_basename, ldlinux_name) != 0))) {
+					for (i=0; (i<NB_OLD_C32) && (!is_old_c32[i]); i++);
+					if (i >= NB_OLD_C32)
+						shared_extent_add(p_statbuf->lsn, i_file_length, psz_iso_name);
+				}
+				continue;
+			}
+			InterlockedIncrement(&progress_files);
+			journaled = !is_syslinux_cfg;
+			update = update_extraction && !is_syslinux_cfg;
+			// Shared extents are written to all their destinations at once, which we don't do on update
+			shareable = !is_syslinux_cfg && !update_extraction;
+			for (i=0; i<NB_OLD_C32; i++) {
+				if (is_old_c32[i])
+					shareable = FALSE;
+				if (is_old_c32[i] && use_own_c32[i])
+					journaled = FALSE;
+			}
+			ext = shareable?shared_extent_lookup(p_statbuf->lsn, i_file_length):NULL;
+			if ((journaled) && (journal_skip(psz_iso_name, i_file_length))) {
+				if (ext != NULL)
+					ext->index++;
+				update_progress((i_file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+				continue;
+			}
+			// Data from a shared extent has already been written along with a previous entry
+			if ((ext != NULL) && (ext->written)) {
+				ext->index++;
+				journal_hash = ext->hash;
+				journal_record(psz_iso_name, i_file_length);
 				continue;
 			}
 			// Replace slashes with backslashes and append the size to the path for UI display
@@ -340,7 +1338,7 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 			for (i=0; i<nul_pos; i++) if (psz_fullpath[i] == '/') psz_fullpath[i] = '\\';
 			safe_strcpy(&psz_fullpath[nul_pos], 24, size_to_hr(i_file_length));
 			uprintf("Extracting: %s\n", psz_fullpath);
-			SetWindowTextU(hISOFileName, psz_fullpath);
+			publish_name(psz_fullpath);
 			// ISO9660 cannot handle backslashes
 			for (i=0; i<nul_pos; i++) if (psz_fullpath[i] == '\\') psz_fullpath[i] = '/';
 			psz_fullpath[nul_pos] = 0;
@@ -355,48 +1353,170 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 			}
 			if (i < NB_OLD_C32)
 				continue;
-			file_handle = CreateFileU(psz_fullpath, GENERIC_READ | GENERIC_WRITE,
-				FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			file_handle = open_target(psz_fullpath, update, i_file_length);
 			if (file_handle == INVALID_HANDLE_VALUE) {
 				uprintf("  Unable to create file: %s\n", WindowsErrorString());
 				goto out;
 			}
-			for (i = 0; i_file_length > 0; i++) {
+			if ((is_syslinux_cfg) && (i_file_length <= MAX_CFG_PATCH_SIZE))
+				cfg_buf = (char*)malloc((size_t)i_file_length + 1);
+			if ((ext != NULL) && (!shared_extent_open(ext, &shared_handle, &nb_shared_handles)))
+				goto out;
+			cfg_size = 0;
+			journal_hash = FNV64_INIT;
+			if (update_hash_known) {
+				if (!iso_hash_file(p_iso, p_statbuf->lsn, i_file_length, &journal_hash)) {
+					uprintf("  Error reading ISO9660 file %s\n", psz_iso_name);
+					goto out;
+				}
+				if (update_check_hash(journal_hash, i_file_length)) {
+					update_progress((i_file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+					i_file_length = 0;
+				} else {
+					journal_hash = FNV64_INIT;
+				}
+			}
+			for (i = 0; i_file_length > 0; i += nb) {
 				if (FormatStatus) goto out;
-				memset(buf, 0, ISO_BLOCKSIZE);
+				nb = (size_t)MIN(copy_buf_blocks, (i_file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
 				lsn = p_statbuf->lsn + (lsn_t)i;
-				if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
+				ts = IOStatsTimestamp();
+				i_read = iso9660_iso_seek_read(p_iso, copy_buf, lsn, (long)nb);
+				IOStatsRecord(IOS_SOURCE_READ, (i_read < 0)?0:i_read, ts);
+				if (i_read != (int64_t)(nb * ISO_BLOCKSIZE)) {
 					uprintf("  Error reading ISO9660 file %s at LSN %lu\n",
 						psz_iso_name, (long unsigned int)lsn);
 					goto out;
 				}
-				buf_size = (DWORD)MIN(i_file_length, ISO_BLOCKSIZE);
-				ISO_BLOCKING(s = WriteFile(file_handle, buf, buf_size, &wr_size, NULL));
-				if ((!s) || (buf_size != wr_size)) {
-					uprintf("  Error writing file: %s\n", WindowsErrorString());
-					goto out;
-				}
-				i_file_length -= ISO_BLOCKSIZE;
-				if (nb_blocks++ % PROGRESS_THRESHOLD == 0) {
-					SendMessage(hISOProgressBar, PBM_SETPOS, (WPARAM)((MAX_PROGRESS*nb_blocks)/total_blocks), 0);
-					UpdateProgress(OP_DOS, 100.0f*nb_blocks/total_blocks);
+				buf_size = (DWORD)MIN(i_file_length, i_read);
+				if (cfg_buf != NULL) {
+					memcpy(&cfg_buf[cfg_size], copy_buf, buf_size);
+					cfg_size += buf_size;
+				} else {
+					ISO_BLOCKING(s = write_target(file_handle, copy_buf, buf_size, &wr_size));
+					if ((!s) || (buf_size != wr_size)) {
+						uprintf("  Error writing file: %s\n", WindowsErrorString());
+						goto out;
+					}
+					for (j=0; j<nb_shared_handles; j++) {
+						ts = IOStatsTimestamp();
+						ISO_BLOCKING(s = WriteFile(shared_handle[j], copy_buf, buf_size, &wr_size, NULL));
+						IOStatsRecord(IOS_FILE_WRITE, wr_size, ts);
+						if ((!s) || (buf_size != wr_size)) {
+							uprintf("  Error writing file: %s\n", WindowsErrorString());
+							goto out;
+						}
+					}
+					if (journaled)
+						journal_hash = fnv64(journal_hash, copy_buf, buf_size);
 				}
+				i_file_length -= i_read;
+				update_progress(nb * (1 + nb_shared_handles));
+			}
+			if ((cfg_buf != NULL) && (!write_syslinux_cfg(file_handle, psz_fullpath, &cfg_buf, cfg_size)))
+				goto out;
+			if (!close_target(&file_handle, update, p_statbuf->size))
+				goto out;
+			if (ext != NULL) {
+				shared_extent_close(shared_handle, nb_shared_handles);
+				shared_bytes_saved += nb_shared_handles * p_statbuf->size;
+				shared_handle = NULL;
+				nb_shared_handles = 0;
+				ext->index++;
+				ext->hash = journal_hash;
+				ext->written = TRUE;
 			}
-			ISO_BLOCKING(safe_closehandle(file_handle));
-			if (is_syslinux_cfg) {
+			if (journaled)
+				journal_record(psz_iso_name, p_statbuf->size);
+			if ((is_syslinux_cfg) && (cfg_buf == NULL)) {
 				if (replace_in_token_data(psz_fullpath, "append", iso_report.label, iso_report.usb_label, TRUE) != NULL)
 					uprintf("Patched %s: '%s' -> '%s'\n", psz_fullpath, iso_report.label, iso_report.usb_label);
 			}
+			safe_free(cfg_buf);
 		}
 	}
 	r = 0;
 
 out:
 	ISO_BLOCKING(safe_closehandle(file_handle));
+	shared_extent_close(shared_handle, nb_shared_handles);
+	safe_free(cfg_buf);
 	_cdio_list_free(p_entlist, true);
 	return r;
 }
 
+/*
+ * Detect isohybrid images, i.e. ISOs that also carry an MBR, so that they can be written to
+ * a drive as is. The partition table must be consistent with the size of the image, as an
+ * El Torito boot record is expected for any ISO that was produced to also boot from disk.
+ */
+static BOOL check_isohybrid(const char* src_iso)
+{
+	FILE* fd;
+	int i, nb_parts = 0;
+	BOOL has_efi_part = FALSE, has_efi_entry = FALSE;
+	int64_t iso_size;
+	uint32_t start, count, catalog;
+	uint8_t *buf, *part;
+
+	fd = fopenU(src_iso, "rb");
+	if (fd == NULL)
+		return FALSE;
+	buf = (uint8_t*)malloc(ISO_BLOCKSIZE);
+	if (buf == NULL) {
+		fclose(fd);
+		return FALSE;
+	}
+	_fseeki64(fd, 0, SEEK_END);
+	iso_size = _ftelli64(fd);
+	_fseeki64(fd, 0, SEEK_SET);
+	if ((fread(buf, 1, 512, fd) != 512) || (buf[0x1FE] != 0x55) || (buf[0x1FF] != 0xAA))
+		goto out;
+	for (i=0; i<4; i++) {
+		part = &buf[0x1BE + 16*i];
+		if (part[4] == 0)
+			continue;
+		start = *(uint32_t*)&part[8];
+		count = *(uint32_t*)&part[12];
+		// A protective GPT entry may legitimately extend past the end of the image
+		if ( ((part[0] != 0x00) && (part[0] != 0x80)) || (count == 0) || ((int64_t)start*512 >= iso_size)
+		  || ((part[4] != 0xEE) && ((int64_t)(start + (uint64_t)count)*512 > iso_size)) )
+			goto out;
+		if (part[4] == 0xEF)
+			has_efi_part = TRUE;
+		nb_parts++;
+	}
+	if (nb_parts == 0)
+		goto out;
+
+	// Look for the El Torito boot record, right after the primary volume descriptor
+	_fseeki64(fd, 17 * ISO_BLOCKSIZE, SEEK_SET);
+	if ( (fread(buf, 1, ISO_BLOCKSIZE, fd) != ISO_BLOCKSIZE) || (buf[0] != 0)
+	  || (memcmp(&buf[1], "CD001", 5) != 0) || (memcmp(&buf[7], ELTORITO_ID, sizeof(ELTORITO_ID)-1) != 0) ) {
+		uprintf("Image has an MBR but no El Torito boot record - ignoring\n");
+		nb_parts = 0;
+		goto out;
+	}
+	catalog = *(uint32_t*)&buf[ELTORITO_CATALOG_OFFSET];
+	_fseeki64(fd, (int64_t)catalog * ISO_BLOCKSIZE, SEEK_SET);
+	if (((int64_t)catalog * ISO_BLOCKSIZE < iso_size) && (fread(buf, 1, ISO_BLOCKSIZE, fd) == ISO_BLOCKSIZE)) {
+		// The validation entry and the section headers all hold a platform ID
+		has_efi_entry = (buf[0] == 0x01) && (buf[1] == ELTORITO_PLATFORM_EFI);
+		for (i=64; (i<ISO_BLOCKSIZE) && (!has_efi_entry); i+=32) {
+			if ((buf[i] == ELTORITO_HEADER_MORE) || (buf[i] == ELTORITO_HEADER_LAST))
+				has_efi_entry = (buf[i+1] == ELTORITO_PLATFORM_EFI);
+		}
+	}
+	uprintf("Image is isohybrid (%d partition%s%s)\n", nb_parts, (nb_parts == 1)?"":"s",
+		(has_efi_part || has_efi_entry)?", EFI bootable":"");
+	iso_report.image_size = iso_size;
+
+out:
+	free(buf);
+	fclose(fd);
+	return (nb_parts != 0);
+}
+
 BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 {
 	size_t i;
@@ -408,7 +1528,8 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	udf_dirent_t* p_udf_root;
 	LONG progress_style;
 	char* tmp;
-	char path[64];
+	char path[64], update_path[MAX_PATH];
+	wchar_t update_wpath[MAX_PATH];
 	const char* scan_text = "Scanning ISO image...";
 	const char* basedir[] = { "i386", "minint" };
 	const char* tmp_sif = ".\\txtsetup.sif~";
@@ -418,11 +1539,15 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 
 	scan_only = scan;
 	cdio_log_set_handler(log_handler);
+	set_index_dir();
 	psz_extract_dir = dest_dir;
 	progress_style = GetWindowLong(hISOProgressBar, GWL_STYLE);
 	if (scan_only) {
 		total_blocks = 0;
 		memset(&iso_report, 0, sizeof(iso_report));
+		shared_extent_free();
+		StrArrayDestroy(&iso_entry);
+		StrArrayCreate(&iso_entry, 1024);
 		// String array of all isolinux/syslinux locations
 		StrArrayCreate(&config_path, 8);
 		// Change the Window title and static text
@@ -440,9 +1565,42 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 			goto out;
 		}
 		nb_blocks = 0;
+		InterlockedExchange(&progress_blocks, 0);
+		InterlockedExchange(&progress_files, 0);
+		free(InterlockedExchangePointer(&progress_name, NULL));
+		InterlockedExchange(&progress_active, TRUE);
 		iso_blocking_status = 0;
+		// Copy in chunks of the optimal I/O size of the target drive, if it was probed
+		copy_buf_blocks = min(max(SelectedDrive.OptimalIOSize, DEFAULT_COPY_SIZE), MAX_COPY_SIZE) / ISO_BLOCKSIZE;
+		copy_buf = (uint8_t*)malloc(copy_buf_blocks * ISO_BLOCKSIZE);
+		if (copy_buf == NULL) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+			goto out;
+		}
 		SetWindowLong(hISOProgressBar, GWL_STYLE, progress_style & (~PBS_MARQUEE));
 		SendMessage(hISOProgressBar, PBM_SETPOS, 0, 0);
+		for (i=0; i<nb_shared_extents; i++) {
+			shared_extent[i].index = 0;
+			shared_extent[i].written = FALSE;
+		}
+		shared_bytes_saved = 0;
+		journal_open(src_iso, dest_dir);
+		if (update_extraction) {
+			update_bytes_kept = 0;
+			update_files_kept = 0;
+			update_files_deleted = 0;
+			update_buf = (uint8_t*)malloc(copy_buf_blocks * ISO_BLOCKSIZE);
+			if (update_buf == NULL) {
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+				goto out;
+			}
+			manifest_load();
+			// Remove what is no longer part of the ISO first, to free space for the new files
+			SetWindowTextU(hISOFileName, "Removing obsolete files...");
+			update_path[0] = 0;
+			if (utf8_to_wchar_no_alloc(dest_dir, update_wpath, ARRAYSIZE(update_wpath)) > 0)
+				update_cleanup(update_wpath, ARRAYSIZE(update_wpath), update_path, sizeof(update_path));
+		}
 	}
 	SendMessage(hISOProgressDlg, UM_ISO_INIT, 0, 0);
 
@@ -489,6 +1647,10 @@ out:
 			iso_report.label[j] = 0;
 		// We use the fact that UDF_BLOCKSIZE and ISO_BLOCKSIZE are the same here
 		iso_report.projected_size = total_blocks * ISO_BLOCKSIZE;
+		iso_report.is_isohybrid = check_isohybrid(src_iso);
+		shared_extent_build();
+		if (iso_entry.Table != NULL)
+			qsort(iso_entry.Table, iso_entry.Index, sizeof(char*), iso_entry_cmp);
 		// We will link the existing isolinux.cfg from a syslinux.cfg we create
 		// If multiple config file exist, choose the one with the shortest path
 		if (iso_report.has_isolinux) {
@@ -540,7 +1702,22 @@ out:
 		if (fd != NULL)
 			fclose(fd);
 	}
+	if (!scan_only) {
+		if (shared_bytes_saved != 0)
+			uprintf("Shared extents: avoided reading duplicated data%s again\n", size_to_hr(shared_bytes_saved));
+		if (update_extraction) {
+			uprintf("Update: %d file%s unchanged, %d file%s deleted, avoided writing%s\n",
+				update_files_kept, (update_files_kept == 1)?"":"s", update_files_deleted,
+				(update_files_deleted == 1)?"":"s", size_to_hr(update_bytes_kept));
+			safe_free(update_buf);
+			StrArrayDestroy(&manifest);
+		}
+		journal_close((r == 0) && (FormatStatus == 0));
+	}
+	// The UI does a last refresh of the progress on exit, after which it must no longer sample it
 	SendMessage(hISOProgressDlg, UM_ISO_EXIT, 0, 0);
+	InterlockedExchange(&progress_active, FALSE);
+	safe_free(copy_buf);
 	if (p_iso != NULL)
 		iso9660_close(p_iso);
 	if (p_udf != NULL)
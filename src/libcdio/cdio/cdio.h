@@ -47,6 +47,11 @@ extern "C" {
 
   typedef struct cdtext_s cdtext_t;
 
+  /** Set the directory where the indexes of compressed images (gzip and
+      zstd) are kept, for reuse on the next open. If this isn't set, which
+      is the default, the indexes are not saved. */
+  void cdio_zstream_set_index_dir(const char psz_dir[]);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -111,11 +111,12 @@ typedef struct iso_su_er_s {
   char data[EMPTY_ARRAY_SIZE];
 } GNUC_PACKED iso_su_er_t;
 
+/*! system-use continuation area */
 typedef struct iso_su_ce_s {
-  char extent[8];
-  char offset[8];
-  char size[8];
-} iso_su_ce_t;
+  iso733_t extent;        /**< block of the continuation area */
+  iso733_t offset;        /**< byte offset within that block */
+  iso733_t size;          /**< length of the continuation area */
+} GNUC_PACKED iso_su_ce_t;
 
 /*! POSIX file attributes, PX. See Rock Ridge Section 4.1.2 */
 typedef struct iso_rock_px_s {
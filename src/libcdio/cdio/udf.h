@@ -48,6 +48,9 @@ typedef struct udf_dirent_s {
     uint64_t           dir_left;
     uint8_t           *sector;
     udf_fileid_desc_t *fid;
+    uint32_t          *fe_lba;   /* sorted ICB locations of prefetched FEs */
+    uint8_t           *fe_cache; /* prefetched FEs, in fe_lba order */
+    uint32_t           i_fe_count;
     
     /* This field has to come last because it is variable in length. */
     udf_file_entry_t   fe;
@@ -88,6 +88,13 @@ extern "C" {
   ssize_t udf_read_block(const udf_dirent_t *p_udf_dirent, 
 			 void * buf, size_t count);
 
+  /**
+    Moves the read position of p_udf_dirent back to the start of the
+    file, so that the next udf_read_block() reads it from the beginning
+    again.
+  */
+  void udf_rewind(const udf_dirent_t *p_udf_dirent);
+
   /**
     Advances p_udf_direct to the the next directory entry in the
     pointed to by p_udf_dir. It also returns this as the value.  NULL
@@ -0,0 +1,3044 @@
+/*
+  Copyright (C) 2013 Pete Batard <pete@akeo.ie>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Random access stream for compressed images (.iso.gz, .iso.xz, .iso.zst
+  and CSO).
+
+  The uncompressed image is split into spans of ZSTREAM_SPAN_SIZE bytes,
+  that can each be decompressed on their own:
+  - For CSO, each span is a run of independently deflated blocks, which
+    we locate through the block index from the CSO header.
+  - For gzip, a span starts on a deflate block boundary, and we record the
+    bit offset and the 32 KB of data that precede it (as zlib's zran does).
+    The restart points are discovered as the data gets decompressed, so a
+    first sequential pass is needed to get the complete index, after which
+    it is saved in the directory set with cdio_zstream_set_index_dir(), for
+    reuse on the next open.
+  - For xz and zstd, the image is made of units (xz blocks or zstd frames)
+    that can be decompressed on their own, and that are split into spans.
+    The xz blocks are listed in the index at the end of each xz stream. The
+    zstd frames are discovered as the data gets decompressed, like the gzip
+    restart points, and the same goes for their index. Within a unit, the
+    data can only be decompressed sequentially, so we keep a few cursors,
+    each with the decoder state and the window of the data it decompressed
+    last, and pick the one that is the closest before the span we want.
+  Decompressed spans are kept in a small cache and, on Windows, the spans
+  that follow the one being read are decompressed ahead of time by a pool
+  of worker threads.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+# define __CDIO_CONFIG_H__ 1
+#endif
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <cdio/logging.h>
+#include <cdio/util.h>
+#include <cdio/sector.h>
+#include "_cdio_stream.h"
+#include "_cdio_zstream.h"
+
+#if defined(HAVE_FSEEKO64) && defined(_FILE_OFFSET_BITS) && (_FILE_OFFSET_BITS == 64)
+#define CDIO_FSEEK fseeko64
+#elif defined(HAVE_FSEEKO)
+#define CDIO_FSEEK fseeko
+#else
+#define CDIO_FSEEK fseek
+#endif
+
+#if defined(_WIN32)
+#include <cdio/utf8.h>
+#define CDIO_FOPEN fopen_utf8
+#else
+#define CDIO_FOPEN fopen
+#endif
+
+#if defined(HAVE__STATI64) && defined(_FILE_OFFSET_BITS) && (_FILE_OFFSET_BITS == 64)
+#define CDIO_STAT_STRUCT _stati64
+#if defined(_WIN32)
+static inline int _stati64_utf8(const char *path, struct _stati64 *buffer) {
+  int ret;
+  wchar_t* wpath = cdio_utf8_to_wchar(path);
+  ret = _wstati64(wpath, buffer);
+  free(wpath);
+  return ret;
+}
+#define CDIO_STAT_CALL _stati64_utf8
+#else
+#define CDIO_STAT_CALL _stati64
+#endif
+#else
+#define CDIO_STAT_STRUCT stat
+#define CDIO_STAT_CALL stat
+#endif
+
+#define ZSTREAM_SPAN_SIZE       (4*1024*1024)
+#define ZSTREAM_WINDOW_SIZE     32768
+#define ZSTREAM_INBUF_SIZE      (256*1024)
+#define ZSTREAM_MAX_WORKERS     4
+#define ZSTREAM_MAX_SLOTS       (2*ZSTREAM_MAX_WORKERS + 2)
+#define ZSTREAM_INDEX_EXT       ".idx"
+#define ZSTREAM_INDEX_MAGIC     "CDIOZIX1"
+#define ZSTREAM_INDEX_MAGIC_ZSTD "CDIOZIZ1"
+#define ZSTREAM_PVD_LSN         16
+#define ZSTREAM_MAX_CURSORS     (ZSTREAM_MAX_WORKERS + 1)
+#define ZSTREAM_CURSOR_MEM      (256*1024*1024)
+#define ZSTREAM_MAX_WINDOW      (128*1024*1024)
+#define ZSTREAM_XZ_MAX_STEP     (2*1024*1024)
+#define ZSTREAM_XZ_MAX_INDEX    (16*1024*1024)
+#define ZSTD_MAGIC              0xFD2FB528
+#define ZSTD_SKIPPABLE_MAGIC    0x184D2A50
+#define ZSTD_BLOCK_MAX          (128*1024)
+#define ZFSE_MAX_AL             9
+#define ZHUF_MAX_BITS           11
+
+typedef enum {
+  ZSTREAM_GZIP,
+  ZSTREAM_CSO,
+  ZSTREAM_XZ,
+  ZSTREAM_ZSTD
+} zstream_format_t;
+
+typedef enum {
+  SLOT_EMPTY,
+  SLOT_PENDING,     /* queued for one of the workers */
+  SLOT_BUSY,        /* being decompressed */
+  SLOT_READY,
+  SLOT_FAILED
+} zslot_state_t;
+
+/* A restart point (for CSO, only u_offset is used) */
+typedef struct {
+  uint64_t u_offset;  /* uncompressed offset of the span */
+  uint64_t c_bit;     /* bit offset of the first deflate block or gzip header */
+  uint8_t *window;    /* up to 32 KB of the data that precedes the span */
+  bool at_header;     /* the span starts with a gzip member header */
+  uint32_t unit;      /* for xz and zstd, the unit that holds the span */
+} zspan_t;
+
+/* An xz block or a zstd frame */
+typedef struct {
+  uint64_t u_offset;
+  uint64_t u_size;
+  uint64_t c_offset;
+  uint64_t window;    /* how far back the data may refer to */
+} zunit_t;
+
+typedef struct {
+  int64_t span;
+  zslot_state_t state;
+  uint8_t *data;      /* for gzip, the span data is preceded by its window */
+  size_t data_cap;
+  size_t data_start;
+  size_t data_len;
+  uint64_t last_use;
+#ifdef _WIN32
+  HANDLE done;        /* manual reset event, signaled unless PENDING/BUSY */
+#endif
+} zslot_t;
+
+/* Huffman decoding table: entries in fast[] are 'symbol | (length << 11)',
+   or 0 for codes that are longer than ZFAST_BITS */
+#define ZFAST_BITS 10
+typedef struct {
+  uint16_t fast[1 << ZFAST_BITS];
+  uint16_t count[16];
+  uint16_t symbol[288];
+} zhuff_t;
+
+/* Decompression context, one for each thread */
+typedef struct {
+  FILE *fd;           /* NULL when decoding from in[] only */
+  uint8_t *in;
+  size_t in_cap;
+  size_t in_len;
+  size_t in_pos;
+  uint64_t in_base;   /* file offset of in[0] */
+  uint64_t limit;     /* file offset where the compressed data ends */
+  uint64_t bitbuf;
+  int bitcnt;
+  unsigned overrun;   /* number of zero bytes fed past the end of the data */
+  zhuff_t lit, dist;
+} zdec_t;
+
+/* Growable output buffer */
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+} zbuf_t;
+
+/* LZMA decoder state */
+typedef struct {
+  uint16_t choice[2];
+  uint16_t low[16][8];
+  uint16_t mid[16][8];
+  uint16_t high[256];
+} zlzma_len_t;
+
+/* Range decoder, kept apart from the rest of the state so that it can live
+   in registers while a chunk is decoded */
+typedef struct {
+  const uint8_t *in;
+  const uint8_t *in_end;
+  uint32_t range;
+  uint32_t code;
+  bool overrun;
+} zrc_t;
+
+typedef struct {
+  bool need_dict_reset;
+  bool need_props;
+  int lc, lp, pb;
+  uint32_t state;
+  uint32_t rep[4];
+  struct {
+    uint16_t is_match[12][16];
+    uint16_t is_rep[12];
+    uint16_t is_rep_g0[12];
+    uint16_t is_rep_g1[12];
+    uint16_t is_rep_g2[12];
+    uint16_t is_rep0_long[12][16];
+    uint16_t pos_slot[4][64];
+    uint16_t pos_special[115];
+    uint16_t align[16];
+    zlzma_len_t len;
+    zlzma_len_t rep_len;
+    uint16_t literal[0x300 << 4];   /* lc + lp <= 4 with LZMA2 */
+  } p;
+} zlzma_t;
+
+/* Zstandard decoder state */
+typedef struct {
+  uint16_t base;
+  uint8_t symbol;
+  uint8_t bits;
+} zfse_entry_t;
+
+typedef struct {
+  int al;             /* accuracy log, or -1 if the table isn't set */
+  zfse_entry_t e[1 << ZFSE_MAX_AL];
+} zfse_t;
+
+typedef struct {
+  zfse_t ll, of, ml;
+  int huf_bits;       /* longest Huffman code, or 0 if the table isn't set */
+  uint8_t huf_sym[1 << ZHUF_MAX_BITS];
+  uint8_t huf_len[1 << ZHUF_MAX_BITS];
+  uint32_t rep[3];
+  bool checksum;
+  uint8_t lit[ZSTD_BLOCK_MAX];
+} zzstd_t;
+
+/* Sequential decompression of a unit */
+typedef struct {
+  int64_t unit;       /* -1 if the cursor isn't positioned */
+  uint64_t u_pos;     /* unit offset of the data that comes next */
+  uint64_t u_end;     /* where u_pos will be, once the current job is done */
+  uint64_t dict_start;/* unit offset of the last LZMA2 dictionary reset */
+  uint64_t c_pos;     /* file offset of the next block or chunk */
+  bool busy;
+  bool done;          /* the end of the unit data was reached */
+  uint64_t last_use;
+  FILE *fd;
+  uint8_t *hist;      /* the last data that was decoded, up to u_pos */
+  size_t hist_len;
+  size_t hist_cap;
+  size_t hist_keep;   /* how much of it the data that follows may refer to */
+  uint8_t *in;        /* compressed block or chunk */
+  zlzma_t *lzma;
+  zzstd_t *zstd;
+#ifdef _WIN32
+  HANDLE idle;        /* manual reset event, signaled unless busy */
+#endif
+} zcursor_t;
+
+typedef struct {
+  char *pathname;
+  zstream_format_t format;
+  uint64_t c_size;
+  uint64_t c_mtime;
+  uint64_t u_size;          /* only valid when index_complete */
+  uint64_t u_size_hint;     /* estimate of u_size, until the index is complete */
+  bool u_size_hint_checked;
+  bool index_complete;
+  bool index_loaded;
+  uint64_t pos;
+
+  zspan_t *spans;
+  uint32_t n_spans;
+  uint32_t spans_cap;
+
+  uint32_t cso_block_size;
+  uint32_t cso_blocks;
+  uint32_t cso_blocks_per_span;
+  uint8_t cso_align;
+  uint32_t *cso_index;
+
+  zunit_t *units;
+  uint32_t n_units;
+  uint32_t units_cap;
+  uint64_t max_window;
+  zcursor_t cursors[ZSTREAM_MAX_CURSORS];
+  int n_cursors;
+
+  zslot_t slots[ZSTREAM_MAX_SLOTS];
+  int n_slots;
+  uint64_t use_count;
+  int64_t last_span;        /* last span requested by the reader */
+  bool sequential;          /* whether the reader went there from the span before */
+  zdec_t dec;               /* used by the reader thread */
+#ifdef _WIN32
+  CRITICAL_SECTION lock;
+  HANDLE work;              /* semaphore, counting the PENDING slots */
+  HANDLE workers[ZSTREAM_MAX_WORKERS];
+  zdec_t *worker_dec[ZSTREAM_MAX_WORKERS];
+  int n_workers;
+  volatile LONG worker_id;
+  volatile bool quit;
+#endif
+} _UserData;
+
+#ifdef _WIN32
+#define ZLOCK(ud)   EnterCriticalSection(&(ud)->lock)
+#define ZUNLOCK(ud) LeaveCriticalSection(&(ud)->lock)
+#else
+#define ZLOCK(ud)
+#define ZUNLOCK(ud)
+#endif
+
+/*
+ * Inflate
+ */
+static const uint16_t zlen_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t zlen_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t zdist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577 };
+static const uint8_t zdist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t zclen_order[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static zhuff_t zfixed_lit, zfixed_dist;
+static bool zfixed_ready = false;
+
+static void
+_zrefill(zdec_t *d, int n)
+{
+  while (d->bitcnt <= 56) {
+    if (d->in_pos == d->in_len && d->fd != NULL) {
+      d->in_base += d->in_len;
+      d->in_len = fread(d->in, 1, d->in_cap, d->fd);
+      d->in_pos = 0;
+    }
+    if (d->in_pos == d->in_len) {
+      if (d->bitcnt >= n)
+        break;
+      /* Past the end of the data: feed zeroes, and let the caller
+         detect the overrun */
+      d->overrun++;
+    } else {
+      d->bitbuf |= (uint64_t)d->in[d->in_pos++] << d->bitcnt;
+    }
+    d->bitcnt += 8;
+  }
+}
+
+static inline void
+_zneed(zdec_t *d, int n)
+{
+  if (d->bitcnt < n)
+    _zrefill(d, n);
+}
+
+static inline uint32_t
+_zbits(zdec_t *d, int n)
+{
+  uint32_t v;
+
+  if (n == 0)
+    return 0;
+  _zneed(d, n);
+  v = (uint32_t)(d->bitbuf & ((1ULL << n) - 1));
+  d->bitbuf >>= n;
+  d->bitcnt -= n;
+  return v;
+}
+
+/* Current position, in bits, from the start of the file */
+static inline uint64_t
+_ztell(const zdec_t *d)
+{
+  return (d->in_base + d->in_pos + d->overrun) * 8 - d->bitcnt;
+}
+
+static inline bool
+_zoverrun(const zdec_t *d)
+{
+  return _ztell(d) > d->limit * 8;
+}
+
+static void
+_zalign(zdec_t *d)
+{
+  d->bitbuf >>= d->bitcnt & 7;
+  d->bitcnt &= ~7;
+}
+
+static bool
+_zseek(zdec_t *d, uint64_t bit)
+{
+  uint64_t byte = bit >> 3;
+
+  if (d->fd != NULL) {
+    if (CDIO_FSEEK(d->fd, (off_t)byte, SEEK_SET) != 0)
+      return false;
+    d->in_base = byte;
+    d->in_len = 0;
+  } else if (byte < d->in_base || byte > d->in_base + d->in_len) {
+    return false;
+  }
+  d->in_pos = (size_t)(byte - d->in_base);
+  d->bitbuf = 0;
+  d->bitcnt = 0;
+  d->overrun = 0;
+  _zbits(d, bit & 7);
+  return true;
+}
+
+static bool
+_zhuff_build(zhuff_t *h, const uint8_t *lens, int n)
+{
+  uint16_t offs[16];
+  int i, j, len, left = 1, idx = 0;
+  uint32_t code = 0, rev;
+
+  memset(h->count, 0, sizeof(h->count));
+  for (i = 0; i < n; i++)
+    h->count[lens[i]]++;
+  for (len = 1; len < 16; len++) {
+    left <<= 1;
+    left -= h->count[len];
+    if (left < 0)
+      return false;   /* over-subscribed */
+  }
+  offs[1] = 0;
+  for (len = 1; len < 15; len++)
+    offs[len + 1] = offs[len] + h->count[len];
+  for (i = 0; i < n; i++)
+    if (lens[i] != 0)
+      h->symbol[offs[lens[i]]++] = (uint16_t)i;
+
+  /* Deflate codes are sent MSB first, so the fast table is indexed
+     by the bit-reversed codes */
+  memset(h->fast, 0, sizeof(h->fast));
+  for (len = 1; len < 16; len++) {
+    for (i = 0; i < h->count[len]; i++, idx++, code++) {
+      if (len > ZFAST_BITS)
+        continue;
+      for (rev = 0, j = 0; j < len; j++)
+        rev |= ((code >> j) & 1) << (len - 1 - j);
+      for (j = rev; j < (1 << ZFAST_BITS); j += 1 << len)
+        h->fast[j] = h->symbol[idx] | (len << 11);
+    }
+    code <<= 1;
+  }
+  return true;
+}
+
+static inline int
+_zdecode(zdec_t *d, const zhuff_t *h)
+{
+  int len, code = 0, first = 0, index = 0, count;
+  uint16_t e;
+
+  _zneed(d, 15);
+  e = h->fast[d->bitbuf & ((1 << ZFAST_BITS) - 1)];
+  if (e != 0) {
+    d->bitbuf >>= e >> 11;
+    d->bitcnt -= e >> 11;
+    return e & 0x7FF;
+  }
+  for (len = 1; len < 16; len++) {
+    code |= (d->bitbuf >> (len - 1)) & 1;
+    count = h->count[len];
+    if (code - count < first) {
+      d->bitbuf >>= len;
+      d->bitcnt -= len;
+      return h->symbol[index + (code - first)];
+    }
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static bool
+_zbuf_reserve(zbuf_t *out, size_t size)
+{
+  uint8_t *data;
+  size_t cap;
+
+  if (out->len + size <= out->cap)
+    return true;
+  cap = out->cap + out->cap / 2 + size;
+  data = realloc(out->data, cap);
+  if (data == NULL)
+    return false;
+  out->data = data;
+  out->cap = cap;
+  return true;
+}
+
+static void
+_zfixed_init(void)
+{
+  uint8_t lens[288];
+  int i;
+
+  if (zfixed_ready)
+    return;
+  for (i = 0; i < 144; i++) lens[i] = 8;
+  for (; i < 256; i++) lens[i] = 9;
+  for (; i < 280; i++) lens[i] = 7;
+  for (; i < 288; i++) lens[i] = 8;
+  _zhuff_build(&zfixed_lit, lens, 288);
+  for (i = 0; i < 30; i++) lens[i] = 5;
+  _zhuff_build(&zfixed_dist, lens, 30);
+  zfixed_ready = true;
+}
+
+static bool
+_zinflate_codes(zdec_t *d, zbuf_t *out, const zhuff_t *lit, const zhuff_t *dist)
+{
+  int sym;
+  uint32_t len, off;
+  uint8_t *p;
+
+  for (;;) {
+    sym = _zdecode(d, lit);
+    if (sym < 256) {
+      if (sym < 0 || _zoverrun(d))
+        return false;
+      if (!_zbuf_reserve(out, 1))
+        return false;
+      out->data[out->len++] = (uint8_t)sym;
+      continue;
+    }
+    if (sym == 256)
+      return true;
+    sym -= 257;
+    if (sym >= 29)
+      return false;
+    len = zlen_base[sym] + _zbits(d, zlen_extra[sym]);
+    sym = _zdecode(d, dist);
+    if (sym < 0 || sym >= 30)
+      return false;
+    off = zdist_base[sym] + _zbits(d, zdist_extra[sym]);
+    if (off > out->len || !_zbuf_reserve(out, len))
+      return false;
+    for (p = &out->data[out->len]; len > 0; len--, p++)
+      *p = *(p - off);
+    out->len = p - out->data;
+    if (_zoverrun(d))
+      return false;
+  }
+}
+
+static bool
+_zinflate_dynamic(zdec_t *d, zbuf_t *out)
+{
+  uint8_t lens[288 + 32];
+  int i, n, sym, nlen, ndist, ncode;
+  uint8_t prev;
+
+  nlen = _zbits(d, 5) + 257;
+  ndist = _zbits(d, 5) + 1;
+  ncode = _zbits(d, 4) + 4;
+  if (nlen > 286 || ndist > 30)
+    return false;
+  memset(lens, 0, 19);
+  for (i = 0; i < ncode; i++)
+    lens[zclen_order[i]] = (uint8_t)_zbits(d, 3);
+  if (!_zhuff_build(&d->lit, lens, 19))
+    return false;
+
+  for (i = 0; i < nlen + ndist; ) {
+    sym = _zdecode(d, &d->lit);
+    if (sym < 0)
+      return false;
+    if (sym < 16) {
+      lens[i++] = (uint8_t)sym;
+      continue;
+    }
+    prev = 0;
+    if (sym == 16) {
+      if (i == 0)
+        return false;
+      prev = lens[i - 1];
+      n = 3 + _zbits(d, 2);
+    } else if (sym == 17) {
+      n = 3 + _zbits(d, 3);
+    } else {
+      n = 11 + _zbits(d, 7);
+    }
+    if (i + n > nlen + ndist)
+      return false;
+    while (n--)
+      lens[i++] = prev;
+  }
+  if (lens[256] == 0)
+    return false;
+  if (!_zhuff_build(&d->lit, lens, nlen) || !_zhuff_build(&d->dist, &lens[nlen], ndist))
+    return false;
+  return _zinflate_codes(d, out, &d->lit, &d->dist);
+}
+
+/* Inflate a single deflate block. Returns 1 for the final block, 0 for
+   other blocks, and -1 on error */
+static int
+_zinflate_block(zdec_t *d, zbuf_t *out)
+{
+  int final, type;
+  uint32_t len, nlen;
+  bool r;
+
+  final = _zbits(d, 1);
+  type = _zbits(d, 2);
+  switch (type) {
+  case 0:
+    _zalign(d);
+    len = _zbits(d, 16);
+    nlen = _zbits(d, 16);
+    if ((len ^ 0xFFFF) != nlen || !_zbuf_reserve(out, len))
+      return -1;
+    while (len--)
+      out->data[out->len++] = (uint8_t)_zbits(d, 8);
+    r = true;
+    break;
+  case 1:
+    r = _zinflate_codes(d, out, &zfixed_lit, &zfixed_dist);
+    break;
+  case 2:
+    r = _zinflate_dynamic(d, out);
+    break;
+  default:
+    r = false;
+    break;
+  }
+  if (!r || _zoverrun(d))
+    return -1;
+  return final;
+}
+
+/* Parse a gzip member header. Returns false if we're not looking at one */
+static bool
+_zgzip_header(zdec_t *d)
+{
+  uint32_t flags, n;
+
+  _zalign(d);
+  if (_zbits(d, 16) != 0x8B1F || _zbits(d, 8) != 8 || _zoverrun(d))
+    return false;
+  flags = _zbits(d, 8);
+  _zbits(d, 16); _zbits(d, 16);    /* MTIME */
+  _zbits(d, 16);                   /* XFL, OS */
+  if (flags & 0x04) {              /* FEXTRA */
+    for (n = _zbits(d, 16); n > 0 && !_zoverrun(d); n--)
+      _zbits(d, 8);
+  }
+  if (flags & 0x08)                /* FNAME */
+    while (_zbits(d, 8) != 0 && !_zoverrun(d));
+  if (flags & 0x10)                /* FCOMMENT */
+    while (_zbits(d, 8) != 0 && !_zoverrun(d));
+  if (flags & 0x02)                /* FHCRC */
+    _zbits(d, 16);
+  return !_zoverrun(d);
+}
+
+/*
+ * Span decompression
+ */
+static bool
+_zspan_gzip(_UserData *ud, zdec_t *d, const zspan_t *span, zslot_t *slot,
+            zspan_t *next, bool *eos)
+{
+  zbuf_t out;
+  size_t wlen;
+  bool at_header = span->at_header;
+  int r;
+
+  out.data = slot->data;
+  out.cap = slot->data_cap;
+  wlen = (span->window != NULL) ? (size_t)MIN(ZSTREAM_WINDOW_SIZE, span->u_offset) : 0;
+  out.len = wlen;
+  if (!_zbuf_reserve(&out, ZSTREAM_SPAN_SIZE + 65536))
+    goto error;
+  if (wlen != 0)
+    memcpy(out.data, span->window, wlen);
+
+  d->limit = ud->c_size;
+  if (!_zseek(d, span->c_bit))
+    goto error;
+  *eos = false;
+  while (out.len - wlen < ZSTREAM_SPAN_SIZE) {
+    if (at_header) {
+      if (_ztell(d) >= d->limit * 8 || !_zgzip_header(d)) {
+        /* End of the data, or trailing garbage after the last member */
+        *eos = true;
+        break;
+      }
+      at_header = false;
+    }
+    r = _zinflate_block(d, &out);
+    if (r < 0) {
+      cdio_warn("zstream: invalid deflate data in span at LSN %lu",
+                (long unsigned int)(span->u_offset / CDIO_CD_FRAMESIZE));
+      goto error;
+    }
+    if (r == 1) {
+      /* Skip the CRC32 and ISIZE trailer */
+      _zalign(d);
+      _zbits(d, 16); _zbits(d, 16); _zbits(d, 16); _zbits(d, 16);
+      if (_zoverrun(d))
+        goto error;
+      at_header = true;
+    }
+  }
+
+  slot->data = out.data;
+  slot->data_cap = out.cap;
+  slot->data_start = wlen;
+  slot->data_len = out.len - wlen;
+  if (!*eos) {
+    next->u_offset = span->u_offset + slot->data_len;
+    next->c_bit = _ztell(d);
+    next->at_header = at_header;
+    wlen = MIN(ZSTREAM_WINDOW_SIZE, out.len);
+    next->window = malloc(wlen);
+    if (next->window == NULL)
+      return false;
+    memcpy(next->window, &out.data[out.len - wlen], wlen);
+  }
+  return true;
+
+ error:
+  slot->data = out.data;
+  slot->data_cap = out.cap;
+  return false;
+}
+
+static inline uint64_t
+_zcso_offset(const _UserData *ud, uint32_t block)
+{
+  return (uint64_t)(ud->cso_index[block] & 0x7FFFFFFF) << ud->cso_align;
+}
+
+static bool
+_zspan_cso(_UserData *ud, zdec_t *d, int64_t k, zslot_t *slot)
+{
+  uint32_t b, first = (uint32_t)k * ud->cso_blocks_per_span;
+  uint32_t last = MIN(first + ud->cso_blocks_per_span, ud->cso_blocks);
+  uint64_t c_start = _zcso_offset(ud, first), c_end = _zcso_offset(ud, last);
+  uint64_t b_start, b_end;
+  size_t b_len, c_len, u_len;
+  zbuf_t out;
+  FILE *fd = d->fd;
+  int r;
+
+  out.data = slot->data;
+  out.cap = slot->data_cap;
+  out.len = 0;
+  u_len = (size_t)MIN((uint64_t)ud->cso_blocks_per_span * ud->cso_block_size,
+                      ud->u_size - (uint64_t)first * ud->cso_block_size);
+  if (c_end < c_start || c_end - c_start > 2 * ZSTREAM_SPAN_SIZE + 65536
+      || !_zbuf_reserve(&out, u_len))
+    goto error;
+  c_len = (size_t)(c_end - c_start);
+
+  /* Read all the compressed blocks of the span at once */
+  if (c_len > d->in_cap) {
+    uint8_t *in = realloc(d->in, c_len);
+    if (in == NULL)
+      goto error;
+    d->in = in;
+    d->in_cap = c_len;
+  }
+  if (CDIO_FSEEK(fd, (off_t)c_start, SEEK_SET) != 0
+      || fread(d->in, 1, c_len, fd) != c_len)
+    goto error;
+  d->fd = NULL;
+  d->in_base = c_start;
+  d->in_len = c_len;
+
+  for (b = first; b < last; b++) {
+    b_start = _zcso_offset(ud, b);
+    b_end = _zcso_offset(ud, b + 1);
+    b_len = (size_t)MIN(ud->cso_block_size, ud->u_size - (uint64_t)b * ud->cso_block_size);
+    if (b_end < b_start || b_end > c_end)
+      goto error;
+    if (ud->cso_index[b] & 0x80000000) {
+      /* Stored as is */
+      if (b_end - b_start < b_len)
+        goto error;
+      memcpy(&out.data[out.len], &d->in[b_start - c_start], b_len);
+      out.len += b_len;
+      continue;
+    }
+    d->limit = b_end;
+    if (!_zseek(d, b_start * 8))
+      goto error;
+    do {
+      r = _zinflate_block(d, &out);
+    } while (r == 0);
+    if (r < 0 || out.len != (size_t)(b - first) * ud->cso_block_size + b_len) {
+      cdio_warn("zstream: invalid CSO block %u", b);
+      goto error;
+    }
+  }
+  d->fd = fd;
+  slot->data = out.data;
+  slot->data_cap = out.cap;
+  slot->data_start = 0;
+  slot->data_len = out.len;
+  return true;
+
+ error:
+  d->fd = fd;
+  d->in_len = 0;
+  slot->data = out.data;
+  slot->data_cap = out.cap;
+  return false;
+}
+
+/*
+ * LZMA2 decoder (xz)
+ */
+static inline void
+_zrc_normalize(zrc_t *rc)
+{
+  if (rc->range < (1U << 24)) {
+    rc->range <<= 8;
+    if (rc->in < rc->in_end) {
+      rc->code = (rc->code << 8) | *rc->in++;
+    } else {
+      rc->code <<= 8;
+      rc->overrun = true;
+    }
+  }
+}
+
+static inline uint32_t
+_zrc_bit(zrc_t *rc, uint16_t *prob)
+{
+  uint32_t bound = (rc->range >> 11) * *prob, bit;
+
+  if (rc->code < bound) {
+    rc->range = bound;
+    *prob += (2048 - *prob) >> 5;
+    bit = 0;
+  } else {
+    rc->range -= bound;
+    rc->code -= bound;
+    *prob -= *prob >> 5;
+    bit = 1;
+  }
+  _zrc_normalize(rc);
+  return bit;
+}
+
+static inline uint32_t
+_zrc_tree(zrc_t *rc, uint16_t *probs, int n)
+{
+  uint32_t m = 1;
+  int i;
+
+  for (i = 0; i < n; i++)
+    m = (m << 1) | _zrc_bit(rc, &probs[m]);
+  return m - (1U << n);
+}
+
+static inline uint32_t
+_zrc_tree_reverse(zrc_t *rc, uint16_t *probs, int n)
+{
+  uint32_t m = 1, sym = 0, bit;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    bit = _zrc_bit(rc, &probs[m]);
+    m = (m << 1) | bit;
+    sym |= bit << i;
+  }
+  return sym;
+}
+
+static inline uint32_t
+_zrc_direct(zrc_t *rc, int n)
+{
+  uint32_t r = 0;
+
+  while (n-- > 0) {
+    rc->range >>= 1;
+    if (rc->code >= rc->range) {
+      rc->code -= rc->range;
+      r = (r << 1) | 1;
+    } else {
+      r <<= 1;
+    }
+    _zrc_normalize(rc);
+  }
+  return r;
+}
+
+static void
+_zlzma_reset(zlzma_t *z)
+{
+  uint16_t *probs = (uint16_t *)&z->p;
+  size_t i;
+
+  for (i = 0; i < sizeof(z->p) / sizeof(uint16_t); i++)
+    probs[i] = 1024;
+  z->state = 0;
+  memset(z->rep, 0, sizeof(z->rep));
+}
+
+static inline uint32_t
+_zlzma_len(zrc_t *rc, zlzma_len_t *l, uint32_t pos_state)
+{
+  if (_zrc_bit(rc, &l->choice[0]) == 0)
+    return _zrc_tree(rc, l->low[pos_state], 3);
+  if (_zrc_bit(rc, &l->choice[1]) == 0)
+    return 8 + _zrc_tree(rc, l->mid[pos_state], 3);
+  return 16 + _zrc_tree(rc, l->high, 8);
+}
+
+static inline uint32_t
+_zlzma_dist(zlzma_t *z, zrc_t *rc, uint32_t len)
+{
+  uint32_t slot = _zrc_tree(rc, z->p.pos_slot[MIN(len, 3)], 6), n, dist;
+
+  if (slot < 4)
+    return slot;
+  n = (slot >> 1) - 1;
+  dist = (2 | (slot & 1)) << n;
+  if (slot < 14)
+    return dist + _zrc_tree_reverse(rc, &z->p.pos_special[dist - slot], n);
+  dist += _zrc_direct(rc, n - 4) << 4;
+  return dist + _zrc_tree_reverse(rc, z->p.align, 4);
+}
+
+/* Decode an LZMA chunk of len bytes into out. pos is the number of bytes
+   that were decoded since the last dictionary reset, and avail the number
+   of these bytes that are still available right before out */
+static bool
+_zlzma_chunk(zlzma_t *z, const uint8_t *in, size_t in_len, uint8_t *out,
+             size_t len, uint64_t pos, uint64_t avail)
+{
+  uint8_t *p = out, *end = out + len;
+  uint32_t pb_mask = (1U << z->pb) - 1, lp_mask = (1U << z->lp) - 1;
+  uint32_t state = z->state, pos_state, sym, match, bit, n, dist;
+  uint16_t *probs;
+  const uint8_t *src;
+  zrc_t rc;
+
+  if (in_len < 5 || in[0] != 0)
+    return false;
+  rc.code = ((uint32_t)in[1] << 24) | (in[2] << 16) | (in[3] << 8) | in[4];
+  rc.range = 0xFFFFFFFF;
+  rc.in = &in[5];
+  rc.in_end = &in[in_len];
+  rc.overrun = false;
+
+  while (p < end && !rc.overrun) {
+    pos_state = (uint32_t)(pos + (p - out)) & pb_mask;
+    if (_zrc_bit(&rc, &z->p.is_match[state][pos_state]) == 0) {
+      /* Literal */
+      probs = z->p.literal;
+      if (avail + (p - out) > 0)
+        probs = &probs[0x300 * (((((uint32_t)(pos + (p - out))) & lp_mask) << z->lc)
+                                + (p[-1] >> (8 - z->lc)))];
+      sym = 1;
+      if (state >= 7) {
+        if ((uint64_t)z->rep[0] >= avail + (p - out))
+          return false;
+        match = *(p - z->rep[0] - 1);
+        do {
+          bit = (match >> 7) & 1;
+          match <<= 1;
+          sym = (sym << 1) | _zrc_bit(&rc, &probs[((1 + bit) << 8) + sym]);
+        } while (sym < 0x100 && bit == (sym & 1));
+      }
+      while (sym < 0x100)
+        sym = (sym << 1) | _zrc_bit(&rc, &probs[sym]);
+      *p++ = (uint8_t)sym;
+      state = (state < 4) ? 0 : ((state < 10) ? state - 3 : state - 6);
+      continue;
+    }
+    if (_zrc_bit(&rc, &z->p.is_rep[state]) == 0) {
+      /* Match */
+      n = _zlzma_len(&rc, &z->p.len, pos_state);
+      state = (state < 7) ? 7 : 10;
+      dist = _zlzma_dist(z, &rc, n);
+      z->rep[3] = z->rep[2];
+      z->rep[2] = z->rep[1];
+      z->rep[1] = z->rep[0];
+      z->rep[0] = dist;
+      n += 2;
+    } else {
+      n = 0;
+      if (_zrc_bit(&rc, &z->p.is_rep_g0[state]) == 0) {
+        if (_zrc_bit(&rc, &z->p.is_rep0_long[state][pos_state]) == 0)
+          n = 1;
+      } else {
+        if (_zrc_bit(&rc, &z->p.is_rep_g1[state]) == 0) {
+          dist = z->rep[1];
+        } else {
+          if (_zrc_bit(&rc, &z->p.is_rep_g2[state]) == 0) {
+            dist = z->rep[2];
+          } else {
+            dist = z->rep[3];
+            z->rep[3] = z->rep[2];
+          }
+          z->rep[2] = z->rep[1];
+        }
+        z->rep[1] = z->rep[0];
+        z->rep[0] = dist;
+      }
+      if (n == 1) {
+        /* Short rep */
+        state = (state < 7) ? 9 : 11;
+      } else {
+        /* Rep match */
+        n = _zlzma_len(&rc, &z->p.rep_len, pos_state) + 2;
+        state = (state < 7) ? 8 : 11;
+      }
+    }
+    if ((uint64_t)z->rep[0] >= avail + (p - out) || n > (uint32_t)(end - p))
+      return false;
+    src = p - z->rep[0] - 1;
+    while (n-- > 0)
+      *p++ = *src++;
+  }
+  z->state = state;
+  return (p == end) && !rc.overrun;
+}
+
+/*
+ * Zstandard decoder
+ */
+static const int16_t zstd_ll_norm[36] = {
+  4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+  -1, -1, -1, -1 };
+static const int16_t zstd_ml_norm[53] = {
+  1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+  -1, -1, -1, -1, -1 };
+static const int16_t zstd_of_norm[29] = {
+  1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1 };
+static const uint32_t zstd_ll_base[36] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+  8192, 16384, 32768, 65536 };
+static const uint8_t zstd_ll_bits[36] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+  13, 14, 15, 16 };
+static const uint32_t zstd_ml_base[53] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+  19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+  35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+  4099, 8195, 16387, 32771, 65539 };
+static const uint8_t zstd_ml_bits[53] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+  12, 13, 14, 15, 16 };
+
+/* Forward bitstream, for the FSE table descriptions */
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  size_t bit;
+} zfbits_t;
+
+static uint32_t
+_zfbits(zfbits_t *b, int n)
+{
+  uint32_t v = 0;
+  int i;
+
+  for (i = 0; i < n; i++, b->bit++)
+    if ((b->bit >> 3) < b->size)
+      v |= (uint32_t)((b->data[b->bit >> 3] >> (b->bit & 7)) & 1) << i;
+  return v;
+}
+
+/* Backward bitstream, for the entropy coded data */
+typedef struct {
+  const uint8_t *data;
+  int64_t bit;            /* bits left to read, negative once overrun */
+} zrbits_t;
+
+static bool
+_zrbits_init(zrbits_t *b, const uint8_t *data, size_t size)
+{
+  int n;
+
+  /* The last byte holds a padding marker, in its highest set bit */
+  if (size == 0 || data[size - 1] == 0)
+    return false;
+  for (n = 7; (data[size - 1] & (1 << n)) == 0; n--);
+  b->data = data;
+  b->bit = (int64_t)(size - 1) * 8 + n;
+  return true;
+}
+
+static inline uint32_t
+_zrbits(zrbits_t *b, int n)
+{
+  uint64_t v = 0;
+  int64_t off;
+  int i, len;
+
+  if (n == 0)
+    return 0;
+  b->bit -= n;
+  off = b->bit;
+  if (off >= 0) {
+    len = (int)(((off & 7) + n + 7) >> 3);
+    for (i = 0; i < len; i++)
+      v |= (uint64_t)b->data[(off >> 3) + i] << (8 * i);
+    v >>= off & 7;
+  } else if (off + n > 0) {
+    /* Bits that precede the start of the stream read as zeroes */
+    len = (int)((off + n + 7) >> 3);
+    for (i = 0; i < len; i++)
+      v |= (uint64_t)b->data[i] << (8 * i);
+    v <<= -off;
+  }
+  return (uint32_t)(v & ((1ULL << n) - 1));
+}
+
+static bool
+_zfse_build(zfse_t *t, const int16_t *norm, int n, int al)
+{
+  uint16_t next[256], x;
+  uint32_t size = 1U << al, high = size, mask = size - 1, pos = 0, step, i;
+  int s, j, nb;
+
+  for (s = 0; s < n; s++) {
+    if (norm[s] == -1) {
+      if (high == 0)
+        return false;
+      t->e[--high].symbol = (uint8_t)s;
+      next[s] = 1;
+    }
+  }
+  step = (size >> 1) + (size >> 3) + 3;
+  for (s = 0; s < n; s++) {
+    if (norm[s] <= 0)
+      continue;
+    next[s] = (uint16_t)norm[s];
+    for (j = 0; j < norm[s]; j++) {
+      t->e[pos].symbol = (uint8_t)s;
+      do
+        pos = (pos + step) & mask;
+      while (pos >= high);
+    }
+  }
+  if (pos != 0)
+    return false;
+  for (i = 0; i < size; i++) {
+    x = next[t->e[i].symbol]++;
+    for (nb = 0; ((uint32_t)x << nb) < size; nb++);
+    t->e[i].bits = (uint8_t)nb;
+    t->e[i].base = (uint16_t)(((uint32_t)x << nb) - size);
+  }
+  t->al = al;
+  return true;
+}
+
+/* Read an FSE table description. Returns its size, or -1 on error */
+static int
+_zfse_desc(zfse_t *t, const uint8_t *src, size_t size, int max_al, int max_sym)
+{
+  int16_t norm[256];
+  zfbits_t b = { src, size, 0 };
+  int32_t remaining;
+  uint32_t val, lower, threshold;
+  int al, n = 0, nbits, p, rep, i;
+
+  al = (int)_zfbits(&b, 4) + 5;
+  if (al > max_al)
+    return -1;
+  remaining = 1 << al;
+  while (remaining > 0 && n <= max_sym) {
+    for (nbits = 1; ((remaining + 1) >> nbits) != 0; nbits++);
+    val = _zfbits(&b, nbits);
+    lower = (1U << (nbits - 1)) - 1;
+    threshold = (1U << nbits) - 1 - (uint32_t)(remaining + 1);
+    /* Small values use one bit less */
+    if ((val & lower) < threshold) {
+      b.bit--;
+      val &= lower;
+    } else if (val > lower) {
+      val -= threshold;
+    }
+    p = (int)val - 1;
+    remaining -= (p < 0) ? -p : p;
+    norm[n++] = (int16_t)p;
+    if (p == 0) {
+      do {
+        rep = (int)_zfbits(&b, 2);
+        for (i = 0; i < rep && n <= max_sym; i++)
+          norm[n++] = 0;
+      } while (rep == 3);
+    }
+  }
+  if (remaining != 0 || b.bit > 8 * size || !_zfse_build(t, norm, n, al))
+    return -1;
+  return (int)((b.bit + 7) / 8);
+}
+
+/* Build the Huffman decoding table from the weights of the first n
+   symbols (the weight of the last one is implied) */
+static bool
+_zhuf_table(zzstd_t *z, const uint8_t *w, int n)
+{
+  uint8_t len[256];
+  uint32_t sum = 0, left, count[ZHUF_MAX_BITS + 2], idx[ZHUF_MAX_BITS + 2], j;
+  int i, max_bits, last;
+
+  if (n > 255)
+    return false;
+  for (i = 0; i < n; i++) {
+    if (w[i] > ZHUF_MAX_BITS)
+      return false;
+    if (w[i] != 0)
+      sum += 1U << (w[i] - 1);
+  }
+  if (sum == 0)
+    return false;
+  for (max_bits = 1; (sum >> max_bits) != 0; max_bits++);
+  if (max_bits > ZHUF_MAX_BITS)
+    return false;
+  left = (1U << max_bits) - sum;
+  if ((left & (left - 1)) != 0)
+    return false;
+  for (last = 1; (1U << (last - 1)) < left; last++);
+  for (i = 0; i < n; i++)
+    len[i] = (w[i] != 0) ? (uint8_t)(max_bits + 1 - w[i]) : 0;
+  len[n] = (uint8_t)(max_bits + 1 - last);
+
+  /* The longest codes come first */
+  memset(count, 0, sizeof(count));
+  for (i = 0; i <= n; i++)
+    count[len[i]]++;
+  idx[max_bits] = 0;
+  for (i = max_bits; i >= 1; i--)
+    idx[i - 1] = idx[i] + count[i] * (1U << (max_bits - i));
+  for (i = 0; i <= n; i++) {
+    if (len[i] == 0)
+      continue;
+    for (j = 0; j < (1U << (max_bits - len[i])); j++) {
+      z->huf_sym[idx[len[i]] + j] = (uint8_t)i;
+      z->huf_len[idx[len[i]] + j] = len[i];
+    }
+    idx[len[i]] += 1U << (max_bits - len[i]);
+  }
+  z->huf_bits = max_bits;
+  return true;
+}
+
+/* Read a Huffman tree description. Returns its size, or -1 on error */
+static int
+_zhuf_desc(zzstd_t *z, const uint8_t *src, size_t size)
+{
+  uint8_t w[256];
+  zfse_t t;
+  zrbits_t b;
+  uint32_t s1, s2;
+  int i, n = 0, hdr, len;
+
+  if (size == 0)
+    return -1;
+  hdr = src[0];
+  if (hdr >= 128) {
+    /* Weights stored as 4-bit values */
+    n = hdr - 127;
+    len = 1 + (n + 1) / 2;
+    if ((size_t)len > size)
+      return -1;
+    for (i = 0; i < n; i++)
+      w[i] = (i & 1) ? (src[1 + i / 2] & 0x0F) : (src[1 + i / 2] >> 4);
+  } else {
+    /* FSE compressed weights, using two interleaved states */
+    len = 1 + hdr;
+    if (hdr == 0 || (size_t)len > size)
+      return -1;
+    i = _zfse_desc(&t, &src[1], hdr, 6, 255);
+    if (i < 0 || i >= hdr || !_zrbits_init(&b, &src[1 + i], hdr - i))
+      return -1;
+    s1 = _zrbits(&b, t.al);
+    s2 = _zrbits(&b, t.al);
+    for (;;) {
+      if (n >= 254)
+        return -1;
+      w[n++] = t.e[s1].symbol;
+      s1 = t.e[s1].base + _zrbits(&b, t.e[s1].bits);
+      if (b.bit < 0) {
+        w[n++] = t.e[s2].symbol;
+        break;
+      }
+      w[n++] = t.e[s2].symbol;
+      s2 = t.e[s2].base + _zrbits(&b, t.e[s2].bits);
+      if (b.bit < 0) {
+        w[n++] = t.e[s1].symbol;
+        break;
+      }
+    }
+  }
+  return _zhuf_table(z, w, n) ? len : -1;
+}
+
+static bool
+_zhuf_stream(const zzstd_t *z, const uint8_t *src, size_t size, uint8_t *out, size_t n)
+{
+  zrbits_t b;
+  uint32_t state, mask = (1U << z->huf_bits) - 1;
+  size_t i;
+  int nb;
+
+  if (!_zrbits_init(&b, src, size))
+    return false;
+  state = _zrbits(&b, z->huf_bits);
+  for (i = 0; i < n; i++) {
+    out[i] = z->huf_sym[state];
+    nb = z->huf_len[state];
+    state = ((state << nb) | _zrbits(&b, nb)) & mask;
+  }
+  return b.bit == -z->huf_bits;
+}
+
+/* Decode the literals section of a block into z->lit. Returns its size,
+   or -1 on error */
+static int
+_zstd_literals(zzstd_t *z, const uint8_t *src, size_t size, size_t *lit_len)
+{
+  size_t regen, comp, s[4], seg, o, l;
+  uint64_t h = 0;
+  int type, fmt, hlen, bits, i, r;
+  const uint8_t *p;
+
+  if (size < 1)
+    return -1;
+  type = src[0] & 3;
+  fmt = (src[0] >> 2) & 3;
+  if (type < 2) {
+    /* Raw or RLE */
+    hlen = (fmt == 1) ? 2 : ((fmt == 3) ? 3 : 1);
+    if ((size_t)hlen > size)
+      return -1;
+    if (hlen == 1)
+      regen = src[0] >> 3;
+    else if (hlen == 2)
+      regen = (src[0] >> 4) + (src[1] << 4);
+    else
+      regen = (src[0] >> 4) + (src[1] << 4) + ((size_t)src[2] << 12);
+    if (regen > ZSTD_BLOCK_MAX)
+      return -1;
+    *lit_len = regen;
+    if (type == 1) {
+      if ((size_t)hlen + 1 > size)
+        return -1;
+      memset(z->lit, src[hlen], regen);
+      return hlen + 1;
+    }
+    if (hlen + regen > size)
+      return -1;
+    memcpy(z->lit, &src[hlen], regen);
+    return (int)(hlen + regen);
+  }
+
+  /* Huffman compressed, with a new tree or the one from the previous block */
+  hlen = (fmt < 2) ? 3 : fmt + 2;
+  bits = (fmt < 2) ? 10 : ((fmt == 2) ? 14 : 18);
+  if ((size_t)hlen > size)
+    return -1;
+  for (i = 0; i < hlen; i++)
+    h |= (uint64_t)src[i] << (8 * i);
+  regen = (size_t)(h >> 4) & ((1U << bits) - 1);
+  comp = (size_t)(h >> (4 + bits)) & ((1U << bits) - 1);
+  if (regen > ZSTD_BLOCK_MAX || hlen + comp > size)
+    return -1;
+  p = &src[hlen];
+  l = comp;
+  if (type == 2) {
+    r = _zhuf_desc(z, p, l);
+    if (r < 0)
+      return -1;
+    p += r;
+    l -= r;
+  } else if (z->huf_bits == 0) {
+    return -1;
+  }
+  if (fmt == 0) {
+    if (!_zhuf_stream(z, p, l, z->lit, regen))
+      return -1;
+  } else {
+    /* Four streams, preceded by a jump table */
+    if (l < 6)
+      return -1;
+    for (i = 0; i < 3; i++)
+      s[i] = p[2 * i] | (p[2 * i + 1] << 8);
+    if (6 + s[0] + s[1] + s[2] > l)
+      return -1;
+    s[3] = l - 6 - s[0] - s[1] - s[2];
+    seg = (regen + 3) / 4;
+    if (3 * seg > regen)
+      return -1;
+    for (i = 0, o = 6; i < 4; o += s[i], i++) {
+      if (!_zhuf_stream(z, &p[o], s[i], &z->lit[i * seg], (i < 3) ? seg : regen - 3 * seg))
+        return -1;
+    }
+  }
+  *lit_len = regen;
+  return (int)(hlen + comp);
+}
+
+/* Set up a sequence decoding table. Returns the size of its description,
+   or -1 on error */
+static int
+_zstd_table(zfse_t *t, int mode, const uint8_t *src, size_t size,
+            const int16_t *norm, int n, int al, int max_al)
+{
+  switch (mode) {
+  case 0:   /* Predefined */
+    return _zfse_build(t, norm, n, al) ? 0 : -1;
+  case 1:   /* RLE */
+    if (size < 1 || src[0] >= n)
+      return -1;
+    t->al = 0;
+    t->e[0].symbol = src[0];
+    t->e[0].bits = 0;
+    t->e[0].base = 0;
+    return 1;
+  case 2:   /* FSE compressed */
+    return _zfse_desc(t, src, size, max_al, n - 1);
+  default:  /* Repeat */
+    return (t->al < 0) ? -1 : 0;
+  }
+}
+
+/* Decode and execute the sequences of a block. avail is the amount of
+   data that precedes out. Returns the size of the block data, or -1 */
+static int64_t
+_zstd_sequences(zzstd_t *z, const uint8_t *src, size_t size, size_t lit_len,
+                uint8_t *out, uint64_t avail)
+{
+  const uint8_t *p = src, *end = src + size;
+  uint8_t *o = out, *o_end = out + ZSTD_BLOCK_MAX, *m;
+  size_t n_seq, i, lit_pos = 0;
+  uint32_t ll_s, of_s, ml_s, code, ll, ml, off, idx;
+  zrbits_t b;
+  int r;
+
+  if (p >= end)
+    return -1;
+  if (p[0] < 128) {
+    n_seq = *p++;
+  } else if (p[0] < 255) {
+    if (end - p < 2)
+      return -1;
+    n_seq = ((p[0] - 128) << 8) + p[1];
+    p += 2;
+  } else {
+    if (end - p < 3)
+      return -1;
+    n_seq = p[1] + (p[2] << 8) + 0x7F00;
+    p += 3;
+  }
+
+  if (n_seq > 0) {
+    if (p >= end || (*p & 3) != 0)
+      return -1;
+    code = *p++;
+    r = _zstd_table(&z->ll, (code >> 6) & 3, p, end - p, zstd_ll_norm, 36, 6, 9);
+    if (r < 0)
+      return -1;
+    p += r;
+    r = _zstd_table(&z->of, (code >> 4) & 3, p, end - p, zstd_of_norm, 29, 5, 8);
+    if (r < 0)
+      return -1;
+    p += r;
+    r = _zstd_table(&z->ml, (code >> 2) & 3, p, end - p, zstd_ml_norm, 53, 6, 9);
+    if (r < 0 || !_zrbits_init(&b, p + r, end - p - r))
+      return -1;
+    ll_s = _zrbits(&b, z->ll.al);
+    of_s = _zrbits(&b, z->of.al);
+    ml_s = _zrbits(&b, z->ml.al);
+
+    for (i = 0; i < n_seq; i++) {
+      code = z->of.e[of_s].symbol;
+      off = (1U << code) + _zrbits(&b, code);
+      code = z->ml.e[ml_s].symbol;
+      ml = zstd_ml_base[code] + _zrbits(&b, zstd_ml_bits[code]);
+      code = z->ll.e[ll_s].symbol;
+      ll = zstd_ll_base[code] + _zrbits(&b, zstd_ll_bits[code]);
+      if (i + 1 < n_seq) {
+        ll_s = z->ll.e[ll_s].base + _zrbits(&b, z->ll.e[ll_s].bits);
+        ml_s = z->ml.e[ml_s].base + _zrbits(&b, z->ml.e[ml_s].bits);
+        of_s = z->of.e[of_s].base + _zrbits(&b, z->of.e[of_s].bits);
+      }
+
+      /* Offsets 1 to 3 refer to the repeat offsets */
+      if (off > 3) {
+        off -= 3;
+        z->rep[2] = z->rep[1];
+        z->rep[1] = z->rep[0];
+        z->rep[0] = off;
+      } else {
+        idx = off - 1 + ((ll == 0) ? 1 : 0);
+        if (idx == 0) {
+          off = z->rep[0];
+        } else {
+          off = (idx < 3) ? z->rep[idx] : z->rep[0] - 1;
+          if (idx > 1)
+            z->rep[2] = z->rep[1];
+          z->rep[1] = z->rep[0];
+          z->rep[0] = off;
+        }
+      }
+
+      if (ll > lit_len - lit_pos || ll + ml > (size_t)(o_end - o))
+        return -1;
+      memcpy(o, &z->lit[lit_pos], ll);
+      o += ll;
+      lit_pos += ll;
+      if (off == 0 || off > avail + (o - out))
+        return -1;
+      m = o - off;
+      if (off >= ml) {
+        memcpy(o, m, ml);
+        o += ml;
+      } else {
+        for (; ml > 0; ml--)
+          *o++ = *m++;
+      }
+    }
+    if (b.bit != 0)
+      return -1;
+  }
+
+  if (lit_len - lit_pos > (size_t)(o_end - o))
+    return -1;
+  memcpy(o, &z->lit[lit_pos], lit_len - lit_pos);
+  o += lit_len - lit_pos;
+  return o - out;
+}
+
+/* Read the header of the zstd frame at offset. Returns 1 for a frame that
+   we can decode, with *len set to the size of its header, 0 for a skippable
+   frame, with *size set to the size of the whole frame, or -1 */
+static int
+_zstd_frame_header(FILE *fd, uint64_t offset, uint32_t *len, uint64_t *size,
+                   uint64_t *window, bool *checksum)
+{
+  uint8_t hdr[18], fhd;
+  uint32_t magic, did_len, fcs_len, w, i;
+  uint64_t did = 0, fcs = 0, base;
+
+  if (CDIO_FSEEK(fd, (off_t)offset, SEEK_SET) != 0 || fread(hdr, 1, 4, fd) != 4)
+    return -1;
+  magic = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((uint32_t)hdr[3] << 24);
+  if ((magic & 0xFFFFFFF0) == ZSTD_SKIPPABLE_MAGIC) {
+    if (fread(hdr, 1, 4, fd) != 4)
+      return -1;
+    *size = 8 + (hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((uint64_t)hdr[3] << 24));
+    return 0;
+  }
+  if (magic != ZSTD_MAGIC || fread(&fhd, 1, 1, fd) != 1 || (fhd & 0x08) != 0)
+    return -1;
+  did_len = (fhd & 3) ? 1U << ((fhd & 3) - 1) : 0;
+  fcs_len = (fhd >> 6) ? 1U << (fhd >> 6) : ((fhd & 0x20) ? 1 : 0);
+  *len = 5 + ((fhd & 0x20) ? 0 : 1) + did_len + fcs_len;
+  if (fread(hdr, 1, *len - 5, fd) != *len - 5)
+    return -1;
+  /* Window_Descriptor, Dictionary_ID and Frame_Content_Size */
+  w = (fhd & 0x20) ? 0 : 1;
+  for (i = 0; i < did_len; i++)
+    did |= (uint64_t)hdr[w + i] << (8 * i);
+  for (i = 0; i < fcs_len; i++)
+    fcs |= (uint64_t)hdr[w + did_len + i] << (8 * i);
+  if (fcs_len == 2)
+    fcs += 256;
+  if (fhd & 0x20) {
+    *window = fcs;
+  } else {
+    base = 1ULL << (10 + (hdr[0] >> 3));
+    *window = base + (base >> 3) * (hdr[0] & 7);
+  }
+  *size = fcs;
+  *checksum = (fhd & 0x04) != 0;
+  if (did != 0) {
+    cdio_warn("zstream: zstd frames that require a dictionary are not supported");
+    return -1;
+  }
+  if (fcs_len == 0) {
+    cdio_warn("zstream: zstd frames without a content size are not supported");
+    return -1;
+  }
+  if (*window > ZSTREAM_MAX_WINDOW) {
+    cdio_warn("zstream: zstd window size %lu MB is too large",
+              (long unsigned int)(*window >> 20));
+    return -1;
+  }
+  return 1;
+}
+
+/* Find the first non-empty zstd frame from offset. Returns 1 if one was
+   found, 0 at the end of the file and -1 on error */
+static int
+_zstd_next_frame(FILE *fd, uint64_t offset, uint64_t c_size, zunit_t *u)
+{
+  uint8_t hdr[3];
+  uint32_t len, h;
+  uint64_t size, window;
+  bool checksum;
+  int r;
+
+  while (offset < c_size) {
+    r = _zstd_frame_header(fd, offset, &len, &size, &window, &checksum);
+    if (r < 0)
+      return -1;
+    if (r == 0) {
+      offset += size;
+      continue;
+    }
+    if (size != 0) {
+      u->c_offset = offset;
+      u->u_size = size;
+      u->window = window;
+      return 1;
+    }
+    /* Walk the blocks of an empty frame */
+    offset += len;
+    do {
+      if (CDIO_FSEEK(fd, (off_t)offset, SEEK_SET) != 0 || fread(hdr, 1, 3, fd) != 3)
+        return -1;
+      h = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16);
+      if (((h >> 1) & 3) == 3)
+        return -1;
+      offset += 3 + ((((h >> 1) & 3) == 1) ? 1 : (h >> 3));
+    } while ((h & 1) == 0);
+    if (checksum)
+      offset += 4;
+  }
+  return 0;
+}
+
+/*
+ * xz and zstd units
+ */
+static bool
+_zxz_varint(const uint8_t *buf, size_t size, size_t *i, uint64_t *val)
+{
+  int n;
+
+  *val = 0;
+  for (n = 0; n < 9 && *i < size; n++) {
+    *val |= (uint64_t)(buf[*i] & 0x7F) << (7 * n);
+    if ((buf[(*i)++] & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+/* Read the header of the xz block at offset, which must only use LZMA2 */
+static bool
+_zxz_block_header(FILE *fd, uint64_t offset, uint32_t *len, uint64_t *dict)
+{
+  uint8_t hdr[1024];
+  uint64_t id, size;
+  size_t i = 2;
+  int p;
+
+  if (CDIO_FSEEK(fd, (off_t)offset, SEEK_SET) != 0 || fread(hdr, 1, 1, fd) != 1
+      || hdr[0] == 0)
+    return false;
+  *len = (hdr[0] + 1) * 4;
+  if (fread(&hdr[1], 1, *len - 1, fd) != *len - 1 || (hdr[1] & 0x3C) != 0)
+    return false;
+  if (((hdr[1] & 0x40) && !_zxz_varint(hdr, *len - 4, &i, &size))
+      || ((hdr[1] & 0x80) && !_zxz_varint(hdr, *len - 4, &i, &size)))
+    return false;
+  if ((hdr[1] & 0x03) != 0 || !_zxz_varint(hdr, *len - 4, &i, &id)
+      || !_zxz_varint(hdr, *len - 4, &i, &size) || id != 0x21 || size != 1
+      || i >= *len - 4) {
+    cdio_warn("zstream: xz filters other than LZMA2 are not supported");
+    return false;
+  }
+  p = hdr[i] & 0x3F;
+  if (p > 40)
+    return false;
+  *dict = (p == 40) ? 0xFFFFFFFF : (uint64_t)(2 | (p & 1)) << (p / 2 + 11);
+  return true;
+}
+
+/* Append a unit, along with the spans that cover it */
+static bool
+_zunit_add(_UserData *ud, const zunit_t *u)
+{
+  uint32_t n = (uint32_t)((u->u_size + ZSTREAM_SPAN_SIZE - 1) / ZSTREAM_SPAN_SIZE), i;
+  zunit_t *units;
+  zspan_t *spans;
+
+  if (ud->n_units == ud->units_cap) {
+    units = realloc(ud->units, (ud->units_cap + 64) * sizeof(zunit_t));
+    if (units == NULL)
+      return false;
+    ud->units = units;
+    ud->units_cap += 64;
+  }
+  if (ud->n_spans + n > ud->spans_cap) {
+    spans = realloc(ud->spans, (MAX(2 * ud->spans_cap, ud->n_spans + n)) * sizeof(zspan_t));
+    if (spans == NULL)
+      return false;
+    ud->spans = spans;
+    ud->spans_cap = MAX(2 * ud->spans_cap, ud->n_spans + n);
+  }
+  for (i = 0; i < n; i++) {
+    memset(&ud->spans[ud->n_spans], 0, sizeof(zspan_t));
+    ud->spans[ud->n_spans].u_offset = u->u_offset + (uint64_t)i * ZSTREAM_SPAN_SIZE;
+    ud->spans[ud->n_spans++].unit = ud->n_units;
+  }
+  ud->units[ud->n_units++] = *u;
+  ud->max_window = MAX(ud->max_window, MIN(u->window, u->u_size));
+  return true;
+}
+
+static bool
+_zcursor_read(zcursor_t *c, void *buf, size_t len)
+{
+  if (fread(buf, 1, len, c->fd) != len)
+    return false;
+  c->c_pos += len;
+  return true;
+}
+
+/* Position a cursor at the start of a unit (called without the lock) */
+static bool
+_zcursor_reset(_UserData *ud, zcursor_t *c, const zunit_t *u)
+{
+  size_t keep = (size_t)MIN(u->window, u->u_size), cap;
+  uint32_t len;
+  uint64_t size, window;
+  uint8_t *hist;
+  bool checksum;
+
+  cap = 2 * keep + ((ud->format == ZSTREAM_XZ) ? ZSTREAM_XZ_MAX_STEP : ZSTD_BLOCK_MAX);
+  if (cap > c->hist_cap) {
+    free(c->hist);
+    hist = malloc(cap);
+    c->hist = hist;
+    c->hist_cap = (hist != NULL) ? cap : 0;
+    if (hist == NULL)
+      return false;
+  }
+  c->hist_keep = keep;
+  c->hist_len = 0;
+  c->u_pos = 0;
+  c->dict_start = 0;
+  c->done = false;
+  if (ud->format == ZSTREAM_XZ) {
+    if (!_zxz_block_header(c->fd, u->c_offset, &len, &window))
+      return false;
+    c->lzma->need_dict_reset = true;
+    c->lzma->need_props = true;
+  } else {
+    if (_zstd_frame_header(c->fd, u->c_offset, &len, &size, &window, &checksum) != 1)
+      return false;
+    c->zstd->checksum = checksum;
+    c->zstd->rep[0] = 1;
+    c->zstd->rep[1] = 4;
+    c->zstd->rep[2] = 8;
+    c->zstd->ll.al = c->zstd->of.al = c->zstd->ml.al = -1;
+    c->zstd->huf_bits = 0;
+  }
+  c->c_pos = u->c_offset + len;
+  return true;
+}
+
+/* Decode the next LZMA2 chunk. Returns the size of its data, or -1 */
+static int64_t
+_zxz_step(zcursor_t *c)
+{
+  zlzma_t *z = c->lzma;
+  uint8_t hdr[5], *out = &c->hist[c->hist_len];
+  uint32_t u_len, c_len, mode, props;
+
+  if (!_zcursor_read(c, hdr, 1))
+    return -1;
+  if (hdr[0] == 0x00) {
+    c->done = true;
+    return 0;
+  }
+  if (hdr[0] == 0x01 || hdr[0] == 0x02) {
+    /* Uncompressed chunk, with or without a dictionary reset */
+    if (!_zcursor_read(c, &hdr[1], 2))
+      return -1;
+    if (hdr[0] == 0x01) {
+      c->dict_start = c->u_pos;
+      z->need_dict_reset = false;
+    } else if (z->need_dict_reset) {
+      return -1;
+    }
+    u_len = ((hdr[1] << 8) | hdr[2]) + 1;
+    return _zcursor_read(c, out, u_len) ? u_len : -1;
+  }
+  if (hdr[0] < 0x80 || !_zcursor_read(c, &hdr[1], 4))
+    return -1;
+  u_len = ((hdr[0] & 0x1F) << 16) + (hdr[1] << 8) + hdr[2] + 1;
+  c_len = (hdr[3] << 8) + hdr[4] + 1;
+  mode = (hdr[0] >> 5) & 3;
+  if (mode == 3) {
+    c->dict_start = c->u_pos;
+    z->need_dict_reset = false;
+  } else if (z->need_dict_reset) {
+    return -1;
+  }
+  if (mode >= 2) {
+    if (!_zcursor_read(c, hdr, 1) || hdr[0] >= 9 * 5 * 5)
+      return -1;
+    props = hdr[0];
+    z->lc = props % 9;
+    props /= 9;
+    z->lp = props % 5;
+    z->pb = props / 5;
+    if (z->lc + z->lp > 4)
+      return -1;
+    z->need_props = false;
+  } else if (z->need_props) {
+    return -1;
+  }
+  if (mode >= 1)
+    _zlzma_reset(z);
+  if (!_zcursor_read(c, c->in, c_len)
+      || !_zlzma_chunk(z, c->in, c_len, out, u_len, c->u_pos - c->dict_start,
+                       MIN(c->u_pos - c->dict_start, c->hist_len)))
+    return -1;
+  return u_len;
+}
+
+/* Decode the next zstd block. Returns the size of its data, or -1 */
+static int64_t
+_zstd_step(zcursor_t *c)
+{
+  uint8_t hdr[4], *out = &c->hist[c->hist_len];
+  uint32_t h, size;
+  size_t lit_len;
+  int64_t n;
+  int r;
+
+  if (!_zcursor_read(c, hdr, 3))
+    return -1;
+  h = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16);
+  size = h >> 3;
+  if (size > ZSTD_BLOCK_MAX)
+    return -1;
+  switch ((h >> 1) & 3) {
+  case 0:   /* Raw */
+    if (!_zcursor_read(c, out, size))
+      return -1;
+    n = size;
+    break;
+  case 1:   /* RLE */
+    if (!_zcursor_read(c, out, 1))
+      return -1;
+    memset(out, out[0], size);
+    n = size;
+    break;
+  case 2:   /* Compressed */
+    if (!_zcursor_read(c, c->in, size))
+      return -1;
+    r = _zstd_literals(c->zstd, c->in, size, &lit_len);
+    if (r < 0)
+      return -1;
+    n = _zstd_sequences(c->zstd, &c->in[r], size - r, lit_len, out, c->hist_len);
+    break;
+  default:
+    return -1;
+  }
+  if (h & 1) {
+    c->done = true;
+    if (c->zstd->checksum && !_zcursor_read(c, hdr, 4))
+      return -1;
+  }
+  return n;
+}
+
+/* Get a cursor to decompress [u_start, u_end) of a unit: the one that's
+   the closest before u_start in the same unit, or that still has u_start in
+   its history (as the last step of the previous span usually goes past its
+   end), or else the least recently used one, in which case *reset is set.
+   Called with the lock held. */
+static zcursor_t *
+_zcursor_get(_UserData *ud, uint32_t unit, uint64_t u_start, uint64_t u_end,
+             bool *reset)
+{
+  zcursor_t *c, *best, *lru;
+  uint64_t pos, best_pos = 0;
+  int i;
+#ifdef _WIN32
+  HANDLE idle[ZSTREAM_MAX_CURSORS];
+#endif
+
+  for (;;) {
+    best = lru = NULL;
+    for (i = 0; i < ud->n_cursors; i++) {
+      c = &ud->cursors[i];
+      /* A busy cursor will be where its current job ends */
+      pos = c->busy ? c->u_end : c->u_pos;
+      if (c->unit == unit && (pos <= u_start || (!c->busy && pos - c->hist_len <= u_start))
+          && (best == NULL || MIN(pos, u_start) > best_pos)) {
+        best = c;
+        best_pos = MIN(pos, u_start);
+      }
+      if (!c->busy && (lru == NULL || c->last_use < lru->last_use))
+        lru = c;
+    }
+    if (best != NULL && !best->busy) {
+      c = best;
+      *reset = false;
+    } else if (best == NULL && lru != NULL) {
+      c = lru;
+      *reset = true;
+    } else {
+#ifdef _WIN32
+      /* Wait for the cursor that is ahead of us, or for any cursor */
+      ZUNLOCK(ud);
+      if (best != NULL) {
+        WaitForSingleObject(best->idle, INFINITE);
+      } else {
+        for (i = 0; i < ud->n_cursors; i++)
+          idle[i] = ud->cursors[i].idle;
+        WaitForMultipleObjects(ud->n_cursors, idle, FALSE, INFINITE);
+      }
+      ZLOCK(ud);
+      continue;
+#else
+      return NULL;
+#endif
+    }
+    c->unit = unit;
+    c->busy = true;
+    c->u_end = u_end;
+    c->last_use = ++ud->use_count;
+#ifdef _WIN32
+    ResetEvent(c->idle);
+#endif
+    return c;
+  }
+}
+
+static void
+_zcursor_put(_UserData *ud, zcursor_t *c, bool r)
+{
+  ZLOCK(ud);
+  if (!r)
+    c->unit = -1;
+  c->busy = false;
+#ifdef _WIN32
+  SetEvent(c->idle);
+#endif
+  ZUNLOCK(ud);
+}
+
+/* Decompress a span of an xz block or zstd frame. If next is not NULL, the
+   frame that follows is looked up, and *eos is set if there isn't any */
+static bool
+_zspan_unit(_UserData *ud, const zspan_t *span, const zunit_t *u, zslot_t *slot,
+            zunit_t *next, bool *eos)
+{
+  uint64_t start = span->u_offset - u->u_offset, end, from, to;
+  size_t len = (size_t)MIN(ZSTREAM_SPAN_SIZE, u->u_size - start);
+  size_t step = (ud->format == ZSTREAM_XZ) ? ZSTREAM_XZ_MAX_STEP : ZSTD_BLOCK_MAX;
+  zcursor_t *c;
+  zbuf_t out;
+  int64_t n;
+  bool reset, r = false;
+
+  end = start + len;
+  out.data = slot->data;
+  out.cap = slot->data_cap;
+  out.len = 0;
+  if (!_zbuf_reserve(&out, len))
+    goto error;
+  ZLOCK(ud);
+  c = _zcursor_get(ud, span->unit, start, end, &reset);
+  ZUNLOCK(ud);
+  if (c == NULL)
+    goto error;
+  if (reset && !_zcursor_reset(ud, c, u))
+    goto out;
+
+  /* Start with what the cursor already went through */
+  if (c->u_pos > start) {
+    to = MIN(end, c->u_pos);
+    memcpy(out.data, &c->hist[c->hist_len - (c->u_pos - start)], (size_t)(to - start));
+  }
+  *eos = false;
+  while (c->u_pos < end || (next != NULL && !c->done)) {
+    if (c->done)
+      goto out;
+    /* Keep the part of the data that the next block or chunk may refer to */
+    if (c->hist_cap - c->hist_len < step) {
+      memmove(c->hist, &c->hist[c->hist_len - c->hist_keep], c->hist_keep);
+      c->hist_len = c->hist_keep;
+    }
+    n = (ud->format == ZSTREAM_XZ) ? _zxz_step(c) : _zstd_step(c);
+    if (n < 0 || c->u_pos + n > u->u_size)
+      goto out;
+    c->hist_len += (size_t)n;
+    c->u_pos += n;
+    from = MAX(start, c->u_pos - n);
+    to = MIN(end, c->u_pos);
+    if (from < to)
+      memcpy(&out.data[from - start], &c->hist[c->hist_len - (c->u_pos - from)], (size_t)(to - from));
+  }
+  if (next != NULL) {
+    switch (_zstd_next_frame(c->fd, c->c_pos, ud->c_size, next)) {
+    case 1:
+      next->u_offset = u->u_offset + u->u_size;
+      break;
+    case 0:
+      *eos = true;
+      break;
+    default:
+      cdio_warn("zstream: ignoring the data that follows the zstd frame at LSN %lu",
+                (long unsigned int)(u->u_offset / CDIO_CD_FRAMESIZE));
+      *eos = true;
+      break;
+    }
+    /* The file position no longer matches the cursor's */
+    c->c_pos = ud->c_size;
+  }
+  r = true;
+
+ out:
+  if (!r)
+    cdio_warn("zstream: invalid %s data in span at LSN %lu",
+              (ud->format == ZSTREAM_XZ) ? "xz" : "zstd",
+              (long unsigned int)(span->u_offset / CDIO_CD_FRAMESIZE));
+  _zcursor_put(ud, c, r);
+ error:
+  slot->data = out.data;
+  slot->data_cap = out.cap;
+  slot->data_start = 0;
+  slot->data_len = r ? len : 0;
+  return r;
+}
+
+/* Locate the blocks of an xz image, through the index of each stream */
+static bool
+_zxz_probe(_UserData *ud, FILE *fd)
+{
+  uint8_t buf[12], *index = NULL;
+  uint64_t pos = ud->c_size, back, start, n, j, unpadded, size, blocks, dict;
+  zunit_t *units = NULL, *tmp, u;
+  uint32_t n_units = 0, len, k;
+  size_t i;
+  bool r = false;
+
+  while (pos > 0) {
+    /* Skip the stream padding */
+    while (pos >= 4) {
+      if (CDIO_FSEEK(fd, (off_t)(pos - 4), SEEK_SET) != 0 || fread(buf, 1, 4, fd) != 4)
+        goto out;
+      if (buf[0] != 0 || buf[1] != 0 || buf[2] != 0 || buf[3] != 0)
+        break;
+      pos -= 4;
+    }
+    if (pos < 24 || CDIO_FSEEK(fd, (off_t)(pos - 12), SEEK_SET) != 0
+        || fread(buf, 1, 12, fd) != 12 || buf[10] != 'Y' || buf[11] != 'Z')
+      goto out;
+    back = ((uint64_t)(buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24)) + 1) * 4;
+    if (back > pos - 24 || back > ZSTREAM_XZ_MAX_INDEX)
+      goto out;
+    start = pos - 12 - back;
+    free(index);
+    index = malloc((size_t)back);
+    if (index == NULL || CDIO_FSEEK(fd, (off_t)start, SEEK_SET) != 0
+        || fread(index, 1, (size_t)back, fd) != back)
+      goto out;
+    i = 1;
+    if (index[0] != 0 || !_zxz_varint(index, (size_t)back, &i, &n) || n > back)
+      goto out;
+    /* The streams are found last first */
+    tmp = realloc(units, (n_units + (size_t)n) * sizeof(zunit_t));
+    if (tmp == NULL)
+      goto out;
+    units = tmp;
+    memmove(&units[n], units, n_units * sizeof(zunit_t));
+    n_units += (uint32_t)n;
+    for (j = 0, blocks = 0; j < n; j++) {
+      if (!_zxz_varint(index, (size_t)back, &i, &unpadded)
+          || !_zxz_varint(index, (size_t)back, &i, &size) || unpadded == 0)
+        goto out;
+      units[j].c_offset = blocks;
+      units[j].u_size = size;
+      blocks += (unpadded + 3) & ~3ULL;
+    }
+    if (blocks + 12 > start)
+      goto out;
+    pos = start - blocks - 12;
+    if (CDIO_FSEEK(fd, (off_t)pos, SEEK_SET) != 0 || fread(buf, 1, 6, fd) != 6
+        || memcmp(buf, "\xFD" "7zXZ\0", 6) != 0)
+      goto out;
+    for (j = 0; j < n; j++)
+      units[j].c_offset += pos + 12;
+  }
+
+  for (k = 0; k < n_units; k++) {
+    if (units[k].u_size == 0)
+      continue;
+    u = units[k];
+    u.u_offset = ud->u_size;
+    if (!_zxz_block_header(fd, u.c_offset, &len, &dict))
+      goto out;
+    u.window = dict;
+    if (MIN(dict, u.u_size) > ZSTREAM_MAX_WINDOW) {
+      cdio_warn("zstream: xz dictionary size %lu MB is too large",
+                (long unsigned int)(dict >> 20));
+      goto out;
+    }
+    if (!_zunit_add(ud, &u))
+      goto out;
+    ud->u_size += u.u_size;
+  }
+  ud->index_complete = true;
+  r = true;
+
+ out:
+  free(index);
+  free(units);
+  if (!r)
+    cdio_warn("zstream: invalid or unsupported xz image");
+  return r;
+}
+
+/*
+ * Span cache
+ */
+static bool
+_zspan_known(const _UserData *ud, int64_t k)
+{
+  if (ud->format == ZSTREAM_CSO)
+    return (uint64_t)k * ud->cso_blocks_per_span < ud->cso_blocks;
+  return k < ud->n_spans;
+}
+
+static zslot_t *
+_zslot_find(_UserData *ud, int64_t k)
+{
+  int i;
+
+  for (i = 0; i < ud->n_slots; i++)
+    if (ud->slots[i].span == k)
+      return &ud->slots[i];
+  return NULL;
+}
+
+static void
+_zslot_set_state(zslot_t *slot, zslot_state_t state)
+{
+  slot->state = state;
+#ifdef _WIN32
+  if (state == SLOT_PENDING || state == SLOT_BUSY)
+    ResetEvent(slot->done);
+  else
+    SetEvent(slot->done);
+#endif
+}
+
+/* Pick a slot to hold a new span. For readahead, only slots that are
+   empty or that hold data from outside the readahead window are used. */
+static zslot_t *
+_zslot_victim(_UserData *ud, bool readahead, int64_t base)
+{
+  zslot_t *victim = NULL;
+  int i;
+
+  for (i = 0; i < ud->n_slots; i++) {
+    zslot_t *s = &ud->slots[i];
+    if (s->state == SLOT_EMPTY)
+      return s;
+    if (s->state == SLOT_BUSY)
+      continue;
+    if (s->state == SLOT_PENDING && readahead)
+      continue;
+    if (readahead && s->span >= base && s->span <= base + ud->n_slots - 2)
+      continue;
+    /* Prefer evicting completed spans over cancelling pending ones */
+    if (victim == NULL
+        || (victim->state == SLOT_PENDING && s->state != SLOT_PENDING)
+        || ((victim->state == SLOT_PENDING) == (s->state == SLOT_PENDING)
+            && s->last_use < victim->last_use))
+      victim = s;
+  }
+  return victim;
+}
+
+/* Queue the spans that follow 'base' for decompression (lock held) */
+static void
+_zreadahead(_UserData *ud, int64_t base)
+{
+#ifdef _WIN32
+  int64_t k;
+  zslot_t *slot;
+
+  /* On random access, decompressing ahead only competes with the reader */
+  if (ud->n_workers == 0 || base < 0 || !ud->sequential)
+    return;
+  for (k = base + 1; k <= base + ud->n_slots - 2; k++) {
+    if (!_zspan_known(ud, k))
+      break;
+    if (_zslot_find(ud, k) != NULL)
+      continue;
+    slot = _zslot_victim(ud, true, base);
+    if (slot == NULL)
+      break;
+    slot->span = k;
+    slot->last_use = ud->use_count;
+    _zslot_set_state(slot, SLOT_PENDING);
+    ReleaseSemaphore(ud->work, 1, NULL);
+  }
+#endif
+}
+
+
+/* Decompress span k into slot, which must be BUSY (called without the lock) */
+static void
+_zslot_fill(_UserData *ud, zdec_t *d, zslot_t *slot, int64_t k)
+{
+  zspan_t span, next = { 0, 0, NULL, false, 0 };
+  zunit_t unit, next_unit;
+  bool r, discover = false, eos = false;
+#ifdef _WIN32
+  int i;
+#endif
+
+  if (ud->format == ZSTREAM_CSO) {
+    r = _zspan_cso(ud, d, k, slot);
+  } else if (ud->format == ZSTREAM_GZIP) {
+    ZLOCK(ud);
+    span = ud->spans[k];
+    ZUNLOCK(ud);
+    r = _zspan_gzip(ud, d, &span, slot, &next, &eos);
+  } else {
+    ZLOCK(ud);
+    span = ud->spans[k];
+    unit = ud->units[span.unit];
+    /* For zstd, the frame that follows the last span is yet to be found */
+    discover = !ud->index_complete && (k + 1 == ud->n_spans);
+    ZUNLOCK(ud);
+    r = _zspan_unit(ud, &span, &unit, slot, discover ? &next_unit : NULL, &eos);
+  }
+
+  ZLOCK(ud);
+  if (r && ud->format == ZSTREAM_GZIP && !ud->index_complete) {
+    if (eos) {
+      ud->u_size = span.u_offset + slot->data_len;
+      ud->index_complete = true;
+      ud->n_spans = (uint32_t)k + 1;
+    } else if (k + 1 == ud->n_spans) {
+      if (ud->n_spans == ud->spans_cap) {
+        zspan_t *spans = realloc(ud->spans, 2 * ud->spans_cap * sizeof(zspan_t));
+        if (spans != NULL) {
+          ud->spans = spans;
+          ud->spans_cap *= 2;
+        }
+      }
+      if (ud->n_spans < ud->spans_cap) {
+        ud->spans[ud->n_spans++] = next;
+        next.window = NULL;
+      }
+    }
+  }
+  if (r && discover) {
+    if (eos) {
+      ud->u_size = span.u_offset + slot->data_len;
+      ud->index_complete = true;
+    } else {
+      _zunit_add(ud, &next_unit);
+    }
+  }
+  free(next.window);
+  _zslot_set_state(slot, r ? SLOT_READY : SLOT_FAILED);
+  /* For gzip and zstd, the next span only becomes known now */
+  _zreadahead(ud, ud->last_span);
+#ifdef _WIN32
+  /* The workers may have left out pending spans of the unit we were in */
+  for (i = 0; i < ud->n_slots && ud->format != ZSTREAM_GZIP && ud->format != ZSTREAM_CSO; i++) {
+    if (ud->slots[i].state == SLOT_PENDING) {
+      ReleaseSemaphore(ud->work, 1, NULL);
+      break;
+    }
+  }
+#endif
+  ZUNLOCK(ud);
+}
+
+#ifdef _WIN32
+/* For xz and zstd, whether span k is in a unit that is being decompressed
+   (lock held) */
+static bool
+_zunit_busy(const _UserData *ud, int64_t k)
+{
+  int i;
+
+  if (ud->format != ZSTREAM_XZ && ud->format != ZSTREAM_ZSTD)
+    return false;
+  for (i = 0; i < ud->n_slots; i++)
+    if (ud->slots[i].state == SLOT_BUSY
+        && ud->spans[ud->slots[i].span].unit == ud->spans[k].unit)
+      return true;
+  return false;
+}
+
+static DWORD WINAPI
+_zworker(LPVOID param)
+{
+  _UserData *ud = param;
+  zdec_t *d = ud->worker_dec[InterlockedIncrement(&ud->worker_id) - 1];
+  zslot_t *slot;
+  int i;
+
+  for (;;) {
+    WaitForSingleObject(ud->work, INFINITE);
+    if (ud->quit)
+      break;
+    ZLOCK(ud);
+    slot = NULL;
+    for (i = 0; i < ud->n_slots; i++) {
+      /* Within an xz or zstd unit, spans can only be decompressed in turn */
+      if (ud->slots[i].state == SLOT_PENDING
+          && (slot == NULL || ud->slots[i].span < slot->span)
+          && !_zunit_busy(ud, ud->slots[i].span))
+        slot = &ud->slots[i];
+    }
+    /* The reader may already have taken over our job */
+    if (slot != NULL)
+      _zslot_set_state(slot, SLOT_BUSY);
+    ZUNLOCK(ud);
+    if (slot != NULL)
+      _zslot_fill(ud, d, slot, slot->span);
+  }
+  return 0;
+}
+#endif
+
+/* Return the slot holding span k, decompressing it if needed */
+static zslot_t *
+_zspan_get(_UserData *ud, int64_t k)
+{
+  zslot_t *slot;
+  bool tried = false;
+
+  ZLOCK(ud);
+  if (k != ud->last_span)
+    ud->sequential = (k == ud->last_span + 1);
+  ud->last_span = k;
+  for (;;) {
+    slot = _zslot_find(ud, k);
+    if (slot != NULL) {
+      if (slot->state == SLOT_READY || (slot->state == SLOT_FAILED && tried)) {
+        slot->last_use = ++ud->use_count;
+        _zreadahead(ud, k);
+        ZUNLOCK(ud);
+        return (slot->state == SLOT_READY) ? slot : NULL;
+      }
+#ifdef _WIN32
+      if (slot->state == SLOT_BUSY) {
+        ZUNLOCK(ud);
+        WaitForSingleObject(slot->done, INFINITE);
+        ZLOCK(ud);
+        continue;
+      }
+#endif
+      /* Still pending, or failed in a worker (transient read error, cancelled
+         readahead...): decompress it ourselves, so that the error is only
+         reported once it has also occurred here */
+    } else {
+      slot = _zslot_victim(ud, false, k);
+      if (slot == NULL) {
+        ZUNLOCK(ud);
+        return NULL;
+      }
+      slot->span = k;
+    }
+    _zslot_set_state(slot, SLOT_BUSY);
+    ZUNLOCK(ud);
+    _zslot_fill(ud, &ud->dec, slot, k);
+    ZLOCK(ud);
+    tried = true;
+  }
+}
+
+/*
+ * Index file (gzip and zstd)
+ */
+static char *zindex_dir = NULL;
+
+void
+cdio_zstream_set_index_dir(const char psz_dir[])
+{
+  free(zindex_dir);
+  zindex_dir = (psz_dir != NULL) ? strdup(psz_dir) : NULL;
+}
+
+/* The index of an image goes to the index directory, under the name of the
+   image followed by a hash of its path, or nowhere if that isn't set */
+static char *
+_zindex_path(const _UserData *ud)
+{
+  const char *name = ud->pathname, *p;
+  uint32_t hash = 0x811c9dc5;
+  size_t len;
+  char *path;
+
+  if (zindex_dir == NULL)
+    return NULL;
+  for (p = ud->pathname; *p != 0; p++) {
+    if (*p == '/' || *p == '\\')
+      name = p + 1;
+    hash = (hash ^ (uint8_t)*p) * 0x01000193;
+  }
+  len = strlen(zindex_dir) + strlen(name) + 10 + sizeof(ZSTREAM_INDEX_EXT);
+  path = malloc(len);
+  if (path != NULL)
+    snprintf(path, len, "%s%s%s.%08x" ZSTREAM_INDEX_EXT, zindex_dir,
+             (*zindex_dir != 0 && strchr("/\\", zindex_dir[strlen(zindex_dir) - 1]) == NULL) ? "/" : "",
+             name, hash);
+  return path;
+}
+
+static void
+_zindex_load(_UserData *ud)
+{
+  char magic[8], *path = _zindex_path(ud);
+  uint64_t hdr[3], rec[3];
+  uint32_t i, n = 0;
+  FILE *fd = (path != NULL) ? CDIO_FOPEN(path, "rb") : NULL;
+  zspan_t *spans = NULL;
+  zunit_t u;
+
+  if (fd == NULL)
+    goto out;
+  if (fread(magic, 1, sizeof(magic), fd) != sizeof(magic)
+      || memcmp(magic, (ud->format == ZSTREAM_ZSTD) ? ZSTREAM_INDEX_MAGIC_ZSTD
+                : ZSTREAM_INDEX_MAGIC, sizeof(magic)) != 0
+      || fread(hdr, sizeof(uint64_t), 3, fd) != 3 || fread(&n, sizeof(n), 1, fd) != 1
+      || hdr[0] != ud->c_size || hdr[1] != ud->c_mtime || n == 0)
+    goto out;
+  if (ud->format == ZSTREAM_ZSTD) {
+    /* The frames, as u_size, c_offset and window */
+    for (i = 0, u.u_offset = 0; i < n; i++) {
+      if (fread(rec, sizeof(uint64_t), 3, fd) != 3 || rec[0] == 0 || rec[2] > ZSTREAM_MAX_WINDOW)
+        break;
+      u.u_size = rec[0];
+      u.c_offset = rec[1];
+      u.window = rec[2];
+      if (!_zunit_add(ud, &u))
+        break;
+      u.u_offset += u.u_size;
+    }
+    if (i != n || u.u_offset != hdr[2]) {
+      ud->n_units = 0;
+      ud->n_spans = 0;
+      ud->max_window = 0;
+      goto out;
+    }
+  } else {
+    spans = calloc(n, sizeof(zspan_t));
+    if (spans == NULL)
+      goto out;
+    for (i = 0; i < n; i++) {
+      size_t wlen;
+      uint8_t at_header;
+      if (fread(&spans[i].u_offset, sizeof(uint64_t), 1, fd) != 1
+          || fread(&spans[i].c_bit, sizeof(uint64_t), 1, fd) != 1
+          || fread(&at_header, 1, 1, fd) != 1)
+        goto out;
+      spans[i].at_header = (at_header != 0);
+      wlen = (size_t)MIN(ZSTREAM_WINDOW_SIZE, spans[i].u_offset);
+      if (wlen == 0)
+        continue;
+      spans[i].window = malloc(wlen);
+      if (spans[i].window == NULL || fread(spans[i].window, 1, wlen, fd) != wlen)
+        goto out;
+    }
+    ud->spans = spans;
+    ud->n_spans = ud->spans_cap = n;
+    spans = NULL;
+  }
+  ud->u_size = hdr[2];
+  ud->index_complete = true;
+  ud->index_loaded = true;
+  cdio_info("zstream: using index '%s' (%u %s)", path, n,
+            (ud->format == ZSTREAM_ZSTD) ? "frames" : "spans");
+
+ out:
+  if (spans != NULL) {
+    for (i = 0; i < n; i++)
+      free(spans[i].window);
+    free(spans);
+  }
+  if (fd != NULL)
+    fclose(fd);
+  free(path);
+}
+
+static void
+_zindex_save(_UserData *ud)
+{
+  char *path = _zindex_path(ud);
+  uint64_t hdr[3] = { ud->c_size, ud->c_mtime, ud->u_size }, rec[3];
+  uint32_t i, n = (ud->format == ZSTREAM_ZSTD) ? ud->n_units : ud->n_spans;
+  bool r = false;
+  FILE *fd = (path != NULL) ? CDIO_FOPEN(path, "wb") : NULL;
+
+  if (fd == NULL)
+    goto out;
+  if (fwrite((ud->format == ZSTREAM_ZSTD) ? ZSTREAM_INDEX_MAGIC_ZSTD : ZSTREAM_INDEX_MAGIC, 1, 8, fd) != 8
+      || fwrite(hdr, sizeof(uint64_t), 3, fd) != 3
+      || fwrite(&n, sizeof(uint32_t), 1, fd) != 1)
+    goto out;
+  for (i = 0; i < n; i++) {
+    if (ud->format == ZSTREAM_ZSTD) {
+      rec[0] = ud->units[i].u_size;
+      rec[1] = ud->units[i].c_offset;
+      rec[2] = ud->units[i].window;
+      if (fwrite(rec, sizeof(uint64_t), 3, fd) != 3)
+        goto out;
+    } else {
+      uint8_t at_header = ud->spans[i].at_header ? 1 : 0;
+      size_t wlen = (size_t)MIN(ZSTREAM_WINDOW_SIZE, ud->spans[i].u_offset);
+      if (fwrite(&ud->spans[i].u_offset, sizeof(uint64_t), 1, fd) != 1
+          || fwrite(&ud->spans[i].c_bit, sizeof(uint64_t), 1, fd) != 1
+          || fwrite(&at_header, 1, 1, fd) != 1
+          || (wlen != 0 && fwrite(ud->spans[i].window, 1, wlen, fd) != wlen))
+        goto out;
+    }
+  }
+  r = true;
+  ud->index_loaded = true;
+  cdio_info("zstream: saved index '%s'", path);
+
+ out:
+  if (fd != NULL) {
+    fclose(fd);
+    if (!r)
+      remove(path);
+  }
+  if (!r)
+    cdio_debug("zstream: could not save index for '%s'", ud->pathname);
+  free(path);
+}
+
+/*
+ * Stream functions
+ */
+static bool
+_zdec_init(_UserData *ud, zdec_t *d)
+{
+  memset(d, 0, sizeof(zdec_t));
+  d->fd = CDIO_FOPEN(ud->pathname, "rb");
+  d->in_cap = ZSTREAM_INBUF_SIZE;
+  d->in = malloc(d->in_cap);
+  return (d->fd != NULL && d->in != NULL);
+}
+
+static void
+_zdec_exit(zdec_t *d)
+{
+  if (d->fd != NULL)
+    fclose(d->fd);
+  free(d->in);
+  memset(d, 0, sizeof(zdec_t));
+}
+
+static int _zstream_close(void *user_data);
+
+static void
+_zcursor_exit(zcursor_t *c)
+{
+  if (c->fd != NULL)
+    fclose(c->fd);
+  free(c->hist);
+  free(c->in);
+  free(c->lzma);
+  free(c->zstd);
+  c->fd = NULL;
+  c->hist = c->in = NULL;
+  c->hist_cap = 0;
+  c->lzma = NULL;
+  c->zstd = NULL;
+  c->unit = -1;
+}
+
+static int
+_zstream_open(void *user_data)
+{
+  _UserData *const ud = user_data;
+  zcursor_t *c;
+  int n_cursors = 1;
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  int i;
+#endif
+
+  if (!_zdec_init(ud, &ud->dec)) {
+    _zdec_exit(&ud->dec);
+    return 1;
+  }
+  ud->pos = 0;
+  ud->last_span = -1;
+  ud->n_slots = 2;
+#ifdef _WIN32
+  GetSystemInfo(&si);
+  ud->n_workers = MIN(MAX((int)si.dwNumberOfProcessors, 1), ZSTREAM_MAX_WORKERS);
+  ud->quit = false;
+  ud->worker_id = 0;
+  /* Tokens may outnumber the pending spans, as a worker that finds nothing
+     it can take just waits again, so don't let the count saturate */
+  ud->work = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+  for (i = 0; i < ud->n_workers && ud->work != NULL; i++) {
+    ud->worker_dec[i] = malloc(sizeof(zdec_t));
+    if (ud->worker_dec[i] == NULL)
+      break;
+    if (!_zdec_init(ud, ud->worker_dec[i])) {
+      _zdec_exit(ud->worker_dec[i]);
+      free(ud->worker_dec[i]);
+      break;
+    }
+    ud->workers[i] = CreateThread(NULL, 0, _zworker, ud, 0, NULL);
+    if (ud->workers[i] == NULL) {
+      _zdec_exit(ud->worker_dec[i]);
+      free(ud->worker_dec[i]);
+      break;
+    }
+  }
+  ud->n_workers = i;
+  /* One slot for the span being read, one for the previous one, and
+     enough for each worker to have two spans queued */
+  ud->n_slots = (ud->n_workers == 0) ? 2 : 2 * ud->n_workers + 2;
+  n_cursors = ud->n_workers + 1;
+#endif
+
+  /* For xz and zstd, one cursor for each thread, as long as their history
+     buffers fit in our memory budget */
+  ud->n_cursors = 0;
+  if (ud->format == ZSTREAM_XZ || ud->format == ZSTREAM_ZSTD) {
+    n_cursors = (int)MIN((uint64_t)n_cursors, MAX(1, ZSTREAM_CURSOR_MEM
+                         / (2 * ud->max_window + ZSTREAM_XZ_MAX_STEP)));
+    for (; ud->n_cursors < n_cursors; ud->n_cursors++) {
+      c = &ud->cursors[ud->n_cursors];
+      c->unit = -1;
+      c->busy = false;
+      c->fd = CDIO_FOPEN(ud->pathname, "rb");
+      c->in = malloc(ZSTD_BLOCK_MAX);
+      if (ud->format == ZSTREAM_XZ)
+        c->lzma = malloc(sizeof(zlzma_t));
+      else
+        c->zstd = malloc(sizeof(zzstd_t));
+      if (c->fd == NULL || c->in == NULL || (c->lzma == NULL && c->zstd == NULL)) {
+        _zcursor_exit(c);
+        break;
+      }
+    }
+    if (ud->n_cursors == 0) {
+      _zstream_close(ud);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int
+_zstream_close(void *user_data)
+{
+  _UserData *const ud = user_data;
+  int i;
+
+#ifdef _WIN32
+  if (ud->n_workers > 0) {
+    ud->quit = true;
+    ReleaseSemaphore(ud->work, ud->n_workers, NULL);
+    WaitForMultipleObjects(ud->n_workers, ud->workers, TRUE, INFINITE);
+    for (i = 0; i < ud->n_workers; i++) {
+      CloseHandle(ud->workers[i]);
+      _zdec_exit(ud->worker_dec[i]);
+      free(ud->worker_dec[i]);
+    }
+    ud->n_workers = 0;
+  }
+  if (ud->work != NULL) {
+    CloseHandle(ud->work);
+    ud->work = NULL;
+  }
+#endif
+  for (i = 0; i < ZSTREAM_MAX_SLOTS; i++) {
+    free(ud->slots[i].data);
+    ud->slots[i].data = NULL;
+    ud->slots[i].data_cap = 0;
+    ud->slots[i].span = -1;
+    _zslot_set_state(&ud->slots[i], SLOT_EMPTY);
+  }
+  for (i = 0; i < ud->n_cursors; i++)
+    _zcursor_exit(&ud->cursors[i]);
+  ud->n_cursors = 0;
+  _zdec_exit(&ud->dec);
+
+  if ((ud->format == ZSTREAM_GZIP || ud->format == ZSTREAM_ZSTD)
+      && ud->index_complete && !ud->index_loaded)
+    _zindex_save(ud);
+  return 0;
+}
+
+static void
+_zstream_free(void *user_data)
+{
+  _UserData *const ud = user_data;
+  uint32_t i;
+
+  if (ud->dec.fd != NULL)
+    _zstream_close(user_data);
+  for (i = 0; i < ud->n_spans; i++)
+    free(ud->spans[i].window);
+  free(ud->spans);
+  free(ud->units);
+  free(ud->cso_index);
+#ifdef _WIN32
+  for (i = 0; i < ZSTREAM_MAX_SLOTS; i++)
+    if (ud->slots[i].done != NULL)
+      CloseHandle(ud->slots[i].done);
+  for (i = 0; i < ZSTREAM_MAX_CURSORS; i++)
+    if (ud->cursors[i].idle != NULL)
+      CloseHandle(ud->cursors[i].idle);
+  DeleteCriticalSection(&ud->lock);
+#endif
+  free(ud->pathname);
+  free(ud);
+}
+
+static int
+_zstream_seek(void *user_data, off_t offset, int whence)
+{
+  _UserData *const ud = user_data;
+
+  switch (whence) {
+  case SEEK_SET:
+    break;
+  case SEEK_CUR:
+    offset += (off_t)ud->pos;
+    break;
+  case SEEK_END:
+    if (!ud->index_complete)
+      return DRIVER_OP_ERROR;
+    offset += (off_t)ud->u_size;
+    break;
+  default:
+    return DRIVER_OP_ERROR;
+  }
+  if (offset < 0)
+    return DRIVER_OP_ERROR;
+  ud->pos = offset;
+  return DRIVER_OP_SUCCESS;
+}
+
+static off_t
+_zstream_stat(void *user_data)
+{
+  _UserData *const ud = user_data;
+  zslot_t *slot;
+  const uint8_t *pvd;
+  uint64_t size;
+
+  if (ud->index_complete)
+    return (off_t)ud->u_size;
+
+  /* Until the gzip index is complete, use the size from the ISO9660 primary
+     volume descriptor, which sits in the first span, or else the one from
+     the gzip trailer (that was set on probe) */
+  if (!ud->u_size_hint_checked) {
+    ud->u_size_hint_checked = true;
+    slot = _zspan_get(ud, 0);
+    if (slot != NULL && slot->data_len >= (ZSTREAM_PVD_LSN + 1) * CDIO_CD_FRAMESIZE) {
+      pvd = &slot->data[slot->data_start + ZSTREAM_PVD_LSN * CDIO_CD_FRAMESIZE];
+      size = (uint64_t)(pvd[80] | (pvd[81] << 8) | (pvd[82] << 16) | ((uint32_t)pvd[83] << 24))
+        * (pvd[128] | (pvd[129] << 8));
+      if (pvd[0] == 1 && memcmp(&pvd[1], "CD001", 5) == 0 && size != 0)
+        ud->u_size_hint = size;
+    }
+  }
+  return (ud->u_size_hint != 0) ? (off_t)ud->u_size_hint : -1;
+}
+
+static ssize_t
+_zstream_read(void *user_data, void *buf, size_t count)
+{
+  _UserData *const ud = user_data;
+  uint8_t *dst = buf;
+  ssize_t read_count = 0;
+  int64_t k, lo, hi;
+  uint64_t u_offset;
+  size_t len;
+  zslot_t *slot;
+
+  while (count > 0) {
+    if (ud->index_complete && ud->pos >= ud->u_size)
+      break;
+    if (ud->format == ZSTREAM_CSO) {
+      k = ud->pos / ((uint64_t)ud->cso_blocks_per_span * ud->cso_block_size);
+      u_offset = (uint64_t)k * ud->cso_blocks_per_span * ud->cso_block_size;
+    } else {
+      /* Find the last span that starts at or before pos. If the index
+         is incomplete, this may be a span that we have yet to go past. */
+      ZLOCK(ud);
+      for (lo = 0, hi = ud->n_spans - 1; lo < hi; ) {
+        k = (lo + hi + 1) / 2;
+        if (ud->spans[k].u_offset <= ud->pos)
+          lo = k;
+        else
+          hi = k - 1;
+      }
+      k = lo;
+      u_offset = ud->spans[k].u_offset;
+      ZUNLOCK(ud);
+    }
+    slot = _zspan_get(ud, k);
+    if (slot == NULL) {
+      cdio_warn("zstream: could not decompress data at LSN %lu",
+                (long unsigned int)(ud->pos / CDIO_CD_FRAMESIZE));
+      break;
+    }
+    if (ud->pos >= u_offset + slot->data_len) {
+      /* Past the end of this span: for gzip and zstd, the next one is now known */
+      if (ud->format != ZSTREAM_CSO && _zspan_known(ud, k + 1))
+        continue;
+      break;
+    }
+    len = (size_t)MIN(count, u_offset + slot->data_len - ud->pos);
+    memcpy(dst, &slot->data[slot->data_start + (ud->pos - u_offset)], len);
+    dst += len;
+    ud->pos += len;
+    count -= len;
+    read_count += len;
+  }
+  if (count > 0)
+    cdio_debug("zstream: short read at LSN %lu",
+               (long unsigned int)(ud->pos / CDIO_CD_FRAMESIZE));
+  return read_count;
+}
+
+static bool
+_zstream_probe(_UserData *ud)
+{
+  uint8_t hdr[24];
+  uint64_t u_size;
+  uint32_t i;
+  zunit_t u;
+  FILE *fd = CDIO_FOPEN(ud->pathname, "rb");
+  bool r = false;
+
+  if (fd == NULL)
+    return false;
+  if (fread(hdr, 1, sizeof(hdr), fd) != sizeof(hdr))
+    goto out;
+
+  if (hdr[0] == 0x1F && hdr[1] == 0x8B && hdr[2] == 8) {
+    ud->format = ZSTREAM_GZIP;
+    _zindex_load(ud);
+    if (!ud->index_complete) {
+      /* The first span starts with the gzip header */
+      ud->spans_cap = 64;
+      ud->spans = calloc(ud->spans_cap, sizeof(zspan_t));
+      if (ud->spans == NULL)
+        goto out;
+      ud->n_spans = 1;
+      ud->spans[0].at_header = true;
+      /* ISIZE, from the gzip trailer, is the uncompressed size modulo 4 GB */
+      if (ud->c_size >= sizeof(hdr) + 8 && CDIO_FSEEK(fd, (off_t)(ud->c_size - 4), SEEK_SET) == 0
+          && fread(hdr, 1, 4, fd) == 4)
+        ud->u_size_hint = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((uint32_t)hdr[3] << 24);
+      cdio_info("zstream: no index for '%s', it will be built on first read", ud->pathname);
+    }
+    r = true;
+  } else if (memcmp(hdr, "CISO", 4) == 0) {
+    ud->format = ZSTREAM_CSO;
+    memcpy(&u_size, &hdr[8], sizeof(u_size));
+    memcpy(&ud->cso_block_size, &hdr[16], sizeof(uint32_t));
+    ud->cso_align = hdr[21];
+    if (hdr[20] > 1 || ud->cso_block_size == 0 || ud->cso_block_size > ZSTREAM_SPAN_SIZE
+        || (ud->cso_block_size & 0x7FF) != 0 || u_size == 0) {
+      cdio_warn("zstream: unsupported CSO image (version %d, block size %u)",
+                hdr[20], ud->cso_block_size);
+      goto out;
+    }
+    ud->u_size = u_size;
+    ud->index_complete = true;
+    ud->cso_blocks = (uint32_t)((u_size + ud->cso_block_size - 1) / ud->cso_block_size);
+    ud->cso_blocks_per_span = ZSTREAM_SPAN_SIZE / ud->cso_block_size;
+    ud->cso_index = malloc((ud->cso_blocks + 1) * sizeof(uint32_t));
+    if (ud->cso_index == NULL
+        || fread(ud->cso_index, sizeof(uint32_t), ud->cso_blocks + 1, fd) != ud->cso_blocks + 1)
+      goto out;
+    for (i = 0; i < ud->cso_blocks; i++) {
+      if (_zcso_offset(ud, i + 1) < _zcso_offset(ud, i)
+          || _zcso_offset(ud, i + 1) > ud->c_size) {
+        cdio_warn("zstream: invalid CSO index");
+        goto out;
+      }
+    }
+    r = true;
+  } else if (memcmp(hdr, "\xFD" "7zXZ\0", 6) == 0) {
+    ud->format = ZSTREAM_XZ;
+    r = _zxz_probe(ud, fd);
+  } else if (memcmp(hdr, "\x28\xB5\x2F\xFD", 4) == 0
+             || ((hdr[0] & 0xF0) == 0x50 && memcmp(&hdr[1], "\x2A\x4D\x18", 3) == 0)) {
+    /* A zstd frame, or a skippable frame that may precede one */
+    ud->format = ZSTREAM_ZSTD;
+    _zindex_load(ud);
+    if (!ud->index_complete) {
+      switch (_zstd_next_frame(fd, 0, ud->c_size, &u)) {
+      case 1:
+        u.u_offset = 0;
+        if (!_zunit_add(ud, &u))
+          goto out;
+        ud->u_size_hint = u.u_size;
+        cdio_info("zstream: no index for '%s', it will be built on first read", ud->pathname);
+        break;
+      case 0:
+        ud->index_complete = true;
+        break;
+      default:
+        goto out;
+      }
+    }
+    r = true;
+  }
+
+ out:
+  fclose(fd);
+  return r;
+}
+
+CdioDataSource_t *
+cdio_zstream_new(const char pathname[])
+{
+  cdio_stream_io_functions funcs = { NULL, NULL, NULL, NULL, NULL, NULL };
+  _UserData *ud = NULL;
+  struct CDIO_STAT_STRUCT statbuf;
+  int i;
+
+  if (pathname == NULL)
+    return NULL;
+
+  ud = calloc(1, sizeof(_UserData));
+  if (ud == NULL)
+    return NULL;
+  ud->pathname = _cdio_strdup_fixpath(pathname);
+  if (ud->pathname == NULL || CDIO_STAT_CALL(ud->pathname, &statbuf) == -1) {
+    free(ud->pathname);
+    free(ud);
+    return NULL;
+  }
+  ud->c_size = statbuf.st_size;
+  ud->c_mtime = statbuf.st_mtime;
+  for (i = 0; i < ZSTREAM_MAX_SLOTS; i++) {
+    ud->slots[i].span = -1;
+#ifdef _WIN32
+    ud->slots[i].done = CreateEvent(NULL, TRUE, TRUE, NULL);
+#endif
+  }
+  for (i = 0; i < ZSTREAM_MAX_CURSORS; i++) {
+    ud->cursors[i].unit = -1;
+#ifdef _WIN32
+    ud->cursors[i].idle = CreateEvent(NULL, TRUE, TRUE, NULL);
+#endif
+  }
+#ifdef _WIN32
+  InitializeCriticalSection(&ud->lock);
+#endif
+
+  if (!_zstream_probe(ud)) {
+    _zstream_free(ud);
+    return NULL;
+  }
+  _zfixed_init();
+
+  funcs.open   = _zstream_open;
+  funcs.seek   = _zstream_seek;
+  funcs.stat   = _zstream_stat;
+  funcs.read   = _zstream_read;
+  funcs.close  = _zstream_close;
+  funcs.free   = _zstream_free;
+
+  return cdio_stream_new(ud, &funcs);
+}
+
+
+/*
+ * Local variables:
+ *  c-file-style: "gnu"
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,49 @@
+/*
+  Copyright (C) 2013 Pete Batard <pete@akeo.ie>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CDIO_ZSTREAM_H_
+#define CDIO_ZSTREAM_H_
+
+#include "_cdio_stream.h"
+
+/*!
+  Initialize a new stream reading from a compressed image (gzip, xz, zstd
+  or CSO). A pointer to the stream is returned, or NULL if pathname is not
+  a compressed image that we can read, in which case the caller should
+  fall back to cdio_stdio_new().
+
+  Reads are random access: CSO and xz images carry their own block index,
+  and for gzip and zstd images an index of restart points or frames is
+  built during the first pass, and cached in the directory set with
+  cdio_zstream_set_index_dir(), in a file with an ".idx" suffix.
+
+  cdio_stream_destroy should be called on the returned value when you
+  don't need the stream any more.
+ */
+CdioDataSource_t * cdio_zstream_new(const char psz_path[]);
+
+#endif /* CDIO_ZSTREAM_H_ */
+
+
+/*
+ * Local variables:
+ *  c-file-style: "gnu"
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -52,11 +52,23 @@
 /* Private headers */
 #include "cdio_assert.h"
 #include "_cdio_stdio.h"
+#include "_cdio_zstream.h"
 #include "cdio_private.h"
+#include "iso9660_private.h"
 
 static const char _rcsid[] = "$Id: iso9660_fs.c,v 1.47 2008/04/18 16:02:09 karl Exp $";
 
 /* Implementation of iso9660_t type */
+/* Number of Rock Ridge continuation area sectors cached per image. The
+   entries of a directory generally share the same few of these sectors. */
+#define SU_CACHE_SIZE 8
+
+typedef struct {
+  lsn_t lsn[SU_CACHE_SIZE];
+  unsigned int i_next;
+  uint8_t buf[SU_CACHE_SIZE][ISO_BLOCKSIZE];
+} iso9660_su_cache_t;
+
 struct _iso9660_s {
   CdioDataSource_t *stream; /* Stream pointer */
   bool_3way_t b_xa;         /* true if has XA attributes. */
@@ -89,6 +101,7 @@ struct _iso9660_s {
 			       filesystem inside that it may be
 			       different.
 			     */
+  iso9660_su_cache_t *p_su_cache; /* Rock Ridge continuation sectors */
 };
 
 static long int iso9660_seek_read_framesize (const iso9660_t *p_iso, 
@@ -169,10 +182,13 @@ iso9660_open_ext_private (const char *psz_path,
 {
   iso9660_t *p_iso = (iso9660_t *) calloc(1, sizeof(iso9660_t)) ;
   bool b_have_superblock;
+  unsigned int i;
 
   if (!p_iso) return NULL;
   
-  p_iso->stream = cdio_stdio_new( psz_path );
+  p_iso->stream = cdio_zstream_new( psz_path );
+  if (NULL == p_iso->stream)
+    p_iso->stream = cdio_stdio_new( psz_path );
   if (NULL == p_iso->stream) 
     goto error;
 
@@ -183,6 +199,12 @@ iso9660_open_ext_private (const char *psz_path,
     : iso9660_ifs_read_superblock(p_iso, iso_extension_mask) ;
 
   if ( ! b_have_superblock ) goto error;
+
+  p_iso->p_su_cache = (iso9660_su_cache_t *) malloc(sizeof(iso9660_su_cache_t));
+  if (NULL == p_iso->p_su_cache) goto error;
+  for (i=0; i<SU_CACHE_SIZE; i++)
+    p_iso->p_su_cache->lsn[i] = CDIO_INVALID_LSN;
+  p_iso->p_su_cache->i_next = 0;
   
   /* Determine if image has XA attributes. */
   
@@ -196,6 +218,7 @@ iso9660_open_ext_private (const char *psz_path,
 
  error:
   if (p_iso && p_iso->stream) cdio_stdio_destroy(p_iso->stream);
+  if (p_iso) free(p_iso->p_su_cache);
   free(p_iso);
   
   return NULL;
@@ -256,11 +279,41 @@ iso9660_close (iso9660_t *p_iso)
 {
   if (NULL != p_iso) {
     cdio_stdio_destroy(p_iso->stream);
+    free(p_iso->p_su_cache);
     free(p_iso);
   }
   return true;
 }
 
+/*!
+  Read a sector holding a Rock Ridge continuation area, through the small
+  sector cache of p_iso. The returned data must not be modified, and is
+  only valid until the next call. NULL is returned on error.
+*/
+uint8_t *
+iso9660_ifs_read_su_sector(const iso9660_t *p_iso, lsn_t lsn)
+{
+  iso9660_su_cache_t *p_cache;
+  unsigned int i;
+
+  if (NULL == p_iso || NULL == p_iso->p_su_cache) return NULL;
+  p_cache = p_iso->p_su_cache;
+
+  for (i=0; i<SU_CACHE_SIZE; i++)
+    if (p_cache->lsn[i] == lsn)
+      return p_cache->buf[i];
+
+  /* Replace the oldest entry */
+  i = p_cache->i_next;
+  p_cache->i_next = (i + 1) % SU_CACHE_SIZE;
+  if (ISO_BLOCKSIZE != iso9660_iso_seek_read(p_iso, p_cache->buf[i], lsn, 1)) {
+    p_cache->lsn[i] = CDIO_INVALID_LSN;
+    return NULL;
+  }
+  p_cache->lsn[i] = lsn;
+  return p_cache->buf[i];
+}
+
 static bool
 check_pvd (const iso9660_pvd_t *p_pvd, cdio_log_level_t log_level) 
 {
@@ -709,8 +762,8 @@ iso9660_iso_seek_read (const iso9660_t *p_iso, void *ptr, lsn_t start,
 
 
 static iso9660_stat_t *
-_iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir, bool_3way_t b_xa, 
-			 uint8_t i_joliet_level)
+_iso9660_dir_to_statbuf (const iso9660_t *p_iso, iso9660_dir_t *p_iso9660_dir,
+			 bool_3way_t b_xa, uint8_t i_joliet_level)
 {
   uint8_t dir_len= iso9660_get_dir_len(p_iso9660_dir);
   iso711_t i_fname;
@@ -743,7 +796,7 @@ _iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir, bool_3way_t b_xa,
 
     int  i_rr_fname = 
 #ifdef HAVE_ROCK
-      get_rock_ridge_filename(p_iso9660_dir, rr_fname, p_stat);
+      iso9660_parse_rock_ridge(p_iso, p_iso9660_dir, rr_fname, p_stat, 0);
 #else
       0;
 #endif
@@ -911,7 +964,7 @@ _fs_stat_root (CdIo_t *p_cdio)
     p_iso9660_dir = &(p_env->pvd.root_directory_record) ;
 #endif
     
-    p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, b_xa, 
+    p_stat = _iso9660_dir_to_statbuf (NULL, p_iso9660_dir, b_xa, 
 				      p_env->i_joliet_level);
     return p_stat;
   }
@@ -932,7 +985,7 @@ _ifs_stat_root (iso9660_t *p_iso)
   p_iso9660_dir = &(p_iso->pvd.root_directory_record) ;
 #endif
   
-  p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, p_iso->b_xa,
+  p_stat = _iso9660_dir_to_statbuf (p_iso, p_iso9660_dir, p_iso->b_xa,
 				    p_iso->i_joliet_level);
   return p_stat;
 }
@@ -985,7 +1038,7 @@ _fs_stat_traverse (const CdIo_t *p_cdio, const iso9660_stat_t *_root,
 	  continue;
 	}
       
-      p_iso9660_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, dunno, 
+      p_iso9660_stat = _iso9660_dir_to_statbuf (NULL, p_iso9660_dir, dunno, 
 					p_env->i_joliet_level);
 
       cmp = strcmp(splitpath[0], p_iso9660_stat->filename);
@@ -1084,7 +1137,7 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
 	  continue;
 	}
       
-      p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, p_iso->b_xa, 
+      p_stat = _iso9660_dir_to_statbuf (p_iso, p_iso9660_dir, p_iso->b_xa, 
 					p_iso->i_joliet_level);
 
       cmp = strcmp(splitpath[0], p_stat->filename);
@@ -1290,7 +1343,7 @@ iso9660_fs_readdir (CdIo_t *p_cdio, const char psz_path[], bool b_mode2)
 	    continue;
 	  }
 
-	p_iso9660_stat = _iso9660_dir_to_statbuf(p_iso9660_dir, dunno,
+	p_iso9660_stat = _iso9660_dir_to_statbuf(NULL, p_iso9660_dir, dunno,
 						 p_env->i_joliet_level);
 	_cdio_list_append (retval, p_iso9660_stat);
 
@@ -1357,7 +1410,7 @@ iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
 	    continue;
 	  }
 
-	p_iso9660_stat = _iso9660_dir_to_statbuf(p_iso9660_dir, p_iso->b_xa,
+	p_iso9660_stat = _iso9660_dir_to_statbuf(p_iso, p_iso9660_dir, p_iso->b_xa,
 						 p_iso->i_joliet_level);
 
 	if (p_iso9660_stat) 
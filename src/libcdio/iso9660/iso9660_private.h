@@ -31,6 +31,7 @@
 #endif
 
 #include <cdio/types.h>
+#include <cdio/iso9660.h>
 
 #ifdef HAVE_STDBOOL_H
 # include <stdbool.h>
@@ -75,6 +76,25 @@ typedef struct iso_path_table_s {
 
 PRAGMA_END_PACKED
 
+/*!
+  Read a sector holding a Rock Ridge continuation area, through the small
+  sector cache of p_iso. The returned data must not be modified, and is
+  only valid until the next call. NULL is returned on error.
+*/
+uint8_t *iso9660_ifs_read_su_sector(const iso9660_t *p_iso, lsn_t lsn);
+
+/*!
+  Single pass parsing of the Rock Ridge entries of a directory record,
+  following continuation areas when p_iso is not NULL. psz_name may be
+  NULL if the Rock Ridge name is not needed.
+  @return length of name field; 0: not found, -1: to be ignored
+*/
+int iso9660_parse_rock_ridge(const iso9660_t *p_iso,
+			     iso9660_dir_t *p_iso9660_dir,
+			     /*out*/ char *psz_name,
+			     /*in/out*/ iso9660_stat_t *p_stat,
+			     int regard_xa);
+
 #endif /* CDIO_ISO0660_ISO9660_PRIVATE_H_ */
 
 
@@ -38,6 +38,7 @@
 #include <cdio/logging.h>
 #include <cdio/bytesex.h>
 #include "filemode.h"
+#include "iso9660_private.h"
 
 #define CDIO_MKDEV(ma,mi)	((ma)<<16 | (mi))
 
@@ -95,13 +96,12 @@ realloc_symlink(/*in/out*/ iso9660_stat_t *p_stat, uint8_t i_grow)
    is done correctly */
 
 #define CONTINUE_DECLS \
-  int cont_extent = 0, cont_offset = 0, cont_size = 0;   \
-  void *buffer = NULL
+  int cont_extent = 0, cont_offset = 0, cont_size = 0
 
 #define CHECK_CE				 \
-  { cont_extent = from_733(*rr->u.CE.extent);	 \
-    cont_offset = from_733(*rr->u.CE.offset);	 \
-    cont_size = from_733(*rr->u.CE.size);	 \
+  { cont_extent = from_733(rr->u.CE.extent);	 \
+    cont_offset = from_733(rr->u.CE.offset);	 \
+    cont_size = from_733(rr->u.CE.size);		 \
     (void)cont_extent; (void)cont_offset, (void)cont_size; }
 
 #define SETUP_ROCK_RIDGE(DE,CHR,LEN)	      		      	\
@@ -140,14 +140,24 @@ realloc_symlink(/*in/out*/ iso9660_stat_t *p_stat, uint8_t i_grow)
     }								  \
   }								  
 
-/*! 
-  Get
-  @return length of name field; 0: not found, -1: to be ignored 
+/* Maximum number of continuation areas followed for a single directory
+   record, as a guard against CE loops in broken images */
+#define MAX_CE_DEPTH 16
+
+/*!
+  Walk the System Use area of a directory record, along with the
+  continuation areas it points to, and extract the Rock Ridge name (NM),
+  attributes (PX), device number (PN), symlink (SL) and timestamps (TF)
+  in a single pass. Continuation areas are only followed if p_iso is
+  not NULL, and their sectors are read through the cache of p_iso.
+  @return length of name field; 0: not found, -1: to be ignored
 */
-int 
-get_rock_ridge_filename(iso9660_dir_t * p_iso9660_dir, 
-			/*out*/ char * psz_name, 
-			/*in/out*/ iso9660_stat_t *p_stat)
+int
+iso9660_parse_rock_ridge(const iso9660_t *p_iso,
+			 iso9660_dir_t * p_iso9660_dir,
+			 /*out*/ char * psz_name,
+			 /*in/out*/ iso9660_stat_t *p_stat,
+			 int regard_xa)
 {
   int len;
   unsigned char *chr;
@@ -155,12 +165,27 @@ get_rock_ridge_filename(iso9660_dir_t * p_iso9660_dir,
   CONTINUE_DECLS;
   int i_namelen = 0;
   int truncate=0;
+  int i_ce = 0;
+  iso711_t i_fname;
+  bool b_dots;
 
   if (!p_stat || nope == p_stat->rr.b3_rock) return 0;
-  *psz_name = 0;
+  if (psz_name) *psz_name = 0;
+
+  /* The CE of the '.' and '..' entries only leads to ER, which we don't need */
+  i_fname = from_711(p_iso9660_dir->filename.len);
+  b_dots = (1 == i_fname) && ('\0' == p_iso9660_dir->filename.str[1]
+			      || '\1' == p_iso9660_dir->filename.str[1]);
 
   SETUP_ROCK_RIDGE(p_iso9660_dir, chr, len);
-  /*repeat:*/
+  if (regard_xa)
+    {
+      chr+=14;
+      len-=14;
+      if (len<0) len=0;
+    }
+
+ repeat:
   {
     iso_extension_record_t * rr;
     int sig;
@@ -178,13 +203,8 @@ get_rock_ridge_filename(iso9660_dir_t * p_iso9660_dir,
 	CHECK_SP(goto out);
 	break;
       case SIG('C','E'): 
-	{
-	  iso711_t i_fname = from_711(p_iso9660_dir->filename.len);
-	  if ('\0' == p_iso9660_dir->filename.str[1] && 1 == i_fname)
-	    break;
-	  if ('\1' == p_iso9660_dir->filename.str[1] && 1 == i_fname)
-	    break;
-	}
+	if (b_dots)
+	  break;
 	CHECK_CE;
 	break;
       case SIG('E','R'):
@@ -198,7 +218,7 @@ get_rock_ridge_filename(iso9660_dir_t * p_iso9660_dir,
       case SIG('N','M'):
 	/* Alternate name */
 	p_stat->rr.b3_rock = yep;
-	if (truncate) break;
+	if (truncate || !psz_name) break;
 	if (rr->u.NM.flags & ISO_ROCK_NM_PARENT) {
 	  i_namelen = sizeof("..");
 	  strncat(psz_name, "..", i_namelen);
@@ -227,144 +247,6 @@ get_rock_ridge_filename(iso9660_dir_t * p_iso9660_dir,
 	p_stat->rr.st_gid    = from_733(rr->u.PX.st_gid);
 	p_stat->rr.b3_rock    = yep;
 	break;
-      case SIG('S','L'):
-	{
-	  /* Symbolic link */
-	  uint8_t slen;
-	  iso_rock_sl_part_t * p_sl;
-	  iso_rock_sl_part_t * p_oldsl;
-	  slen = rr->len - 5;
-	  p_sl = &rr->u.SL.link;
-	  p_stat->rr.i_symlink = symlink_len;
-	  while (slen > 1){
-	    rootflag = 0;
-	    switch(p_sl->flags &~1){
-	    case 0:
-	      realloc_symlink(p_stat, p_sl->len);
-	      memcpy(&(p_stat->rr.psz_symlink[p_stat->rr.i_symlink]),
-		     p_sl->text, p_sl->len);
-	      p_stat->rr.i_symlink += p_sl->len;
-	      break;
-	    case 4:
-	      realloc_symlink(p_stat, 1);
-	      p_stat->rr.psz_symlink[p_stat->rr.i_symlink++] = '.';
-	      /* continue into next case. */
-	    case 2:
-	      realloc_symlink(p_stat, 1);
-	      p_stat->rr.psz_symlink[p_stat->rr.i_symlink++] = '.';
-	      break;
-	    case 8:
-	      rootflag = 1;
-	      realloc_symlink(p_stat, 1);
-	      p_stat->rr.psz_symlink[p_stat->rr.i_symlink++] = '/';
-	      break;
-	    default:
-	      cdio_warn("Symlink component flag not implemented");
-	    }
-	    slen -= p_sl->len + 2;
-	    p_oldsl = p_sl;
-	    p_sl = (iso_rock_sl_part_t *) (((char *) p_sl) + p_sl->len + 2);
-	    
-	    if (slen < 2) {
-	      if (((rr->u.SL.flags & 1) != 0) && ((p_oldsl->flags & 1) == 0)) 
-		p_stat->rr.i_symlink += 1;
-	      break;
-	    }
-	    
-	    /*
-	     * If this component record isn't continued, then append a '/'.
-	     */
-	    if (!rootflag && (p_oldsl->flags & 1) == 0) {
-	      realloc_symlink(p_stat, 1);
-	      p_stat->rr.psz_symlink[p_stat->rr.i_symlink++] = '/';
-	    }
-	  }
-	}
-	symlink_len = p_stat->rr.i_symlink;
-	realloc_symlink(p_stat, 1);
-	p_stat->rr.psz_symlink[symlink_len]='\0';
-	break;
-      case SIG('R','E'):
-	free(buffer);
-	return -1;
-      case SIG('T','F'): 
-	/* Time stamp(s) for a file */
-	{
-	  int cnt = 0;
-	  add_time(ISO_ROCK_TF_CREATE,     create);
-	  add_time(ISO_ROCK_TF_MODIFY,     modify);
-	  add_time(ISO_ROCK_TF_ACCESS,     access);
-	  add_time(ISO_ROCK_TF_ATTRIBUTES, attributes);
-	  add_time(ISO_ROCK_TF_BACKUP,     backup);
-	  add_time(ISO_ROCK_TF_EXPIRATION, expiration);
-	  add_time(ISO_ROCK_TF_EFFECTIVE,  effective);
-	  p_stat->rr.b3_rock = yep;
-	  break;
-	}
-      default:
-	break;
-      }
-    }
-  }
-  free(buffer);
-  return i_namelen; /* If 0, this file did not have a NM field */
- out:
-  free(buffer);
-  return 0;
-}
-
-static int
-parse_rock_ridge_stat_internal(iso9660_dir_t *p_iso9660_dir,
-			       iso9660_stat_t *p_stat, int regard_xa)
-{
-  int len;
-  unsigned char * chr;
-  int symlink_len = 0;
-  CONTINUE_DECLS;
-
-  if (nope == p_stat->rr.b3_rock) return 0;
-
-  SETUP_ROCK_RIDGE(p_iso9660_dir, chr, len);
-  if (regard_xa)
-    {
-      chr+=14;
-      len-=14;
-      if (len<0) len=0;
-    }
-  
-  /* repeat:*/
-  {
-    int sig;
-    iso_extension_record_t * rr;
-    int rootflag;
-    
-    while (len > 1){ /* There may be one byte for padding somewhere */
-      rr = (iso_extension_record_t *) chr;
-      if (rr->len == 0) goto out; /* Something got screwed up here */
-      sig = from_721(*chr);
-      chr += rr->len; 
-      len -= rr->len;
-      
-      switch(sig){
-      case SIG('S','P'):
-	CHECK_SP(goto out);
-	break;
-      case SIG('C','E'):
-	CHECK_CE;
-	break;
-      case SIG('E','R'):
-	p_stat->rr.b3_rock = yep;
-	cdio_debug("ISO 9660 Extensions: ");
-	{ int p;
-	  for(p=0;p<rr->u.ER.len_id;p++) cdio_debug("%c",rr->u.ER.data[p]);
-	}
-	break;
-      case SIG('P','X'):
-	p_stat->rr.st_mode   = from_733(rr->u.PX.st_mode);
-	p_stat->rr.st_nlinks = from_733(rr->u.PX.st_nlinks);
-	p_stat->rr.st_uid    = from_733(rr->u.PX.st_uid);
-	p_stat->rr.st_gid    = from_733(rr->u.PX.st_gid);
-	break;
       case SIG('P','N'):
 	/* Device major,minor number */
 	{ int32_t high, low;
@@ -384,20 +266,6 @@ parse_rock_ridge_stat_internal(iso9660_dir_t *p_iso9660_dir,
 	  }
 	}
 	break;
-      case SIG('T','F'): 
-	/* Time stamp(s) for a file */
-	{
-	  int cnt = 0;
-	  add_time(ISO_ROCK_TF_CREATE,     create);
-	  add_time(ISO_ROCK_TF_MODIFY,     modify);
-	  add_time(ISO_ROCK_TF_ACCESS,     access);
-	  add_time(ISO_ROCK_TF_ATTRIBUTES, attributes);
-	  add_time(ISO_ROCK_TF_BACKUP,     backup);
-	  add_time(ISO_ROCK_TF_EXPIRATION, expiration);
-	  add_time(ISO_ROCK_TF_EFFECTIVE,  effective);
-	  p_stat->rr.b3_rock = yep;
-	  break;
-	}
       case SIG('S','L'):
 	{
 	  /* Symbolic link */
@@ -428,7 +296,6 @@ parse_rock_ridge_stat_internal(iso9660_dir_t *p_iso9660_dir,
 	      rootflag = 1;
 	      realloc_symlink(p_stat, 1);
 	      p_stat->rr.psz_symlink[p_stat->rr.i_symlink++] = '/';
-	      p_stat->rr.i_symlink++;
 	      break;
 	    default:
 	      cdio_warn("Symlink component flag not implemented");
@@ -457,40 +324,56 @@ parse_rock_ridge_stat_internal(iso9660_dir_t *p_iso9660_dir,
 	p_stat->rr.psz_symlink[symlink_len]='\0';
 	break;
       case SIG('R','E'):
-	cdio_warn("Attempt to read p_stat for relocated directory");
-	goto out;
-#ifdef FINISHED
-      case SIG('C','L'): 
+	return -1;
+      case SIG('T','F'): 
+	/* Time stamp(s) for a file */
 	{
-	  iso9660_stat_t * reloc;
-	  ISOFS_I(p_stat)->i_first_extent = from_733(rr->u.CL.location);
-	  reloc = isofs_iget(p_stat->rr.i_sb, p_stat->rr.i_first_extent, 0);
-	  if (!reloc)
-	    goto out;
-	  p_stat->rr.st_mode   = reloc->st_mode;
-	  p_stat->rr.st_nlinks = reloc->st_nlinks;
-	  p_stat->rr.st_uid    = reloc->st_uid;
-	  p_stat->rr.st_gid    = reloc->st_gid;
-	  p_stat->rr.i_rdev    = reloc->i_rdev;
-	  p_stat->rr.i_symlink = reloc->i_symlink;
-	  p_stat->rr.i_blocks  = reloc->i_blocks;
-	  p_stat->rr.i_atime   = reloc->i_atime;
-	  p_stat->rr.i_ctime   = reloc->i_ctime;
-	  p_stat->rr.i_mtime   = reloc->i_mtime;
-	  iput(reloc);
+	  int cnt = 0;
+	  add_time(ISO_ROCK_TF_CREATE,     create);
+	  add_time(ISO_ROCK_TF_MODIFY,     modify);
+	  add_time(ISO_ROCK_TF_ACCESS,     access);
+	  add_time(ISO_ROCK_TF_ATTRIBUTES, attributes);
+	  add_time(ISO_ROCK_TF_BACKUP,     backup);
+	  add_time(ISO_ROCK_TF_EXPIRATION, expiration);
+	  add_time(ISO_ROCK_TF_EFFECTIVE,  effective);
+	  p_stat->rr.b3_rock = yep;
+	  break;
 	}
-	break;
-#endif
       default:
 	break;
       }
     }
   }
+
+  /* Carry on with the continuation area, if any */
+  if (cont_size && p_iso && cont_offset < ISO_BLOCKSIZE
+      && i_ce++ < MAX_CE_DEPTH) {
+    chr = iso9660_ifs_read_su_sector(p_iso, cont_extent);
+    if (chr) {
+      chr += cont_offset;
+      len = (cont_size < ISO_BLOCKSIZE - cont_offset)
+	? cont_size : ISO_BLOCKSIZE - cont_offset;
+      cont_size = 0;
+      goto repeat;
+    }
+  }
+  return i_namelen; /* If 0, this file did not have a NM field */
  out:
-  free(buffer);
   return 0;
 }
 
+/*! 
+  Get
+  @return length of name field; 0: not found, -1: to be ignored 
+*/
+int 
+get_rock_ridge_filename(iso9660_dir_t * p_iso9660_dir, 
+			/*out*/ char * psz_name, 
+			/*in/out*/ iso9660_stat_t *p_stat)
+{
+  return iso9660_parse_rock_ridge(NULL, p_iso9660_dir, psz_name, p_stat, 0);
+}
+
 int 
 parse_rock_ridge_stat(iso9660_dir_t *p_iso9660_dir, 
 		      /*out*/ iso9660_stat_t *p_stat)
@@ -499,11 +382,11 @@ parse_rock_ridge_stat(iso9660_dir_t *p_iso9660_dir,
 
   if (!p_stat) return 0;
   
-  result = parse_rock_ridge_stat_internal(p_iso9660_dir, p_stat, 0);
+  result = iso9660_parse_rock_ridge(NULL, p_iso9660_dir, NULL, p_stat, 0);
   /* if Rock-Ridge flag was reset and we didn't look for attributes
    * behind eventual XA attributes, have a look there */
   if (0xFF == p_stat->rr.s_rock_offset && nope != p_stat->rr.b3_rock) {
-    result = parse_rock_ridge_stat_internal(p_iso9660_dir, p_stat, 14);
+    result = iso9660_parse_rock_ridge(NULL, p_iso9660_dir, NULL, p_stat, 14);
   }
   return result;
 }
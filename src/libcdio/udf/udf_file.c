@@ -106,7 +106,8 @@ udf_is_dir(const udf_dirent_t *p_udf_dirent)
 
 /*
  * Translate a file offset into a logical block and then into a physical
- * block.
+ * block. pi_max_size is set to the number of bytes left in the extent
+ * from that offset, which is as much as can be read contiguously.
  */
 static lba_t
 offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset, 
@@ -154,13 +155,13 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
 	    p_icb = (udf_short_ad_t *) 
 	      GETICB( uint32_from_le(p_udf_fe->i_extended_attr) 
 		      + ad_offset );
-	    icblen = p_icb->len;
+	    icblen = uint32_from_le(p_icb->len) & UDF_LENGTH_MASK;
 	    ad_num++;
 	  } while(i_offset >= icblen);
 	  
-	  lsector = (i_offset / UDF_BLOCKSIZE) + p_icb->pos;
+	  lsector = (i_offset / UDF_BLOCKSIZE) + uint32_from_le(p_icb->pos);
 	  
-	  *pi_max_size = p_icb->len;
+	  *pi_max_size = (uint32_t)(icblen - i_offset);
 	}
 	break;
       case ICBTAG_FLAG_AD_LONG: 
@@ -181,14 +182,14 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
 	    p_icb = (udf_long_ad_t *) 
 	      GETICB( uint32_from_le(p_udf_fe->i_extended_attr)
 		      + ad_offset );
-	    icblen = p_icb->len;
+	    icblen = uint32_from_le(p_icb->len) & UDF_LENGTH_MASK;
 	    ad_num++;
 	  } while(i_offset >= icblen);
 	
 	  lsector = (i_offset / UDF_BLOCKSIZE) +
 	    uint32_from_le(((udf_long_ad_t *)(p_icb))->loc.lba);
 	  
-	  *pi_max_size = p_icb->len;
+	  *pi_max_size = (uint32_t)(icblen - i_offset);
 	}
 	break;
       case ICBTAG_FLAG_AD_IN_ICB:
@@ -232,6 +233,10 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
   It is the caller's responsibility to ensure that count is less
   than the number of blocks recorded via p_udf_dirent.
 
+  A read never goes past the end of the extent it starts in, so for
+  a fragmented file, fewer bytes than requested may be returned, and
+  the rest must be read with another call.
+
   If there is an error, cast the result to driver_return_code_t for 
   the specific error code.
 */
@@ -248,9 +253,8 @@ udf_read_block(const udf_dirent_t *p_udf_dirent, void * buf, size_t count)
     if (i_lba != CDIO_INVALID_LBA) {
       uint32_t i_max_blocks = CEILING(i_max_size, UDF_BLOCKSIZE);
       if ( i_max_blocks < count ) {
-	  cdio_warn("read count %u is larger than %u extent size.",
+	  cdio_debug("read count %u truncated to %u, at the end of the extent",
 		  (unsigned int)count, i_max_blocks);
-	  cdio_warn("read count truncated to %u", (unsigned int)count);
 	  count = i_max_blocks;
       }
       ret = udf_read_sectors(p_udf, buf, i_lba, count);
@@ -265,3 +269,14 @@ udf_read_block(const udf_dirent_t *p_udf_dirent, void * buf, size_t count)
     }
   }
 }
+
+/*!
+  Moves the read position of p_udf_dirent back to the start of the
+  file, so that the next udf_read_block() reads it from the beginning
+  again.
+*/
+void
+udf_rewind(const udf_dirent_t *p_udf_dirent)
+{
+  p_udf_dirent->p_udf->i_position = 0;
+}
@@ -368,7 +368,9 @@ udf_open (const char *psz_path)
     /* Not a CD-ROM drive or CD Image. Maybe it's a UDF file not
        encapsulated as a CD-ROM Image (e.g. often .UDF or (sic) .ISO)
     */
-    p_udf->stream = cdio_stdio_new( psz_path );
+    p_udf->stream = cdio_zstream_new( psz_path );
+    if (!p_udf->stream)
+      p_udf->stream = cdio_stdio_new( psz_path );
     if (!p_udf->stream) 
       goto error;
     p_udf->b_stream = true;
@@ -623,26 +625,109 @@ udf_dirent_t *
 udf_opendir(const udf_dirent_t *p_udf_dirent)
 {
   if (p_udf_dirent->b_dir && !p_udf_dirent->b_parent && p_udf_dirent->fid) {
-    udf_t *p_udf = p_udf_dirent->p_udf;
-    udf_file_entry_t udf_fe;
-    
-    driver_return_code_t i_ret = 
-      udf_read_sectors(p_udf, &udf_fe, p_udf->i_part_start 
-		       + p_udf_dirent->fid->icb.loc.lba, 1);
-
-    if (DRIVER_OP_SUCCESS == i_ret 
-	&& !udf_checktag(&udf_fe.tag, TAGID_FILE_ENTRY)) {
-      
-      if (ICBTAG_FILE_TYPE_DIRECTORY == udf_fe.icb_tag.file_type) {
-	udf_dirent_t *p_udf_dirent_new = 
-	  udf_new_dirent(&udf_fe, p_udf, p_udf_dirent->psz_name, true, true);
-	return p_udf_dirent_new;
-      }
+    /* The File Entry for this FID was already loaded by udf_readdir(),
+       so there is no need to read it from the media again. */
+    const udf_file_entry_t *p_udf_fe = &p_udf_dirent->fe;
+
+    if (!udf_checktag(&p_udf_fe->tag, TAGID_FILE_ENTRY)
+	&& ICBTAG_FILE_TYPE_DIRECTORY == p_udf_fe->icb_tag.file_type) {
+      udf_dirent_t *p_udf_dirent_new = 
+	udf_new_dirent((udf_file_entry_t *)p_udf_fe, p_udf_dirent->p_udf,
+		       p_udf_dirent->psz_name, true, true);
+      return p_udf_dirent_new;
     }
   }
   return NULL;
 }
 
+static int
+udf_cmp_lba(const void *p1, const void *p2)
+{
+  const uint32_t i_lba1 = *(const uint32_t *)p1;
+  const uint32_t i_lba2 = *(const uint32_t *)p2;
+  return (i_lba1 > i_lba2) - (i_lba1 < i_lba2);
+}
+
+/*!
+  Collect the ICB locations of all the File Identifier Descriptors held
+  in the directory data that was just read, sort them, and read the
+  matching File Entries with one read per run of contiguous sectors, so
+  that udf_readdir() doesn't have to issue a scattered single sector
+  read for every entry. Failure is not fatal: udf_readdir() falls back
+  to reading the File Entries it can't find in the cache one by one.
+*/
+static void
+udf_prefetch_fe(udf_dirent_t *p_udf_dirent, uint32_t i_size)
+{
+  udf_t *p_udf = p_udf_dirent->p_udf;
+  const udf_fileid_desc_t *p_fid;
+  uint32_t i, j, n = 0, ofs = 0;
+  uint64_t i_left = p_udf_dirent->dir_left;
+
+  if (i_left > i_size)
+    i_left = i_size;
+  p_udf_dirent->fe_lba = (uint32_t *)
+    malloc(sizeof(uint32_t) * (i_size / sizeof(udf_fileid_desc_t) + 1));
+  if (!p_udf_dirent->fe_lba)
+    return;
+
+  while (ofs + sizeof(udf_fileid_desc_t) <= i_left) {
+    p_fid = (const udf_fileid_desc_t *)(p_udf_dirent->sector + ofs);
+    if (udf_checktag(&p_fid->tag, TAGID_FID))
+      break;
+    p_udf_dirent->fe_lba[n++] = p_fid->icb.loc.lba;
+    ofs += 4 * ((sizeof(*p_fid) + p_fid->u.i_imp_use + p_fid->i_file_id + 3) / 4);
+  }
+  if (n == 0)
+    return;
+
+  /* Sort and remove duplicates (hard links) */
+  qsort(p_udf_dirent->fe_lba, n, sizeof(uint32_t), udf_cmp_lba);
+  for (i = 1, j = 1; i < n; i++) {
+    if (p_udf_dirent->fe_lba[i] != p_udf_dirent->fe_lba[j-1])
+      p_udf_dirent->fe_lba[j++] = p_udf_dirent->fe_lba[i];
+  }
+  n = j;
+
+  p_udf_dirent->fe_cache = (uint8_t *) malloc((size_t)n * UDF_BLOCKSIZE);
+  if (!p_udf_dirent->fe_cache)
+    return;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; (j < n)
+	   && (p_udf_dirent->fe_lba[j] == p_udf_dirent->fe_lba[j-1] + 1); j++);
+    if (DRIVER_OP_SUCCESS !=
+	udf_read_sectors(p_udf, &p_udf_dirent->fe_cache[(size_t)i * UDF_BLOCKSIZE],
+			 p_udf->i_part_start + p_udf_dirent->fe_lba[i], j - i)) {
+      free_and_null(p_udf_dirent->fe_cache);
+      return;
+    }
+  }
+  p_udf_dirent->i_fe_count = n;
+}
+
+/*!
+  Copy the prefetched File Entry located at i_lba into p_udf_fe.
+  Return false if that entry is not in the prefetch cache.
+*/
+static bool
+udf_get_prefetched_fe(const udf_dirent_t *p_udf_dirent, uint32_t i_lba,
+		      /*out*/ udf_file_entry_t *p_udf_fe)
+{
+  const uint32_t *p_lba;
+
+  if (!p_udf_dirent->i_fe_count || !p_udf_dirent->fe_cache)
+    return false;
+  p_lba = (const uint32_t *) bsearch(&i_lba, p_udf_dirent->fe_lba,
+				     p_udf_dirent->i_fe_count,
+				     sizeof(uint32_t), udf_cmp_lba);
+  if (!p_lba)
+    return false;
+  memcpy(p_udf_fe, &p_udf_dirent->fe_cache[(size_t)(p_lba - p_udf_dirent->fe_lba)
+					   * UDF_BLOCKSIZE], UDF_BLOCKSIZE);
+  return true;
+}
+
 udf_dirent_t *
 udf_readdir(udf_dirent_t *p_udf_dirent)
 {
@@ -679,9 +764,11 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
     i_ret = udf_read_sectors(p_udf, p_udf_dirent->sector, 
 			     p_udf_dirent->i_part_start+p_udf_dirent->i_loc, 
 			     i_sectors);
-    if (DRIVER_OP_SUCCESS == i_ret)
+    if (DRIVER_OP_SUCCESS == i_ret) {
       p_udf_dirent->fid = (udf_fileid_desc_t *) p_udf_dirent->sector;
-    else
+      if (!p_udf_dirent->fe_lba)
+	udf_prefetch_fe(p_udf_dirent, size);
+    } else
       p_udf_dirent->fid = NULL;
   }
   
@@ -700,7 +787,9 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
       {
 	const unsigned int i_len = p_udf_dirent->fid->i_file_id;
 
-	if (DRIVER_OP_SUCCESS != udf_read_sectors(p_udf, &p_udf_dirent->fe, p_udf->i_part_start 
+	if (!udf_get_prefetched_fe(p_udf_dirent, p_udf_dirent->fid->icb.loc.lba,
+				   &p_udf_dirent->fe)
+	    && DRIVER_OP_SUCCESS != udf_read_sectors(p_udf, &p_udf_dirent->fe, p_udf->i_part_start 
 			 + p_udf_dirent->fid->icb.loc.lba, 1)) {
 		udf_dirent_free(p_udf_dirent);
 		return NULL;
@@ -730,6 +819,8 @@ udf_dirent_free(udf_dirent_t *p_udf_dirent)
     p_udf_dirent->fid = NULL;
     free_and_null(p_udf_dirent->psz_name);
     free_and_null(p_udf_dirent->sector);
+    free_and_null(p_udf_dirent->fe_lba);
+    free_and_null(p_udf_dirent->fe_cache);
     free_and_null(p_udf_dirent);
   }
   return true;
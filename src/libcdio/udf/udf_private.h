@@ -31,6 +31,7 @@
 #include <cdio/ecma_167.h>
 #include <cdio/udf.h>
 #include "_cdio_stdio.h"
+#include "_cdio_zstream.h"
 
 /* Implementation of opaque types */
 
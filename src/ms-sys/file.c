@@ -17,6 +17,7 @@
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 ******************************************************************/
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -30,6 +31,7 @@ int64_t write_sectors(HANDLE hDrive, uint64_t SectorSize,
 {
    LARGE_INTEGER ptr;
    DWORD Size;
+   uint64_t ts;
 
    if((nSectors*SectorSize) > 0xFFFFFFFFUL)
    {
@@ -45,13 +47,16 @@ int64_t write_sectors(HANDLE hDrive, uint64_t SectorSize,
       return -1;
    }
 
+   ts = IOStatsTimestamp();
    if((!WriteFile(hDrive, pBuf, Size, &Size, NULL)) || (Size != nSectors*SectorSize))
    {
+      IOStatsRecord(IOS_DEVICE_WRITE, Size, ts);
       uprintf("write_sectors: Write error - %s\n", WindowsErrorString());
       uprintf("  Wrote: %d, Expected: %d\n",  Size, nSectors*SectorSize);
       uprintf("  StartSector:%0X, nSectors:%0X, SectorSize:%0X\n", StartSector, nSectors, SectorSize);
       return Size;
    }
+   IOStatsRecord(IOS_DEVICE_WRITE, Size, ts);
 
    return (int64_t)Size;
 }
@@ -63,6 +68,7 @@ int64_t read_sectors(HANDLE hDrive, uint64_t SectorSize,
 {
    LARGE_INTEGER ptr;
    DWORD Size;
+   uint64_t ts;
 
    if((nSectors*SectorSize) > 0xFFFFFFFFUL)
    {
@@ -78,12 +84,14 @@ int64_t read_sectors(HANDLE hDrive, uint64_t SectorSize,
       return -1;
    }
 
+   ts = IOStatsTimestamp();
    if((!ReadFile(hDrive, pBuf, Size, &Size, NULL)) || (Size != nSectors*SectorSize))
    {
       uprintf("read_sectors: Read error - %s\n", WindowsErrorString());
       uprintf("  Read: %d, Expected: %d\n",  Size, nSectors*SectorSize);
       uprintf("  StartSector:%0X, nSectors:%0X, SectorSize:%0X\n", StartSector, nSectors, SectorSize);
    }
+   IOStatsRecord(IOS_DEVICE_READ, Size, ts);
 
    return (int64_t)Size;
 }
@@ -93,7 +101,167 @@ int64_t read_sectors(HANDLE hDrive, uint64_t SectorSize,
  * fp->_ptr: a Windows handle
  * fp->_bufsiz: the sector size
  * fp->_cnt: a file offset
+ * fp->_base: an optional sector cache (see begin_sector_cache)
  */
+
+typedef struct
+{
+   uint64_t Sector;
+   int Dirty;
+   unsigned char *pData;
+} sector_cache_entry;
+
+typedef struct
+{
+   int NumEntries;
+   sector_cache_entry Entry[MAX_CACHED_SECTORS];
+} sector_cache;
+
+static sector_cache_entry *find_cached_sector(sector_cache *pCache, uint64_t Sector)
+{
+   int i;
+
+   for(i=0; i<pCache->NumEntries; i++)
+      if(pCache->Entry[i].Sector == Sector)
+         return &pCache->Entry[i];
+   return NULL;
+}
+
+/* Makes sure that all of the sectors of a range are cached, with a single read
+   of the whole range if any of them is missing */
+static int cache_sectors(FILE *fp, uint64_t StartSector, uint64_t NumSectors)
+{
+   unsigned char aucBuf[MAX_DATA_LEN];
+   sector_cache *pCache = (sector_cache*)fp->_base;
+   HANDLE hDrive = (HANDLE)fp->_ptr;
+   uint64_t SectorSize = (uint64_t)fp->_bufsiz;
+   sector_cache_entry *pEntry;
+   uint64_t i;
+
+   for(i=0; i<NumSectors; i++)
+      if(find_cached_sector(pCache, StartSector+i) == NULL)
+         break;
+   if(i == NumSectors)
+      return 1;
+
+   if(pCache->NumEntries + NumSectors > MAX_CACHED_SECTORS)
+   {
+      uprintf("cache_sectors: please increase MAX_CACHED_SECTORS in file.h\n");
+      return 0;
+   }
+
+   if(read_sectors(hDrive, SectorSize, StartSector,
+                     NumSectors, aucBuf) <= 0)
+      return 0;
+
+   for(i=0; i<NumSectors; i++)
+   {
+      /* Don't overwrite a sector we already have, as it may have been modified */
+      if(find_cached_sector(pCache, StartSector+i) != NULL)
+         continue;
+      pEntry = &pCache->Entry[pCache->NumEntries];
+      pEntry->pData = (unsigned char*)malloc((size_t)SectorSize);
+      if(pEntry->pData == NULL)
+         return 0;
+      memcpy(pEntry->pData, &aucBuf[i*SectorSize], (size_t)SectorSize);
+      pEntry->Sector = StartSector+i;
+      pEntry->Dirty = 0;
+      pCache->NumEntries++;
+   }
+   return 1;
+}
+
+/* Copies a range of cached sectors to pBuf or, if bWrite is set, updates the
+   cached sectors with the content of pBuf */
+static int copy_cached_sectors(FILE *fp, uint64_t StartSector, uint64_t NumSectors,
+                               unsigned char *pBuf, int bWrite)
+{
+   sector_cache *pCache = (sector_cache*)fp->_base;
+   size_t SectorSize = (size_t)fp->_bufsiz;
+   sector_cache_entry *pEntry;
+   uint64_t i;
+
+   if(!cache_sectors(fp, StartSector, NumSectors))
+      return 0;
+
+   for(i=0; i<NumSectors; i++)
+   {
+      pEntry = find_cached_sector(pCache, StartSector+i);
+      if(bWrite)
+      {
+         memcpy(pEntry->pData, &pBuf[i*SectorSize], SectorSize);
+         pEntry->Dirty = 1;
+      }
+      else
+      {
+         memcpy(&pBuf[i*SectorSize], pEntry->pData, SectorSize);
+      }
+   }
+   return 1;
+}
+
+static int compare_cached_sectors(const void *p1, const void *p2)
+{
+   const sector_cache_entry *pEntry1 = (const sector_cache_entry*)p1;
+   const sector_cache_entry *pEntry2 = (const sector_cache_entry*)p2;
+
+   if(pEntry1->Sector == pEntry2->Sector)
+      return 0;
+   return (pEntry1->Sector < pEntry2->Sector)?-1:1;
+}
+
+int begin_sector_cache(FILE *fp)
+{
+   if(fp->_base != NULL)
+      return 1;
+   fp->_base = (char*)calloc(1, sizeof(sector_cache));
+   return (fp->_base != NULL);
+}
+
+int flush_sector_cache(FILE *fp)
+{
+   sector_cache *pCache = (sector_cache*)fp->_base;
+   HANDLE hDrive = (HANDLE)fp->_ptr;
+   uint64_t SectorSize = (uint64_t)fp->_bufsiz;
+   unsigned char *pBuf = NULL;
+   int i, j, r = 1;
+
+   if(pCache == NULL)
+      return 1;
+
+   qsort(pCache->Entry, pCache->NumEntries, sizeof(sector_cache_entry),
+         compare_cached_sectors);
+   pBuf = (unsigned char*)malloc((size_t)(pCache->NumEntries*SectorSize));
+   if(pBuf == NULL)
+   {
+      uprintf("flush_sector_cache: could not allocate buffer\n");
+      r = 0;
+   }
+
+   for(i=0; (r) && (i<pCache->NumEntries); i=j)
+   {
+      if(!pCache->Entry[i].Dirty)
+      {
+         j = i+1;
+         continue;
+      }
+      /* Coalesce a run of adjacent dirty sectors into a single write */
+      for(j=i; (j<pCache->NumEntries) && (pCache->Entry[j].Dirty) &&
+          (pCache->Entry[j].Sector == pCache->Entry[i].Sector+(j-i)); j++)
+         memcpy(&pBuf[(j-i)*SectorSize], pCache->Entry[j].pData, (size_t)SectorSize);
+      if(write_sectors(hDrive, SectorSize, pCache->Entry[i].Sector,
+                        j-i, pBuf) <= 0)
+         r = 0;
+   }
+
+   for(i=0; i<pCache->NumEntries; i++)
+      free(pCache->Entry[i].pData);
+   free(pBuf);
+   free(pCache);
+   fp->_base = NULL;
+   return r;
+}
+
 int contains_data(FILE *fp, uint64_t Position,
                   const void *pData, uint64_t Len)
 {
@@ -119,7 +287,12 @@ int contains_data(FILE *fp, uint64_t Position,
       return 0;
    }
 
-   if(read_sectors(hDrive, SectorSize, StartSector,
+   if(fp->_base != NULL)
+   {
+      if(!copy_cached_sectors(fp, StartSector, NumSectors, aucBuf, 0))
+         return 0;
+   }
+   else if(read_sectors(hDrive, SectorSize, StartSector,
                      NumSectors, aucBuf) <= 0)
       return 0;
 
@@ -128,7 +301,8 @@ int contains_data(FILE *fp, uint64_t Position,
    return 1;
 } /* contains_data */
 
-/* May read/write the same sector many times, but compatible with existing ms-sys */
+/* May read/write the same sector many times, unless a sector cache is used, but
+   compatible with existing ms-sys */
 int write_data(FILE *fp, uint64_t Position,
                const void *pData, uint64_t Len)
 {
@@ -155,13 +329,22 @@ int write_data(FILE *fp, uint64_t Position,
    }
 
    /* Data to write may not be aligned on a sector boundary => read into a sector buffer first */
-   if(read_sectors(hDrive, SectorSize, StartSector,
+   if(fp->_base != NULL)
+   {
+      if(!copy_cached_sectors(fp, StartSector, NumSectors, aucBuf, 0))
+         return 0;
+   }
+   else if(read_sectors(hDrive, SectorSize, StartSector,
                      NumSectors, aucBuf) <= 0)
       return 0;
 
    if(!memcpy(&aucBuf[Position - StartSector*SectorSize], pData, (size_t)Len))
       return 0;
 
+   /* With a cache, the sectors are only written when the cache is flushed */
+   if(fp->_base != NULL)
+      return copy_cached_sectors(fp, StartSector, NumSectors, aucBuf, 1);
+
    if(write_sectors(hDrive, SectorSize, StartSector,
                      NumSectors, aucBuf) <= 0)
       return 0;
@@ -6,6 +6,9 @@
 /* Max valid value of uiLen for contains_data */
 #define MAX_DATA_LEN 8192
 
+/* Max number of sectors that can be held by a sector cache */
+#define MAX_CACHED_SECTORS 64
+
 /* Checks if a file contains a data pattern of length Len at position
    Position. The file pointer will change when calling this function! */
 int contains_data(FILE *fp, uint64_t Position,
@@ -16,6 +19,17 @@ int contains_data(FILE *fp, uint64_t Position,
 int write_data(FILE *fp, uint64_t Position,
                const void *pData, uint64_t Len);
 
+/* Enables write-back caching for fp. Until flush_sector_cache() is called,
+   contains_data() and write_data() only read each sector from the device once
+   and keep all modifications in memory. Returns 0 if the cache could not be
+   allocated, in which case fp is left uncached. */
+int begin_sector_cache(FILE *fp);
+
+/* Writes all the sectors modified through fp once, in LBA order, coalescing
+   adjacent sectors into a single write, then releases the cache. Does
+   nothing if fp is not cached. Returns 0 on error. */
+int flush_sector_cache(FILE *fp);
+
 /* Writes nSectors of size SectorSize starting at sector StartSector */
 int64_t write_sectors(void *hDrive, uint64_t SectorSize,
                       uint64_t StartSector, uint64_t nSectors,
@@ -326,6 +326,20 @@ static __inline BOOL DeleteFileU(const char* lpFileName)
 	return ret;
 }
 
+static __inline BOOL MoveFileExU(const char* lpExistingFileName, const char* lpNewFileName, DWORD dwFlags)
+{
+	BOOL ret = FALSE;
+	DWORD err = ERROR_INVALID_DATA;
+	wconvert(lpExistingFileName);
+	wconvert(lpNewFileName);
+	ret = MoveFileExW(wlpExistingFileName, wlpNewFileName, dwFlags);
+	err = GetLastError();
+	wfree(lpExistingFileName);
+	wfree(lpNewFileName);
+	SetLastError(err);
+	return ret;
+}
+
 // This function differs from regular GetTextExtentPoint in that it uses a zero terminated string
 static __inline BOOL GetTextExtentPointU(HDC hdc, const char* lpString, LPSIZE lpSize)
 {
@@ -37,6 +37,20 @@
 
 /* Maximum download chunk size, in bytes */
 #define DOWNLOAD_BUFFER_SIZE    10240
+/* Size of the ranges requested by the parallel downloader */
+#define DOWNLOAD_CHUNK_SIZE     (1024*1024)
+/* Number of concurrent connections for a download */
+#define DOWNLOAD_THREADS        4
+/* Number of times a dropped range request is reissued */
+#define DOWNLOAD_RETRIES        5
+/* Number of times a download is restarted, if the remote file changes while it is in progress */
+#define DOWNLOAD_RESTARTS       2
+/* Partial download, and its chunk map */
+#define DOWNLOAD_PART_EXT       ".part"
+#define DOWNLOAD_MAP_EXT        ".map"
+#define DOWNLOAD_MAP_MAGIC      0x50414D44	// "DMAP"
+#define DOWNLOAD_REQUEST_FLAGS  (INTERNET_FLAG_HYPERLINK|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP| \
+	INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|INTERNET_FLAG_NO_COOKIES|INTERNET_FLAG_NO_UI|INTERNET_FLAG_NO_CACHE_WRITE)
 /* Default delay between update checks (1 day) */
 #define DEFAULT_UPDATE_INTERVAL (24*3600)
 
@@ -74,6 +88,12 @@ static BOOL force_update_check = FALSE;
 #if !defined(ERROR_INTERNET_LOGIN_FAILURE_DISPLAY_ENTITY_BODY)
 #define ERROR_INTERNET_LOGIN_FAILURE_DISPLAY_ENTITY_BODY (INTERNET_ERROR_BASE + 174)
 #endif
+#if !defined(INTERNET_OPTION_MAX_CONNS_PER_SERVER)
+#define INTERNET_OPTION_MAX_CONNS_PER_SERVER 73
+#endif
+#if !defined(INTERNET_OPTION_MAX_CONNS_PER_1_0_SERVER)
+#define INTERNET_OPTION_MAX_CONNS_PER_1_0_SERVER 74
+#endif
 
 /*
  * FormatMessage does not handle internet errors
@@ -231,27 +251,418 @@ const char* WinInetErrorString(void)
 	}
 }
 
+/*
+ * Parallel download support: the file is split into DOWNLOAD_CHUNK_SIZE chunks that
+ * are requested, through HTTP range requests, by DOWNLOAD_THREADS concurrent workers
+ * and written in place into a preallocated '.part' file, that only gets renamed once
+ * complete and verified. The list of completed chunks is saved alongside the partial
+ * file, so that an interrupted download can be resumed.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t chunk_size;
+	uint64_t size;
+	char validator[128];	// ETag or Last-Modified value of the remote file
+} DOWNLOAD_MAP_HEADER;
+
+typedef struct {
+	HINTERNET hConnection;
+	const char* path;
+	HANDLE hFile;
+	uint64_t size;
+	uint32_t nb_chunks;
+	uint8_t* done;						// one byte per chunk, set once the chunk is on disk
+	volatile LONG next_chunk;			// next chunk to hand out to a worker
+	volatile LONG nb_done;				// number of chunks completed
+	volatile LONG partial[DOWNLOAD_THREADS];	// bytes of the current chunk, per worker
+	volatile LONG error;				// set by the first worker that gives up
+	volatile LONG changed;				// set if the remote file no longer matches the validator
+	char validator[128];
+} DOWNLOAD_STATE;
+
+typedef struct {
+	DOWNLOAD_STATE* dl;
+	int id;
+} DOWNLOAD_WORKER;
+
+/*
+ * Load the chunk map of a previous download attempt. Returns the number of chunks that
+ * can be reused, which is 0 unless the remote file still has the same size and validator.
+ */
+static uint32_t LoadDownloadMap(const char* map_path, DOWNLOAD_STATE* dl)
+{
+	FILE* fd;
+	DOWNLOAD_MAP_HEADER hdr;
+	uint8_t bits;
+	uint32_t i, nb_done = 0;
+
+	if (dl->validator[0] == 0)
+		return 0;
+	fd = fopenU(map_path, "rb");
+	if (fd == NULL)
+		return 0;
+	if ( (fread(&hdr, sizeof(hdr), 1, fd) != 1) || (hdr.magic != DOWNLOAD_MAP_MAGIC)
+	  || (hdr.chunk_size != DOWNLOAD_CHUNK_SIZE) || (hdr.size != dl->size)
+	  || (strncmp(hdr.validator, dl->validator, sizeof(hdr.validator)) != 0) ) {
+		uprintf("Remote file has changed since the last attempt - restarting download\n");
+		goto out;
+	}
+	for (i=0; i<dl->nb_chunks; i++) {
+		if ((i%8 == 0) && (fread(&bits, 1, 1, fd) != 1))
+			break;
+		dl->done[i] = (bits>>(i%8)) & 1;
+		nb_done += dl->done[i];
+	}
+	if (i != dl->nb_chunks) {
+		memset(dl->done, 0, dl->nb_chunks);
+		nb_done = 0;
+	}
+out:
+	fclose(fd);
+	return nb_done;
+}
+
+/*
+ * The chunks are only recorded as done once their data has been flushed to disk,
+ * else a crash could leave a map that claims data the partial file doesn't have.
+ * So the map is built first, and only the chunks that were complete at that point,
+ * and are therefore covered by the flush that follows, get recorded.
+ */
+static BOOL SaveDownloadMap(const char* map_path, DOWNLOAD_STATE* dl)
+{
+	FILE* fd = NULL;
+	DOWNLOAD_MAP_HEADER hdr;
+	uint8_t* bits;
+	uint32_t i;
+	BOOL r = FALSE;
+
+	if (dl->validator[0] == 0)
+		return FALSE;
+	bits = (uint8_t*)calloc((dl->nb_chunks + 7) / 8, 1);
+	if (bits == NULL)
+		return FALSE;
+	for (i=0; i<dl->nb_chunks; i++)
+		bits[i/8] |= (dl->done[i] & 1)<<(i%8);
+	if ( (dl->hFile != NULL) && (dl->hFile != INVALID_HANDLE_VALUE) && (!FlushFileBuffers(dl->hFile)) ) {
+		uprintf("Could not flush the partial download: %s\n", WindowsErrorString());
+		goto out;
+	}
+	fd = fopenU(map_path, "wb");
+	if (fd == NULL)
+		goto out;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = DOWNLOAD_MAP_MAGIC;
+	hdr.chunk_size = DOWNLOAD_CHUNK_SIZE;
+	hdr.size = dl->size;
+	safe_strcpy(hdr.validator, sizeof(hdr.validator), dl->validator);
+	r = (fwrite(&hdr, sizeof(hdr), 1, fd) == 1) && (fwrite(bits, (dl->nb_chunks + 7) / 8, 1, fd) == 1);
+out:
+	if (fd != NULL)
+		fclose(fd);
+	free(bits);
+	return r;
+}
+
+/*
+ * Issue a request for bytes [first, last] of the remote file
+ */
+static HINTERNET OpenRangeRequest(DOWNLOAD_STATE* dl, uint64_t first, uint64_t last)
+{
+	HINTERNET hRequest;
+	DWORD dwSize, dwStatus = 0;
+	char header[192];
+
+	hRequest = HttpOpenRequestA(dl->hConnection, "GET", dl->path, NULL, NULL, (const char**)"*/*\0",
+		DOWNLOAD_REQUEST_FLAGS, (DWORD_PTR)NULL);
+	if (hRequest == NULL)
+		return NULL;
+	// If-Range makes the server send the whole file (status 200) if it changed under us
+	safe_sprintf(header, sizeof(header), "Range: bytes=%" PRIu64 "-%" PRIu64 "\r\n%s%s%s", first, last,
+		(dl->validator[0] != 0)?"If-Range: ":"", dl->validator, (dl->validator[0] != 0)?"\r\n":"");
+	dwSize = sizeof(dwStatus);
+	if ( (!HttpSendRequestA(hRequest, header, (DWORD)-1, NULL, 0))
+	  || (!HttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE|HTTP_QUERY_FLAG_NUMBER, (LPVOID)&dwStatus, &dwSize, NULL))
+	  || (dwStatus != 206) ) {
+		if ((dwStatus == 200) && (dl->validator[0] != 0)) {
+			// No point in retrying: the data we already have is stale
+			if (InterlockedExchange(&dl->changed, TRUE) == FALSE)
+				uprintf("Remote file has changed during the download\n");
+			InterlockedCompareExchange(&dl->error, ERROR_INTERNET_CONNECTION_ABORTED, 0);
+		} else if (dwStatus != 0) {
+			uprintf("Range request failed. Server status %d\n", dwStatus);
+		}
+		InternetCloseHandle(hRequest);
+		return NULL;
+	}
+	return hRequest;
+}
+
+/*
+ * Worker thread: fetch chunks until there are none left. A dropped connection is
+ * retried from where it stopped, up to DOWNLOAD_RETRIES times per chunk.
+ */
+static DWORD WINAPI DownloadChunksThread(LPVOID param)
+{
+	DOWNLOAD_WORKER* w = (DOWNLOAD_WORKER*)param;
+	DOWNLOAD_STATE* dl = w->dl;
+	HINTERNET hRequest = NULL;
+	unsigned char* buf;
+	uint64_t start, end, got;
+	DWORD dwDownloaded, dwWritten;
+	OVERLAPPED overlapped;
+	LONG chunk;
+	int retries;
+
+	buf = (unsigned char*)malloc(DOWNLOAD_BUFFER_SIZE);
+	if (buf == NULL) {
+		InterlockedCompareExchange(&dl->error, ERROR_NOT_ENOUGH_MEMORY, 0);
+		ExitThread(0);
+	}
+
+	while ((dl->error == 0) && (!IS_ERROR(FormatStatus))) {
+		chunk = InterlockedIncrement(&dl->next_chunk) - 1;
+		if (chunk >= (LONG)dl->nb_chunks)
+			break;
+		if (dl->done[chunk])
+			continue;
+		start = (uint64_t)chunk * DOWNLOAD_CHUNK_SIZE;
+		end = min(start + DOWNLOAD_CHUNK_SIZE, dl->size);
+		got = 0;
+		retries = 0;
+		while (start + got < end) {
+			if ((dl->error != 0) || IS_ERROR(FormatStatus))
+				goto out;
+			if (hRequest == NULL)
+				hRequest = OpenRangeRequest(dl, start + got, end - 1);
+			if (dl->changed)
+				goto out;
+			if ( (hRequest == NULL) || (!InternetReadFile(hRequest, buf,
+				(DWORD)min(DOWNLOAD_BUFFER_SIZE, end - start - got), &dwDownloaded)) || (dwDownloaded == 0) ) {
+				// Reissue the request for the remainder of the chunk
+				if (hRequest != NULL) {
+					InternetCloseHandle(hRequest);
+					hRequest = NULL;
+				}
+				if (++retries > DOWNLOAD_RETRIES) {
+					uprintf("Giving up on chunk %d: %s\n", chunk, WinInetErrorString());
+					InterlockedCompareExchange(&dl->error, ERROR_INTERNET_CONNECTION_ABORTED, 0);
+					goto out;
+				}
+				uprintf("Connection lost on chunk %d - retrying (%d/%d)\n", chunk, retries, DOWNLOAD_RETRIES);
+				Sleep(500*retries);
+				continue;
+			}
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.Offset = (DWORD)(start + got);
+			overlapped.OffsetHigh = (DWORD)((start + got) >> 32);
+			if ((!WriteFile(dl->hFile, buf, dwDownloaded, &dwWritten, &overlapped)) || (dwWritten != dwDownloaded)) {
+				uprintf("Error writing downloaded data: %s\n", WindowsErrorString());
+				InterlockedCompareExchange(&dl->error, ERROR_WRITE_FAULT, 0);
+				goto out;
+			}
+			got += dwDownloaded;
+			dl->partial[w->id] = (LONG)got;
+		}
+		InternetCloseHandle(hRequest);
+		hRequest = NULL;
+		dl->done[chunk] = 1;
+		InterlockedIncrement(&dl->nb_done);
+		dl->partial[w->id] = 0;
+	}
+
+out:
+	if (hRequest != NULL)
+		InternetCloseHandle(hRequest);
+	dl->partial[w->id] = 0;
+	free(buf);
+	ExitThread(0);
+}
+
+static void DownloadProgress(HWND hProgressBar, uint64_t current, uint64_t total, DWORD start_time)
+{
+	LARGE_INTEGER speed;
+	DWORD elapsed = GetTickCount() - start_time;
+
+	speed.QuadPart = (elapsed == 0)?0:(LONGLONG)((current * 1000) / elapsed);
+	SendMessage(hProgressBar, PBM_SETPOS, (WPARAM)(MAX_PROGRESS*((1.0f*current)/(1.0f*total))), 0);
+	PrintStatus(0, FALSE, "Downloading: %0.1f%% (%s/s)\n", (100.0f*current)/(1.0f*total), SizeToHumanReadable(speed));
+}
+
+/*
+ * Download a file that supports range requests, into a preallocated file, resuming
+ * from a previous attempt if possible. The chunk map is kept on failure, unless the
+ * remote file changed, in which case both the partial file and its map are discarded.
+ */
+static BOOL DownloadRanges(DOWNLOAD_STATE* dl, const char* file, HWND hProgressBar)
+{
+	BOOL r = FALSE;
+	char map_path[MAX_PATH];
+	HANDLE hThread[DOWNLOAD_THREADS] = {0};
+	DOWNLOAD_WORKER worker[DOWNLOAD_THREADS];
+	LARGE_INTEGER li;
+	uint64_t current, resumed;
+	DWORD start_time, last_save;
+	int i, nb_threads = 0;
+
+	safe_sprintf(map_path, sizeof(map_path), "%s" DOWNLOAD_MAP_EXT, file);
+	dl->nb_chunks = (uint32_t)((dl->size + DOWNLOAD_CHUNK_SIZE - 1) / DOWNLOAD_CHUNK_SIZE);
+	dl->done = (uint8_t*)calloc(dl->nb_chunks, 1);
+	if (dl->done == NULL) {
+		error_code = ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	// Only reuse the existing file if its chunk map is still valid
+	resumed = LoadDownloadMap(map_path, dl);
+	dl->hFile = CreateFileU(file, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		(resumed != 0)?OPEN_ALWAYS:CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (dl->hFile == INVALID_HANDLE_VALUE) {
+		uprintf("Unable to create file %s: %s\n", file, WindowsErrorString());
+		goto out;
+	}
+	if ((resumed != 0) && (GetLastError() != ERROR_ALREADY_EXISTS)) {
+		// The map outlived the partial file
+		memset(dl->done, 0, dl->nb_chunks);
+		resumed = 0;
+	}
+	li.QuadPart = dl->size;
+	if ((!SetFilePointerEx(dl->hFile, li, NULL, FILE_BEGIN)) || (!SetEndOfFile(dl->hFile))) {
+		uprintf("Unable to preallocate %s: %s\n", file, WindowsErrorString());
+		goto out;
+	}
+	if (resumed != 0)
+		uprintf("Resuming download: %d of %d chunks already present\n", (int)resumed, dl->nb_chunks);
+	dl->nb_done = (LONG)resumed;
+	// Make sure the map exists from the start, so that a crash also leaves a resumable file
+	SaveDownloadMap(map_path, dl);
+
+	for (i=0; i<DOWNLOAD_THREADS; i++) {
+		worker[i].dl = dl;
+		worker[i].id = i;
+		hThread[nb_threads] = CreateThread(NULL, 0, DownloadChunksThread, &worker[i], 0, NULL);
+		if (hThread[nb_threads] == NULL) {
+			uprintf("Unable to start download thread: %s\n", WindowsErrorString());
+			break;
+		}
+		nb_threads++;
+	}
+	if (nb_threads == 0)
+		goto out;
+
+	start_time = last_save = GetTickCount();
+	while (WaitForMultipleObjects(nb_threads, hThread, TRUE, 250) == WAIT_TIMEOUT) {
+		current = (uint64_t)(dl->nb_done - (LONG)resumed) * DOWNLOAD_CHUNK_SIZE;
+		for (i=0; i<DOWNLOAD_THREADS; i++)
+			current += dl->partial[i];
+		DownloadProgress(hProgressBar, min(resumed * DOWNLOAD_CHUNK_SIZE + current, dl->size), dl->size, start_time);
+		if (GetTickCount() - last_save > 2000) {
+			SaveDownloadMap(map_path, dl);
+			last_save = GetTickCount();
+		}
+	}
+
+	if (IS_ERROR(FormatStatus) || (dl->changed))
+		goto out;
+	if ((dl->error != 0) || (dl->nb_done != (LONG)dl->nb_chunks)) {
+		error_code = (dl->error != 0)?dl->error:ERROR_INTERNET_CONNECTION_ABORTED;
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		uprintf("Could not download complete file - %d of %d chunks received\n", dl->nb_done, dl->nb_chunks);
+		goto out;
+	}
+	li.QuadPart = (dl->size - resumed * DOWNLOAD_CHUNK_SIZE) * 1000 / max(GetTickCount() - start_time, 1);
+	uprintf("Downloaded %d chunks with %d connections, at %s/s\n", dl->nb_chunks - (uint32_t)resumed,
+		nb_threads, SizeToHumanReadable(li));
+	r = TRUE;
+
+out:
+	for (i=0; i<nb_threads; i++) {
+		// Workers check FormatStatus and the shared error, so they terminate on their own
+		WaitForSingleObject(hThread[i], INFINITE);
+		CloseHandle(hThread[i]);
+	}
+	if ((r) || (dl->changed)) {
+		DeleteFileU(map_path);
+	} else if (dl->done != NULL) {
+		SaveDownloadMap(map_path, dl);
+	}
+	safe_free(dl->done);
+	if ((dl->hFile != NULL) && (dl->hFile != INVALID_HANDLE_VALUE))
+		CloseHandle(dl->hFile);
+	dl->hFile = NULL;
+	if (dl->changed)
+		DeleteFileU(file);
+	return r;
+}
+
+/*
+ * Compare the SHA-1 of a file against the hexadecimal string provided
+ */
+static BOOL CheckFileSha1(const char* file, const char* sha1)
+{
+	HCRYPTPROV hProv = 0;
+	HCRYPTHASH hHash = 0;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	unsigned char buf[DOWNLOAD_BUFFER_SIZE], hash[20];
+	char str[2*sizeof(hash)+1];
+	DWORD i, dwSize;
+	BOOL r = FALSE;
+
+	hFile = CreateFileU(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		goto out;
+	if ( (!CryptAcquireContext(&hProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+	  || (!CryptCreateHash(hProv, CALG_SHA1, 0, 0, &hHash)) ) {
+		uprintf("Unable to initialize SHA-1: %s\n", WindowsErrorString());
+		goto out;
+	}
+	while (ReadFile(hFile, buf, sizeof(buf), &dwSize, NULL) && (dwSize != 0)) {
+		if (!CryptHashData(hHash, buf, dwSize, 0))
+			goto out;
+	}
+	dwSize = sizeof(hash);
+	if (!CryptGetHashParam(hHash, HP_HASHVAL, hash, &dwSize, 0))
+		goto out;
+	for (i=0; i<sizeof(hash); i++)
+		safe_sprintf(&str[2*i], sizeof(str)-2*i, "%02x", hash[i]);
+	r = (_stricmp(str, sha1) == 0);
+	if (!r)
+		uprintf("SHA-1 mismatch for %s: expected %s, got %s\n", file, sha1, str);
+
+out:
+	if (hHash) CryptDestroyHash(hHash);
+	if (hProv) CryptReleaseContext(hProv, 0);
+	if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+	return r;
+}
+
 /* 
  * Download a file from an URL
  * Mostly taken from http://support.microsoft.com/kb/234913
  * If hProgressDialog is not NULL, this function will send INIT and EXIT messages
  * to the dialog in question, with WPARAM being set to nonzero for EXIT on success
  * and also attempt to indicate progress using an IDC_PROGRESS control
+ * The data is downloaded into '<file>.part', which is only renamed to 'file' once
+ * the download is complete and, if sha1 is not NULL, its SHA-1 matches. If the server
+ * supports range requests, the download is split across parallel connections and can
+ * be resumed after a failure, from the partial file and its chunk map.
  */
-BOOL DownloadFile(const char* url, const char* file, HWND hProgressDialog)
+BOOL DownloadFile(const char* url, const char* file, HWND hProgressDialog, const char* sha1)
 {
 	HWND hProgressBar = NULL;
-	BOOL r = FALSE;
-	DWORD dwFlags, dwSize, dwDownloaded, dwTotalSize, dwStatus;
-	FILE* fd = NULL; 
+	BOOL r = FALSE, keep_partial = FALSE;
+	DWORD dwFlags, dwSize, dwDownloaded, dwWritten, dwStatus, dwMaxConns, start_time;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
 	LONG progress_style;
 	unsigned char buf[DOWNLOAD_BUFFER_SIZE];
-	char agent[64], hostname[64], urlpath[128];
+	char agent[64], hostname[64], urlpath[128], str[32], part_path[MAX_PATH], map_path[MAX_PATH];
+	uint64_t size;
+	DOWNLOAD_STATE dl = {0};
 	HINTERNET hSession = NULL, hConnection = NULL, hRequest = NULL;
 	URL_COMPONENTSA UrlParts = {sizeof(URL_COMPONENTSA), NULL, 1, (INTERNET_SCHEME)0,
 		hostname, sizeof(hostname), 0, NULL, 1, urlpath, sizeof(urlpath), NULL, 1};
-	int i;
+	int i, nb_restarts = 0;
 
+	safe_sprintf(part_path, sizeof(part_path), "%s" DOWNLOAD_PART_EXT, file);
 	if (hProgressDialog != NULL) {
 		// Use the progress control provided, if any
 		hProgressBar = GetDlgItem(hProgressDialog, IDC_PROGRESS);
@@ -288,6 +699,12 @@ BOOL DownloadFile(const char* url, const char* file, HWND hProgressDialog)
 		uprintf("Could not open internet session: %s\n", WinInetErrorString());
 		goto out;
 	}
+	// WinInet may only allow 2 connections per server, which would serialize the range
+	// requests of the workers. These options are process wide, hence the NULL handle.
+	dwMaxConns = DOWNLOAD_THREADS;
+	if ( (!InternetSetOptionA(NULL, INTERNET_OPTION_MAX_CONNS_PER_SERVER, &dwMaxConns, sizeof(dwMaxConns)))
+	  || (!InternetSetOptionA(NULL, INTERNET_OPTION_MAX_CONNS_PER_1_0_SERVER, &dwMaxConns, sizeof(dwMaxConns))) )
+		uprintf("Could not set the maximum number of connections per server: %s\n", WinInetErrorString());
 
 	hConnection = InternetConnectA(hSession, UrlParts.lpszHostName, UrlParts.nPort, NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
 	if (hConnection == NULL) {
@@ -295,9 +712,9 @@ BOOL DownloadFile(const char* url, const char* file, HWND hProgressDialog)
 		goto out;
 	}
 
+restart:
 	hRequest = HttpOpenRequestA(hConnection, "GET", UrlParts.lpszUrlPath, NULL, NULL, (const char**)"*/*\0",
-		INTERNET_FLAG_HYPERLINK|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|INTERNET_FLAG_NO_COOKIES|
-		INTERNET_FLAG_NO_UI|INTERNET_FLAG_NO_CACHE_WRITE, (DWORD_PTR)NULL);
+		DOWNLOAD_REQUEST_FLAGS, (DWORD_PTR)NULL);
 	if (hRequest == NULL) {
 		uprintf("Could not open url %s: %s\n", url, WindowsErrorString());
 		goto out;
@@ -317,51 +734,104 @@ BOOL DownloadFile(const char* url, const char* file, HWND hProgressDialog)
 		uprintf("Unable to acess file. Server status %d\n", dwStatus);
 		goto out;
 	}
-	dwSize = sizeof(dwTotalSize);
-	if (!HttpQueryInfoA(hRequest, HTTP_QUERY_CONTENT_LENGTH|HTTP_QUERY_FLAG_NUMBER, (LPVOID)&dwTotalSize, &dwSize, NULL)) {
+	// HTTP_QUERY_FLAG_NUMBER is limited to 32 bits, so query the length as a string
+	dwSize = sizeof(str);
+	if (!HttpQueryInfoA(hRequest, HTTP_QUERY_CONTENT_LENGTH, (LPVOID)str, &dwSize, NULL)) {
 		uprintf("Unable to retrieve file length: %s\n", WinInetErrorString());
 		goto out;
 	}
-	uprintf("File length: %d bytes\n", dwTotalSize);
+	size = _strtoui64(str, NULL, 10);
+	uprintf("File length: %" PRIu64 " bytes\n", size);
 
-	fd = fopen(file, "wb");
-	if (fd == NULL) {
-		uprintf("Unable to create file %s: %s\n", file, WinInetErrorString());
-		goto out;
+	// A strong validator is needed to resume safely, as well as for If-Range
+	memset(&dl, 0, sizeof(dl));
+	dwSize = sizeof(dl.validator);
+	if ( (!HttpQueryInfoA(hRequest, HTTP_QUERY_ETAG, (LPVOID)dl.validator, &dwSize, NULL))
+	  || (strncmp(dl.validator, "W/", 2) == 0) ) {
+		dwSize = sizeof(dl.validator);
+		if (!HttpQueryInfoA(hRequest, HTTP_QUERY_LAST_MODIFIED, (LPVOID)dl.validator, &dwSize, NULL))
+			dl.validator[0] = 0;
 	}
 
-	// Keep checking for data until there is nothing left.
-	dwSize = 0;
-	while (1) {
-		if (IS_ERROR(FormatStatus))
+	dwSize = sizeof(str);
+	if ( (size > DOWNLOAD_CHUNK_SIZE)
+	  && (HttpQueryInfoA(hRequest, HTTP_QUERY_ACCEPT_RANGES, (LPVOID)str, &dwSize, NULL))
+	  && (_stricmp(str, "bytes") == 0) ) {
+		// No need for the full response - the workers issue their own requests
+		InternetCloseHandle(hRequest);
+		hRequest = NULL;
+		dl.hConnection = hConnection;
+		dl.path = UrlParts.lpszUrlPath;
+		dl.size = size;
+		r = DownloadRanges(&dl, part_path, hProgressBar);
+		// The partial data is gone if the file changed => start over with the new version
+		if ((!r) && (dl.changed) && (!IS_ERROR(FormatStatus)) && (nb_restarts++ < DOWNLOAD_RESTARTS)) {
+			uprintf("Restarting download of %s\n", file);
+			goto restart;
+		}
+		// A partial download that has a valid map can be resumed
+		keep_partial = (!r) && (!dl.changed) && (dl.validator[0] != 0);
+		if (!r)
+			goto out;
+	} else {
+		// A plain download cannot be resumed, so drop any stale chunk map
+		safe_sprintf(map_path, sizeof(map_path), "%s" DOWNLOAD_MAP_EXT, part_path);
+		DeleteFileU(map_path);
+		hFile = CreateFileU(part_path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			uprintf("Unable to create file %s: %s\n", part_path, WindowsErrorString());
 			goto out;
+		}
 
-		if (!InternetReadFile(hRequest, buf, sizeof(buf), &dwDownloaded) || (dwDownloaded == 0))
-			break;
-		dwSize += dwDownloaded;
-		SendMessage(hProgressBar, PBM_SETPOS, (WPARAM)(MAX_PROGRESS*((1.0f*dwSize)/(1.0f*dwTotalSize))), 0);
-		PrintStatus(0, FALSE, "Downloading: %0.1f%%\n", (100.0f*dwSize)/(1.0f*dwTotalSize));
-		if (fwrite(buf, 1, dwDownloaded, fd) != dwDownloaded) {
-			uprintf("Error writing file %s: %s\n", file, WinInetErrorString());
+		// Keep checking for data until there is nothing left.
+		dl.size = 0;
+		start_time = GetTickCount();
+		while (1) {
+			if (IS_ERROR(FormatStatus))
+				goto out;
+
+			if (!InternetReadFile(hRequest, buf, sizeof(buf), &dwDownloaded) || (dwDownloaded == 0))
+				break;
+			dl.size += dwDownloaded;
+			DownloadProgress(hProgressBar, dl.size, size, start_time);
+			if ((!WriteFile(hFile, buf, dwDownloaded, &dwWritten, NULL)) || (dwWritten != dwDownloaded)) {
+				uprintf("Error writing file %s: %s\n", part_path, WindowsErrorString());
+				goto out;
+			}
+		}
+		CloseHandle(hFile);
+		hFile = INVALID_HANDLE_VALUE;
+
+		if (dl.size != size) {
+			uprintf("Could not download complete file - read: %" PRIu64 " bytes, expected: %" PRIu64 " bytes\n", dl.size, size);
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 			goto out;
 		}
 	}
 
-	if (dwSize != dwTotalSize) {
-		uprintf("Could not download complete file - read: %d bytes, expected: %d bytes\n", dwSize, dwTotalSize);
+	r = FALSE;
+	if ((sha1 != NULL) && (!CheckFileSha1(part_path, sha1))) {
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 		goto out;
-	} else {
-		r = TRUE;
-		uprintf("Successfully downloaded %s\n", file);
 	}
+	if (!MoveFileExU(part_path, file, MOVEFILE_REPLACE_EXISTING)) {
+		uprintf("Unable to rename %s to %s: %s\n", part_path, file, WindowsErrorString());
+		goto out;
+	}
+	r = TRUE;
+	uprintf("Successfully downloaded %s\n", file);
 
 out:
 	if (hProgressDialog != NULL)
 		SendMessage(hProgressDialog, UM_ISO_EXIT, (WPARAM)r, 0);
-	if (fd != NULL) fclose(fd);
+	if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
 	if (!r) {
-		_unlink(file);
+		// Whatever happens, the destination file is left as it was
+		if (keep_partial) {
+			uprintf("Partial download kept as %s, for resume\n", part_path);
+		} else {
+			DeleteFileU(part_path);
+		}
 		PrintStatus(0, FALSE, "Failed to download file.");
 		SetLastError(error_code);
 		MessageBoxA(hMainDialog, IS_ERROR(FormatStatus)?StrError(FormatStatus):WinInetErrorString(),
@@ -375,18 +845,19 @@ out:
 }
 
 /* Threaded download */
-static const char *_url, *_file;
+static const char *_url, *_file, *_sha1;
 static HWND _hProgressDialog;
 static DWORD WINAPI _DownloadFileThread(LPVOID param)
 {
-	ExitThread(DownloadFile(_url, _file, _hProgressDialog));
+	ExitThread(DownloadFile(_url, _file, _hProgressDialog, _sha1));
 }
 
-HANDLE DownloadFileThreaded(const char* url, const char* file, HWND hProgressDialog)
+HANDLE DownloadFileThreaded(const char* url, const char* file, HWND hProgressDialog, const char* sha1)
 {
 	_url = url;
 	_file = file;
 	_hProgressDialog = hProgressDialog;
+	_sha1 = sha1;
 	return CreateThread(NULL, 0, _DownloadFileThread, NULL, 0, NULL);
 }
 
@@ -232,6 +232,7 @@ void parse_update(char* buf, size_t len)
 	update.platform_min[0] = 5;
 	update.platform_min[1] = 2;	// XP or later
 	safe_free(update.download_url);
+	safe_free(update.download_sha1);
 	safe_free(update.release_notes);
 	if ((data = get_sanitized_token_data_buffer("version", 1, buf, len)) != NULL) {
 		for (i=0; (i<4) && ((token = strtok((i==0)?data:NULL, ".")) != NULL); i++) {
@@ -246,6 +247,7 @@ void parse_update(char* buf, size_t len)
 		safe_free(data);
 	}
 	update.download_url = get_sanitized_token_data_buffer("download_url", 1, buf, len);
+	update.download_sha1 = get_sanitized_token_data_buffer("download_sha1", 1, buf, len);
 	update.release_notes = get_sanitized_token_data_buffer("release_notes", 1, buf, len);
 }
 
@@ -375,6 +377,52 @@ out:
 	return ret;
 }
 
+// Search for a specific 'str' substring in the data of all occurences of 'token'.
+// File can be ANSI or UNICODE. Parameters are UTF-8.
+// The parsed line is of the form: [ ]token[ ]data
+// Returns TRUE if 'str' was found on any of the token lines, FALSE otherwise
+BOOL find_in_token_data(const char* filename, const char* token, const char* str)
+{
+	wchar_t *wtoken = NULL, *wfilename = NULL, *wstr = NULL;
+	wchar_t wspace[] = L" \t";
+	wchar_t buf[1024];
+	FILE* fd = NULL;
+	size_t i;
+	BOOL ret = FALSE;
+
+	if ((filename == NULL) || (token == NULL) || (str == NULL))
+		return FALSE;
+	if ((filename[0] == 0) || (token[0] == 0) || (str[0] == 0))
+		return FALSE;
+
+	wfilename = utf8_to_wchar(filename);
+	wtoken = utf8_to_wchar(token);
+	wstr = utf8_to_wchar(str);
+	if ((wfilename == NULL) || (wtoken == NULL) || (wstr == NULL)) {
+		uprintf("Could not convert token data parameters to UTF-16\n");
+		goto out;
+	}
+	fd = _wfopen(wfilename, L"r, ccs=UNICODE");
+	if (fd == NULL)
+		goto out;
+
+	while ((!ret) && (fgetws(buf, ARRAYSIZE(buf), fd) != NULL)) {
+		i = wcsspn(buf, wspace);
+		if (_wcsnicmp(&buf[i], wtoken, wcslen(wtoken)) != 0)
+			continue;
+		i += wcslen(wtoken);
+		ret = (wcsstr(&buf[i], wstr) != NULL);
+	}
+
+out:
+	if (fd != NULL)
+		fclose(fd);
+	safe_free(wfilename);
+	safe_free(wtoken);
+	safe_free(wstr);
+	return ret;
+}
+
 // Search for a specific 'src' substring the data for all occurences of 'token', and replace
 // it with 'rep'. File can be ANSI or UNICODE and is overwritten. Parameters are UTF-8.
 // The parsed line is of the form: [ ]token[ ]data
@@ -521,3 +569,146 @@ out:
 
 	return ret;
 }
+
+// Same as replace_in_token_data(), but for file data that is held in memory, so that
+// a file can be patched before it is written to its (possibly slow) destination.
+// The buffer can be ANSI/UTF-8 (with or without BOM) or UTF-16LE (with BOM) and the
+// result is encoded the same way. Parameters are UTF-8. Lines are normalized to CRLF,
+// or to LF if 'dos2unix' is set, which matches what the file-based version produces.
+// If a replacement occurs, *buffer is reallocated, *buffer_size is updated and a pointer
+// to rep is returned. Otherwise, NULL is returned and the buffer is left untouched.
+char* replace_in_token_data_buffer(const char* token, const char* src, const char* rep,
+	BOOL dos2unix, char** buffer, size_t* buffer_size)
+{
+	const char utf8_bom[] = { (char)0xEF, (char)0xBB, (char)0xBF };
+	char *in = NULL, *out = NULL, *newbuf = NULL, *line, *eol, *torep, *p, *ret = NULL, c;
+	wchar_t *win = NULL, *wout = NULL;
+	size_t i, len, out_size = 0, nb_lines = 1, token_len, src_len, rep_len;
+	int mode;
+
+	if ((token == NULL) || (src == NULL) || (rep == NULL) || (buffer == NULL) || (*buffer == NULL) || (buffer_size == NULL))
+		return NULL;
+	if ((token[0] == 0) || (src[0] == 0) || (rep[0] == 0) || (*buffer_size == 0))
+		return NULL;
+	if (strcmp(src, rep) == 0)
+		return NULL;
+	token_len = strlen(token);
+	src_len = strlen(src);
+	rep_len = strlen(rep);
+
+	// Convert the input to a NUL terminated UTF-8 string, using the same BOM detection as above
+	if ((*buffer_size >= 2) && ((uint8_t)(*buffer)[0] == 0xFF) && ((uint8_t)(*buffer)[1] == 0xFE)) {
+		mode = 2;	// UTF-16 (LE)
+		len = (*buffer_size - 2) / sizeof(wchar_t);
+		win = (wchar_t*)calloc(len + 1, sizeof(wchar_t));
+		if (win == NULL)
+			goto out;
+		memcpy(win, &(*buffer)[2], len * sizeof(wchar_t));
+		in = wchar_to_utf8(win);
+	} else {
+		i = 0;
+		mode = 0;	// ANSI
+		if ((*buffer_size >= sizeof(utf8_bom)) && (memcmp(*buffer, utf8_bom, sizeof(utf8_bom)) == 0)) {
+			mode = 1;	// UTF-8 (with BOM)
+			i = sizeof(utf8_bom);
+		}
+		in = (char*)malloc(*buffer_size - i + 1);
+		if (in != NULL) {
+			memcpy(in, &(*buffer)[i], *buffer_size - i);
+			in[*buffer_size - i] = 0;
+		}
+	}
+	if (in == NULL) {
+		uprintf("Could not allocate buffer for token replacement\n");
+		goto out;
+	}
+
+	// Each line gets at most one replacement and may gain a CR
+	for (p = in; *p != 0; p++)
+		if (*p == '\n')
+			nb_lines++;
+	out = (char*)malloc(strlen(in) + nb_lines * (rep_len + 1) + 1);
+	if (out == NULL) {
+		uprintf("Could not allocate buffer for token replacement\n");
+		goto out;
+	}
+
+	for (line = in; *line != 0; line = eol) {
+		eol = strchr(line, '\n');
+		eol = (eol == NULL) ? &line[strlen(line)] : &eol[1];
+		torep = NULL;
+		// Skip leading spaces. Our token should begin a line
+		i = strspn(line, " \t");
+		if (_strnicmp(&line[i], token, token_len) == 0) {
+			// Token was found, move past token and spaces
+			i += token_len;
+			i += strspn(&line[i], " \t");
+			c = *eol;
+			*eol = 0;
+			torep = strstr(&line[i], src);
+			*eol = c;
+		}
+		for (p = line; p < eol; p++) {
+			if (p == torep) {
+				memcpy(&out[out_size], rep, rep_len);
+				out_size += rep_len;
+				p += src_len - 1;
+				ret = (char*)rep;
+				continue;
+			}
+			if ((*p == '\r') && (dos2unix || (p[1] == '\n')))
+				continue;
+			if ((*p == '\n') && (!dos2unix))
+				out[out_size++] = '\r';
+			out[out_size++] = *p;
+		}
+	}
+	out[out_size] = 0;
+
+	if (ret == NULL)
+		goto out;
+
+	// Re-encode the output the same way as the input
+	switch (mode) {
+	case 2:
+		wout = utf8_to_wchar(out);
+		if (wout == NULL)
+			break;
+		len = wcslen(wout) * sizeof(wchar_t);
+		newbuf = (char*)malloc(len + 2);
+		if (newbuf == NULL)
+			break;
+		newbuf[0] = (char)0xFF;
+		newbuf[1] = (char)0xFE;
+		memcpy(&newbuf[2], wout, len);
+		out_size = len + 2;
+		break;
+	case 1:
+		newbuf = (char*)malloc(out_size + sizeof(utf8_bom));
+		if (newbuf == NULL)
+			break;
+		memcpy(newbuf, utf8_bom, sizeof(utf8_bom));
+		memcpy(&newbuf[sizeof(utf8_bom)], out, out_size);
+		out_size += sizeof(utf8_bom);
+		break;
+	default:
+		newbuf = out;
+		out = NULL;
+		break;
+	}
+	if (newbuf == NULL) {
+		uprintf("Could not allocate buffer for token replacement\n");
+		ret = NULL;
+		goto out;
+	}
+	free(*buffer);
+	*buffer = newbuf;
+	*buffer_size = out_size;
+
+out:
+	safe_free(in);
+	safe_free(out);
+	safe_free(win);
+	safe_free(wout);
+	return ret;
+}
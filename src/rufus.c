@@ -38,6 +38,7 @@
 #include "resource.h"
 #include "rufus.h"
 #include "registry.h"
+#include "badblocks.h"
 
 /* Redefinitions for the WDK */
 #ifndef PBM_SETSTATE
@@ -105,7 +106,8 @@ int default_fs;
 HWND hDeviceList, hPartitionScheme, hFileSystem, hClusterSize, hLabel, hBootType, hNBPasses, hLog = NULL;
 HWND hISOProgressDlg = NULL, hLogDlg = NULL, hISOProgressBar, hISOFileName, hDiskID;
 BOOL use_own_c32[NB_OLD_C32] = {FALSE, FALSE}, detect_fakes = TRUE, mbr_selected_by_user = FALSE;
-BOOL iso_op_in_progress = FALSE, format_op_in_progress = FALSE;
+BOOL iso_op_in_progress = FALSE, format_op_in_progress = FALSE, enable_persistence = FALSE;
+BOOL resume_extraction = FALSE, update_extraction = FALSE, write_as_image = FALSE;
 int dialog_showing = 0;
 uint16_t rufus_version[4];
 RUFUS_UPDATE update = { {0,0,0,0}, {0,0}, NULL, NULL};
@@ -284,7 +286,7 @@ static BOOL SetClusterSizes(int FSType)
 {
 	char szClustSize[64];
 	int i, k, default_index = 0;
-	ULONG j;
+	ULONG j, optimized;
 
 	IGNORE_RETVAL(ComboBox_ResetContent(hClusterSize));
 
@@ -298,13 +300,22 @@ static BOOL SetClusterSizes(int FSType)
 		return FALSE;
 	}
 
+	// If we have an ISO, mark (and select) the size that suits its content best
+	optimized = (iso_path != NULL) ? GetOptimizedClusterSize(FSType, &iso_report) : 0;
+
 	for(i=0,j=0x200,k=0;j<0x10000000;i++,j<<=1) {
 		if (j & SelectedDrive.ClusterSize[FSType].Allowed) {
 			safe_sprintf(szClustSize, sizeof(szClustSize), "%s", ClusterSizeLabel[i]);
-			if (j == SelectedDrive.ClusterSize[FSType].Default) {
+			if ((j == SelectedDrive.ClusterSize[FSType].Default) && (j == optimized)) {
+				safe_strcat(szClustSize, sizeof(szClustSize), " (Default, Optimized)");
+			} else if (j == SelectedDrive.ClusterSize[FSType].Default) {
 				safe_strcat(szClustSize, sizeof(szClustSize), " (Default)");
-				default_index = k;
+			} else if (j == optimized) {
+				safe_strcat(szClustSize, sizeof(szClustSize), " (Optimized)");
 			}
+			if ( ((optimized == 0) && (j == SelectedDrive.ClusterSize[FSType].Default))
+			  || (j == optimized) )
+				default_index = k;
 			IGNORE_RETVAL(ComboBox_SetItemData(hClusterSize, ComboBox_AddStringU(hClusterSize, szClustSize), j));
 			k++;
 		}
@@ -700,11 +711,13 @@ static void InitProgress(void)
 	}
 	nb_slots[OP_PARTITION] = 1;
 	nb_slots[OP_FIX_MBR] = 1;
-	nb_slots[OP_CREATE_FS] = 
-		nb_steps[ComboBox_GetItemData(hFileSystem, ComboBox_GetCurSel(hFileSystem))];
-	if ( (!IsChecked(IDC_QUICKFORMAT))
-	  || ((fs == FS_FAT32) && (SelectedDrive.DiskSize >= LARGE_FAT32_SIZE)) ) {
+	// FAT file systems are created natively, which only reports progress on the format slot
+	if ((fs == FS_FAT16) || (fs == FS_FAT32)) {
 		nb_slots[OP_FORMAT] = -1;
+	} else {
+		nb_slots[OP_CREATE_FS] = nb_steps[fs];
+		if (!IsChecked(IDC_QUICKFORMAT))
+			nb_slots[OP_FORMAT] = -1;
 	}
 	nb_slots[OP_FINALIZE] = ((dt == DT_ISO) && (fs == FS_NTFS))?2:1;
 
@@ -846,6 +859,7 @@ BOOL CALLBACK LogProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 			SetWindowTextA(hLog, "");
 			return TRUE;
 		case IDC_LOG_SAVE:
+			FlushLog();
 			log_size = GetWindowTextLengthU(hLog);
 			if (log_size > 0)
 				log_buffer = (char*)malloc(log_size);
@@ -916,6 +930,14 @@ static void CALLBACK BlockingTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD
 	}
 }
 
+/*
+ * Sample the progress that the ISO extraction thread publishes
+ */
+static void CALLBACK ISOProgressTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
+{
+	RefreshISOProgress();
+}
+
 /* Callback for the modeless ISO extraction progress, and other progress dialogs */
 BOOL CALLBACK ISOProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam) 
 {
@@ -931,8 +953,11 @@ BOOL CALLBACK ISOProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 		CenterDialog(hDlg);
 		ShowWindow(hDlg, SW_SHOW);
 		UpdateWindow(hDlg);
+		SetTimer(hDlg, TID_ISO_PROGRESS, ISO_PROGRESS_INTERVAL, ISOProgressTimer);
 		return TRUE;
 	case UM_ISO_EXIT:
+		KillTimer(hDlg, TID_ISO_PROGRESS);
+		RefreshISOProgress();
 		// Just hide and recentrer the dialog
 		ShowWindow(hDlg, SW_HIDE);
 		iso_op_in_progress = FALSE;
@@ -967,9 +992,21 @@ DWORD WINAPI ISOScanThread(LPVOID param)
 	const char* old_c32_name[NB_OLD_C32] = OLD_C32_NAMES;
 	const char* new_c32_url[NB_OLD_C32] = NEW_C32_URL;
 	char msg[1024], msg_title[32];
+	uint64_t vhd_size;
 
 	if (iso_path == NULL)
 		goto out;
+	// Virtual disk images are written to the drive as is, so there's nothing to scan
+	if (IsVHD(iso_path, &vhd_size)) {
+		memset(&iso_report, 0, sizeof(iso_report));
+		iso_report.is_vhd = TRUE;
+		iso_report.projected_size = vhd_size;
+		CheckDlgButton(hMainDialog, IDC_BOOT, BST_CHECKED);
+		for (i=(int)safe_strlen(iso_path); (i>0)&&(iso_path[i]!='\\'); i--);
+		PrintStatus(0, TRUE, "Using VHD: %s\n", &iso_path[i+1]);
+		SendMessage(hMainDialog, WM_NEXTDLGCTL, (WPARAM)GetDlgItem(hMainDialog, IDC_START), TRUE);
+		goto out;
+	}
 	PrintStatus(0, TRUE, "Scanning ISO image...\n");
 	if (!ExtractISO(iso_path, "", TRUE)) {
 		SendMessage(hISOProgressDlg, UM_ISO_EXIT, 0, 0);
@@ -987,13 +1024,17 @@ DWORD WINAPI ISOScanThread(LPVOID param)
 			uprintf("    With an old %s: %s\n", old_c32_name[i], iso_report.has_old_c32[i]?"Yes":"No");
 		}
 	}
-	if ((!iso_report.has_bootmgr) && (!iso_report.has_isolinux) && (!IS_WINPE(iso_report.winpe)) && (!iso_report.has_efi)) {
+	if (iso_report.has_casper)
+		uprintf("  Uses casper: Yes (Alt-P enables persistence)\n");
+	if ((!CAN_EXTRACT(iso_report)) && (!iso_report.is_isohybrid)) {
 		MessageBoxU(hMainDialog, "This version of Rufus only supports bootable ISOs\n"
 			"based on 'bootmgr/WinPE', 'isolinux' or EFI boot.\n"
 			"This ISO image doesn't appear to use either...", "Unsupported ISO", MB_OK|MB_ICONINFORMATION);
 		safe_free(iso_path);
 		SetMBRProps();
 	} else {
+		if (!CAN_EXTRACT(iso_report))
+			uprintf("ISO content is not supported for file copy: it will be written as a disk image\n");
 		for(i=0; i<NB_OLD_C32; i++) {
 			if (iso_report.has_old_c32[i]) {
 				fd = fopen(old_c32_name[i], "rb");
@@ -1016,7 +1057,7 @@ DWORD WINAPI ISOScanThread(LPVOID param)
 					if (MessageBoxA(hMainDialog, msg, msg_title, MB_YESNO|MB_ICONWARNING) == IDYES) {
 						SetWindowTextU(hISOProgressDlg, "Downloading file...");
 						SetWindowTextU(hISOFileName, new_c32_url[i]);
-						if (DownloadFile(new_c32_url[i], old_c32_name[i], hISOProgressDlg))
+						if (DownloadFile(new_c32_url[i], old_c32_name[i], hISOProgressDlg, NULL))
 							use_own_c32[i] = TRUE;
 					}
 				}
@@ -1064,8 +1105,13 @@ void MoveControl(int nID, float vertical_shift)
 void SetPassesTooltip(void)
 {
 	char passes_tooltip[32];
+	int nb_passes = (int)ComboBox_GetItemData(hNBPasses, ComboBox_GetCurSel(hNBPasses));
+	if (nb_passes == BB_READ_ONLY) {
+		CreateTooltip(hNBPasses, "Read only (non destructive)", -1);
+		return;
+	}
 	safe_strcpy(passes_tooltip, sizeof(passes_tooltip), "Pattern: 0x55, 0xAA, 0xFF, 0x00");
-	passes_tooltip[13 + ComboBox_GetCurSel(hNBPasses)*6] = 0;
+	passes_tooltip[13 + (nb_passes-1)*6] = 0;
 	CreateTooltip(hNBPasses, passes_tooltip, -1);
 }
 
@@ -1108,10 +1154,31 @@ void ToggleAdvanced(void)
 	SendMessage(GetDlgItem(hMainDialog, IDC_ADVANCED), BCM_SETIMAGELIST, 0, (LPARAM)(advanced_mode?&bi_up:&bi_down));
 }
 
+/*
+ * An existing volume can only be updated in place if it has the partition scheme, file system
+ * and cluster size that formatting the device with the current settings would produce
+ */
+static BOOL IsUpdatable(char drive_letter)
+{
+	char drive_root[] = "?:\\";
+	DWORD SectorsPerCluster, BytesPerSector, NbFreeClusters, NbClusters;
+	int fs, pt;
+
+	fs = (int)ComboBox_GetItemData(hFileSystem, ComboBox_GetCurSel(hFileSystem));
+	pt = GETPARTTYPE((int)ComboBox_GetItemData(hPartitionScheme, ComboBox_GetCurSel(hPartitionScheme)));
+	if ((SelectedDrive.FSType != fs) || (SelectedDrive.PartitionType != pt))
+		return FALSE;
+	drive_root[0] = drive_letter;
+	if (!GetDiskFreeSpaceA(drive_root, &SectorsPerCluster, &BytesPerSector, &NbFreeClusters, &NbClusters))
+		return FALSE;
+	return (SectorsPerCluster * BytesPerSector == (DWORD)ComboBox_GetItemData(hClusterSize, ComboBox_GetCurSel(hClusterSize)));
+}
+
 static BOOL BootCheck(void)
 {
-	int fs, bt;
+	int i, fs, bt;
 
+	write_as_image = FALSE;
 	if (ComboBox_GetItemData(hBootType, ComboBox_GetCurSel(hBootType)) == DT_ISO) {
 		if (iso_path == NULL) {
 			MessageBoxA(hMainDialog, "Please click on the disc button to select a bootable ISO,\n"
@@ -1119,11 +1186,29 @@ static BOOL BootCheck(void)
 				"No ISO image selected...", MB_OK|MB_ICONERROR);
 			return FALSE;
 		}
-		if ((iso_size_check) && (iso_report.projected_size > (uint64_t)SelectedDrive.DiskSize)) {
+		// An isohybrid ISO can be written as is, which is the only option if we can't copy its files
+		if (iso_report.is_isohybrid) {
+			if (CAN_EXTRACT(iso_report)) {
+				i = MessageBoxA(hMainDialog, "This ISO image is isohybrid, which means that it can also be "
+					"written to the device as a disk image.\n\nDo you want to write it in image mode (exact, "
+					"verified copy), rather than copy its files?", "Isohybrid image detected",
+					MB_YESNOCANCEL|MB_ICONQUESTION|MB_DEFBUTTON2);
+				if (i == IDCANCEL)
+					return FALSE;
+				write_as_image = (i == IDYES);
+			} else {
+				write_as_image = TRUE;
+			}
+		}
+		if ((iso_size_check) && ((write_as_image)?iso_report.image_size:iso_report.projected_size)
+		  > (uint64_t)SelectedDrive.DiskSize) {
 			MessageBoxA(hMainDialog, "This ISO image is too big "
 				"for the selected target.", "ISO image too big...", MB_OK|MB_ICONERROR);
 			return FALSE;
 		}
+		// None of the file system or boot type constraints apply to a raw write
+		if ((iso_report.is_vhd) || (write_as_image))
+			return TRUE;
 		fs = (int)ComboBox_GetItemData(hFileSystem, ComboBox_GetCurSel(hFileSystem));
 		bt = GETBIOSTYPE((int)ComboBox_GetItemData(hPartitionScheme, ComboBox_GetCurSel(hPartitionScheme)));
 		if (bt == BT_UEFI) {
@@ -1151,7 +1236,7 @@ static BOOL BootCheck(void)
 			return FALSE;
 		}
 		if ((bt == BT_UEFI) && (iso_report.has_win7_efi) && (!WimExtractCheck())) {
-			if (MessageBoxA(hMainDialog, "Your platform cannot extract files from WIM archives. WIM extraction "
+			if (MessageBoxA(hMainDialog, "Your platform cannot extract files from the WIM archive of this image. WIM extraction "
 				"is required to create EFI bootable Windows 7 and Windows Vista USB drives. You can fix that "
 				"by installing a recent version of 7-Zip.\r\nDo you want to visit the 7-zip download page?",
 				"Missing WIM support...", MB_YESNO|MB_ICONERROR) == IDYES)
@@ -1226,8 +1311,9 @@ void InitDialog(HWND hDlg)
 	// Fill up the passes
 	for (i=0; i<4; i++) {
 		safe_sprintf(tmp, sizeof(tmp), "%d Pass%s", i+1, (i==0)?"":"es");
-		IGNORE_RETVAL(ComboBox_AddStringU(hNBPasses, tmp));
+		IGNORE_RETVAL(ComboBox_SetItemData(hNBPasses, ComboBox_AddStringU(hNBPasses, tmp), i+1));
 	}
+	IGNORE_RETVAL(ComboBox_SetItemData(hNBPasses, ComboBox_AddStringU(hNBPasses, "Read only"), BB_READ_ONLY));
 	IGNORE_RETVAL(ComboBox_SetCurSel(hNBPasses, 1));
 	SetPassesTooltip();
 	// Fill up the DOS type dropdown
@@ -1315,6 +1401,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 	RECT DialogRect, DesktopRect;
 	int nDeviceIndex, fs, bt, i, nWidth, nHeight;
 	static DWORD DeviceNum = 0;
+	char drive_letter, *label;
 	wchar_t wtmp[128], wstr[MAX_PATH];
 	static UINT uDOSChecked = BST_CHECKED, uQFChecked;
 	static BOOL first_log_display = TRUE, user_changed_label = FALSE;
@@ -1334,6 +1421,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		SetUpdateCheck();
 		// Create the log window (hidden)
 		hLogDlg = CreateDialogA(hMainInstance, MAKEINTRESOURCEA(IDD_LOG), hDlg, (DLGPROC)LogProc); 
+		StartLogger(hDlg);
 		InitDialog(hDlg);
 		GetUSBDevices(0);
 		CheckForUpdates(FALSE);
@@ -1541,7 +1629,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			return (INT_PTR)TRUE;
 		case IDC_SELECT_ISO:
 			safe_free(iso_path);
-			iso_path = FileDialog(FALSE, NULL, "*.iso", "iso", "ISO Image");
+			iso_path = FileDialog(FALSE, NULL, "*.iso", "iso;*.iso.gz;*.iso.xz;*.iso.zst;*.cso;*.vhd;*.vhdx", "ISO or VHD Image");
 			if (iso_path == NULL) {
 				CreateTooltip(hSelectISO, "Click to select...", -1);
 				break;
@@ -1574,13 +1662,46 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			if (nDeviceIndex != CB_ERR) {
 				if ((IsChecked(IDC_BOOT)) && (!BootCheck()))
 					break;
+				DeviceNum = (DWORD)ComboBox_GetItemData(hDeviceList, nDeviceIndex);
+				// If a copy of the same ISO onto this drive was interrupted, offer to resume it
+				resume_extraction = FALSE;
+				i = IDNO;
+				if ( (IsChecked(IDC_BOOT)) && (selection_default == DT_ISO) && (iso_path != NULL) && (!iso_report.is_vhd)
+				  && (!write_as_image) && (GetDriveLabel(DeviceNum, &drive_letter, &label)) && (JournalCheck(iso_path, drive_letter)) ) {
+					i = MessageBoxA(hMainDialog, "This device contains an incomplete copy of the selected ISO.\n"
+						"Do you want to resume this copy, rather than format the device and start over?",
+						"Resume ISO copy", MB_YESNOCANCEL|MB_ICONQUESTION);
+					resume_extraction = (i == IDYES);
+					if (i == IDNO)
+						JournalDelete(iso_path, drive_letter);
+				}
+				// If the device already has a volume that matches the selected settings, offer to only
+				// write the files that differ from the ISO, rather than format and copy everything
+				update_extraction = FALSE;
+				if ( (i == IDNO) && (IsChecked(IDC_BOOT)) && (selection_default == DT_ISO) && (iso_path != NULL)
+				  && (!iso_report.is_vhd) && (!write_as_image) && (GetDriveLabel(DeviceNum, &drive_letter, &label))
+				  && (IsUpdatable(drive_letter)) ) {
+					// The bad blocks check overwrites the whole device, so it requires a format
+					if (IsChecked(IDC_BADBLOCKS)) {
+						uprintf("Not offering to update the existing ISO copy, as a bad blocks check was requested\n");
+					} else {
+						i = MessageBoxA(hMainDialog, "This device already has a volume with the selected partition scheme, "
+							"file system and cluster size.\n"
+							"Do you want to update it from the selected ISO instead of formatting it?\n\n"
+							"The boot records and bootloader will be reinstalled for the selected target system, "
+							"and only the files that differ will be written. ALL THE FILES THAT ARE NOT "
+							"PART OF THE ISO WILL BE DELETED.", "Update ISO copy",
+							MB_YESNOCANCEL|MB_ICONQUESTION|MB_DEFBUTTON2);
+						update_extraction = (i == IDYES);
+					}
+				}
 				GetWindowTextW(hDeviceList, wtmp, ARRAYSIZE(wtmp));
 				_snwprintf(wstr, ARRAYSIZE(wstr), L"WARNING: ALL DATA ON DEVICE %s\r\nWILL BE DESTROYED.\r\n"
 					L"To continue with this operation, click OK. To quit click CANCEL.", wtmp);
-				if (MessageBoxW(hMainDialog, wstr, L"Rufus", MB_OKCANCEL|MB_ICONWARNING) == IDOK) {
+				if ( (i != IDCANCEL) && ((resume_extraction) || (update_extraction)
+				  || (MessageBoxW(hMainDialog, wstr, L"Rufus", MB_OKCANCEL|MB_ICONWARNING) == IDOK)) ) {
 					// Disable all controls except cancel
 					EnableControls(FALSE);
-					DeviceNum = (DWORD)ComboBox_GetItemData(hDeviceList, nDeviceIndex);
 					FormatStatus = 0;
 					InitProgress();
 					format_thid = CreateThread(NULL, 0, FormatThread, (LPVOID)(uintptr_t)DeviceNum, 0, NULL);
@@ -1782,6 +1903,15 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 				PrintStatus2000("Fake drive detection", detect_fakes);
 				continue;
 			}
+			// Alt-P => Toggle the creation of a persistence file for casper based live images
+			// If this is enabled, and the target is FAT32, a casper-rw file that uses most of
+			// the free space (up to 4 GB) is created after the ISO content has been copied,
+			// and the boot configuration files are patched to enable persistence.
+			if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'P')) {
+				enable_persistence = !enable_persistence;
+				PrintStatus2000("Persistence file creation", enable_persistence);
+				continue;
+			}
 			// Alt-R => Remove all the registry keys created by Rufus
 			if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'R')) {
 				PrintStatus(2000, FALSE, "Application registry key %s deleted.",
@@ -1799,9 +1929,11 @@ out:
 	DestroyAllTooltips();
 	safe_free(iso_path);
 	safe_free(update.download_url);
+	safe_free(update.download_sha1);
 	safe_free(update.release_notes);
 	SetLGP(TRUE, &existing_key, "Software\\Microsoft\\Windows\\CurrentVersion\\Policies\\Explorer", "NoDriveTypeAutorun", 0);
 	CloseHandle(mutex);
+	StopLogger();
 	uprintf("*** RUFUS EXIT ***\n");
 
 #ifdef _CRTDBG_MAP_ALLOC
@@ -41,13 +41,17 @@
 #define MAX_DRIVES                  16
 #define MAX_TOOLTIPS                32
 #define MAX_PROGRESS                (0xFFFF-1)	// leave room for 1 more for insta-progress workaround
+#define ISO_PROGRESS_INTERVAL       100			// how often (in ms) the UI samples the progress of an ISO extraction
 #define MAX_LOG_SIZE                0x7FFFFFFE
 #define MAX_GUID_STRING_LENGTH      40
 #define MAX_GPT_PARTITIONS          128
 #define MAX_SECTORS_TO_CLEAR        128			// nb sectors to zap when clearing the MBR/GPT (must be >34)
+#define ASYNC_QUEUE_DEPTH           8			// max number of writes in flight for the asynchronous write engine
+#define ASYNC_WRITE_SIZE            (1024*1024)	// size of the asynchronous writes used for zeroing
 #define PROPOSEDLABEL_TOLERANCE     0.10
 #define FS_DEFAULT                  FS_FAT32
-#define LARGE_FAT32_SIZE            (32*1073741824LL)	// Size at which we need to use fat32format
+#define LARGE_FAT32_SIZE            (32*1073741824LL)	// Size above which Windows will not create FAT32 volumes
+#define FAT32_DEFAULT_ALIGNMENT     (4*1024*1024)	// FAT and cluster heap alignment, if the erase block size is unknown
 #define WHITE                       RGB(255,255,255)
 #define SEPARATOR_GREY              RGB(223,223,223)
 #define RUFUS_URL                   "http://rufus.akeo.ie"
@@ -86,8 +90,14 @@ extern void _uprintf(const char *format, ...);
 #define uprintf(...) _uprintf(__VA_ARGS__)
 #define vuprintf(...) if (verbose) _uprintf(__VA_ARGS__)
 #define vvuprintf(...) if (verbose > 1) _uprintf(__VA_ARGS__)
+extern void FlushLog(void);
+extern void StartLogger(HWND hWnd);
+extern void StopLogger(void);
 #else
 #define uprintf(...)
+#define FlushLog()
+#define StartLogger(h)
+#define StopLogger()
 #endif
 
 /* Custom Windows messages */
@@ -117,7 +127,9 @@ enum timer_type {
 	TID_MESSAGE = 0x1000,
 	TID_BADBLOCKS_UPDATE,
 	TID_APP_TIMER,
-	TID_BLOCKING_TIMER
+	TID_BLOCKING_TIMER,
+	TID_LOG_UPDATE,
+	TID_ISO_PROGRESS
 };
 
 /* Action type, for progress bar breakdown */
@@ -133,6 +145,15 @@ enum action_type {
 	OP_MAX
 };
 
+/* I/O types, for performance statistics */
+enum io_stat_type {
+	IOS_DEVICE_READ,
+	IOS_DEVICE_WRITE,
+	IOS_SOURCE_READ,
+	IOS_FILE_WRITE,
+	IOS_MAX
+};
+
 /* File system indexes in our FS combobox */
 enum {
 	FS_UNKNOWN = -1,
@@ -170,12 +191,17 @@ typedef struct {
 	int PartitionType;
 	int FSType;
 	BOOL has_protective_mbr;
+	DWORD EraseBlockSize;		// As probed by ProbeFlashGeometry(), 0 if unknown
+	DWORD OptimalIOSize;		// Smallest write size that achieves near best throughput, 0 if unknown
 	struct {
 		ULONG Allowed;
 		ULONG Default;
 	} ClusterSize[FS_MAX];
 } RUFUS_DRIVE_INFO;
 
+/* Opaque asynchronous write engine context */
+typedef struct ASYNC_WRITER ASYNC_WRITER;
+
 /* Special handling for old .c32 files we need to replace */
 #define NB_OLD_C32          2
 #define OLD_C32_NAMES       {"menu.c32", "vesamenu.c32"}
@@ -187,28 +213,41 @@ typedef struct {
 #define WINPE_I386      0x15
 #define IS_WINPE(r)     (((r&WINPE_MININT) == WINPE_MININT)||((r&WINPE_I386) == WINPE_I386))
 #define IS_EFI(r)       ((r.has_efi) || (r.has_win7_efi))
+#define CAN_EXTRACT(r)  ((r.has_bootmgr) || (r.has_isolinux) || (IS_WINPE(r.winpe)) || (IS_EFI(r)))
+/* File size histogram: bucket 0 holds empty files, bucket n sizes in [2^(n-1), 2^n) */
+#define ISO_HISTOGRAM_SIZE 40
 
 typedef struct {
 	char label[192];		/* 3*64 to account for UTF-8 */
 	char usb_label[192];	/* converted USB label for workaround */
 	char cfg_path[128];		/* path to the ISO's isolinux.cfg */
 	uint64_t projected_size;
+	uint32_t nb_files;
+	uint32_t nb_dirs;
+	uint32_t size_count[ISO_HISTOGRAM_SIZE];	/* number of files per size bucket */
+	uint64_t size_bytes[ISO_HISTOGRAM_SIZE];	/* total size of the files per size bucket */
 	uint8_t winpe;
 	BOOL has_4GB_file;
 	BOOL has_bootmgr;
 	BOOL has_efi;
 	BOOL has_win7_efi;
+	BOOL has_native_wim;	/* install.wim can be read by our own WIM extraction */
 	BOOL has_isolinux;
+	BOOL has_casper;
 	BOOL has_autorun;
 	BOOL has_old_c32[NB_OLD_C32];
 	BOOL has_old_vesamenu;
 	BOOL uses_minint;
+	BOOL is_vhd;
+	BOOL is_isohybrid;
+	uint64_t image_size;	/* size of the image file, when it can be written as is */
 } RUFUS_ISO_REPORT;
 
 typedef struct {
 	uint16_t version[4];
 	uint32_t platform_min[2];		// minimum platform version required
 	char* download_url;
+	char* download_sha1;		// optional SHA-1 of the download
 	char* release_notes;
 } RUFUS_UPDATE;
 
@@ -247,7 +286,8 @@ extern char* iso_path;
 extern DWORD FormatStatus;
 extern RUFUS_DRIVE_INFO SelectedDrive;
 extern const int nb_steps[FS_MAX];
-extern BOOL use_own_c32[NB_OLD_C32], detect_fakes, iso_op_in_progress, format_op_in_progress;
+extern BOOL use_own_c32[NB_OLD_C32], detect_fakes, iso_op_in_progress, format_op_in_progress, enable_persistence;
+extern BOOL resume_extraction, update_extraction, write_as_image;
 extern RUFUS_ISO_REPORT iso_report;
 extern int64_t iso_blocking_status;
 extern uint16_t rufus_version[4];
@@ -263,6 +303,11 @@ extern const char *WindowsErrorString(void);
 extern void DumpBufferHex(void *buf, size_t size);
 extern void PrintStatus(unsigned int duration, BOOL debug, const char *format, ...);
 extern void UpdateProgress(int op, float percent);
+extern uint64_t IOStatsTimestamp(void);
+extern void IOStatsReset(void);
+extern void IOStatsSetPhase(int op);
+extern void IOStatsRecord(int type, uint64_t bytes, uint64_t start);
+extern void IOStatsReport(void);
 extern const char* StrError(DWORD error_code);
 extern char* GuidToString(const GUID* guid);
 extern char* SizeToHumanReadable(LARGE_INTEGER size);
@@ -281,6 +326,9 @@ extern BOOL Question(char* title, char* format, ...);
 extern BOOL ExtractDOS(const char* path);
 extern BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan);
 extern BOOL ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file);
+extern void RefreshISOProgress(void);
+extern BOOL JournalCheck(const char* src_iso, char drive_letter);
+extern void JournalDelete(const char* src_iso, char drive_letter);
 extern BOOL InstallSyslinux(DWORD num, const char* drive_name);
 DWORD WINAPI FormatThread(void* param);
 extern BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system);
@@ -289,6 +337,14 @@ extern BOOL GetDrivePartitionData(DWORD DeviceNumber, char* FileSystemName, DWOR
 extern HANDLE GetDriveHandle(DWORD DriveIndex, char* DriveLetter, BOOL bWriteAccess, BOOL bLockDrive);
 extern BOOL GetDriveLabel(DWORD DriveIndex, char* letter, char** label);
 extern BOOL UnmountDrive(HANDLE hDrive);
+extern void ProbeFlashGeometry(HANDLE hDrive);
+extern ULONG GetOptimizedClusterSize(int FSType, const RUFUS_ISO_REPORT* report);
+extern ASYNC_WRITER* AsyncWriteOpen(HANDLE hDrive, DWORD MaxSize, BOOL bReopen);
+extern BOOL AsyncWriteSectors(ASYNC_WRITER* aw, uint64_t SectorSize, uint64_t StartSector, uint64_t nSectors, const void* pBuf);
+extern BOOL AsyncWriteFlush(ASYNC_WRITER* aw, uint64_t* ErrorSector);
+extern uint64_t AsyncWriteCompleted(ASYNC_WRITER* aw);
+extern BOOL AsyncWriteClose(ASYNC_WRITER* aw);
+extern BOOL DiscardSectors(HANDLE hDrive, uint64_t SectorSize, uint64_t StartSector, uint64_t nSectors);
 extern BOOL CreateProgress(void);
 extern BOOL SetAutorun(const char* path);
 extern char* FileDialog(BOOL save, char* path, char* filename, char* ext, char* ext_desc);
@@ -296,8 +352,8 @@ extern BOOL FileIO(BOOL save, char* path, char** buffer, DWORD* size);
 extern unsigned char* GetResource(HMODULE module, char* name, char* type, const char* desc, DWORD* len, BOOL duplicate);
 extern BOOL SetLGP(BOOL bRestore, BOOL* bExistingKey, const char* szPath, const char* szPolicy, DWORD dwValue);
 extern LONG GetEntryWidth(HWND hDropDown, const char* entry);
-extern BOOL DownloadFile(const char* url, const char* file, HWND hProgressDialog);
-extern HANDLE DownloadFileThreaded(const char* url, const char* file, HWND hProgressDialog);
+extern BOOL DownloadFile(const char* url, const char* file, HWND hProgressDialog, const char* sha1);
+extern HANDLE DownloadFileThreaded(const char* url, const char* file, HWND hProgressDialog, const char* sha1);
 extern INT_PTR CALLBACK UpdateCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
 extern BOOL SetUpdateCheck(void);
 extern BOOL CheckForUpdates(BOOL force);
@@ -306,10 +362,17 @@ extern BOOL IsShown(HWND hDlg);
 extern char* get_token_data_file(const char* token, const char* filename);
 extern char* get_token_data_buffer(const char* token, unsigned int n, const char* buffer, size_t buffer_size);
 extern char* insert_section_data(const char* filename, const char* section, const char* data, BOOL dos2unix);
+extern BOOL find_in_token_data(const char* filename, const char* token, const char* str);
 extern char* replace_in_token_data(const char* filename, const char* token, const char* src, const char* rep, BOOL dos2unix);
+extern char* replace_in_token_data_buffer(const char* token, const char* src, const char* rep, BOOL dos2unix, char** buffer, size_t* buffer_size);
 extern void parse_update(char* buf, size_t len);
 extern BOOL WimExtractCheck(void);
 extern BOOL WimExtractFile(const char* wim_image, int index, const char* src, const char* dst);
+extern BOOL WimExtractFile_Native(const char* wim_image, int index, const char* src, const char* dst);
+extern BOOL WimIsNativelySupported(const void* buf, size_t size);
+extern BOOL IsVHD(const char* path, uint64_t* disk_size);
+extern BOOL WriteVHD(HANDLE hPhysicalDrive, const char* path);
+extern BOOL WriteRawImage(HANDLE hPhysicalDrive, const char* path);
 
 __inline static BOOL UnlockDrive(HANDLE hDrive)
 {
@@ -38,6 +38,148 @@
 HWND hStatus;
 
 #ifdef RUFUS_DEBUG
+/*
+ * Log messages are not sent to the log window by the thread that produces them, as the
+ * cost of updating the edit control grows with its content and would stall the format
+ * and extraction threads. Instead, they are appended to a lock-free multi-producer ring
+ * buffer, which is drained by the UI thread, in batches, on a timer.
+ * Messages are split into as many consecutive slots as they need, which are reserved
+ * atomically. If the ring is full, the message is dropped and accounted for.
+ */
+#define LOG_RING_SLOTS          512		// must be a power of 2
+#define LOG_SLOT_SIZE           256
+#define LOG_FLUSH_INTERVAL      100		// in ms
+// A slot sequence is even when the slot is free for a given lap, and odd when it holds data
+#define LOG_SEQ_FREE(pos)       (((pos) / LOG_RING_SLOTS) * 2)
+#define LOG_SEQ_USED(pos)       (LOG_SEQ_FREE(pos) + 1)
+typedef struct {
+	volatile LONG seq;
+	DWORD len;
+	char data[LOG_SLOT_SIZE];
+} log_slot;
+static log_slot log_ring[LOG_RING_SLOTS];
+static volatile LONG log_tail = 0, log_dropped = 0, log_drainer = 0;
+static DWORD log_head = 0, log_thread_id = 0;
+static BOOL log_stopped = FALSE;
+
+static void LogEnqueue(const char* buf, size_t len)
+{
+	DWORD i, pos, n = (DWORD)((len + LOG_SLOT_SIZE - 1) / LOG_SLOT_SIZE);
+	log_slot* slot;
+
+	do {
+		pos = (DWORD)log_tail;
+		// Slots are released in order, so if the last one we need is free, all of them are
+		if (log_ring[(pos + n - 1) & (LOG_RING_SLOTS - 1)].seq != (LONG)LOG_SEQ_FREE(pos + n - 1)) {
+			InterlockedIncrement(&log_dropped);
+			return;
+		}
+	} while (InterlockedCompareExchange(&log_tail, (LONG)(pos + n), (LONG)pos) != (LONG)pos);
+
+	for (i = 0; i < n; i++) {
+		slot = &log_ring[(pos + i) & (LOG_RING_SLOTS - 1)];
+		slot->len = (DWORD)min(len, LOG_SLOT_SIZE);
+		memcpy(slot->data, buf, slot->len);
+		buf += slot->len;
+		len -= slot->len;
+		InterlockedExchange(&slot->seq, LOG_SEQ_USED(pos + i));
+	}
+}
+
+/*
+ * Send all pending log messages to the debug facility and, if requested, to the log window.
+ * Only one thread drains the ring at any time: a call made while another drain is in progress
+ * (including a reentrant one) returns right away.
+ */
+static void DrainLog(BOOL to_window)
+{
+	static char buf[64*1024];
+	log_slot* slot;
+	size_t size;
+	LONG dropped;
+
+	if (InterlockedCompareExchange(&log_drainer, (LONG)GetCurrentThreadId(), 0) != 0)
+		return;
+	do {
+		size = 0;
+		dropped = InterlockedExchange(&log_dropped, 0);
+		if (dropped != 0) {
+			safe_sprintf(buf, sizeof(buf), "[%d log message(s) dropped]\r\n", dropped);
+			size = strlen(buf);
+		}
+		while (size + LOG_SLOT_SIZE < sizeof(buf)) {
+			slot = &log_ring[log_head & (LOG_RING_SLOTS - 1)];
+			if (slot->seq != (LONG)LOG_SEQ_USED(log_head))
+				break;
+			memcpy(&buf[size], slot->data, slot->len);
+			size += slot->len;
+			InterlockedExchange(&slot->seq, LOG_SEQ_FREE(log_head + LOG_RING_SLOTS));
+			log_head++;
+		}
+		if (size == 0)
+			break;
+		buf[size] = 0;
+		// Send output to Windows debug facility
+		OutputDebugStringA(buf);
+		// Send output to our log Window
+		if ((to_window) && (hLog != NULL)) {
+			Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
+			Edit_ReplaceSelU(hLog, buf);
+			// Make sure the message scrolls into view
+			// (Or see code commented in LogProc:WM_SHOWWINDOW for a less forceful scroll)
+			SendMessage(hLog, EM_LINESCROLL, 0, SendMessage(hLog, EM_GETLINECOUNT, 0, 0));
+		}
+	} while (size + LOG_SLOT_SIZE >= sizeof(buf));
+	InterlockedExchange(&log_drainer, 0);
+}
+
+/*
+ * Send all pending log messages to the debug facility and the log window.
+ * Must only be called from the UI thread.
+ */
+void FlushLog(void)
+{
+	DrainLog(TRUE);
+}
+
+/*
+ * Don't lose the messages that led to a crash: the log window can't be updated from
+ * the faulting thread, but the debug facility can.
+ */
+static LONG WINAPI LogCrashHandler(EXCEPTION_POINTERS* ExceptionInfo)
+{
+	DrainLog(FALSE);
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void CALLBACK LogTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
+{
+	FlushLog();
+}
+
+/*
+ * Start draining the log ring buffer. Must be called from the UI thread.
+ */
+void StartLogger(HWND hWnd)
+{
+	log_thread_id = GetCurrentThreadId();
+	SetUnhandledExceptionFilter(LogCrashHandler);
+	SetTimer(hWnd, TID_LOG_UPDATE, LOG_FLUSH_INTERVAL, LogTimer);
+	FlushLog();
+}
+
+/*
+ * Drain whatever is left in the ring on exit, once the log window is gone. Messages
+ * logged after this call go straight to the debug facility, whichever thread they
+ * come from.
+ */
+void StopLogger(void)
+{
+	log_stopped = TRUE;
+	hLog = NULL;
+	DrainLog(FALSE);
+}
+
 void _uprintf(const char *format, ...)
 {
 	char buf[4096], *p = buf;
@@ -57,14 +199,11 @@ void _uprintf(const char *format, ...)
 	*p++ = '\n';
 	*p   = '\0';
 
-	// Send output to Windows debug facility
-	OutputDebugStringA(buf);
-	// Send output to our log Window
-	Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-	Edit_ReplaceSelU(hLog, buf);
-	// Make sure the message scrolls into view
-	// (Or see code commented in LogProc:WM_SHOWWINDOW for a less forceful scroll)
-	SendMessage(hLog, EM_LINESCROLL, 0, SendMessage(hLog, EM_GETLINECOUNT, 0, 0));
+	LogEnqueue(buf, p - buf);
+	// Messages from the UI thread are displayed right away, as are all messages once the
+	// logger has been stopped
+	if ((log_stopped) || (GetCurrentThreadId() == log_thread_id))
+		DrainLog(!log_stopped);
 }
 #endif
 
@@ -275,3 +414,144 @@ const char* StrError(DWORD error_code)
 		return WindowsErrorString();
 	}
 }
+
+/*
+ * I/O instrumentation: phase durations, bytes and operations moved, and latency
+ * histograms (in power of 2 microseconds buckets) for each type of I/O.
+ * Phases are only changed by the format thread, but I/O is also recorded by the async writer
+ * and ISO readahead threads, so the I/O counters are updated with interlocked operations.
+ */
+#define IOS_NB_BUCKETS 24
+typedef struct {
+	uint64_t duration;		// in performance counter ticks
+	volatile LONGLONG bytes[IOS_MAX];
+	volatile LONG ops[IOS_MAX];
+	volatile LONG latency[IOS_MAX][IOS_NB_BUCKETS];
+} phase_stats;
+static phase_stats io_stats[OP_MAX+1];	// OP_MAX is used for anything outside of a phase
+static volatile int io_phase = OP_MAX;
+static uint64_t io_phase_start, io_stats_start;
+static LARGE_INTEGER io_freq = { 0 };
+static const char* io_phase_name[OP_MAX+1] = { "badblocks", "zero_mbr", "partition", "format",
+	"create_fs", "fix_mbr", "copy_files", "finalize", "other" };
+static const char* io_type_name[IOS_MAX] = { "device_read", "device_write", "source_read", "file_write" };
+
+uint64_t IOStatsTimestamp(void)
+{
+	LARGE_INTEGER ts;
+	QueryPerformanceCounter(&ts);
+	return (uint64_t)ts.QuadPart;
+}
+
+static __inline uint64_t TicksToUs(uint64_t ticks)
+{
+	return (io_freq.QuadPart == 0)?0:(ticks * 1000000ULL) / (uint64_t)io_freq.QuadPart;
+}
+
+void IOStatsReset(void)
+{
+	QueryPerformanceFrequency(&io_freq);
+	memset((void*)io_stats, 0, sizeof(io_stats));
+	io_phase = OP_MAX;
+	io_stats_start = io_phase_start = IOStatsTimestamp();
+}
+
+// Mark the start of a new phase. Durations accumulate if a phase is entered more than once.
+void IOStatsSetPhase(int op)
+{
+	uint64_t now = IOStatsTimestamp();
+
+	if ((op < 0) || (op > OP_MAX))
+		return;
+	io_stats[io_phase].duration += now - io_phase_start;
+	io_phase = op;
+	io_phase_start = now;
+}
+
+// InterlockedExchangeAdd64() is not available for x86 when targeting XP, but
+// InterlockedCompareExchange64() is. A torn read of the addend just fails the exchange.
+static __inline void InterlockedAdd64Compat(volatile LONGLONG* addend, LONGLONG value)
+{
+	LONGLONG old;
+
+	do {
+		old = *addend;
+	} while (InterlockedCompareExchange64(addend, old + value, old) != old);
+}
+
+// Record an I/O operation of 'bytes' that started at timestamp 'start'
+void IOStatsRecord(int type, uint64_t bytes, uint64_t start)
+{
+	uint64_t us = TicksToUs(IOStatsTimestamp() - start);
+	int bucket = 0, phase = io_phase;
+
+	if ((type < 0) || (type >= IOS_MAX))
+		return;
+	while ((us >>= 1) && (bucket < IOS_NB_BUCKETS - 1))
+		bucket++;
+	InterlockedAdd64Compat(&io_stats[phase].bytes[type], (LONGLONG)bytes);
+	InterlockedIncrement(&io_stats[phase].ops[type]);
+	InterlockedIncrement(&io_stats[phase].latency[type][bucket]);
+}
+
+/*
+ * Close the current phase, log a summary and save a JSON report of the statistics
+ * in the user directory
+ */
+void IOStatsReport(void)
+{
+	int i, j, k;
+	BOOL first = TRUE;
+	uint64_t ms;
+	char path[MAX_PATH], *userdir;
+	SYSTEMTIME lt;
+	FILE* fd = NULL;
+
+	IOStatsSetPhase(OP_MAX);
+	uprintf("I/O statistics (total: %llu ms):\n", TicksToUs(IOStatsTimestamp() - io_stats_start) / 1000);
+	for (i = 0; i <= OP_MAX; i++) {
+		if (io_stats[i].duration == 0)
+			continue;
+		ms = TicksToUs(io_stats[i].duration) / 1000;
+		uprintf("  %s: %llu ms\n", io_phase_name[i], ms);
+		for (j = 0; j < IOS_MAX; j++) {
+			if (io_stats[i].ops[j] == 0)
+				continue;
+			uprintf("    %s: %llu bytes in %u ops (%0.1f MB/s)\n", io_type_name[j], (uint64_t)io_stats[i].bytes[j],
+				(uint32_t)io_stats[i].ops[j], (ms == 0)?0.0:(io_stats[i].bytes[j] / 1048.576) / ms);
+		}
+	}
+
+	userdir = getenvU("USERPROFILE");
+	safe_strcpy(path, MAX_PATH, userdir);
+	safe_free(userdir);
+	GetLocalTime(&lt);
+	safe_sprintf(&path[strlen(path)], sizeof(path)-strlen(path)-1,
+		"\\rufus_%04d%02d%02d_%02d%02d%02d.json",
+		lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
+	fd = fopenU(path, "w");
+	if (fd == NULL) {
+		uprintf("Could not create I/O report file '%s'\n", path);
+		return;
+	}
+	fprintf(fd, "{\n  \"status\": \"0x%08X\",\n  \"total_ms\": %llu,\n  \"phases\": [", FormatStatus,
+		TicksToUs(IOStatsTimestamp() - io_stats_start) / 1000);
+	for (i = 0; i <= OP_MAX; i++) {
+		if (io_stats[i].duration == 0)
+			continue;
+		fprintf(fd, "%s\n    { \"name\": \"%s\", \"duration_ms\": %llu, \"io\": {", first?"":",",
+			io_phase_name[i], TicksToUs(io_stats[i].duration) / 1000);
+		first = FALSE;
+		for (j = 0; j < IOS_MAX; j++) {
+			fprintf(fd, "%s\n      \"%s\": { \"bytes\": %llu, \"ops\": %u, \"latency_us_log2\": [",
+				(j == 0)?"":",", io_type_name[j], (uint64_t)io_stats[i].bytes[j], (uint32_t)io_stats[i].ops[j]);
+			for (k = 0; k < IOS_NB_BUCKETS; k++)
+				fprintf(fd, "%s%u", (k == 0)?"":", ", (uint32_t)io_stats[i].latency[j][k]);
+			fprintf(fd, "] }");
+		}
+		fprintf(fd, "\n    } }");
+	}
+	fprintf(fd, "\n  ]\n}\n");
+	fclose(fd);
+	uprintf("I/O report saved as '%s'\n", path);
+}
@@ -1142,7 +1142,7 @@ INT_PTR CALLBACK NewVersionCallback(HWND hDlg, UINT message, WPARAM wParam, LPAR
 				for (i=(int)safe_strlen(update.download_url); (i>0)&&(update.download_url[i]!='/'); i--);
 				filepath = FileDialog(TRUE, app_dir, (char*)&update.download_url[i+1], "exe", "Application");
 				if (filepath != NULL)
-					DownloadFileThreaded(update.download_url, filepath, hDlg);
+					DownloadFileThreaded(update.download_url, filepath, hDlg, update.download_sha1);
 				break;
 			}
 			return (INT_PTR)TRUE;
@@ -28,12 +28,17 @@
 
 #include "rufus.h"
 #include "resource.h"
+#include "file.h"
+#include "format.h"
 
 #include "syslinux.h"
 #include "syslxfs.h"
 #include "libfat.h"
 #include "setadv.h"
 
+// How much of the FAT we look into for a free cluster run, when placing ldlinux.sys directly
+#define LDLINUX_FAT_SCAN_SIZE	(64*1024)
+
 unsigned char* syslinux_ldlinux = NULL;
 DWORD syslinux_ldlinux_len;
 unsigned char* syslinux_bootsect = NULL;
@@ -62,6 +67,215 @@ int libfat_readfile(intptr_t pp, void *buf, size_t secsize,
 	return (int)secsize;
 }
 
+/*
+ * Install ldlinux.sys on a freshly formatted FAT16 or FAT32 volume, by allocating
+ * a contiguous cluster run for it straight into the FAT. As the sector map is then
+ * known beforehand, ldlinux.sys can be patched in memory, and the file data, FATs,
+ * directory entry and boot record written in a single batch, rather than through
+ * the file system, with a flush and a second pass to patch the file.
+ * Returns FALSE without writing anything if the volume doesn't have the expected
+ * layout, so that the caller can fall back to the file system. Write errors are
+ * reported in FormatStatus.
+ */
+static BOOL InstallSyslinuxDirect(HANDLE hVolume, DWORD BytesPerSect)
+{
+	BOOL r = FALSE;
+	FAT_BOOTSECTOR32* pBootSect = NULL;
+	FAT_FSINFO* pFsInfo = NULL;
+	FAT_DIRENT* pDirent = NULL;
+	BYTE *pFAT = NULL, *pDir = NULL, *pData = NULL;
+	ASYNC_WRITER* aw = NULL;
+	sector_t* sectors = NULL;
+	const char* errmsg;
+	int fs_type, nsectors;
+	DWORD i, c, e, FatBits, FatSize, TotSec, RootDirSectors, DataStart, NbClusters, NbEntries;
+	DWORD ClusterSize, FileSize, NbAlloc, RunStart = 0, RunSize = 0, FatSects, DirStart, DirSects;
+	DWORD FirstSect, LastSect, MaxSize;
+	SYSTEMTIME st;
+
+	if ((BytesPerSect < SECTOR_SIZE) || (BytesPerSect % SECTOR_SIZE != 0))
+		return FALSE;
+	pBootSect = (FAT_BOOTSECTOR32*)calloc(BytesPerSect, 1);
+	if (pBootSect == NULL)
+		goto out;
+	if (read_sectors(hVolume, BytesPerSect, 0, 1, pBootSect) != BytesPerSect) {
+		uprintf("Could not read boot record: %s\n", WindowsErrorString());
+		goto out;
+	}
+	errmsg = syslinux_check_bootsect(pBootSect, &fs_type);
+	if ((errmsg != NULL) || (fs_type != VFAT) || (pBootSect->wBytsPerSec != BytesPerSect)) {
+		uprintf("Unexpected boot record for direct Syslinux installation%s%s\n",
+			(errmsg != NULL)?": ":"", (errmsg != NULL)?errmsg:"");
+		goto out;
+	}
+
+	// Same FAT type determination as the MS specs, from the cluster count
+	FatSize = (pBootSect->wFATSz16 != 0)?pBootSect->wFATSz16:pBootSect->dFATSz32;
+	TotSec = (pBootSect->wTotSec16 != 0)?pBootSect->wTotSec16:pBootSect->dTotSec32;
+	RootDirSectors = (pBootSect->wRootEntCnt * sizeof(FAT_DIRENT) + BytesPerSect - 1) / BytesPerSect;
+	DataStart = pBootSect->wRsvdSecCnt + pBootSect->bNumFATs * FatSize + RootDirSectors;
+	NbClusters = (TotSec - DataStart) / pBootSect->bSecPerClus;
+	FatBits = (NbClusters < 4085)?12:((NbClusters < 65525)?16:32);
+	if (FatBits == 12) {
+		uprintf("Direct Syslinux installation is not supported on FAT12\n");
+		goto out;
+	}
+
+	// Look for a run of free clusters large enough for ldlinux.sys, and its ADV, in the first part of the FAT
+	ClusterSize = BytesPerSect * pBootSect->bSecPerClus;
+	FileSize = syslinux_ldlinux_len + 2 * ADV_SIZE;
+	NbAlloc = (FileSize + ClusterSize - 1) / ClusterSize;
+	FatSects = min(FatSize, LDLINUX_FAT_SCAN_SIZE / BytesPerSect);
+	NbEntries = min(FatSects * BytesPerSect * 8 / FatBits, NbClusters + 2);
+	pFAT = (BYTE*)malloc((size_t)FatSects * BytesPerSect);
+	if ( (pFAT == NULL) || (read_sectors(hVolume, BytesPerSect, pBootSect->wRsvdSecCnt, FatSects, pFAT)
+	  != (int64_t)FatSects * BytesPerSect) ) {
+		uprintf("Could not read FAT\n");
+		goto out;
+	}
+	for (c=2; (c<NbEntries) && (RunSize<NbAlloc); c++) {
+		e = (FatBits == 16)?((WORD*)pFAT)[c]:(((DWORD*)pFAT)[c] & 0x0FFFFFFF);
+		if (e != 0) {
+			RunSize = 0;
+			continue;
+		}
+		if (RunSize++ == 0)
+			RunStart = c;
+	}
+	if (RunSize < NbAlloc) {
+		uprintf("No contiguous free space for ldlinux.sys at the start of the volume\n");
+		goto out;
+	}
+
+	// The root directory must be terminated within its first cluster (FAT32) or sectors, so that
+	// we know there is no ldlinux.sys already
+	if (FatBits == 16) {
+		DirStart = pBootSect->wRsvdSecCnt + pBootSect->bNumFATs * FatSize;
+		DirSects = min(RootDirSectors, LDLINUX_FAT_SCAN_SIZE / BytesPerSect);
+	} else {
+		DirStart = DataStart + (pBootSect->dRootClus - 2) * pBootSect->bSecPerClus;
+		DirSects = pBootSect->bSecPerClus;
+	}
+	pDir = (BYTE*)malloc((size_t)DirSects * BytesPerSect);
+	if ( (pDir == NULL) || (read_sectors(hVolume, BytesPerSect, DirStart, DirSects, pDir)
+	  != (int64_t)DirSects * BytesPerSect) ) {
+		uprintf("Could not read root directory\n");
+		goto out;
+	}
+	for (i=0; i<DirSects*BytesPerSect/sizeof(FAT_DIRENT); i++) {
+		if ((((FAT_DIRENT*)pDir)[i].sName[0] == 0xE5) && (pDirent == NULL))
+			pDirent = &((FAT_DIRENT*)pDir)[i];
+		if (((FAT_DIRENT*)pDir)[i].sName[0] == 0x00)
+			break;
+		if ( (((FAT_DIRENT*)pDir)[i].bAttr != 0x0F)
+		  && (memcmp(((FAT_DIRENT*)pDir)[i].sName, "LDLINUX SYS", 11) == 0) ) {
+			uprintf("ldlinux.sys already exists\n");
+			goto out;
+		}
+	}
+	if (i >= DirSects*BytesPerSect/sizeof(FAT_DIRENT)) {
+		uprintf("Root directory is not empty enough for direct Syslinux installation\n");
+		goto out;
+	}
+	if (pDirent == NULL)
+		pDirent = &((FAT_DIRENT*)pDir)[i];
+
+	// Map and patch ldlinux.sys and the boot sector (in 512 bytes sectors, regardless of the sector size)
+	nsectors = (FileSize + SECTOR_SIZE - 1) >> SECTOR_SHIFT;
+	sectors = (sector_t*)calloc(nsectors, sizeof(sector_t));
+	pData = (BYTE*)calloc(NbAlloc, ClusterSize);
+	if ((sectors == NULL) || (pData == NULL))
+		goto out;
+	for (i=0; i<(DWORD)nsectors; i++)
+		sectors[i] = (DataStart + (uint64_t)(RunStart - 2) * pBootSect->bSecPerClus) * (BytesPerSect / SECTOR_SIZE) + i;
+	if (syslinux_patch(sectors, nsectors, 0, 0, NULL, NULL) < 0) {
+		uprintf("Could not patch ldlinux.sys\n");
+		goto out;
+	}
+	memcpy(pData, syslinux_ldlinux, syslinux_ldlinux_len);
+	memcpy(&pData[syslinux_ldlinux_len], syslinux_adv, 2 * ADV_SIZE);
+	syslinux_make_bootsect(pBootSect, VFAT);
+
+	// Chain the clusters
+	for (c=RunStart; c<RunStart+NbAlloc; c++) {
+		e = (c == RunStart+NbAlloc-1)?0x0FFFFFFF:c+1;
+		if (FatBits == 16)
+			((WORD*)pFAT)[c] = (WORD)e;
+		else
+			((DWORD*)pFAT)[c] = (((DWORD*)pFAT)[c] & 0xF0000000) | e;
+	}
+	FirstSect = RunStart * (FatBits/8) / BytesPerSect;
+	LastSect = ((RunStart + NbAlloc) * (FatBits/8) - 1) / BytesPerSect;
+
+	// Add the directory entry. The lowercase flags of the reserved byte make it display as 'ldlinux.sys'
+	memset(pDirent, 0, sizeof(FAT_DIRENT));
+	memcpy(pDirent->sName, "LDLINUX SYS", 11);
+	pDirent->bAttr = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_ARCHIVE;
+	pDirent->bNTRes = 0x18;
+	GetLocalTime(&st);
+	pDirent->wCrtDate = pDirent->wLstAccDate = pDirent->wWrtDate = ((st.wYear - 1980) << 9) | (st.wMonth << 5) | st.wDay;
+	pDirent->wCrtTime = pDirent->wWrtTime = (st.wHour << 11) | (st.wMinute << 5) | (st.wSecond / 2);
+	pDirent->wFstClusHI = (WORD)(RunStart >> 16);
+	pDirent->wFstClusLO = (WORD)RunStart;
+	pDirent->dFileSize = FileSize;
+
+	// Keep the free cluster count in sync
+	if ((FatBits == 32) && (pBootSect->wFSInfo != 0)) {
+		pFsInfo = (FAT_FSINFO*)calloc(BytesPerSect, 1);
+		if ( (pFsInfo != NULL) && (read_sectors(hVolume, BytesPerSect, pBootSect->wFSInfo, 1, pFsInfo) == BytesPerSect)
+		  && (pFsInfo->dLeadSig == 0x41615252) && (pFsInfo->dStrucSig == 0x61417272) ) {
+			if ((pFsInfo->dFree_Count != 0xFFFFFFFF) && (pFsInfo->dFree_Count >= NbAlloc))
+				pFsInfo->dFree_Count -= NbAlloc;
+			pFsInfo->dNxt_Free = RunStart + NbAlloc;
+		} else {
+			safe_free(pFsInfo);
+		}
+	}
+
+	// Now write everything in one go. The boot record, which makes the volume point to ldlinux.sys,
+	// is only written once everything else is on the media
+	MaxSize = max(NbAlloc * ClusterSize, max((LastSect - FirstSect + 1), DirSects) * BytesPerSect);
+	aw = AsyncWriteOpen(hVolume, MaxSize, FALSE);
+	if (aw == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	AsyncWriteSectors(aw, BytesPerSect, DataStart + (uint64_t)(RunStart - 2) * pBootSect->bSecPerClus,
+		NbAlloc * pBootSect->bSecPerClus, pData);
+	for (i=0; i<pBootSect->bNumFATs; i++)
+		AsyncWriteSectors(aw, BytesPerSect, pBootSect->wRsvdSecCnt + i * FatSize + FirstSect,
+			LastSect - FirstSect + 1, &pFAT[FirstSect * BytesPerSect]);
+	AsyncWriteSectors(aw, BytesPerSect, DirStart, DirSects, pDir);
+	if (pFsInfo != NULL)
+		AsyncWriteSectors(aw, BytesPerSect, pBootSect->wFSInfo, 1, pFsInfo);
+	if (!AsyncWriteFlush(aw, NULL)) {
+		uprintf("Could not write ldlinux.sys\n");
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		goto out;
+	}
+	uprintf("Succesfully wrote 'ldlinux.sys' at cluster %d (%d clusters)\n", RunStart, NbAlloc);
+	AsyncWriteSectors(aw, BytesPerSect, 0, 1, pBootSect);
+	r = AsyncWriteClose(aw);
+	aw = NULL;
+	if (!r) {
+		uprintf("Could not write boot record\n");
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		goto out;
+	}
+	uprintf("Succesfully wrote Syslinux boot record\n");
+
+out:
+	if (aw != NULL)
+		AsyncWriteClose(aw);
+	safe_free(pBootSect);
+	safe_free(pFsInfo);
+	safe_free(pFAT);
+	safe_free(pDir);
+	safe_free(pData);
+	safe_free(sectors);
+	return r;
+}
+
 /*
  * Extract the ldlinux.sys and ldlinux.bss from resources,
  * then patch and install them
@@ -98,6 +312,27 @@ BOOL InstallSyslinux(DWORD num, const char* drive_name)
 		goto out;
 	}
 
+	/* Place ldlinux.sys directly onto the volume if we can. As we modify the FAT behind the
+	   back of the file system, this requires a lock, so that nothing can remount the volume
+	   in the meantime. If something else has the volume open, use the file system instead. */
+	d_handle = GetDriveHandle(num, (char*)drive_name, TRUE, TRUE);
+	if (d_handle == INVALID_HANDLE_VALUE) {
+		uprintf("Could not lock the volume for direct Syslinux installation\n");
+	} else if ( (UnmountDrive(d_handle))
+	  && (InstallSyslinuxDirect(d_handle, SelectedDrive.Geometry.BytesPerSector)) ) {
+		safe_unlockclose(d_handle);
+		if (dt == DT_SYSLINUX) {
+			UpdateProgress(OP_DOS, -1.0f);
+			UpdateProgress(OP_DOS, -1.0f);
+		}
+		r = TRUE;
+		goto out;
+	}
+	safe_unlockclose(d_handle);
+	if (IS_ERROR(FormatStatus))
+		goto out;
+	uprintf("Installing Syslinux through the file system\n");
+
 	/* Create ldlinux.sys file */
 	f_handle = CreateFileA(ldlinux_name, GENERIC_READ | GENERIC_WRITE,
 			  FILE_SHARE_READ | FILE_SHARE_WRITE,
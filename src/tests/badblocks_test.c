@@ -0,0 +1,366 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Test for the bad blocks check, against simulated devices
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build and run from the src directory, with MinGW:
+ *   gcc -O2 -DRUFUS_DEBUG -I. -Ims-sys/inc -o badblocks_test.exe tests/badblocks_test.c
+ *     && badblocks_test.exe
+ *
+ * Speed map: BadBlocks() is run against a simulated 1 GB device, which runs on a virtual clock
+ * so that its speed is exactly known. Writes go at 60 MB/s until a given amount has
+ * been written in the current pass, as long as an SLC cache would last, and then at
+ * 10 MB/s. Reads go at 80 MB/s, except in one 64 MB region where they drop to 2 MB/s.
+ * The burst and sustained write speeds, the read speed and each region of the speed
+ * map must match these, and only the slow read region must be flagged.
+ * The test patterns are uniform, as long as detect_fakes is off, so the device only
+ * needs to keep one byte per block.
+ *
+ * Read only scan: BadBlocks() is run against a 64 MB file, where any read, be it
+ * synchronous or overlapped, that covers one of the injected bad blocks fails. Each of
+ * these must be reported, adjacent ones as a single range, and the file never written.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+
+// Reads of the file backed device fail if they cover any of these blocks
+static const uint64_t bad_blocks[] = { 1000, 1001, 1002, 5000, 100000, 131071 };
+static int nb_reads = 0, nb_writes = 0;
+
+static BOOL IsBadRange(uint64_t offset, uint64_t size)
+{
+	int i;
+
+	nb_reads++;
+	for (i = 0; i < ARRAYSIZE(bad_blocks); i++) {
+		if ((bad_blocks[i] * 512 >= offset) && (bad_blocks[i] * 512 < offset + size))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// The overlapped reads of the read only scan go straight to ReadFile()
+static BOOL ReadFileHook(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead,
+	LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped)
+{
+	if ((lpOverlapped != NULL) && (IsBadRange(lpOverlapped->Offset |
+		((uint64_t)lpOverlapped->OffsetHigh << 32), nNumberOfBytesToRead))) {
+		SetLastError(ERROR_CRC);
+		return FALSE;
+	}
+	return ReadFile(hFile, lpBuffer, nNumberOfBytesToRead, lpNumberOfBytesRead, lpOverlapped);
+}
+#define ReadFile ReadFileHook
+
+#include "../badblocks.c"
+
+// Referenced by badblocks.c
+HWND hMainDialog = NULL;
+DWORD FormatStatus = 0;
+BOOL detect_fakes = FALSE;
+
+#define MB                  (1024ULL*1024ULL)
+#define DEVICE_SIZE         (1024*MB)
+#define BLOCK_SIZE          512
+#define FAST_WRITE_SPEED    60.0
+#define SLOW_WRITE_SPEED    10.0
+#define READ_SPEED          80.0
+#define SLOW_READ_SPEED     2.0
+#define SLOW_READ_OFFSET    (512*MB)
+
+static LARGE_INTEGER freq;
+static uint64_t clock_ticks = 0, write_cache, write_cache_left;
+static BYTE* device = NULL;
+static int nb_failed = 0;
+
+void _uprintf(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+}
+
+const char *WindowsErrorString(void)
+{
+	static char err_string[64];
+
+	sprintf(err_string, "error %lu", GetLastError());
+	return err_string;
+}
+
+void PrintStatus(unsigned int duration, BOOL debug, const char *format, ...)
+{
+}
+
+void UpdateProgress(int op, float percent)
+{
+}
+
+uint64_t IOStatsTimestamp(void)
+{
+	return clock_ticks;
+}
+
+void IOStatsRecord(int type, uint64_t bytes, uint64_t start)
+{
+}
+
+// Advance the virtual clock by the time it takes to transfer bytes at speed MB/s
+static void Charge(uint64_t bytes, double speed)
+{
+	clock_ticks += (uint64_t)((double)bytes * freq.QuadPart / (speed * MB));
+}
+
+// The simulated device is used when hDrive is NULL, and the file backed one otherwise
+int64_t write_sectors(void *hDrive, uint64_t SectorSize, uint64_t StartSector, uint64_t nSectors, const void *pBuf)
+{
+	const BYTE* buf = (const BYTE*)pBuf;
+	uint64_t i, fast;
+
+	if (hDrive != NULL) {
+		nb_writes++;
+		return -1;
+	}
+	// Each pass starts from the first block, with an empty cache
+	if (StartSector == 0)
+		write_cache_left = write_cache;
+	fast = min(nSectors * SectorSize, write_cache_left);
+	write_cache_left -= fast;
+	Charge(fast, FAST_WRITE_SPEED);
+	Charge(nSectors * SectorSize - fast, SLOW_WRITE_SPEED);
+	for (i = 0; i < nSectors; i++) {
+		if (memcmp(&buf[i * SectorSize], &buf[i * SectorSize + 1], (size_t)SectorSize - 1) != 0)
+			return -1;
+		device[StartSector + i] = buf[i * SectorSize];
+	}
+	return nSectors * SectorSize;
+}
+
+int64_t read_sectors(void *hDrive, uint64_t SectorSize, uint64_t StartSector, uint64_t nSectors, void *pBuf)
+{
+	uint64_t i, offset = StartSector * SectorSize;
+	LARGE_INTEGER ptr;
+	DWORD size;
+
+	if (hDrive != NULL) {
+		ptr.QuadPart = offset;
+		if ((IsBadRange(offset, nSectors * SectorSize)) || (!SetFilePointerEx(hDrive, ptr, NULL, FILE_BEGIN)) ||
+			(!ReadFile(hDrive, pBuf, (DWORD)(nSectors * SectorSize), &size, NULL)))
+			return -1;
+		return size;
+	}
+	Charge(nSectors * SectorSize, ((offset >= SLOW_READ_OFFSET) && (offset < SLOW_READ_OFFSET + 64*MB)) ?
+		SLOW_READ_SPEED : READ_SPEED);
+	for (i = 0; i < nSectors; i++)
+		memset((BYTE*)pBuf + i * SectorSize, device[StartSector + i], (size_t)SectorSize);
+	return nSectors * SectorSize;
+}
+
+// Writes are performed synchronously, which is how a full asynchronous queue behaves
+ASYNC_WRITER* AsyncWriteOpen(HANDLE hDrive, DWORD MaxSize, BOOL bReopen)
+{
+	return (ASYNC_WRITER*)&device;
+}
+
+BOOL AsyncWriteSectors(ASYNC_WRITER* aw, uint64_t SectorSize, uint64_t StartSector, uint64_t nSectors, const void* pBuf)
+{
+	return (write_sectors(NULL, SectorSize, StartSector, nSectors, pBuf) == (int64_t)(nSectors * SectorSize));
+}
+
+BOOL AsyncWriteFlush(ASYNC_WRITER* aw, uint64_t* ErrorSector)
+{
+	return TRUE;
+}
+
+BOOL AsyncWriteClose(ASYNC_WRITER* aw)
+{
+	return TRUE;
+}
+
+static void CheckSpeed(const char* name, double speed, double expected)
+{
+	if (fabs(speed - expected) > expected / 100.0) {
+		printf("FAIL: %s: got %0.2f MB/s, expected %0.2f MB/s\n", name, speed, expected);
+		nb_failed++;
+	}
+}
+
+// Run a check with the given number of passes, where writes slow down after cache bytes
+static void CheckSpeedMap(int nb_passes, uint64_t cache)
+{
+	badblocks_report report;
+	FILE *log_fd, *speed_fd;
+	char line[256], name[64];
+	int pass, slow, nb_lines = 0;
+	double offset, size, w, r, lat_avg, lat_max, fast, expected;
+
+	printf("%d pass%s, writes slow down after %I64u MB:\n", nb_passes, (nb_passes == 1) ? "" : "es", cache / MB);
+	write_cache = cache;
+	log_fd = fopen("badblocks_test.log", "w+");
+	speed_fd = fopen("badblocks_test.csv", "w+");
+	if ((log_fd == NULL) || (speed_fd == NULL)) {
+		printf("FAIL: could not create the log files\n");
+		nb_failed++;
+		goto out;
+	}
+	if ((!BadBlocks(NULL, DEVICE_SIZE, BLOCK_SIZE, nb_passes, &report, log_fd, speed_fd)) || (report.bb_count != 0)) {
+		printf("FAIL: the check failed, or reported %u bad blocks\n", report.bb_count);
+		nb_failed++;
+		goto out;
+	}
+	CheckSpeed("burst write speed", report.burst_write_speed, FAST_WRITE_SPEED);
+	CheckSpeed("sustained write speed", report.sustained_write_speed,
+		(DEVICE_SIZE / MB) / (cache / MB / FAST_WRITE_SPEED + (DEVICE_SIZE - cache) / MB / SLOW_WRITE_SPEED));
+	CheckSpeed("read speed", report.read_speed,
+		(DEVICE_SIZE / MB) / ((DEVICE_SIZE / MB - 64) / READ_SPEED + 64 / SLOW_READ_SPEED));
+	if (report.num_slow_regions != nb_passes) {
+		printf("FAIL: %u slow regions, expected %d\n", report.num_slow_regions, nb_passes);
+		nb_failed++;
+	}
+
+	// One line per pass and per 64 MB region
+	rewind(speed_fd);
+	fgets(line, sizeof(line), speed_fd);
+	while (fgets(line, sizeof(line), speed_fd) != NULL) {
+		if (sscanf(line, "%d,%lf,%lf,%lf,%lf,%lf,%lf,%d", &pass, &offset, &size, &w, &r,
+			&lat_avg, &lat_max, &slow) != 8) {
+			printf("FAIL: invalid speed map line '%s'\n", line);
+			nb_failed++;
+			break;
+		}
+		nb_lines++;
+		sprintf(name, "pass %d, region at %0.0f MB", pass, offset);
+		fast = min(max((double)cache / MB - offset, 0.0), size);
+		expected = size / (fast / FAST_WRITE_SPEED + (size - fast) / SLOW_WRITE_SPEED);
+		CheckSpeed(name, w, expected);
+		expected = (offset == SLOW_READ_OFFSET / MB) ? SLOW_READ_SPEED : READ_SPEED;
+		CheckSpeed(name, r, expected);
+		if (slow != (offset == SLOW_READ_OFFSET / MB)) {
+			printf("FAIL: %s is %sflagged as slow\n", name, slow ? "" : "not ");
+			nb_failed++;
+		}
+	}
+	if (nb_lines != nb_passes * (int)(DEVICE_SIZE / (64*MB))) {
+		printf("FAIL: the speed map has %d regions, expected %d\n", nb_lines, nb_passes * (int)(DEVICE_SIZE / (64*MB)));
+		nb_failed++;
+	}
+
+out:
+	if (log_fd != NULL)
+		fclose(log_fd);
+	if (speed_fd != NULL)
+		fclose(speed_fd);
+	DeleteFileA("badblocks_test.log");
+	DeleteFileA("badblocks_test.csv");
+}
+
+static void CheckReadOnlyScan(void)
+{
+	badblocks_report report;
+	HANDLE hFile;
+	FILE *log_fd = NULL;
+	char line[256];
+	BYTE* buf = NULL;
+	uint64_t first, last;
+	DWORD i, size;
+	int j, nb_ranges = 0;
+
+	printf("Read only scan, with %d bad blocks:\n", (int)ARRAYSIZE(bad_blocks));
+	hFile = CreateFileA("badblocks_test.img", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, CREATE_ALWAYS, 0, NULL);
+	buf = (BYTE*)malloc(MB);
+	log_fd = fopen("badblocks_test.log", "w+");
+	if ((hFile == INVALID_HANDLE_VALUE) || (buf == NULL) || (log_fd == NULL)) {
+		printf("FAIL: could not create the test files\n");
+		nb_failed++;
+		goto out;
+	}
+	memset(buf, 0x5A, MB);
+	for (i = 0; i < 64; i++) {
+		if (!WriteFile(hFile, buf, MB, &size, NULL) || (size != MB)) {
+			printf("FAIL: could not write the test file\n");
+			nb_failed++;
+			goto out;
+		}
+	}
+	nb_reads = 0;
+	if ((!BadBlocks(hFile, 64 * MB, BLOCK_SIZE, BB_READ_ONLY, &report, log_fd, NULL)) ||
+		(report.bb_count != ARRAYSIZE(bad_blocks)) || (report.num_read_errors != ARRAYSIZE(bad_blocks))) {
+		printf("FAIL: the scan failed, or reported %u bad blocks, with %u read errors\n", report.bb_count,
+			report.num_read_errors);
+		nb_failed++;
+	}
+	if (nb_writes != 0) {
+		printf("FAIL: the scan wrote to the device\n");
+		nb_failed++;
+	}
+	printf("  %d reads, for 64 in a scan without errors\n", nb_reads);
+
+	// Each bad block must be in the log, and adjacent ones reported as a range
+	rewind(log_fd);
+	while (fgets(line, sizeof(line), log_fd) != NULL) {
+		if (sscanf(line, "Blocks %I64u to %I64u: unreadable", &first, &last) != 2)
+			continue;
+		for (j = 0; (j < ARRAYSIZE(bad_blocks)) && (bad_blocks[j] != first); j++);
+		if ((j == ARRAYSIZE(bad_blocks)) || ((j > 0) && (bad_blocks[j - 1] == first - 1))) {
+			printf("FAIL: range %I64u to %I64u does not start with a bad block\n", first, last);
+			nb_failed++;
+			continue;
+		}
+		for (; (j + 1 < ARRAYSIZE(bad_blocks)) && (bad_blocks[j + 1] == bad_blocks[j] + 1); j++);
+		if (bad_blocks[j] != last) {
+			printf("FAIL: range %I64u to %I64u should end at block %I64u\n", first, last, bad_blocks[j]);
+			nb_failed++;
+		}
+		nb_ranges++;
+	}
+	if (nb_ranges != 4) {
+		printf("FAIL: %d unreadable ranges reported, expected 4\n", nb_ranges);
+		nb_failed++;
+	}
+
+out:
+	free(buf);
+	if (log_fd != NULL)
+		fclose(log_fd);
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile);
+	DeleteFileA("badblocks_test.log");
+	DeleteFileA("badblocks_test.img");
+}
+
+int main(int argc, char** argv)
+{
+	QueryPerformanceFrequency(&freq);
+	device = (BYTE*)calloc(DEVICE_SIZE / BLOCK_SIZE, 1);
+	if (device == NULL)
+		return 1;
+
+	// The drop in speed falls on a region boundary, then in the middle of a region
+	CheckSpeedMap(2, 256*MB);
+	CheckSpeedMap(1, 288*MB);
+	CheckReadOnlyScan();
+
+	free(device);
+	printf("%s\n", (nb_failed == 0) ? "PASS" : "FAIL");
+	return (nb_failed == 0) ? 0 : 1;
+}
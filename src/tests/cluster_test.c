@@ -0,0 +1,122 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Unit test for the selection of the cluster size from the ISO content
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build and run from the src directory, with MinGW:
+ *   gcc -DRUFUS_DEBUG -I. -Ims-sys/inc -o cluster_test.exe tests/cluster_test.c ms-sys/file.c
+ *     ms-sys/partition_info.c -lole32 && cluster_test.exe
+ *
+ * GetOptimizedClusterSize() is run against synthetic ISO file size histograms, for
+ * which the expected cluster size follows from its cost model: large files favour
+ * large clusters, many small files favour small ones, and a cluster size for which
+ * the content would not fit on the drive must never be picked.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "../stdio.c"
+#include "../drive.c"
+
+// Referenced by stdio.c and drive.c
+HWND hMainDialog = NULL, hLog = NULL;
+DWORD FormatStatus = 0;
+BOOL enable_fixed_disks = FALSE;
+
+char* get_token_data_file(const char* token, const char* filename)
+{
+	return NULL;
+}
+
+#define MB                  (1024LL*1024LL)
+#define GB                  (1024LL*1024LL*1024LL)
+#define FAT32_ALLOWED       0x0001FE00	// 512 bytes to 64 KB
+#define EXFAT_ALLOWED       0x03FFFE00	// 512 bytes to 32 MB
+
+static int nb_failed = 0;
+
+// Add count files of size bytes each to the histogram of the report
+static void AddFiles(RUFUS_ISO_REPORT* report, uint32_t count, uint64_t size)
+{
+	int i;
+
+	for (i = 0; (i < ISO_HISTOGRAM_SIZE - 1) && (size >= (1ULL << i)); i++);
+	report->nb_files += count;
+	report->size_count[i] += count;
+	report->size_bytes[i] += count * size;
+}
+
+static void Check(const char* name, int fs, LONGLONG DiskSize, ULONG Allowed,
+	const RUFUS_ISO_REPORT* report, ULONG expected)
+{
+	ULONG r;
+
+	SelectedDrive.DiskSize = DiskSize;
+	if (fs < FS_MAX)
+		SelectedDrive.ClusterSize[fs].Allowed = Allowed;
+	r = GetOptimizedClusterSize(fs, report);
+	if ((r != 0) && ((r & Allowed) != r)) {
+		printf("FAIL: %s: %lu is not an allowed cluster size\n", name, r);
+		nb_failed++;
+	} else if (r != expected) {
+		printf("FAIL: %s: got %lu, expected %lu\n", name, r, expected);
+		nb_failed++;
+	} else {
+		printf("  %-44s %8lu\n", name, r);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	RUFUS_ISO_REPORT large, small, tight;
+
+	memset(&large, 0, sizeof(large));
+	memset(&small, 0, sizeof(small));
+	memset(&tight, 0, sizeof(tight));
+
+	// No content, or no ISO at all
+	Check("empty ISO", FS_FAT32, 16*GB, FAT32_ALLOWED, &large, 0);
+	Check("no ISO", FS_FAT32, 16*GB, FAT32_ALLOWED, NULL, 0);
+
+	// A few large files: the fewer clusters to allocate, the better
+	large.nb_dirs = 1;
+	AddFiles(&large, 40, 100*MB);
+	Check("large files, FAT32", FS_FAT32, 16*GB, FAT32_ALLOWED, &large, 64*1024);
+	Check("large files, exFAT", FS_EXFAT, 16*GB, EXFAT_ALLOWED, &large, 1024*1024);
+	Check("invalid file system", FS_MAX, 16*GB, FAT32_ALLOWED, &large, 0);
+
+	// Lots of small files: the space wasted in each cluster dominates
+	small.nb_dirs = 1000;
+	AddFiles(&small, 100000, 1000);
+	Check("small files, FAT32", FS_FAT32, 16*GB, FAT32_ALLOWED, &small, 1024);
+	Check("small files, NTFS", FS_NTFS, 16*GB, FAT32_ALLOWED, &small, 1024);
+	// Only the allowed sizes must be considered
+	Check("small files, FAT32, 4 or 32 KB", FS_FAT32, 16*GB, 0x1000|0x8000, &small, 4*1024);
+
+	// Content that only just fits: the cheapest cluster sizes waste too much space
+	tight.nb_dirs = 10;
+	AddFiles(&tight, 3600, 3*MB/2);
+	Check("5.3 GB of content on 6 GB", FS_FAT32, 6*GB, FAT32_ALLOWED, &tight, 64*1024);
+	Check("5.3 GB of content on 5.5 GB", FS_FAT32, 11*GB/2, FAT32_ALLOWED, &tight, 16*1024);
+	Check("5.3 GB of content on 5.3 GB", FS_FAT32, 53*GB/10, FAT32_ALLOWED, &tight, 0);
+
+	printf("%s\n", (nb_failed == 0) ? "PASS" : "FAIL");
+	return (nb_failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Discard vs zeroing benchmark for the FAT system area, on a file backed target
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build and run from the src directory, with MinGW:
+ *   gcc -O2 -DRUFUS_DEBUG -I. -Ims-sys/inc -o discard_bench.exe tests/discard_bench.c ms-sys/file.c
+ *     ms-sys/partition_info.c -lole32
+ *   discard_bench.exe <target file> [size_MB]
+ *
+ * The target file is created (or overwritten) on an NTFS volume, and stands in for a
+ * drive whose start, the size of the FAT system area, must be cleared. It is filled
+ * with a pattern before each run, and must read back as zeroes after it. It is opened
+ * without caching, so that the writes actually reach the disk. Modes:
+ * - zero:    write zeroes with the write engine, as CreateFAT() does when it can't discard.
+ * - punch:   DiscardSectors() on a sparse file, where FSCTL_SET_ZERO_DATA deallocates
+ *            the range, like a thin provisioned device that returns zeroes for TRIM.
+ * - fill:    DiscardSectors() on a regular file, where the file system has to write the
+ *            zeroes itself, like a device that implements TRIM as a write.
+ * - readback: reading the whole range back, which is what DiscardSectors() adds when
+ *            the device does not guarantee that discarded sectors read as zeroes.
+ * Each mode is run twice, alternating, and the best run of each is reported.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "../stdio.c"
+#include "../drive.c"
+
+// Referenced by stdio.c and drive.c
+HWND hMainDialog = NULL, hLog = NULL;
+DWORD FormatStatus = 0;
+BOOL enable_fixed_disks = FALSE;
+
+char* get_token_data_file(const char* token, const char* filename)
+{
+	return NULL;
+}
+
+#define NB_RUNS         2
+#define NB_MODES        4
+#define SECTOR_SIZE     4096
+#define BURST_SIZE      (4*1024*1024)	// FAT_ZERO_BURST_SIZE
+
+enum { MODE_ZERO, MODE_PUNCH, MODE_FILL, MODE_READBACK };
+static const char* mode_name[NB_MODES] = { "zero", "punch", "fill", "readback" };
+
+static LARGE_INTEGER freq;
+static BYTE* buf;
+
+// Fill (or check that we read zeroes from) the first Size bytes of the target
+static BOOL FillOrCheck(HANDLE hTarget, uint64_t Size, BOOL bCheck)
+{
+	uint64_t i, j;
+	DWORD n = BURST_SIZE;
+
+	if (!bCheck)
+		memset(buf, 0xA5, BURST_SIZE);
+	for (i = 0; i < Size; i += BURST_SIZE) {
+		n = (DWORD)min(BURST_SIZE, Size - i);
+		if (bCheck) {
+			if (read_sectors(hTarget, SECTOR_SIZE, i / SECTOR_SIZE, n / SECTOR_SIZE, buf) != n)
+				return FALSE;
+			for (j = 0; (j < n) && (buf[j] == 0); j++);
+			if (j < n) {
+				printf("FAIL: non zero data at offset 0x%I64x\n", i + j);
+				return FALSE;
+			}
+		} else if (write_sectors(hTarget, SECTOR_SIZE, i / SECTOR_SIZE, n / SECTOR_SIZE, buf) != n) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static BOOL SetSparse(HANDLE hTarget, BOOL bSparse)
+{
+	FILE_SET_SPARSE_BUFFER Sparse = { bSparse };
+	DWORD size;
+
+	return DeviceIoControl(hTarget, FSCTL_SET_SPARSE, &Sparse, sizeof(Sparse), NULL, 0, &size, NULL);
+}
+
+// Returns the throughput in MB/s, or a negative value on error
+static double Run(HANDLE hTarget, int mode, uint64_t Size)
+{
+	ASYNC_WRITER* aw;
+	LARGE_INTEGER start, end;
+	uint64_t i;
+	BOOL r = TRUE;
+
+	// Clearing the sparse flag also reallocates the holes that a previous run left
+	if (!SetSparse(hTarget, (mode == MODE_PUNCH)) || !FillOrCheck(hTarget, Size, FALSE))
+		return -1.0;
+	QueryPerformanceCounter(&start);
+	switch (mode) {
+	case MODE_ZERO:
+		aw = AsyncWriteOpen(hTarget, BURST_SIZE, FALSE);
+		if (aw == NULL)
+			return -1.0;
+		for (i = 0; (i < Size) && r; i += BURST_SIZE)
+			r = AsyncWriteSectors(aw, SECTOR_SIZE, i / SECTOR_SIZE, min(BURST_SIZE, Size - i) / SECTOR_SIZE, NULL);
+		r = AsyncWriteClose(aw) && r;
+		break;
+	case MODE_PUNCH:
+	case MODE_FILL:
+		r = DiscardSectors(hTarget, SECTOR_SIZE, 0, Size / SECTOR_SIZE);
+		break;
+	case MODE_READBACK:
+		// Only time the read back, of a range that is already zeroed
+		r = DiscardSectors(hTarget, SECTOR_SIZE, 0, Size / SECTOR_SIZE);
+		QueryPerformanceCounter(&start);
+		r = r && FillOrCheck(hTarget, Size, TRUE);
+		break;
+	}
+	QueryPerformanceCounter(&end);
+	if (!r || !FillOrCheck(hTarget, Size, TRUE))
+		return -1.0;
+	return (Size / (1024.0 * 1024.0)) / ((double)(end.QuadPart - start.QuadPart) / freq.QuadPart);
+}
+
+int main(int argc, char** argv)
+{
+	HANDLE hTarget;
+	uint64_t Size;
+	double best[NB_MODES] = { 0.0 }, speed;
+	int i, mode;
+
+	if ((argc < 2) || (argc > 3)) {
+		printf("Usage: %s <target file> [size_MB]\n", argv[0]);
+		return 2;
+	}
+	Size = ((argc > 2) ? _strtoui64(argv[2], NULL, 10) : 256) * 1024 * 1024;
+	if (Size == 0) {
+		printf("Invalid size\n");
+		return 2;
+	}
+	hTarget = CreateFileA(argv[1], GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+		FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+	if (hTarget == INVALID_HANDLE_VALUE) {
+		printf("Could not create %s: %s\n", argv[1], WindowsErrorString());
+		return 1;
+	}
+	buf = (BYTE*)VirtualAlloc(NULL, BURST_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (buf == NULL) {
+		CloseHandle(hTarget);
+		return 1;
+	}
+	QueryPerformanceFrequency(&freq);
+
+	printf("Clearing %I64u MB of %s\n", Size / (1024 * 1024), argv[1]);
+	for (i = 0; i < NB_RUNS * NB_MODES; i++) {
+		mode = i % NB_MODES;
+		speed = Run(hTarget, mode, Size);
+		if (speed < 0.0) {
+			printf("FAIL: error in %s mode\n", mode_name[mode]);
+			CloseHandle(hTarget);
+			return 1;
+		}
+		printf("  %-8s %10.1f MB/s\n", mode_name[mode], speed);
+		if (speed > best[mode])
+			best[mode] = speed;
+	}
+	printf("Best: zero %.1f MB/s, punch %.1f MB/s (x%.2f), fill %.1f MB/s (x%.2f), "
+		"punch + readback %.1f MB/s (x%.2f)\n", best[MODE_ZERO], best[MODE_PUNCH],
+		best[MODE_PUNCH] / best[MODE_ZERO], best[MODE_FILL], best[MODE_FILL] / best[MODE_ZERO],
+		1.0 / (1.0 / best[MODE_PUNCH] + 1.0 / best[MODE_READBACK]),
+		(1.0 / (1.0 / best[MODE_PUNCH] + 1.0 / best[MODE_READBACK])) / best[MODE_ZERO]);
+	VirtualFree(buf, 0, MEM_RELEASE);
+	CloseHandle(hTarget);
+	return 0;
+}
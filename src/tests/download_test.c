@@ -0,0 +1,103 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Test client for the resumable download code
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build from the src directory, with MinGW:
+ *   gcc -DRUFUS_DEBUG -I. -o download_test.exe tests/download_test.c -lwininet -lcomctl32
+ * then run the scenarios of the local HTTP server against it:
+ *   python tests/http_test_server.py --client download_test.exe
+ *
+ * Usage: download_test <url> <file> [sha1]
+ * Returns 0 if the file was downloaded (and its SHA-1 matched), 1 otherwise.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+// Don't block on error dialogs: net.c is included below, so this also applies to it
+static int WINAPI TestMessageBoxA(HWND hWnd, LPCSTR lpText, LPCSTR lpCaption, UINT uType)
+{
+	printf("%s: %s\n", lpCaption, lpText);
+	return IDOK;
+}
+#undef MessageBoxA
+#define MessageBoxA TestMessageBoxA
+
+#include "../net.c"
+
+// Referenced by net.c
+HWND hMainDialog = NULL;
+DWORD FormatStatus = 0;
+BOOL iso_op_in_progress = FALSE, format_op_in_progress = FALSE;
+int dialog_showing = 0;
+uint16_t rufus_version[4] = { 1, 3, 4, 0 };
+RUFUS_UPDATE update = { {0,0,0,0}, {0,0}, NULL, NULL};
+
+void _uprintf(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+}
+
+void PrintStatus(unsigned int duration, BOOL debug, const char *format, ...)
+{
+}
+
+const char *WindowsErrorString(void)
+{
+	static char err_string[32];
+	DWORD error_code = GetLastError();
+	safe_sprintf(err_string, sizeof(err_string), "[0x%08X]", error_code);
+	SetLastError(error_code);
+	return err_string;
+}
+
+const char* StrError(DWORD error_code)
+{
+	static char err_string[32];
+	safe_sprintf(err_string, sizeof(err_string), "Error 0x%08X", error_code);
+	return err_string;
+}
+
+char* SizeToHumanReadable(LARGE_INTEGER size)
+{
+	static char str_size[32];
+	safe_sprintf(str_size, sizeof(str_size), "%" PRIu64 " bytes", (uint64_t)size.QuadPart);
+	return str_size;
+}
+
+void DownloadNewVersion(void)
+{
+}
+
+void parse_update(char* buf, size_t len)
+{
+}
+
+int main(int argc, char** argv)
+{
+	if ((argc != 3) && (argc != 4)) {
+		printf("Usage: %s <url> <file> [sha1]\n", argv[0]);
+		return 2;
+	}
+	return DownloadFile(argv[1], argv[2], NULL, (argc == 4)?argv[3]:NULL)?0:1;
+}
@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+#
+# Rufus: The Reliable USB Formatting Utility
+# Consistency check of a FAT12/FAT16/FAT32 volume created by CreateFAT()
+# Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Checks what fsck.fat checks on a freshly formatted volume: the FAT type that
+# the cluster count of the BPB implies must match the one that was written, the
+# FATs must be large enough and identical, and the reserved FAT entries, FSInfo,
+# backup boot sector and root directory must be valid. If fsck.fat is available,
+# it is also run on the image, in read-only mode.
+# With --syslinux, the volume must instead hold a Syslinux boot record, and an
+# ldlinux.sys as its only file, in a contiguous cluster run.
+#
+# Usage: python fat_check.py [--syslinux] <volume image> [hidden sectors]
+# A volume image can be obtained from a freshly formatted drive with e.g.
+#   dd if=/dev/sdX1 of=volume.img bs=1M count=64
+# as only the system area (and the first cluster for FAT32) needs to be present.
+
+import mmap
+import shutil
+import struct
+import subprocess
+import sys
+
+
+def fail(msg):
+    print("FAIL: " + msg)
+    sys.exit(1)
+
+
+def check(cond, msg):
+    if not cond:
+        fail(msg)
+
+
+def fat_entry(fat, fat_bits, n):
+    if fat_bits == 16:
+        return struct.unpack_from("<H", fat, 2 * n)[0]
+    return struct.unpack_from("<I", fat, 4 * n)[0] & 0x0FFFFFFF
+
+
+def main():
+    args = sys.argv[1:]
+    syslinux = "--syslinux" in args
+    if syslinux:
+        args.remove("--syslinux")
+    if len(args) not in (1, 2):
+        print("Usage: %s [--syslinux] <volume image> [hidden sectors]" % sys.argv[0])
+        return 2
+    # Images can be large and sparse, so don't read them whole
+    f = open(args[0], "rb")
+    img = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    hidden = int(args[1]) if len(args) == 2 else None
+
+    check(len(img) >= 512 and img[510:512] == b"\x55\xaa", "missing boot signature")
+    bps, spc, rsvd, nb_fats, root_ents, tot16, media, fat16, spt, heads, hidd, tot32 = \
+        struct.unpack_from("<HBHBHHBHHHII", img, 11)
+    check(bps in (512, 1024, 2048, 4096), "invalid bytes per sector: %d" % bps)
+    check(spc != 0 and (spc & (spc - 1)) == 0 and spc <= 128, "invalid sectors per cluster: %d" % spc)
+    check(rsvd != 0 and nb_fats != 0, "invalid reserved sectors or number of FATs")
+    check((tot16 == 0) != (tot32 == 0), "exactly one of TotSec16 and TotSec32 must be set")
+    check(tot32 == 0 or tot32 >= 0x10000 or fat16 == 0, "TotSec32 used for a small FAT12/16 volume")
+    check(hidden is None or hidd == hidden, "hidden sectors %d, expected %d" % (hidd, hidden or 0))
+
+    # The FAT type is determined by the cluster count, and nothing else
+    fat_size = fat16 if fat16 != 0 else struct.unpack_from("<I", img, 36)[0]
+    total = tot16 if tot16 != 0 else tot32
+    root_secs = (root_ents * 32 + bps - 1) // bps
+    data_start = rsvd + nb_fats * fat_size + root_secs
+    check(total > data_start, "no room for a cluster heap")
+    nb_clusters = (total - data_start) // spc
+    fat_bits = 12 if nb_clusters < 4085 else 16 if nb_clusters < 65525 else 32
+    check((fat16 == 0) == (fat_bits == 32), "FAT%d volume with FATSz16 = %d" % (fat_bits, fat16))
+    fs_type = img[82:90] if fat_bits == 32 else img[54:62]
+    check(fs_type == b"FAT%-5d" % fat_bits, "%d clusters make this FAT%d, but the file system type is %r"
+          % (nb_clusters, fat_bits, fs_type))
+    check(root_ents == 0 if fat_bits == 32 else root_ents != 0, "invalid root directory entry count")
+    check(len(img) >= data_start * bps, "image too small for the system area")
+
+    # The FATs must hold an entry for every cluster, plus the 2 reserved ones
+    check(fat_size * bps >= ((nb_clusters + 2) * fat_bits + 7) // 8, "FAT too small for %d clusters" % nb_clusters)
+    fats = [img[(rsvd + i * fat_size) * bps:(rsvd + (i + 1) * fat_size) * bps] for i in range(nb_fats)]
+    check(all(f == fats[0] for f in fats), "FATs differ")
+    fat = fats[0]
+    if fat_bits == 12:
+        check(fat[:3] == bytes([media, 0xFF, 0xFF]), "invalid reserved FAT12 entries")
+        used = 3
+    elif fat_bits == 16:
+        check(fat[:4] == bytes([media, 0xFF, 0xFF, 0xFF]), "invalid reserved FAT16 entries")
+        used = 4
+    else:
+        entries = struct.unpack_from("<3I", fat)
+        check(entries[0] & 0x0FFFFFFF == 0x0FFFFF00 | media and entries[1] & 0x0FFFFFFF == 0x0FFFFFFF,
+              "invalid reserved FAT32 entries")
+        check(entries[2] & 0x0FFFFFFF >= 0x0FFFFFF8, "root directory cluster chain is not terminated")
+        used = 12
+
+    label = img[71:82] if fat_bits == 32 else img[43:54]
+    if fat_bits == 32:
+        root_clus, fsinfo, backup = struct.unpack_from("<IHH", img, 44)
+        check(root_clus == 2, "root directory is not at cluster 2")
+        # Syslinux only replaces the boot code of the primary boot sector
+        bpb = slice(11, 90) if syslinux else slice(0, bps)
+        check(img[bpb] == img[backup * bps:(backup + 1) * bps][bpb], "backup boot sector differs")
+        fs = img[fsinfo * bps:(fsinfo + 1) * bps]
+        lead, = struct.unpack_from("<I", fs, 0)
+        sig, free, next_free = struct.unpack_from("<III", fs, 484)
+        trail, = struct.unpack_from("<I", fs, 508)
+        check(lead == 0x41615252 and sig == 0x61417272 and trail == 0xAA550000, "invalid FSInfo signatures")
+        root = img[data_start * bps:(data_start + spc) * bps]
+    else:
+        root = img[(rsvd + nb_fats * fat_size) * bps:data_start * bps]
+    if label != b"NO NAME    ":
+        check(root[0:11] == label and root[11] == 0x08, "volume label entry missing from the root directory")
+        root = root[32:]
+
+    nb_alloc = 0
+    if syslinux:
+        check(fat_bits != 12, "Syslinux is not installed on FAT12")
+        check(img[3:11] == b"SYSLINUX", "no Syslinux boot record")
+        check(root[0:11] == b"LDLINUX SYS" and root[11] & 0x07 == 0x07,
+              "read-only, hidden and system ldlinux.sys entry missing from the root directory")
+        start = struct.unpack_from("<H", root, 20)[0] << 16 | struct.unpack_from("<H", root, 26)[0]
+        size, = struct.unpack_from("<I", root, 28)
+        nb_alloc = (size + spc * bps - 1) // (spc * bps)
+        check(size != 0 and start >= 2 and start + nb_alloc <= nb_clusters + 2, "invalid ldlinux.sys cluster run")
+        for c in range(start, start + nb_alloc - 1):
+            check(fat_entry(fat, fat_bits, c) == c + 1, "ldlinux.sys cluster run is not contiguous at %d" % c)
+        check(fat_entry(fat, fat_bits, start + nb_alloc - 1) >= (0xFFF8 if fat_bits == 16 else 0x0FFFFFF8),
+              "ldlinux.sys cluster chain is not terminated")
+        # Leave the run out of the check for allocated clusters below
+        w = fat_bits // 8
+        fat = fat[:start * w] + bytes(nb_alloc * w) + fat[(start + nb_alloc) * w:]
+        root = root[32:]
+    check(not any(fat[used:]), "FAT has allocated clusters")
+    check(not any(root), "root directory is not empty")
+    if fat_bits == 32:
+        check(free in (nb_clusters - 1 - nb_alloc, 0xFFFFFFFF), "FSInfo free count %d, expected %d"
+              % (free, nb_clusters - 1 - nb_alloc))
+
+    print("FAT%d, %d clusters of %d bytes, FAT size %d, %d reserved sectors, cluster heap at %d KB%s: OK"
+          % (fat_bits, nb_clusters, spc * bps, fat_size, rsvd, ((hidd + data_start) * bps) // 1024,
+             (", ldlinux.sys at cluster %d" % start) if syslinux else ""))
+
+    fsck = shutil.which("fsck.fat")
+    if fsck is not None and len(img) >= total * bps:
+        r = subprocess.run([fsck, "-n", "-v", args[0]], stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        check(r.returncode == 0, "fsck.fat reported errors:\n" + r.stdout.decode(errors="replace"))
+        print("fsck.fat: OK")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
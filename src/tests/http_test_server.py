@@ -0,0 +1,379 @@
+#!/usr/bin/env python3
+#
+# Rufus: The Reliable USB Formatting Utility
+# Local HTTP server, to test the resumable download code
+# Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Serves a generated file with an ETag, Last-Modified and byte range support,
+# honouring If-Range, and can simulate dropped connections, a network outage
+# and the file being replaced on the server during a download.
+#
+#   python http_test_server.py --selftest
+#       checks the server itself (can be run on any platform)
+#   python http_test_server.py --client download_test.exe
+#       runs all the download scenarios against tests/download_test.c
+#   python http_test_server.py [--port 8080] [options]
+#       just serves http://127.0.0.1:<port>/test.bin
+
+import argparse
+import hashlib
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.error
+import urllib.request
+from email.utils import formatdate
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+FILE_NAME = "test.bin"
+FILE_SIZE = 5 * 1024 * 1024 + 12345     # a few 1 MB chunks, and a short last one
+
+
+def make_content(version, size=FILE_SIZE):
+    return random.Random(version).randbytes(size)
+
+
+class TestServer(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, port=0, version=1, ranges=True, drop_after=0, nb_drops=0,
+                 outage_after=0, change_after=0, delay=0.0):
+        super().__init__(("127.0.0.1", port), Handler)
+        self.lock = threading.Lock()
+        self.ranges = ranges
+        self.drop_after = drop_after        # close the connection after this many body bytes...
+        self.nb_drops = nb_drops            # ...for this many responses
+        self.outage_after = outage_after    # refuse to send anything once this many range bytes were sent
+        self.change_after = change_after    # replace the file after this many range requests
+        self.delay = delay                  # pause between the 64 KB blocks of a response, in seconds
+        self.nb_range_requests = 0
+        self.nb_full_responses = 0
+        self.bytes_sent = 0                 # bytes sent in range responses
+        self.nb_active = 0                  # range responses being sent...
+        self.max_active = 0                 # ...and the most there ever were at the same time
+        self.set_version(version)
+
+    def set_version(self, version):
+        self.version = version
+        self.content = make_content(version)
+        self.etag = '"rufus-test-%d"' % version
+        self.last_modified = formatdate(1357000000 + version * 3600, usegmt=True)
+
+    @property
+    def url(self):
+        return "http://127.0.0.1:%d/%s" % (self.server_address[1], FILE_NAME)
+
+    def start(self):
+        threading.Thread(target=self.serve_forever, daemon=True).start()
+        return self
+
+    def stop(self):
+        self.shutdown()
+        self.server_close()
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        pass
+
+    def do_GET(self):
+        srv = self.server
+        if self.path.lstrip("/") != FILE_NAME:
+            self.send_error(404)
+            return
+        range_header = self.headers.get("Range")
+        if_range = self.headers.get("If-Range")
+        with srv.lock:
+            if srv.outage_after and srv.bytes_sent >= srv.outage_after:
+                self.close_connection = True
+                return
+            if range_header and srv.ranges:
+                srv.nb_range_requests += 1
+                if srv.change_after and srv.nb_range_requests == srv.change_after + 1:
+                    srv.set_version(srv.version + 1)
+            content, etag, last_modified = srv.content, srv.etag, srv.last_modified
+            drop = srv.drop_after if srv.nb_drops > 0 else 0
+            if drop:
+                srv.nb_drops -= 1
+
+        first, last = 0, len(content) - 1
+        partial = range_header is not None and srv.ranges
+        if partial and if_range is not None and if_range not in (etag, last_modified):
+            # The file changed: send it whole, as per RFC 7233
+            partial = False
+        if partial:
+            try:
+                unit, spec = range_header.split("=", 1)
+                start, end = spec.split("-", 1)
+                first = int(start)
+                last = min(int(end), len(content) - 1) if end else len(content) - 1
+                if unit.strip() != "bytes" or first > last:
+                    raise ValueError
+            except ValueError:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(content))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+        else:
+            with srv.lock:
+                srv.nb_full_responses += 1
+
+        body = content[first:last + 1]
+        self.send_response(206 if partial else 200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("ETag", etag)
+        self.send_header("Last-Modified", last_modified)
+        if srv.ranges:
+            self.send_header("Accept-Ranges", "bytes")
+        if partial:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, len(content)))
+        self.end_headers()
+
+        if drop and drop < len(body):
+            body = body[:drop]
+            self.close_connection = True
+        if partial:
+            with srv.lock:
+                srv.nb_active += 1
+                srv.max_active = max(srv.max_active, srv.nb_active)
+        try:
+            self.send_body(body, partial)
+        finally:
+            if partial:
+                with srv.lock:
+                    srv.nb_active -= 1
+
+    def send_body(self, body, partial):
+        srv = self.server
+        for i in range(0, len(body), 64 * 1024):
+            block = body[i:i + 64 * 1024]
+            if partial:
+                with srv.lock:
+                    if srv.outage_after and srv.bytes_sent >= srv.outage_after:
+                        self.close_connection = True
+                        return
+                    srv.bytes_sent += len(block)
+            if srv.delay:
+                time.sleep(srv.delay)
+            try:
+                self.wfile.write(block)
+            except OSError:
+                self.close_connection = True
+                return
+
+
+def fetch(url, headers=None):
+    req = urllib.request.Request(url, headers=headers or {})
+    try:
+        with urllib.request.urlopen(req) as resp:
+            return resp.status, dict(resp.headers), resp.read()
+    except urllib.error.HTTPError as e:
+        return e.code, dict(e.headers), e.read()
+    except Exception:
+        return 0, {}, b""
+
+
+def selftest():
+    failed = []
+
+    def check(name, cond):
+        print("%s %s" % ("PASS" if cond else "FAIL", name))
+        if not cond:
+            failed.append(name)
+
+    srv = TestServer().start()
+    v1 = make_content(1)
+    status, hdrs, body = fetch(srv.url)
+    check("full download", status == 200 and body == v1 and hdrs.get("Accept-Ranges") == "bytes")
+    etag = hdrs.get("ETag")
+    status, hdrs, body = fetch(srv.url, {"Range": "bytes=100-199"})
+    check("range", status == 206 and body == v1[100:200]
+          and hdrs.get("Content-Range") == "bytes 100-199/%d" % FILE_SIZE)
+    status, _, body = fetch(srv.url, {"Range": "bytes=%d-" % (FILE_SIZE - 10)})
+    check("open ended range", status == 206 and body == v1[-10:])
+    status, _, body = fetch(srv.url, {"Range": "bytes=0-9", "If-Range": etag})
+    check("If-Range match", status == 206 and body == v1[:10])
+    status, _, body = fetch(srv.url, {"Range": "bytes=0-9", "If-Range": '"stale"'})
+    check("If-Range mismatch", status == 200 and body == v1)
+    srv.stop()
+
+    srv = TestServer(change_after=1).start()
+    status, _, body = fetch(srv.url, {"Range": "bytes=0-9", "If-Range": '"rufus-test-1"'})
+    check("before change", status == 206 and body == v1[:10])
+    status, hdrs, body = fetch(srv.url, {"Range": "bytes=0-9", "If-Range": '"rufus-test-1"'})
+    check("changed validator", status == 200 and body == make_content(2) and hdrs.get("ETag") == '"rufus-test-2"')
+    srv.stop()
+
+    srv = TestServer(drop_after=1000, nb_drops=1).start()
+    status, _, body = fetch(srv.url, {"Range": "bytes=0-99999"})
+    check("dropped connection", len(body) < 100000)
+    status, _, body = fetch(srv.url, {"Range": "bytes=0-99999"})
+    check("after drop", status == 206 and body == v1[:100000])
+    srv.stop()
+
+    srv = TestServer(outage_after=1).start()
+    fetch(srv.url, {"Range": "bytes=0-9"})
+    status, _, _ = fetch(srv.url, {"Range": "bytes=0-9"})
+    check("outage", status == 0)
+    srv.stop()
+
+    srv = TestServer(ranges=False).start()
+    status, hdrs, body = fetch(srv.url, {"Range": "bytes=0-9"})
+    check("no ranges", status == 200 and body == v1 and "Accept-Ranges" not in hdrs)
+    srv.stop()
+
+    return len(failed) == 0
+
+
+def run_client(client, dir):
+    failed = []
+    path = os.path.join(dir, FILE_NAME)
+    part, map = path + ".part", path + ".part.map"
+
+    def check(name, cond):
+        print("%s %s" % ("PASS" if cond else "FAIL", name))
+        if not cond:
+            failed.append(name)
+
+    def cleanup():
+        for f in (path, part, map):
+            if os.path.exists(f):
+                os.remove(f)
+
+    def download(srv, sha1=None):
+        args = [client, srv.url, path] + ([sha1] if sha1 else [])
+        return subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT).returncode == 0
+
+    def content_is(version):
+        with open(path, "rb") as f:
+            return f.read() == make_content(version)
+
+    def sha1(version):
+        return hashlib.sha1(make_content(version)).hexdigest()
+
+    def no_leftovers():
+        return not os.path.exists(part) and not os.path.exists(map)
+
+    cleanup()
+    srv = TestServer().start()
+    r = download(srv, sha1(1))
+    check("ranged download", r and content_is(1) and no_leftovers() and srv.nb_range_requests > 1)
+    srv.stop()
+
+    # WinInet's default limit of 2 connections per server must not hold the workers back
+    cleanup()
+    srv = TestServer(delay=0.02).start()
+    r = download(srv, sha1(1))
+    check("parallel connections", r and content_is(1) and srv.max_active > 2)
+    print("     %d range responses in flight at most" % srv.max_active)
+    srv.stop()
+
+    cleanup()
+    srv = TestServer(ranges=False).start()
+    r = download(srv, sha1(1))
+    check("plain download", r and content_is(1) and no_leftovers())
+    srv.stop()
+
+    cleanup()
+    srv = TestServer(drop_after=300 * 1024, nb_drops=6).start()
+    r = download(srv, sha1(1))
+    check("dropped connections", r and content_is(1) and no_leftovers())
+    srv.stop()
+
+    # The connection goes away halfway: the partial file must be kept, then resumed
+    cleanup()
+    srv = TestServer(outage_after=FILE_SIZE // 2).start()
+    r = download(srv, sha1(1))
+    check("outage", not r and not os.path.exists(path) and os.path.exists(part) and os.path.exists(map))
+    srv.stop()
+    srv = TestServer().start()
+    r = download(srv, sha1(1))
+    check("resume", r and content_is(1) and no_leftovers() and srv.bytes_sent < FILE_SIZE)
+    srv.stop()
+
+    # The partial data is stale if the file was replaced between the attempts
+    cleanup()
+    srv = TestServer(outage_after=FILE_SIZE // 2).start()
+    download(srv)
+    srv.stop()
+    srv = TestServer(version=2).start()
+    r = download(srv, sha1(2))
+    check("resume after change", r and content_is(2) and no_leftovers() and srv.bytes_sent >= FILE_SIZE)
+    srv.stop()
+
+    # The file is replaced during the download: the If-Range mismatch must restart it
+    cleanup()
+    srv = TestServer(change_after=2).start()
+    r = download(srv, sha1(2))
+    check("changed during download", r and content_is(2) and no_leftovers())
+    srv.stop()
+
+    # A failed download must not touch an existing file
+    cleanup()
+    with open(path, "wb") as f:
+        f.write(b"previous version")
+    srv = TestServer().start()
+    r = download(srv, "0" * 40)
+    with open(path, "rb") as f:
+        check("SHA-1 mismatch", not r and f.read() == b"previous version" and no_leftovers())
+    srv.stop()
+
+    cleanup()
+    return len(failed) == 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local HTTP server for the download tests")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--version", type=int, default=1, help="seed of the served content")
+    parser.add_argument("--no-ranges", action="store_true", help="don't support range requests")
+    parser.add_argument("--drop-after", type=int, default=0, metavar="BYTES")
+    parser.add_argument("--nb-drops", type=int, default=0, metavar="N")
+    parser.add_argument("--outage-after", type=int, default=0, metavar="BYTES")
+    parser.add_argument("--change-after", type=int, default=0, metavar="N")
+    parser.add_argument("--delay", type=float, default=0.0, metavar="SECONDS", help="pause between 64 KB blocks")
+    parser.add_argument("--selftest", action="store_true", help="test the server itself")
+    parser.add_argument("--client", metavar="EXE", help="run the scenarios against download_test.exe")
+    args = parser.parse_args()
+
+    if args.selftest:
+        ok = selftest()
+    elif args.client:
+        with tempfile.TemporaryDirectory() as dir:
+            ok = run_client(os.path.abspath(args.client), dir)
+    else:
+        srv = TestServer(args.port, args.version, not args.no_ranges, args.drop_after, args.nb_drops,
+                         args.outage_after, args.change_after, args.delay)
+        print("Serving %s (SHA-1 %s)" % (srv.url, hashlib.sha1(srv.content).hexdigest()))
+        try:
+            srv.serve_forever()
+        except KeyboardInterrupt:
+            pass
+        return 0
+    print("All tests passed" if ok else "Some tests FAILED")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,287 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Extraction test for ISO images
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build from the src directory, with MinGW:
+ *   gcc -O2 -DRUFUS_DEBUG -DHAVE_CONFIG_H -I. -Ilibcdio -Ilibcdio/driver -o iso_test.exe tests/iso_test.c
+ *     stdfn.c parser.c <all the .c files from libcdio/iso9660, libcdio/udf and libcdio/driver>
+ *     -lole32 -lshell32
+ * then run it against the generated images:
+ *   python tests/iso_test.py --client iso_test.exe
+ *
+ * Usage: iso_test <image> <target dir> [--resume] [--update] [--pause-after <bytes>]
+ *   [--slow-ui <ms> [--sync-progress]] [--scan-only]
+ *
+ * The image is scanned then extracted to the target directory with ExtractISO(), as
+ * the format thread does, with the log written to stdout. The other options are:
+ * --resume: resume from the extraction journal, if there is one
+ * --update: update the files that are already on the target, rather than overwrite them
+ * --pause-after: print "PAUSED" and hang once that many bytes have been written to
+ *   the target, so that the caller can kill us in the middle of the copy
+ * --slow-ui: give the progress dialog to a UI thread, which samples the progress on a
+ *   timer as the application does, but only processes its messages every <ms>. The time
+ *   that the extraction thread spends waiting on the UI thread is then reported.
+ * --sync-progress: also send the progress to the UI thread from the extraction thread,
+ *   every 128 blocks and for each file, as was done before it was published through
+ *   counters, for comparison
+ * --scan-only: only scan the image, and report whether it was found to be isohybrid
+ * Once done, the number of bytes that were read back from the target and written to it
+ * are reported. Returns 0 if the extraction succeeded, 1 otherwise.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+static BOOL sync_progress = FALSE;
+static DWORD worker_tid = 0;
+static LARGE_INTEGER freq;
+static uint64_t stall_ticks = 0;
+static int stall_calls = 0;
+
+// Account for the time the extraction thread spends in the calls that wait on the UI thread
+static LRESULT SendMessageHook(HWND hWnd, UINT Msg, WPARAM wParam, LPARAM lParam)
+{
+	LARGE_INTEGER start, end;
+	LRESULT r;
+
+	if (GetCurrentThreadId() != worker_tid)
+		return SendMessage(hWnd, Msg, wParam, lParam);
+	QueryPerformanceCounter(&start);
+	r = SendMessage(hWnd, Msg, wParam, lParam);
+	QueryPerformanceCounter(&end);
+	stall_ticks += end.QuadPart - start.QuadPart;
+	stall_calls++;
+	return r;
+}
+#define SendMessage SendMessageHook
+
+static BOOL WINAPI SetWindowTextWHook(HWND hWnd, LPCWSTR lpString)
+{
+	LARGE_INTEGER start, end;
+	BOOL r;
+
+	if (GetCurrentThreadId() != worker_tid)
+		return SetWindowTextW(hWnd, lpString);
+	QueryPerformanceCounter(&start);
+	r = SetWindowTextW(hWnd, lpString);
+	QueryPerformanceCounter(&end);
+	stall_ticks += end.QuadPart - start.QuadPart;
+	stall_calls++;
+	return r;
+}
+#define SetWindowTextW SetWindowTextWHook
+
+#include "../iso.c"
+
+// Referenced by iso.c, stdfn.c and parser.c
+HWND hISOProgressDlg = NULL, hISOProgressBar = NULL, hISOFileName = NULL;
+DWORD FormatStatus = 0;
+RUFUS_DRIVE_INFO SelectedDrive;
+RUFUS_UPDATE update = { {0,0,0,0}, {0,0}, NULL, NULL};
+BOOL use_own_c32[NB_OLD_C32] = {FALSE, FALSE};
+BOOL resume_extraction = FALSE, update_extraction = FALSE;
+
+static uint64_t pause_after = 0, bytes_written = 0, bytes_read_back = 0;
+static DWORD slow_ui = 0;
+static BOOL scan_only_test = FALSE;
+static volatile BOOL ui_exit = FALSE;
+
+void _uprintf(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	fflush(stdout);
+	// The name of each file used to be sent to the UI thread as it got extracted
+	if ((sync_progress) && (strncmp(format, "Extracting: ", 12) == 0))
+		SetWindowTextU(hISOFileName, "Extracting");
+}
+
+const char *WindowsErrorString(void)
+{
+	static char err_string[64];
+
+	sprintf(err_string, "error %lu", GetLastError());
+	return err_string;
+}
+
+void PrintStatus(unsigned int duration, BOOL debug, const char *format, ...)
+{
+}
+
+void UpdateProgress(int op, float percent)
+{
+}
+
+uint64_t IOStatsTimestamp(void)
+{
+	return 0;
+}
+
+void IOStatsRecord(int type, uint64_t bytes, uint64_t start)
+{
+	if (type == IOS_DEVICE_READ)
+		bytes_read_back += bytes;
+	if (type != IOS_FILE_WRITE)
+		return;
+	// The progress bar, and the one from the main dialog, used to be sent the progress every
+	// 128 blocks (PROGRESS_THRESHOLD) by the extraction thread
+	if ((sync_progress) && (bytes_written / (128 * ISO_BLOCKSIZE) != (bytes_written + bytes) / (128 * ISO_BLOCKSIZE))) {
+		SendMessage(hISOProgressBar, PBM_SETPOS, 0, 0);
+		SendMessage(hISOProgressBar, PBM_SETPOS, 0, 0);
+	}
+	bytes_written += bytes;
+	if ((pause_after != 0) && (bytes_written >= pause_after)) {
+		printf("PAUSED after %I64u bytes\n", bytes_written);
+		fflush(stdout);
+		Sleep(INFINITE);
+	}
+}
+
+BOOL WimIsNativelySupported(const void* buf, size_t size)
+{
+	return FALSE;
+}
+
+static void CALLBACK ISOProgressTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
+{
+	RefreshISOProgress();
+}
+
+// Stands in for ISOProc(), with the same handling of the progress timer
+static LRESULT CALLBACK UIProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+	switch (message) {
+	case UM_ISO_INIT:
+		SetTimer(hWnd, TID_ISO_PROGRESS, ISO_PROGRESS_INTERVAL, ISOProgressTimer);
+		return 0;
+	case UM_ISO_EXIT:
+		KillTimer(hWnd, TID_ISO_PROGRESS);
+		RefreshISOProgress();
+		return 0;
+	}
+	return DefWindowProcA(hWnd, message, wParam, lParam);
+}
+
+// A UI thread that is slow to process its messages
+static DWORD WINAPI UIThread(LPVOID param)
+{
+	WNDCLASSA wc = { 0 };
+	MSG msg;
+
+	wc.lpfnWndProc = UIProc;
+	wc.hInstance = GetModuleHandle(NULL);
+	wc.lpszClassName = "iso_test_ui";
+	RegisterClassA(&wc);
+	hISOProgressDlg = CreateWindowA("iso_test_ui", "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, wc.hInstance, NULL);
+	hISOProgressBar = CreateWindowA("STATIC", "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, wc.hInstance, NULL);
+	hISOFileName = CreateWindowA("STATIC", "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, wc.hInstance, NULL);
+	SetEvent((HANDLE)param);
+	while (!ui_exit) {
+		Sleep(slow_ui);
+		// This also processes the messages that the extraction thread sent
+		while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+	}
+	DestroyWindow(hISOFileName);
+	DestroyWindow(hISOProgressBar);
+	DestroyWindow(hISOProgressDlg);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	HANDLE hUIThread = NULL, hReady;
+	LARGE_INTEGER start, end;
+	int i;
+
+	if (argc < 3) {
+		printf("Usage: %s <image> <target dir> [--resume] [--update] [--pause-after <bytes>] "
+			"[--slow-ui <ms> [--sync-progress]] [--scan-only]\n", argv[0]);
+		return 2;
+	}
+	for (i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "--resume") == 0) {
+			resume_extraction = TRUE;
+		} else if (strcmp(argv[i], "--update") == 0) {
+			update_extraction = TRUE;
+		} else if ((strcmp(argv[i], "--pause-after") == 0) && (i + 1 < argc)) {
+			pause_after = _strtoui64(argv[++i], NULL, 10);
+		} else if ((strcmp(argv[i], "--slow-ui") == 0) && (i + 1 < argc)) {
+			slow_ui = (DWORD)strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--sync-progress") == 0) {
+			sync_progress = TRUE;
+		} else if (strcmp(argv[i], "--scan-only") == 0) {
+			scan_only_test = TRUE;
+		} else {
+			printf("Unknown option %s\n", argv[i]);
+			return 2;
+		}
+	}
+
+	if ((sync_progress) && (slow_ui == 0)) {
+		printf("--sync-progress requires --slow-ui\n");
+		return 2;
+	}
+
+	worker_tid = GetCurrentThreadId();
+	QueryPerformanceFrequency(&freq);
+	if (slow_ui != 0) {
+		hReady = CreateEvent(NULL, TRUE, FALSE, NULL);
+		hUIThread = CreateThread(NULL, 0, UIThread, hReady, 0, NULL);
+		if ((hReady == NULL) || (hUIThread == NULL) || (WaitForSingleObject(hReady, 5000) != WAIT_OBJECT_0)) {
+			printf("Could not create the UI thread\n");
+			return 1;
+		}
+		CloseHandle(hReady);
+	}
+
+	if (!ExtractISO(argv[1], argv[2], TRUE)) {
+		printf("Scan failed: 0x%08lX\n", FormatStatus);
+		return 1;
+	}
+	if (scan_only_test) {
+		printf("Isohybrid: %s\n", iso_report.is_isohybrid ? "yes" : "no");
+		return 0;
+	}
+	// Only account for the extraction
+	stall_ticks = 0;
+	stall_calls = 0;
+	QueryPerformanceCounter(&start);
+	if (!ExtractISO(argv[1], argv[2], FALSE)) {
+		printf("Extraction failed: 0x%08lX\n", FormatStatus);
+		return 1;
+	}
+	QueryPerformanceCounter(&end);
+	printf("Read back %I64u bytes, wrote %I64u bytes\n", bytes_read_back, bytes_written);
+	if (hUIThread != NULL) {
+		ui_exit = TRUE;
+		WaitForSingleObject(hUIThread, INFINITE);
+		CloseHandle(hUIThread);
+		printf("Worker stall: %I64u ms in %d calls to the UI thread, out of %I64u ms\n",
+			(stall_ticks * 1000) / freq.QuadPart, stall_calls,
+			((end.QuadPart - start.QuadPart) * 1000) / freq.QuadPart);
+	}
+	return 0;
+}
@@ -0,0 +1,738 @@
+#!/usr/bin/env python3
+#
+# Rufus: The Reliable USB Formatting Utility
+# Generates ISO9660 images, to test their extraction with tests/iso_test.c
+# Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# The images are plain ISO9660 (no Joliet or Rock Ridge), with the names that
+# libcdio translates to lowercase, and are written from scratch, as the usual
+# tools (xorriso, genisoimage) aren't available everywhere. The tests are:
+# - journal: the extraction is interrupted in the middle of a file, by killing
+#   the client, then resumed. The most recent file of the journal is altered in
+#   between, so that it has to be detected and copied again.
+# - shared: several entries, some of them in directories that haven't been reached
+#   yet, point to the same extents, which must only be read once. The extraction is
+#   also interrupted while the first of the entries of an extent is written, then
+#   resumed.
+# - update: a first version of an image is extracted to a FAT32 volume, from a VHD that
+#   is mounted with diskpart (which requires elevation), or to a directory if this is
+#   not possible. A second version, with files that were added, removed, modified with
+#   or without a change of size, or left as they were, is then extracted in update mode.
+#   One of the files that were left as they were is altered on the target beforehand,
+#   after the manifest of the first extraction was written. The unchanged files must be
+#   identified from the manifest, without reading them back, and, once the manifest is
+#   deleted, by reading them back.
+# - stall: an image is extracted with a UI thread that only processes its messages
+#   every STALL_UI_MS, and the time that the extraction thread spends waiting on it is
+#   measured, with the progress published through counters, and with it also sent from
+#   the extraction thread, as was done before. The former must not depend on the amount
+#   of data that is copied.
+# - isohybrid: the same content is made into images with an MBR and/or an El Torito
+#   boot catalog, some of which are not isohybrid, such as one with a partition past
+#   the end of the image, or with a protective GPT entry that starts past it. The scan
+#   must only flag the valid ones. Writing them to a drive is tested by vhd_test.py.
+#
+#   python iso_test.py --client iso_test.exe [--keep DIR] [--test NAME]
+#       generates the images and runs the client against each of them
+#   python iso_test.py --generate DIR
+#       just generates the images and the reference files
+
+import argparse
+import datetime
+import glob
+import os
+import random
+import shutil
+import struct
+import subprocess
+import string
+import sys
+import tempfile
+import time
+
+BLOCK = 2048
+PVD_LBA = 16
+MB = 1024 * 1024
+FAT_IMAGE_MB = 128
+STALL_UI_MS = 20
+# The extraction thread only waits on the UI thread for a few messages, at the start and end
+STALL_MAX_CALLS = 10
+
+
+def both16(v):
+    return struct.pack("<H", v) + struct.pack(">H", v)
+
+
+def both32(v):
+    return struct.pack("<I", v) + struct.pack(">I", v)
+
+
+def dir_date(d):
+    return struct.pack("7B", d.year - 1900, d.month, d.day, d.hour, d.minute, d.second, 0)
+
+
+def vol_date(d):
+    return d.strftime("%Y%m%d%H%M%S00").encode("ascii") + bytes(1)
+
+
+def dir_record(name, lba, size, is_dir, d):
+    # Directory record (ECMA 119 9.1), padded to an even length
+    rec = struct.pack("<BB", 0, 0) + both32(lba) + both32(size) + dir_date(d)
+    rec += struct.pack("<BBB", 2 if is_dir else 0, 0, 0) + both16(1) + struct.pack("<B", len(name)) + name
+    rec += bytes(len(rec) % 2)
+    return bytes([len(rec)]) + rec[1:]
+
+
+def iso_name(name, is_dir):
+    return name.upper().encode("ascii") + (b"" if is_dir else b";1")
+
+
+def boot_catalog(efi):
+    # El Torito boot catalog: validation entry and default (BIOS) entry, and an EFI section
+    cat = bytearray(BLOCK)
+    cat[0:32] = struct.pack("<BBH24sHBB", 1, 0, 0, b"RUFUS", 0, 0x55, 0xAA)
+    struct.pack_into("<H", cat, 28, -sum(struct.unpack_from("<16H", cat)) & 0xFFFF)
+    cat[32:64] = struct.pack("<BBHBBHI20x", 0x88, 0, 0, 0, 0, 4, 0)
+    if efi:
+        cat[64:96] = struct.pack("<BBH28x", 0x91, 0xEF, 1)
+        cat[96:128] = struct.pack("<BBHBBHI20x", 0x88, 0, 0, 0, 0, 4, 0)
+    return bytes(cat)
+
+
+def make_iso(files, label, d, links={}, eltorito=None):
+    # files maps "dir/name.ext" to the file data, and links maps paths to one of these
+    # files, whose data the link shares. eltorito, if not None, is the boot catalog to add
+    # along with an El Torito boot record. Returns the image.
+    dirs = {"": []}
+    for path in sorted(list(files) + list(links)):
+        parts = path.split("/")
+        for i in range(1, len(parts)):
+            parent, sub = "/".join(parts[:i - 1]), "/".join(parts[:i])
+            if sub not in dirs:
+                dirs[sub] = []
+                dirs[parent].append((parts[i - 1], sub, True))
+        dirs["/".join(parts[:-1])].append((parts[-1], path, False))
+    # Directories in path table order: by depth, then by parent and name
+    order = sorted(dirs, key=lambda p: (p.count("/") + (p != ""), p))
+    number = {p: i + 1 for i, p in enumerate(order)}
+
+    def dir_size(entries):
+        size, used = 0, 0
+        for rec_len in [34, 34] + [33 + len(iso_name(n, is_dir)) + (len(iso_name(n, is_dir)) + 1) % 2
+                                   for n, _, is_dir in entries]:
+            if used + rec_len > BLOCK:
+                size += BLOCK
+                used = 0
+            used += rec_len
+        return size + BLOCK
+
+    # Layout: PVD, El Torito boot record, terminator, L and M path tables, boot catalog,
+    # directories, then the file data
+    nb_desc = 2 if eltorito is None else 3
+    table_lba = PVD_LBA + nb_desc
+    lba = table_lba + 2
+    catalog_lba = lba
+    if eltorito is not None:
+        lba += 1
+    dir_lba = {}
+    for p in order:
+        dir_lba[p] = lba
+        lba += dir_size(dirs[p]) // BLOCK
+    file_lba = {}
+    for path in sorted(files):
+        file_lba[path] = lba
+        lba += (len(files[path]) + BLOCK - 1) // BLOCK
+    nb_blocks = lba
+
+    img = bytearray(nb_blocks * BLOCK)
+
+    def put(lba, data):
+        img[lba * BLOCK:lba * BLOCK + len(data)] = data
+
+    for p in order:
+        parent = p.rsplit("/", 1)[0] if "/" in p else ""
+        size = dir_size(dirs[p])
+        recs = [dir_record(b"\0", dir_lba[p], size, True, d),
+                dir_record(b"\1", dir_lba[parent], dir_size(dirs[parent]), True, d)]
+        for n, full, is_dir in sorted(dirs[p], key=lambda e: iso_name(e[0], e[2])):
+            if is_dir:
+                recs.append(dir_record(iso_name(n, True), dir_lba[full], dir_size(dirs[full]), True, d))
+            else:
+                full = links.get(full, full)
+                recs.append(dir_record(iso_name(n, False), file_lba[full], len(files[full]), False, d))
+        data, sector = bytearray(), bytearray()
+        for rec in recs:
+            if len(sector) + len(rec) > BLOCK:
+                data += sector + bytes(BLOCK - len(sector))
+                sector = bytearray()
+            sector += rec
+        data += sector
+        put(dir_lba[p], data)
+    for path, data in files.items():
+        put(file_lba[path], data)
+
+    l_table, m_table = b"", b""
+    for p in order:
+        name = b"\0" if p == "" else iso_name(p.rsplit("/", 1)[-1], True)
+        parent = number[p.rsplit("/", 1)[0] if "/" in p else ""]
+        pad = bytes(len(name) % 2)
+        l_table += struct.pack("<BBIH", len(name), 0, dir_lba[p], parent) + name + pad
+        m_table += struct.pack(">BBIH", len(name), 0, dir_lba[p], parent) + name + pad
+    assert len(l_table) <= BLOCK
+    put(table_lba, l_table)
+    put(table_lba + 1, m_table)
+
+    # Primary volume descriptor (ECMA 119 8.4) and set terminator
+    pvd = b"\1CD001\1\0" + b"RUFUS".ljust(32) + label.upper().encode("ascii").ljust(32) + bytes(8)
+    pvd += both32(nb_blocks) + bytes(32) + both16(1) + both16(1) + both16(BLOCK)
+    pvd += both32(len(l_table)) + struct.pack("<II", table_lba, 0) + struct.pack(">II", table_lba + 1, 0)
+    pvd += dir_record(b"\0", dir_lba[""], dir_size(dirs[""]), True, d)
+    pvd += b" " * (128 * 4 + 37 * 3) + vol_date(d) * 2 + b"0" * 16 + bytes(1) + vol_date(d) + b"\1"
+    put(PVD_LBA, pvd)
+    if eltorito is not None:
+        put(PVD_LBA + 1, b"\0CD001\1" + b"EL TORITO SPECIFICATION".ljust(64, b"\0") + struct.pack("<I", catalog_lba))
+        put(catalog_lba, eltorito)
+    put(PVD_LBA + nb_desc - 1, b"\xffCD001\1")
+    return bytes(img)
+
+
+def add_mbr(img, parts):
+    # Add an isohybrid MBR, with (status, type, start, count) partition entries in 512 bytes
+    # sectors, to the system area of an image
+    img = bytearray(img)
+    img[0:3] = b"\xEB\x63\x90"
+    for i, part in enumerate(parts):
+        struct.pack_into("<B3xB3xII", img, 0x1BE + 16 * i, *part)
+    img[0x1FE:0x200] = b"\x55\xAA"
+    return bytes(img)
+
+
+def hybrid_images():
+    # Returns the images, as (data, isohybrid, expected log line) tuples, from the same content
+    rnd = random.Random(50)
+    files = {"readme.txt": b"isohybrid test\n", "data/file.bin": rnd.randbytes(300 * 1024 + 5)}
+    d = datetime.datetime(2013, 3, 14, 12, 0, 0)
+    efi = make_iso(files, "HYBRID", d, eltorito=boot_catalog(True))
+    bios = make_iso(files, "HYBRID", d, eltorito=boot_catalog(False))
+    no_eltorito = make_iso(files, "HYBRID", d)
+    n = len(efi) // 512
+    return {
+        "hybrid": (add_mbr(efi, [(0x80, 0x17, 0, n), (0, 0xEF, 64, 40)]), True,
+                   "Image is isohybrid (2 partitions, EFI bootable)"),
+        "hybrid_bios": (add_mbr(bios, [(0x80, 0x17, 0, len(bios) // 512)]), True, "Image is isohybrid (1 partition)"),
+        # A protective GPT entry covers the whole disk the image gets written to
+        "gpt": (add_mbr(efi, [(0, 0xEE, 1, 0xFFFFFFFF)]), True, "Image is isohybrid (1 partition, EFI bootable)"),
+        "gpt_past_end": (add_mbr(efi, [(0, 0xEE, n, 0xFFFFFFFF)]), False, None),
+        "out_of_range": (add_mbr(efi, [(0x80, 0x17, 0, n + 1)]), False, None),
+        "bad_status": (add_mbr(efi, [(0x12, 0x17, 0, n)]), False, None),
+        "no_eltorito": (add_mbr(no_eltorito, [(0x80, 0x17, 0, len(no_eltorito) // 512)]), False,
+                        "Image has an MBR but no El Torito boot record - ignoring"),
+        "plain": (efi, False, None),
+    }
+
+
+def write_files(dir, files):
+    for path, data in files.items():
+        dest = os.path.join(dir, *path.split("/"))
+        os.makedirs(os.path.dirname(dest), exist_ok=True)
+        with open(dest, "wb") as f:
+            f.write(data)
+
+
+def make_image(dir, name, files, label, d, links={}):
+    ref_dir = os.path.join(dir, name + ".ref")
+    shutil.rmtree(ref_dir, ignore_errors=True)
+    write_files(ref_dir, files)
+    write_files(ref_dir, {path: files[target] for path, target in links.items()})
+    img = os.path.join(dir, name + ".iso")
+    with open(img, "wb") as f:
+        f.write(make_iso(files, label, d, links))
+    print("%-16s %3d files, %10d bytes" % (name + ".iso", len(files) + len(links), os.path.getsize(img)))
+    return img, ref_dir
+
+
+def journal_files():
+    # Enough files, of a few MB each, for the copy to be interrupted well before the end
+    rnd = random.Random(39)
+    files = {}
+    for i in range(24):
+        dir = ["", "boot/", "sources/"][i % 3]
+        files["%sfile_%02d.bin" % (dir, i)] = rnd.randbytes(rnd.randint(100 * 1024, 2 * 1024 * 1024) + i)
+    files["empty.txt"] = b""
+    return files
+
+
+def shared_files():
+    # The first entry of each shared extent comes before the directories of the others
+    rnd = random.Random(42)
+    files = {
+        "sources/original.bin": rnd.randbytes(3 * 1024 * 1024 + 17),
+        "small.bin": rnd.randbytes(5000),
+        "empty.txt": b"",
+    }
+    # Same size as a shared extent, but not the same data
+    files["boot/same_size.bin"] = rnd.randbytes(len(files["sources/original.bin"]))
+    links = {
+        "aaa/first.bin": "sources/original.bin",
+        "zzz/deep/copy.bin": "sources/original.bin",
+        "a.bin": "small.bin",
+        "b.bin": "small.bin",
+    }
+    return files, links
+
+
+def update_files():
+    # Returns the files of the two versions, and the name of the files that are the same in both
+    rnd = random.Random(47)
+    v1 = {}
+    for i in range(6):
+        v1["%sunchanged_%02d.bin" % (["", "boot/"][i % 2], i)] = rnd.randbytes(rnd.randint(200 * 1024, MB))
+    unchanged = sorted(v1)
+    v1["sources/same_size.bin"] = rnd.randbytes(MB)
+    v1["sources/grows.bin"] = rnd.randbytes(300 * 1024)
+    v1["sources/shrinks.bin"] = rnd.randbytes(800 * 1024)
+    v1["removed.bin"] = rnd.randbytes(5000)
+    v1["olddir/a.bin"] = rnd.randbytes(7000)
+    v1["olddir/sub/b.bin"] = rnd.randbytes(9000)
+    v2 = {path: v1[path] for path in unchanged}
+    # Modified at the very start, so that a read back stops at the first chunk
+    v2["sources/same_size.bin"] = bytes([v1["sources/same_size.bin"][0] ^ 0xFF]) + v1["sources/same_size.bin"][1:]
+    v2["sources/grows.bin"] = v1["sources/grows.bin"] + rnd.randbytes(300 * 1024)
+    v2["sources/shrinks.bin"] = v1["sources/shrinks.bin"][:100 * 1024]
+    v2["added/new.bin"] = rnd.randbytes(400 * 1024)
+    return v1, v2, unchanged
+
+
+def list_tree(dir):
+    r = {}
+    for root, dirs, names in os.walk(dir):
+        # Created by Windows at the root of a FAT volume
+        if "System Volume Information" in dirs:
+            dirs.remove("System Volume Information")
+        for n in names:
+            path = os.path.relpath(os.path.join(root, n), dir).replace(os.sep, "/")
+            r[path] = os.path.join(root, n)
+    return r
+
+
+def compare_tree(target, ref_dir):
+    ok = True
+    out, ref = list_tree(target), list_tree(ref_dir)
+    for path in sorted(set(out) | set(ref)):
+        if path not in out:
+            print("FAIL: %s is missing from the target" % path)
+            ok = False
+        elif path not in ref:
+            print("FAIL: %s should not be on the target" % path)
+            ok = False
+        else:
+            with open(out[path], "rb") as f1, open(ref[path], "rb") as f2:
+                if f1.read() != f2.read():
+                    print("FAIL: %s differs from the reference" % path)
+                    ok = False
+    return ok
+
+
+def run(exe, img, target, tmp_dir, *opts, pause=False):
+    # The journal is kept in the temp directory, which we redirect to our own
+    env = dict(os.environ, TEMP=tmp_dir, TMP=tmp_dir)
+    p = subprocess.Popen([exe, img, target] + list(opts), stdout=subprocess.PIPE,
+                         stderr=subprocess.STDOUT, env=env, universal_newlines=True, errors="replace")
+    lines = []
+    for line in p.stdout:
+        lines.append(line.rstrip("\n"))
+        if pause and line.startswith("PAUSED"):
+            p.kill()
+            break
+    p.stdout.close()
+    return p.wait(), lines
+
+
+def make_dirs(dir, name):
+    # Empty target and temp directories
+    target = os.path.abspath(os.path.join(dir, name + ".out"))
+    tmp_dir = os.path.abspath(os.path.join(dir, name + ".tmp"))
+    for d in (target, tmp_dir):
+        shutil.rmtree(d, ignore_errors=True)
+        os.makedirs(d)
+    return target, tmp_dir
+
+
+def clear_tree(dir):
+    for path in list_tree(dir).values():
+        os.remove(path)
+    for name in os.listdir(dir):
+        if name != "System Volume Information" and os.path.isdir(os.path.join(dir, name)):
+            shutil.rmtree(os.path.join(dir, name))
+
+
+def diskpart(script):
+    with tempfile.NamedTemporaryFile("w", suffix=".txt", delete=False) as f:
+        f.write(script)
+    try:
+        r = subprocess.run(["diskpart", "/s", f.name], stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                           universal_newlines=True, errors="replace")
+        return r.returncode == 0
+    except OSError:
+        return False
+    finally:
+        os.remove(f.name)
+
+
+def mount_fat_image(dir, name):
+    # Create a fixed VHD with a FAT32 partition, and mount it on a free drive letter.
+    # Returns the (drive, vhd) pair, or None if diskpart is not available or we're not elevated.
+    if os.name != "nt":
+        return None
+    letters = [l for l in reversed(string.ascii_uppercase[3:]) if not os.path.exists(l + ":\\")]
+    if not letters:
+        return None
+    vhd = os.path.abspath(os.path.join(dir, name + ".vhd"))
+    if os.path.exists(vhd):
+        os.remove(vhd)
+    if not diskpart('create vdisk file="%s" maximum=%d type=fixed\nselect vdisk file="%s"\nattach vdisk\n'
+                    'create partition primary\nformat fs=fat32 quick label=%s\nassign letter=%s\n' %
+                    (vhd, FAT_IMAGE_MB, vhd, name.upper(), letters[0])):
+        unmount_fat_image((None, vhd))
+        return None
+    # Give the volume some time to show up
+    for _ in range(20):
+        if os.path.exists(letters[0] + ":\\"):
+            return letters[0] + ":", vhd
+        time.sleep(0.5)
+    unmount_fat_image((None, vhd))
+    return None
+
+
+def unmount_fat_image(image):
+    diskpart('select vdisk file="%s"\ndetach vdisk\n' % image[1])
+    if os.path.exists(image[1]):
+        os.remove(image[1])
+
+
+def parse_io(lines):
+    # Returns the number of bytes that were read back from the target and written to it
+    for l in lines:
+        if l.startswith("Read back "):
+            w = l.split()
+            return int(w[2]), int(w[5])
+    return None, None
+
+
+def test_journal(exe, dir):
+    files = journal_files()
+    img, ref_dir = make_image(dir, "journal", files, "JOURNAL", datetime.datetime(2013, 3, 9, 12, 0, 0))
+    target, tmp_dir = make_dirs(dir, "journal")
+    nb_files = len(files)
+
+    # Kill the client once half of the data has been written
+    _, lines = run(exe, img, target, tmp_dir, "--pause-after", str(sum(map(len, files.values())) // 2), pause=True)
+    if not any(l.startswith("PAUSED") for l in lines):
+        print("FAIL: the extraction was not interrupted")
+        return False
+    journals = glob.glob(os.path.join(tmp_dir, "rufus_*.jnl"))
+    if len(journals) != 1:
+        print("FAIL: expected one journal, found %d" % len(journals))
+        return False
+    with open(journals[0], "r") as f:
+        entries = f.read().splitlines()[1:]
+    print("  interrupted after %d of %d files" % (len(entries), nb_files))
+    if len(entries) == 0 or len(entries) >= nb_files:
+        print("FAIL: unexpected number of journal entries")
+        return False
+
+    # Alter the last file that was journaled, without changing its size
+    path = entries[-1].split(" ", 2)[2].lstrip("/")
+    with open(os.path.join(target, *path.split("/")), "r+b") as f:
+        f.seek(os.path.getsize(f.name) // 2)
+        c = f.read(1)
+        f.seek(-1, os.SEEK_CUR)
+        f.write(bytes([c[0] ^ 0xFF]))
+
+    r, lines = run(exe, img, target, tmp_dir, "--resume")
+    ok = (r == 0)
+    if not ok:
+        print("FAIL: the resumed extraction failed")
+    nb_extracted = sum(1 for l in lines if l.startswith("Extracting:"))
+    print("  resumed, %d files extracted" % nb_extracted)
+    if not any(l.startswith("Resuming extraction from journal") for l in lines):
+        print("FAIL: the journal was not used")
+        ok = False
+    if not any(l.endswith("failed hash verification") for l in lines):
+        print("FAIL: the altered file was not detected")
+        ok = False
+    # The altered file, and all the ones that weren't journaled, must be copied again
+    if nb_extracted != nb_files - len(entries) + 1:
+        print("FAIL: expected %d files to be extracted" % (nb_files - len(entries) + 1))
+        ok = False
+    if glob.glob(os.path.join(tmp_dir, "rufus_*.jnl")):
+        print("FAIL: the journal was not deleted")
+        ok = False
+    return compare_tree(target, ref_dir) and ok
+
+
+def test_shared(exe, dir):
+    files, links = shared_files()
+    img, ref_dir = make_image(dir, "shared", files, "SHARED", datetime.datetime(2013, 3, 11, 12, 0, 0), links)
+    target, tmp_dir = make_dirs(dir, "shared")
+    nb_dups = len(links)
+    nb_shared = len(set(links.values()))
+
+    r, lines = run(exe, img, target, tmp_dir)
+    ok = (r == 0)
+    if not ok:
+        print("FAIL: the extraction failed")
+    nb_extracted = sum(1 for l in lines if l.startswith("Extracting:"))
+    nb_also = sum(1 for l in lines if l.startswith("  Also writing:"))
+    print("  %d files extracted, %d written along with them" % (nb_extracted, nb_also))
+    if not any(l.startswith("%d files are duplicates of other files, using %d shared extents" % (nb_dups, nb_shared))
+               for l in lines):
+        print("FAIL: the shared extents were not detected")
+        ok = False
+    # Each shared extent is extracted once, for its first entry, and written to all the others
+    if nb_extracted != len(files) + len(links) - nb_dups or nb_also != nb_dups:
+        print("FAIL: expected %d files to be extracted, and %d to be written along with them" %
+              (len(files) + len(links) - nb_dups, nb_dups))
+        ok = False
+    ok = compare_tree(target, ref_dir) and ok
+
+    # Interrupt the copy of the first entry of the large shared extent, then resume
+    target, tmp_dir = make_dirs(dir, "shared")
+    _, lines = run(exe, img, target, tmp_dir, "--pause-after", str(len(files["small.bin"]) * 3 + 1024 * 1024),
+                   pause=True)
+    if not any(l.startswith("PAUSED") for l in lines):
+        print("FAIL: the extraction was not interrupted")
+        return False
+    r, lines = run(exe, img, target, tmp_dir, "--resume")
+    if r != 0:
+        print("FAIL: the resumed extraction failed")
+        ok = False
+    if glob.glob(os.path.join(tmp_dir, "rufus_*.jnl")):
+        print("FAIL: the journal was not deleted")
+        ok = False
+    print("  interrupted and resumed")
+    return compare_tree(target, ref_dir) and ok
+
+
+def check_update(exe, img, target, tmp_dir, ref_dir, kept, deleted, read_back, written, manifest):
+    # read_back and written are the (min, max) number of bytes that can be read back and written
+    r, lines = run(exe, img, target, tmp_dir, "--update")
+    ok = (r == 0)
+    if not ok:
+        print("\n".join(lines))
+        print("FAIL: the update failed")
+    rd, wr = parse_io(lines)
+    print("  updated: read back %s bytes, wrote %s bytes" % (rd, wr))
+    if manifest and not any(l.startswith("Using manifest") for l in lines):
+        print("FAIL: the manifest was not used")
+        ok = False
+    if not manifest and not any(l.startswith("No manifest for this volume") for l in lines):
+        print("FAIL: a manifest was used")
+        ok = False
+    if not any(l.startswith("Update: %d files unchanged, %d files deleted" % (kept, deleted)) for l in lines):
+        print("FAIL: expected %d files to be unchanged and %d to be deleted" % (kept, deleted))
+        ok = False
+    if rd is None or not read_back[0] <= rd <= read_back[1]:
+        print("FAIL: expected %d to %d bytes to be read back" % read_back)
+        ok = False
+    if wr is None or not written[0] <= wr <= written[1]:
+        print("FAIL: expected %d to %d bytes to be written" % written)
+        ok = False
+    if glob.glob(os.path.join(tmp_dir, "rufus_*.jnl")) or len(glob.glob(os.path.join(tmp_dir, "rufus_*.lst"))) != 1:
+        print("FAIL: the journal was not kept as the manifest")
+        ok = False
+    return compare_tree(target, ref_dir) and ok
+
+
+def test_update(exe, dir):
+    v1, v2, unchanged = update_files()
+    img1, ref_dir1 = make_image(dir, "update_v1", v1, "UPDATE", datetime.datetime(2013, 3, 12, 12, 0, 0))
+    img2, ref_dir2 = make_image(dir, "update_v2", v2, "UPDATE", datetime.datetime(2013, 3, 13, 12, 0, 0))
+    image = mount_fat_image(dir, "update")
+    if image is None:
+        print("  could not mount a FAT image, using a directory")
+        target, tmp_dir = make_dirs(dir, "update")
+    else:
+        target, tmp_dir = image[0], make_dirs(dir, "update")[1]
+        print("  using a FAT32 image on %s" % target)
+    root = target + "\\" if target.endswith(":") else target
+    changed = sum(len(v2[path]) for path in v2 if path not in unchanged)
+    deleted = len([path for path in v1 if path not in v2])
+    altered = unchanged[1]
+
+    try:
+        r, lines = run(exe, img1, target, tmp_dir)
+        if r != 0 or not compare_tree(root, ref_dir1):
+            print("FAIL: the extraction of the first version failed")
+            return False
+        manifests = glob.glob(os.path.join(tmp_dir, "rufus_*.lst"))
+        if len(manifests) != 1 or glob.glob(os.path.join(tmp_dir, "rufus_*.jnl")):
+            print("FAIL: the journal was not kept as the manifest")
+            return False
+
+        # Alter a file that is the same in both versions, without changing its size, after the
+        # manifest was written, so that it must be read back rather than trusted
+        path = os.path.join(root, *altered.split("/"))
+        with open(path, "r+b") as f:
+            f.seek(len(v1[altered]) // 2)
+            c = f.read(1)
+            f.seek(-1, os.SEEK_CUR)
+            f.write(bytes([c[0] ^ 0xFF]))
+        t = os.path.getmtime(manifests[0]) + 10
+        os.utime(path, (t, t))
+
+        # With the manifest, only the altered file is read back, up to the chunk that differs
+        ok = check_update(exe, img2, target, tmp_dir, ref_dir2, len(unchanged) - 1, deleted,
+                          (1, len(v1[altered])), (changed, changed + len(v1[altered])), True)
+
+        # Without it, all the files that have the same size must be read back
+        clear_tree(root)
+        r, _ = run(exe, img1, target, tmp_dir)
+        if r != 0:
+            print("FAIL: the extraction of the first version failed")
+            return False
+        for m in glob.glob(os.path.join(tmp_dir, "rufus_*.lst")):
+            os.remove(m)
+        same = sum(len(v1[path]) for path in unchanged)
+        ok = check_update(exe, img2, target, tmp_dir, ref_dir2, len(unchanged), deleted,
+                          (same, same + len(v1["sources/same_size.bin"])), (changed, changed), False) and ok
+    finally:
+        if image is not None:
+            unmount_fat_image(image)
+    return ok
+
+
+def parse_stall(lines):
+    # Returns the time the extraction thread was stalled, the number of calls and the total time
+    for l in lines:
+        if l.startswith("Worker stall: "):
+            w = l.split()
+            return int(w[2]), int(w[5]), int(w[13])
+    return None
+
+
+def test_stall(exe, dir):
+    files = journal_files()
+    img, ref_dir = make_image(dir, "journal", files, "JOURNAL", datetime.datetime(2013, 3, 9, 12, 0, 0))
+    ok = True
+    stall = {}
+    for mode in ("counters", "sync"):
+        target, tmp_dir = make_dirs(dir, "stall")
+        opts = ["--slow-ui", str(STALL_UI_MS)] + (["--sync-progress"] if mode == "sync" else [])
+        r, lines = run(exe, img, target, tmp_dir, *opts)
+        stall[mode] = parse_stall(lines)
+        if r != 0 or stall[mode] is None:
+            print("\n".join(lines))
+            print("FAIL: the extraction failed with %s" % " ".join(opts))
+            return False
+        print("  %-8s %6d ms of stall in %4d calls to the UI thread, out of %6d ms" % ((mode,) + stall[mode]))
+        ok = compare_tree(target, ref_dir) and ok
+    if stall["counters"][1] > STALL_MAX_CALLS or stall["counters"][0] > STALL_MAX_CALLS * STALL_UI_MS * 2:
+        print("FAIL: the extraction thread waited on the UI thread while copying")
+        ok = False
+    # Make sure that the harness does see the stalls
+    if stall["sync"][1] <= stall["counters"][1] or stall["sync"][0] <= stall["counters"][0]:
+        print("FAIL: no stall was measured when sending the progress from the extraction thread")
+        ok = False
+    return ok
+
+
+def make_hybrid_images(dir):
+    images = {}
+    for name, (data, isohybrid, log) in sorted(hybrid_images().items()):
+        img = os.path.join(dir, "hybrid_%s.iso" % name)
+        with open(img, "wb") as f:
+            f.write(data)
+        print("%-24s %10d bytes" % (os.path.basename(img), len(data)))
+        images[name] = (img, isohybrid, log)
+    return images
+
+
+def test_isohybrid(exe, dir):
+    ok = True
+    target, tmp_dir = make_dirs(dir, "isohybrid")
+    for name, (img, isohybrid, log) in make_hybrid_images(dir).items():
+        r, lines = run(exe, img, target, tmp_dir, "--scan-only")
+        if r != 0:
+            print("\n".join(lines))
+            print("FAIL: %s: the scan failed" % name)
+            ok = False
+            continue
+        detected = "Isohybrid: yes" in lines
+        if detected != isohybrid:
+            print("\n".join(lines))
+            print("FAIL: %s: expected the image %sto be detected as isohybrid" % (name, "" if isohybrid else "not "))
+            ok = False
+        elif log is not None and log not in lines:
+            print("\n".join(lines))
+            print("FAIL: %s: expected '%s'" % (name, log))
+            ok = False
+        else:
+            print("  %-16s %s" % (name, "isohybrid" if detected else "not isohybrid"))
+    return ok
+
+
+TESTS = {
+    "isohybrid": test_isohybrid,
+    "journal": test_journal,
+    "shared": test_shared,
+    "stall": test_stall,
+    "update": test_update,
+}
+
+
+def generate(dir):
+    make_image(dir, "journal", journal_files(), "JOURNAL", datetime.datetime(2013, 3, 9, 12, 0, 0))
+    files, links = shared_files()
+    make_image(dir, "shared", files, "SHARED", datetime.datetime(2013, 3, 11, 12, 0, 0), links)
+    v1, v2, _ = update_files()
+    make_image(dir, "update_v1", v1, "UPDATE", datetime.datetime(2013, 3, 12, 12, 0, 0))
+    make_image(dir, "update_v2", v2, "UPDATE", datetime.datetime(2013, 3, 13, 12, 0, 0))
+    make_hybrid_images(dir)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Extraction tests for ISO9660 images")
+    parser.add_argument("--client", metavar="EXE", help="run iso_test.exe against the generated images")
+    parser.add_argument("--generate", metavar="DIR", help="just generate the images in DIR")
+    parser.add_argument("--keep", metavar="DIR", help="generate the images in DIR rather than a temporary one")
+    parser.add_argument("--test", choices=sorted(TESTS), help="only run this test")
+    args = parser.parse_args()
+
+    if args.generate:
+        os.makedirs(args.generate, exist_ok=True)
+        generate(args.generate)
+        return 0
+    if not args.client:
+        parser.print_usage()
+        return 2
+    ok = True
+    with tempfile.TemporaryDirectory() as tmp:
+        dir = args.keep if args.keep else tmp
+        os.makedirs(dir, exist_ok=True)
+        for name in sorted(TESTS):
+            if args.test and name != args.test:
+                continue
+            print("%s:" % name)
+            r = TESTS[name](os.path.abspath(args.client), dir)
+            print("  %s" % ("OK" if r else "FAILED"))
+            ok = ok and r
+    print("All tests passed" if ok else "Some tests FAILED")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,202 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Contention benchmark for the log ring buffer
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build and run from the src directory, with MinGW:
+ *   gcc -O2 -DRUFUS_DEBUG -I. -o log_bench.exe tests/log_bench.c && log_bench.exe
+ *
+ * Usage: log_bench [nb_threads] [nb_messages_per_thread]
+ *
+ * Several producer threads log as fast as they can while the main thread plays the UI
+ * thread and drains the ring on the same interval as the log timer. The sink stands in
+ * for the log edit control: its cost grows with the size of the text it already holds.
+ * The same load is then run against a synchronous logger, where each producer appends
+ * to the sink itself, under a lock, as _uprintf() used to do.
+ * Once the producers are done, StopLogger() must account for every message, either
+ * as received by the sink or as reported dropped.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+// Route the debug output of stdio.c, which is included below, to the simulated edit control
+static void SinkWrite(const char* str);
+#undef OutputDebugStringA
+#define OutputDebugStringA SinkWrite
+
+#include "../stdio.c"
+
+// Referenced by stdio.c
+HWND hMainDialog = NULL, hLog = NULL;
+DWORD FormatStatus = 0;
+
+#define SINK_SIZE           (256*1024)
+#define MAX_THREADS         64
+
+static char* sink;
+static size_t sink_len;
+static volatile LONG sink_lines;
+static LONG nb_received, nb_dropped;
+static CRITICAL_SECTION sync_lock;
+static BOOL sync_mode = FALSE;
+static volatile LONG producers_left;
+static int nb_messages;
+static LARGE_INTEGER freq;
+
+typedef struct {
+	int id;
+	uint64_t total_ticks, max_ticks;
+} producer;
+
+// Like an edit control, the sink gets slower as its content grows
+static void SinkWrite(const char* str)
+{
+	size_t len = strlen(str);
+	const char* p;
+	int dropped;
+	LONG nb_lines = 0;
+
+	for (p = str; (p = strstr(p, "\r\n")) != NULL; p += 2)
+		nb_received++;
+	if (sscanf(str, "[%d log message(s) dropped]", &dropped) == 1) {
+		nb_dropped += dropped;
+		nb_received--;
+	}
+	if (sink_len + len >= SINK_SIZE)
+		sink_len = 0;
+	memcpy(&sink[sink_len], str, len);
+	sink_len += len;
+	// EM_GETLINECOUNT, for the scroll
+	for (p = sink; (p = memchr(p, '\n', &sink[sink_len] - p)) != NULL; p++)
+		nb_lines++;
+	sink_lines = nb_lines;
+}
+
+static void SyncLog(const char* format, ...)
+{
+	char buf[4096];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	EnterCriticalSection(&sync_lock);
+	SinkWrite(buf);
+	LeaveCriticalSection(&sync_lock);
+}
+
+static DWORD WINAPI Producer(LPVOID param)
+{
+	producer* p = (producer*)param;
+	uint64_t start, ticks;
+	int i;
+
+	for (i = 0; i < nb_messages; i++) {
+		start = IOStatsTimestamp();
+		if (sync_mode)
+			SyncLog("Extracting: /casper/filesystem/thread%02d/file%06d (%d bytes)\r\n", p->id, i, i * 512);
+		else
+			uprintf("Extracting: /casper/filesystem/thread%02d/file%06d (%d bytes)\n", p->id, i, i * 512);
+		ticks = IOStatsTimestamp() - start;
+		p->total_ticks += ticks;
+		if (ticks > p->max_ticks)
+			p->max_ticks = ticks;
+	}
+	InterlockedDecrement(&producers_left);
+	return 0;
+}
+
+static BOOL Run(int nb_threads)
+{
+	HANDLE threads[MAX_THREADS];
+	producer p[MAX_THREADS];
+	uint64_t start, total = 0, max = 0;
+	LONG expected = nb_threads * nb_messages;
+	int i;
+
+	memset(p, 0, sizeof(p));
+	sink_len = 0;
+	nb_received = 0;
+	nb_dropped = 0;
+	producers_left = nb_threads;
+	start = IOStatsTimestamp();
+	for (i = 0; i < nb_threads; i++) {
+		p[i].id = i;
+		threads[i] = CreateThread(NULL, 0, Producer, &p[i], 0, NULL);
+	}
+	// Play the UI thread: drain on the log timer interval while the producers run
+	while (producers_left != 0) {
+		if (!sync_mode)
+			FlushLog();
+		Sleep(LOG_FLUSH_INTERVAL);
+	}
+	WaitForMultipleObjects(nb_threads, threads, TRUE, INFINITE);
+	for (i = 0; i < nb_threads; i++) {
+		CloseHandle(threads[i]);
+		total += p[i].total_ticks;
+		if (p[i].max_ticks > max)
+			max = p[i].max_ticks;
+	}
+	printf("%-12s %8.3f s  avg %8.2f us  max %10.2f us", sync_mode?"synchronous":"ring",
+		(double)(IOStatsTimestamp() - start) / freq.QuadPart,
+		(total * 1000000.0 / freq.QuadPart) / expected, (max * 1000000.0) / freq.QuadPart);
+	if (sync_mode) {
+		printf("\n");
+		return (nb_received == expected);
+	}
+	// Anything still in the ring must come out on shutdown
+	StopLogger();
+	printf("  received %ld, dropped %ld\n", nb_received, nb_dropped);
+	if (nb_received + nb_dropped != expected) {
+		printf("FAIL: %ld messages unaccounted for\n", expected - nb_received - nb_dropped);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+int main(int argc, char** argv)
+{
+	int nb_threads = (argc > 1)?atoi(argv[1]):4;
+	BOOL r;
+
+	nb_messages = (argc > 2)?atoi(argv[2]):5000;
+	if ((nb_threads <= 0) || (nb_threads > MAX_THREADS) || (nb_messages <= 0)) {
+		printf("Usage: %s [nb_threads (1-%d)] [nb_messages_per_thread]\n", argv[0], MAX_THREADS);
+		return 2;
+	}
+	sink = (char*)malloc(SINK_SIZE);
+	if (sink == NULL)
+		return 1;
+	QueryPerformanceFrequency(&freq);
+	InitializeCriticalSection(&sync_lock);
+	// The main thread is the UI thread as far as the logger is concerned
+	log_thread_id = GetCurrentThreadId();
+
+	printf("%d threads, %d messages each\n", nb_threads, nb_messages);
+	sync_mode = TRUE;
+	r = Run(nb_threads);
+	sync_mode = FALSE;
+	r = Run(nb_threads) && r;
+
+	DeleteCriticalSection(&sync_lock);
+	free(sink);
+	printf("%s\n", r?"PASS":"FAIL");
+	return r?0:1;
+}
@@ -0,0 +1,148 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Tests for the token data search and replacement of the parser
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build and run from the src directory, with MinGW:
+ *   gcc -DRUFUS_DEBUG -I. -o parser_test.exe tests/parser_test.c parser.c && parser_test.exe
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "rufus.h"
+
+// Referenced by parser.c
+RUFUS_UPDATE update = { {0,0,0,0}, {0,0}, NULL, NULL};
+
+void _uprintf(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+}
+
+static int nb_failed = 0;
+
+// Run a replacement on a copy of 'in' and compare the result with 'expected'
+// (NULL if no replacement is expected to occur, in which case the buffer must be untouched)
+static void check(const char* name, const char* token, const char* src, const char* rep, BOOL dos2unix,
+	const char* in, size_t in_size, const char* expected, size_t expected_size)
+{
+	char* buf = (char*)malloc(in_size);
+	size_t size = in_size;
+	char* r;
+
+	if (buf == NULL) {
+		printf("FAIL %s: out of memory\n", name);
+		nb_failed++;
+		return;
+	}
+	memcpy(buf, in, in_size);
+	r = replace_in_token_data_buffer(token, src, rep, dos2unix, &buf, &size);
+	if (expected == NULL) {
+		if ((r != NULL) || (size != in_size) || (memcmp(buf, in, in_size) != 0)) {
+			printf("FAIL %s: buffer was modified\n", name);
+			nb_failed++;
+		} else {
+			printf("PASS %s\n", name);
+		}
+	} else if ((r != rep) || (size != expected_size) || (memcmp(buf, expected, expected_size) != 0)) {
+		printf("FAIL %s: got %d bytes '%.*s'\n", name, (int)size, (int)size, buf);
+		nb_failed++;
+	} else {
+		printf("PASS %s\n", name);
+	}
+	free(buf);
+}
+
+// Write 'data' to a temporary file and check the result of find_in_token_data() on it
+static void check_find(const char* name, const char* data, const char* token, const char* str, BOOL expected)
+{
+	const char* path = "parser_test.cfg";
+	FILE* fd = fopen(path, "wb");
+
+	if ((fd == NULL) || (fwrite(data, 1, strlen(data), fd) != strlen(data))) {
+		printf("FAIL %s: could not write %s\n", name, path);
+		nb_failed++;
+		if (fd != NULL)
+			fclose(fd);
+		return;
+	}
+	fclose(fd);
+	if (find_in_token_data(path, token, str) != expected) {
+		printf("FAIL %s\n", name);
+		nb_failed++;
+	} else {
+		printf("PASS %s\n", name);
+	}
+	remove(path);
+}
+
+#define CHECK(name, token, src, rep, dos2unix, in, expected) \
+	check(name, token, src, rep, dos2unix, in, sizeof(in)-1, expected, (expected == NULL)?0:sizeof(expected)-1)
+
+int main(void)
+{
+	// UTF-16LE "append LABEL\r\n" and its expected replacement
+	const char utf16_in[] = "\xFF\xFE" "a\0p\0p\0e\0n\0d\0 \0L\0A\0B\0E\0L\0\r\0\n\0";
+	const char utf16_out[] = "\xFF\xFE" "a\0p\0p\0e\0n\0d\0 \0U\0S\0B\0\r\0\n\0";
+
+	// The token starts the buffer, and the match ends it without a line terminator
+	CHECK("token at buffer start", "append", "LABEL", "USB", TRUE,
+		"append LABEL", "append USB");
+	CHECK("match at buffer end", "append", "LABEL", "USB", TRUE,
+		"label foo\nappend initrd=x LABEL", "label foo\nappend initrd=x USB");
+	CHECK("token on the last line only", "append", "LABEL", "USB", FALSE,
+		"kernel vmlinuz\r\n  APPEND LABEL", "kernel vmlinuz\r\n  APPEND USB");
+	// No match: missing token, source only outside of a token line, token not at line start
+	CHECK("no token", "append", "LABEL", "USB", TRUE,
+		"kernel LABEL\nlabel LABEL\n", NULL);
+	CHECK("token not at line start", "append", "LABEL", "USB", TRUE,
+		"kernel append LABEL\n", NULL);
+	CHECK("no source", "append", "LABEL", "USB", TRUE,
+		"append root=/dev/sda\n", NULL);
+	// Multiple matches: every token line is patched, but only once per line
+	CHECK("multiple lines", "append", "LABEL", "USB", TRUE,
+		"append LABEL\nkernel LABEL\n\tappend x=LABEL\n", "append USB\nkernel LABEL\n\tappend x=USB\n");
+	CHECK("one replacement per line", "append", "LABEL", "USB", TRUE,
+		"append LABEL LABEL\n", "append USB LABEL\n");
+	// Line endings are normalized like the file-based version does
+	CHECK("dos2unix", "append", "LABEL", "USB", TRUE,
+		"a\r\nappend LABEL\r\n", "a\nappend USB\n");
+	CHECK("CRLF", "append", "LABEL", "USB", FALSE,
+		"a\nappend LABEL\r\n", "a\r\nappend USB\r\n");
+	// The encoding of the input is preserved
+	CHECK("UTF-8 BOM", "append", "LABEL", "USB", TRUE,
+		"\xEF\xBB\xBF" "append LABEL\n", "\xEF\xBB\xBF" "append USB\n");
+	check("UTF-16LE", "append", "LABEL", "USB", FALSE, utf16_in, sizeof(utf16_in)-1,
+		utf16_out, sizeof(utf16_out)-1);
+
+	// Search in the token data of a file
+	check_find("find on any token line", "label live\nappend boot=casper\n  append boot=casper persistent\n",
+		"append", "persistent", TRUE);
+	check_find("find on token lines only", "kernel persistent\nappend boot=casper\n",
+		"append", "persistent", FALSE);
+
+	printf("%s\n", (nb_failed == 0)?"All tests passed":"Some tests FAILED");
+	return (nb_failed == 0)?0:1;
+}
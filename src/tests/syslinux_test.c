@@ -0,0 +1,193 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Direct Syslinux installation test, on a FAT volume image
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build from the src directory, with MinGW:
+ *   gcc -O2 -DRUFUS_DEBUG -I. -Ims-sys/inc -Isyslinux/libfat -Isyslinux/libinstaller -o syslinux_test.exe
+ *     tests/syslinux_test.c ms-sys/file.c ms-sys/partition_info.c syslinux/libfat/*.c
+ *     syslinux/libinstaller/*.c -lole32
+ * then run it against the generated images:
+ *   python tests/syslinux_test.py --client syslinux_test.exe
+ *
+ * Usage: syslinux_test <volume image> <ldlinux.sys> <ldlinux.bss>
+ *
+ * ldlinux.sys is placed onto the freshly formatted volume image, which stands in for
+ * the locked volume, with InstallSyslinuxDirect(). The file data, ADV and boot record
+ * are then checked against what the file system installer writes, for the sectors that
+ * libfat maps ldlinux.sys to. Returns 0 if ldlinux.sys was installed and matches, 3 if
+ * the installation backed off (so that the file system would be used instead), and 1
+ * on error.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "../stdio.c"
+#include "../drive.c"
+#include "../syslinux.c"
+
+// Referenced by stdio.c, drive.c and syslinux.c
+HWND hMainDialog = NULL, hLog = NULL, hBootType = NULL;
+HINSTANCE hMainInstance = NULL;
+DWORD FormatStatus = 0;
+BOOL enable_fixed_disks = FALSE;
+
+char* get_token_data_file(const char* token, const char* filename)
+{
+	return NULL;
+}
+
+void UpdateProgress(int op, float percent)
+{
+}
+
+unsigned char* GetResource(HMODULE module, char* name, char* type, const char* desc, DWORD* len, BOOL duplicate)
+{
+	return NULL;
+}
+
+static unsigned char* LoadFile(const char* path, DWORD* len)
+{
+	FILE* fd;
+	unsigned char* buf;
+	long size;
+
+	fd = fopen(path, "rb");
+	if (fd == NULL)
+		return NULL;
+	fseek(fd, 0, SEEK_END);
+	size = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	buf = (unsigned char*)malloc(size);
+	if ((buf != NULL) && (fread(buf, 1, size, fd) != (size_t)size))
+		safe_free(buf);
+	fclose(fd);
+	*len = (DWORD)size;
+	return buf;
+}
+
+// Patch pristine copies of ldlinux.sys and the boot record for the sectors that libfat maps
+// ldlinux.sys to, as InstallSyslinux() does when going through the file system, and compare
+static BOOL CheckInstall(HANDLE hImage, unsigned char* sys, DWORD sys_len, unsigned char* bss,
+	unsigned char* boot)
+{
+	struct libfat_filesystem* fs;
+	libfat_sector_t s, *sectors;
+	unsigned char* buf;
+	int i, nsectors = (sys_len + 2 * ADV_SIZE + SECTOR_SIZE - 1) >> SECTOR_SHIFT;
+	int32_t cluster;
+	BOOL r = FALSE;
+
+	sectors = (libfat_sector_t*)calloc(nsectors, sizeof(libfat_sector_t));
+	buf = (unsigned char*)malloc((size_t)nsectors * SECTOR_SIZE);
+	if ((sectors == NULL) || (buf == NULL))
+		goto out;
+	fs = libfat_open(libfat_readfile, (intptr_t)hImage);
+	if (fs == NULL) {
+		printf("FAIL: libfat could not open the volume\n");
+		goto out;
+	}
+	cluster = libfat_searchdir(fs, 0, "LDLINUX SYS", NULL);
+	s = libfat_clustertosector(fs, cluster);
+	for (i = 0; (s != 0) && (i < nsectors); i++) {
+		sectors[i] = s;
+		s = libfat_nextsector(fs, s);
+	}
+	libfat_close(fs);
+	if (i < nsectors) {
+		printf("FAIL: ldlinux.sys is %d sectors long, expected %d\n", i, nsectors);
+		goto out;
+	}
+
+	syslinux_ldlinux = sys;
+	syslinux_bootsect = bss;
+	syslinux_patch(sectors, nsectors, 0, 0, NULL, NULL);
+	syslinux_make_bootsect(boot, VFAT);
+	for (i = 0; i < nsectors; i++) {
+		if (libfat_readfile((intptr_t)hImage, &buf[i * SECTOR_SIZE], SECTOR_SIZE, sectors[i]) != SECTOR_SIZE)
+			goto out;
+	}
+	if (memcmp(buf, syslinux_ldlinux, sys_len) != 0) {
+		printf("FAIL: ldlinux.sys differs from the reference\n");
+		goto out;
+	}
+	if (memcmp(&buf[sys_len], syslinux_adv, 2 * ADV_SIZE) != 0) {
+		printf("FAIL: the ADV differs from the reference\n");
+		goto out;
+	}
+	if ((libfat_readfile((intptr_t)hImage, buf, SECTOR_SIZE, 0) != SECTOR_SIZE) || (memcmp(buf, boot, SECTOR_SIZE) != 0)) {
+		printf("FAIL: the boot record differs from the reference\n");
+		goto out;
+	}
+	printf("ldlinux.sys is at sector %I64u, and matches the reference\n", (uint64_t)sectors[0]);
+	r = TRUE;
+
+out:
+	free(sectors);
+	free(buf);
+	return r;
+}
+
+int main(int argc, char** argv)
+{
+	HANDLE hImage;
+	unsigned char *sys, *bss, boot[SECTOR_SIZE];
+	DWORD sys_len, bss_len;
+	BOOL r;
+
+	if (argc != 4) {
+		printf("Usage: %s <volume image> <ldlinux.sys> <ldlinux.bss>\n", argv[0]);
+		return 2;
+	}
+	// The installer patches these in place, so keep pristine copies for the reference
+	syslinux_ldlinux = LoadFile(argv[2], &syslinux_ldlinux_len);
+	syslinux_bootsect = LoadFile(argv[3], &syslinux_bootsect_len);
+	sys = LoadFile(argv[2], &sys_len);
+	bss = LoadFile(argv[3], &bss_len);
+	if ((syslinux_ldlinux == NULL) || (syslinux_bootsect == NULL) || (sys == NULL) || (bss == NULL)) {
+		printf("FAIL: could not load %s and %s\n", argv[2], argv[3]);
+		return 1;
+	}
+	hImage = CreateFileA(argv[1], GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hImage == INVALID_HANDLE_VALUE) {
+		printf("FAIL: could not open %s: %s\n", argv[1], WindowsErrorString());
+		return 1;
+	}
+	SelectedDrive.Geometry.BytesPerSector = SECTOR_SIZE;
+	syslinux_reset_adv(syslinux_adv);
+	if (libfat_readfile((intptr_t)hImage, boot, SECTOR_SIZE, 0) != SECTOR_SIZE) {
+		CloseHandle(hImage);
+		return 1;
+	}
+
+	r = InstallSyslinuxDirect(hImage, SelectedDrive.Geometry.BytesPerSector);
+	if (!r) {
+		CloseHandle(hImage);
+		if (FormatStatus != 0) {
+			printf("FAIL: direct installation failed: 0x%08lX\n", FormatStatus);
+			return 1;
+		}
+		printf("Direct installation backed off\n");
+		return 3;
+	}
+	r = CheckInstall(hImage, sys, sys_len, bss, boot);
+	CloseHandle(hImage);
+	return r ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+#
+# Rufus: The Reliable USB Formatting Utility
+# Generates FAT volume images, to test the direct installation of Syslinux with tests/syslinux_test.c
+# Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Freshly formatted volumes, as CreateFAT() creates them, are written to sparse image
+# files, with the FAT16 and FAT32 cluster sizes that matter for the placement of
+# ldlinux.sys, and checked with fat_check.py. Syslinux is then installed directly onto
+# each of them by the client, which also checks the result against what the file system
+# installer patches, and fat_check.py --syslinux must accept the volume. A second
+# installation, and one on FAT12, must back off without writing anything.
+#
+#   python syslinux_test.py --client syslinux_test.exe [--keep DIR] [--syslinux DIR]
+#       generates the images and runs the client against each of them
+#   python syslinux_test.py --generate DIR
+#       just generates the images
+
+import argparse
+import hashlib
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+SECTOR = 512
+FAT_CHECK = os.path.join(os.path.dirname(os.path.abspath(__file__)), "fat_check.py")
+SYSLINUX_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "res", "syslinux")
+
+# Name, FAT type, size in sectors and sectors per cluster
+VOLUMES = [
+    ("fat16_512", 16, 65536, 1),
+    ("fat16_2k", 16, 262144, 4),
+    ("fat32_4k", 32, 1228800, 8),
+    ("fat32_16k", 32, 4194304, 32),
+    ("fat12", 12, 16384, 8),
+]
+
+# Exit codes of the client
+INSTALLED = 0
+BACKED_OFF = 3
+
+
+def make_volume(path, fat_bits, total, spc, label):
+    rsvd, root_ents, nb_fats, media = (32, 0, 2, 0xF8) if fat_bits == 32 else (1, 512, 2, 0xF8)
+    root_secs = (root_ents * 32 + SECTOR - 1) // SECTOR
+    # FAT size, as per the MS specs (which overestimate it for FAT12)
+    d = 256 * spc + nb_fats
+    if fat_bits == 32:
+        d //= 2
+    fat_size = (total - rsvd - root_secs + d - 1) // d
+    data_start = rsvd + nb_fats * fat_size + root_secs
+    nb_clusters = (total - data_start) // spc
+    assert (12 if nb_clusters < 4085 else 16 if nb_clusters < 65525 else 32) == fat_bits
+
+    bs = bytearray(SECTOR)
+    bs[0:11] = (b"\xEB\x58\x90" if fat_bits == 32 else b"\xEB\x3C\x90") + b"MSWIN4.1"
+    small = fat_bits != 32 and total < 0x10000
+    struct.pack_into("<HBHBHHBHHHII", bs, 11, SECTOR, spc, rsvd, nb_fats, root_ents, total if small else 0,
+                     media, 0 if fat_bits == 32 else fat_size, 63, 255, 0, 0 if small else total)
+    ext = struct.pack("<BBBI", 0x80, 0, 0x29, 0x20130301) + label.ljust(11).encode("ascii")
+    if fat_bits == 32:
+        struct.pack_into("<IHHIHH", bs, 36, fat_size, 0, 0, 2, 1, 6)
+        bs[64:90] = ext + b"FAT32   "
+    else:
+        bs[36:62] = ext + b"FAT%-5d" % fat_bits
+    bs[510:512] = b"\x55\xAA"
+
+    with open(path, "wb") as f:
+        f.truncate(total * SECTOR)
+        f.write(bs)
+        if fat_bits == 32:
+            fsinfo = bytearray(SECTOR)
+            struct.pack_into("<I", fsinfo, 0, 0x41615252)
+            struct.pack_into("<III", fsinfo, 484, 0x61417272, nb_clusters - 1, 3)
+            struct.pack_into("<I", fsinfo, 508, 0xAA550000)
+            f.write(fsinfo)
+            f.seek(6 * SECTOR)
+            f.write(bs + fsinfo)
+            fat = struct.pack("<3I", 0x0FFFFF00 | media, 0x0FFFFFFF, 0x0FFFFFFF)
+        elif fat_bits == 16:
+            fat = bytes([media, 0xFF, 0xFF, 0xFF])
+        else:
+            fat = bytes([media, 0xFF, 0xFF])
+        for i in range(nb_fats):
+            f.seek((rsvd + i * fat_size) * SECTOR)
+            f.write(fat)
+        f.seek((data_start if fat_bits == 32 else rsvd + nb_fats * fat_size) * SECTOR)
+        f.write(label.ljust(11).encode("ascii") + b"\x08")
+
+
+def make_volumes(dir):
+    images = []
+    for name, fat_bits, total, spc in VOLUMES:
+        path = os.path.join(dir, name + ".img")
+        make_volume(path, fat_bits, total, spc, name.upper()[:11])
+        print("%-14s FAT%d, %5d MB, %5d bytes clusters" % (name + ".img", fat_bits, total * SECTOR // (1024 * 1024),
+                                                         spc * SECTOR))
+        images.append((name, fat_bits, path))
+    return images
+
+
+def digest(path):
+    # The images are sparse, and only their start is ever written to
+    h = hashlib.sha1()
+    with open(path, "rb") as f:
+        h.update(f.read(64 * 1024 * 1024))
+    return h.hexdigest()
+
+
+def fat_check(path, *opts):
+    r = subprocess.run([sys.executable, FAT_CHECK] + list(opts) + [path], stdout=subprocess.PIPE,
+                       stderr=subprocess.STDOUT, universal_newlines=True)
+    return r.returncode == 0, r.stdout.strip()
+
+
+def run_client(exe, dir, syslinux_dir):
+    ok = True
+    sys_file, bss_file = os.path.join(syslinux_dir, "ldlinux.sys"), os.path.join(syslinux_dir, "ldlinux.bss")
+    for name, fat_bits, path in make_volumes(dir):
+        r, out = fat_check(path)
+        if not r:
+            print("FAIL: %s: the generated volume is invalid: %s" % (name, out))
+            ok = False
+            continue
+        for attempt in ("first", "second"):
+            before = digest(path)
+            r = subprocess.run([exe, path, sys_file, bss_file], stdout=subprocess.PIPE,
+                               stderr=subprocess.STDOUT, universal_newlines=True, errors="replace")
+            expected = INSTALLED if (attempt == "first" and fat_bits != 12) else BACKED_OFF
+            desc = "%s (%s install)" % (name, attempt)
+            if r.returncode != expected:
+                print(r.stdout)
+                print("FAIL: %s: the client returned %d, expected %d" % (desc, r.returncode, expected))
+                ok = False
+                break
+            if expected == BACKED_OFF:
+                if digest(path) != before:
+                    print("FAIL: %s: the volume was modified" % desc)
+                    ok = False
+                else:
+                    print("  %-30s backed off, OK" % desc)
+                continue
+            r, out = fat_check(path, "--syslinux")
+            if not r:
+                print(out)
+                print("FAIL: %s: the volume is inconsistent" % desc)
+                ok = False
+                break
+            print("  %-30s %s" % (desc, out.splitlines()[0]))
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Direct Syslinux installation test on FAT volume images")
+    parser.add_argument("--client", metavar="EXE", help="run syslinux_test.exe against the generated images")
+    parser.add_argument("--generate", metavar="DIR", help="just generate the images in DIR")
+    parser.add_argument("--keep", metavar="DIR", help="generate the images in DIR rather than a temporary one")
+    parser.add_argument("--syslinux", metavar="DIR", default=SYSLINUX_DIR,
+                        help="directory where ldlinux.sys and ldlinux.bss are (default: res/syslinux)")
+    args = parser.parse_args()
+
+    if args.generate:
+        os.makedirs(args.generate, exist_ok=True)
+        make_volumes(args.generate)
+        return 0
+    if not args.client:
+        parser.print_usage()
+        return 2
+    if args.keep:
+        os.makedirs(args.keep, exist_ok=True)
+        ok = run_client(os.path.abspath(args.client), args.keep, args.syslinux)
+    else:
+        with tempfile.TemporaryDirectory() as dir:
+            ok = run_client(os.path.abspath(args.client), dir, args.syslinux)
+    print("All tests passed" if ok else "Some tests FAILED")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
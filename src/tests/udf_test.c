@@ -0,0 +1,144 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Extraction test for fragmented UDF files
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build from the src directory, with MinGW:
+ *   gcc -O2 -DHAVE_CONFIG_H -I. -Ilibcdio -Ilibcdio/driver -o udf_test.exe tests/udf_test.c
+ *     <all the .c files from libcdio/udf and libcdio/driver>
+ * then run it against a generated image:
+ *   python tests/udf_test.py --client udf_test.exe
+ *
+ * Usage: udf_test <image> <reference dir>
+ *
+ * Every file at the root of the image is read in the same way as udf_extract_files()
+ * does, with a number of blocks per read that doesn't match the size of the extents,
+ * and compared against the file of the same name in the reference directory.
+ * Returns 0 if all the files matched, 1 otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <cdio/cdio.h>
+#include <cdio/udf.h>
+
+// Images are only ever opened as files
+CdIo_t* cdio_open (const char* psz_source, driver_id_t driver_id) {return NULL;}
+void cdio_destroy (CdIo_t* p_cdio) {}
+
+#ifndef MIN
+#define MIN(a, b)           (((a) < (b)) ? (a) : (b))
+#endif
+#define MAX_BLOCKS          32
+
+static const size_t nb_blocks[] = { 1, 3, 16, MAX_BLOCKS };
+
+static bool CheckFile(udf_dirent_t* p_udf_dirent, const char* ref_dir, size_t copy_buf_blocks)
+{
+	static unsigned char buf[MAX_BLOCKS * UDF_BLOCKSIZE];
+	char path[1024];
+	unsigned char* ref;
+	int64_t i_file_length = udf_get_file_length(p_udf_dirent), offset = 0;
+	ssize_t i_read;
+	size_t len;
+	FILE* fd;
+	bool r = false;
+
+	snprintf(path, sizeof(path), "%s/%s", ref_dir, udf_get_filename(p_udf_dirent));
+	fd = fopen(path, "rb");
+	if (fd == NULL) {
+		printf("FAIL: no reference for %s\n", udf_get_filename(p_udf_dirent));
+		return false;
+	}
+	ref = (unsigned char*)malloc((size_t)i_file_length + 1);
+	len = (ref == NULL) ? 0 : fread(ref, 1, (size_t)i_file_length + 1, fd);
+	fclose(fd);
+	if (len != (size_t)i_file_length) {
+		printf("FAIL: %s is %lld bytes, the reference is %lu\n", udf_get_filename(p_udf_dirent),
+			(long long)i_file_length, (unsigned long)len);
+		goto out;
+	}
+
+	while (i_file_length > 0) {
+		i_read = udf_read_block(p_udf_dirent, buf,
+			(size_t)MIN(copy_buf_blocks, (i_file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE));
+		if (i_read <= 0) {
+			printf("FAIL: read error in %s at %lld\n", udf_get_filename(p_udf_dirent), (long long)offset);
+			goto out;
+		}
+		len = (size_t)MIN(i_file_length, i_read);
+		if (memcmp(buf, &ref[offset], len) != 0) {
+			printf("FAIL: %s differs in the %lu bytes read at %lld, with %lu block reads\n",
+				udf_get_filename(p_udf_dirent), (unsigned long)len, (long long)offset, (unsigned long)copy_buf_blocks);
+			goto out;
+		}
+		offset += len;
+		i_file_length -= i_read;
+	}
+	r = true;
+
+out:
+	free(ref);
+	return r;
+}
+
+int main(int argc, char** argv)
+{
+	udf_t* p_udf;
+	udf_dirent_t *p_udf_root, *p_udf_dirent;
+	int i, nb_files;
+	bool r = true;
+
+	if (argc != 3) {
+		printf("Usage: %s <image> <reference dir>\n", argv[0]);
+		return 2;
+	}
+	p_udf = udf_open(argv[1]);
+	if (p_udf == NULL) {
+		printf("FAIL: could not open %s as UDF\n", argv[1]);
+		return 1;
+	}
+
+	for (i = 0; i < (int)(sizeof(nb_blocks) / sizeof(nb_blocks[0])); i++) {
+		p_udf_root = udf_get_root(p_udf, true, 0);
+		if (p_udf_root == NULL) {
+			printf("FAIL: could not locate the root directory\n");
+			r = false;
+			break;
+		}
+		nb_files = 0;
+		// udf_readdir() frees the entry once the end of the directory is reached
+		for (p_udf_dirent = udf_readdir(p_udf_root); p_udf_dirent != NULL; p_udf_dirent = udf_readdir(p_udf_dirent)) {
+			if ((p_udf_dirent->b_parent) || (udf_is_dir(p_udf_dirent)))
+				continue;
+			nb_files++;
+			if (!CheckFile(p_udf_dirent, argv[2], nb_blocks[i]))
+				r = false;
+		}
+		printf("  %2lu block reads: %d files %s\n", (unsigned long)nb_blocks[i], nb_files, r ? "OK" : "FAILED");
+		if (nb_files == 0)
+			r = false;
+	}
+
+	udf_close(p_udf);
+	printf("%s\n", r ? "PASS" : "FAIL");
+	return r ? 0 : 1;
+}
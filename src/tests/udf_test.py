@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+#
+# Rufus: The Reliable USB Formatting Utility
+# Generates UDF images with fragmented files, to test extraction with tests/udf_test.c
+# Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# The files of the image are split into several extents, which are interleaved with
+# the extents of the other files, so that a read that goes past the end of an extent
+# returns data that belongs to another file. Files are described with short and long
+# allocation descriptors, and the last extent of each file ends with a partial block.
+# Only the structures that libcdio needs are written (AVDP, main VDS, FSD, File Entries
+# and File Identifiers), without CRCs.
+#
+#   python udf_test.py --client udf_test.exe [--keep DIR]
+#       generates the image and runs the client against it
+#   python udf_test.py --generate DIR
+#       just generates the image and the reference files
+
+import argparse
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+
+BLOCK = 2048
+MVDS_START = 32
+AVDP_LBA = 256
+PART_START = 272
+
+AD_SHORT = 0
+AD_LONG = 1
+
+# name, allocation descriptor type, size of each extent in blocks (the last one is
+# shortened by 'tail' bytes)
+FILES = [
+    ("short_ad.bin", AD_SHORT, [20, 7, 13, 1, 40], 1000),
+    ("long_ad.bin", AD_LONG, [9, 1, 33, 5, 17, 2], 2047),
+    ("contiguous.bin", AD_SHORT, [50], 1),
+    ("single_block.bin", AD_LONG, [1, 1, 1, 1], 0),
+    ("small.bin", AD_SHORT, [1], BLOCK - 100),
+]
+
+
+def tag(id, data, loc):
+    # Descriptor tag (ECMA 167 3/7.2), with its checksum and no CRC
+    t = bytearray(struct.pack("<HHBBHHHI", id, 2, 0, 0, 0, 0, 0, loc))
+    t[4] = sum(t) & 0xFF
+    return bytes(t) + data
+
+
+def block(data):
+    assert len(data) <= BLOCK
+    return data + bytes(BLOCK - len(data))
+
+
+def long_ad(length, lba):
+    return struct.pack("<IIH6x", length, lba, 0)
+
+
+def dstring(s, size):
+    d = bytes([8]) + s.encode("ascii")
+    return d + bytes(size - 1 - len(d)) + bytes([len(d)])
+
+
+def file_entry(loc, file_type, length, ad_type, extents):
+    # extents is a list of (lba relative to the partition, length in bytes)
+    if ad_type == AD_SHORT:
+        ads = b"".join(struct.pack("<II", l, lba) for lba, l in extents)
+    else:
+        ads = b"".join(long_ad(l, lba) for lba, l in extents)
+    icb = struct.pack("<IHHHBB6sH", 0, 4, 0, 1, 0, file_type, bytes(6), ad_type)
+    fe = icb + struct.pack("<IIIHBBIQQ", 0, 0, 0x1FFF, 1, 0, 0, 0, length, sum((l + BLOCK - 1) // BLOCK for _, l in extents))
+    fe += bytes(36) + bytes(4) + bytes(16) + bytes(32) + struct.pack("<QII", 0, 0, len(ads)) + ads
+    return block(tag(0x105, fe, loc))
+
+
+def fid(name, characteristics, icb_lba):
+    name = b"" if name is None else bytes([8]) + name.encode("ascii")
+    d = struct.pack("<HBB", 1, characteristics, len(name)) + long_ad(BLOCK, icb_lba) + struct.pack("<H", 0) + name
+    d = tag(0x101, d, 0)
+    return d + bytes(-len(d) % 4)
+
+
+def make_image(dir):
+    rnd = random.Random(34)
+    contents = {}
+    for name, _, sizes, tail in FILES:
+        contents[name] = rnd.randbytes(sum(sizes) * BLOCK - tail)
+
+    # Partition layout: FSD, root FE, root directory, one FE per file, then the data,
+    # with the extents of the files handed out round robin
+    fe_lba = {name: 3 + i for i, (name, _, _, _) in enumerate(FILES)}
+    next_lba = 3 + len(FILES)
+    extents = {name: [] for name, _, _, _ in FILES}
+    data = {}
+    pending = {name: list(sizes) for name, _, sizes, _ in FILES}
+    offset = {name: 0 for name, _, _, _ in FILES}
+    while any(pending.values()):
+        for name, _, _, _ in FILES:
+            if not pending[name]:
+                continue
+            nb = pending[name].pop(0)
+            length = min(nb * BLOCK, len(contents[name]) - offset[name])
+            extents[name].append((next_lba, length))
+            data[next_lba] = contents[name][offset[name]:offset[name] + length]
+            offset[name] += length
+            # Leave a gap of one block, filled with a marker, after some of the extents
+            next_lba += nb + (len(extents[name]) % 2)
+    part_len = next_lba + 1
+
+    dir_data = fid(None, 0x0A, 1)
+    for name, _, _, _ in FILES:
+        dir_data += fid(name, 0, fe_lba[name])
+    assert len(dir_data) <= BLOCK
+
+    img = bytearray(b"\xEE" * ((PART_START + part_len) * BLOCK))
+    img[:16 * BLOCK] = bytes(16 * BLOCK)
+
+    def put(lba, blk):
+        img[lba * BLOCK:lba * BLOCK + len(blk)] = blk
+
+    # Volume recognition sequence
+    for i, id in enumerate([b"BEA01", b"NSR02", b"TEA01"]):
+        put(16 + i, block(bytes([0]) + id + bytes([1])))
+    # Main volume descriptor sequence
+    put(MVDS_START, block(tag(0x001, struct.pack("<II", 0, 0) + dstring("UDF_TEST", 32), MVDS_START)))
+    pd = struct.pack("<IHH", 1, 1, 0) + bytes([0]) + b"+NSR02".ljust(23, b"\0") + bytes(8) + bytes(128)
+    pd += struct.pack("<III", 1, PART_START, part_len)
+    put(MVDS_START + 1, block(tag(0x005, pd, MVDS_START + 1)))
+    lvd = struct.pack("<I", 2) + bytes(64) + dstring("UDF_TEST", 128) + struct.pack("<I", BLOCK)
+    lvd += bytes(32) + long_ad(BLOCK, 0) + bytes(16) + struct.pack("<II", 6, 1) + bytes(32) + bytes(128)
+    lvd += struct.pack("<II", 0, 0) + struct.pack("<BBHH", 1, 6, 1, 0)
+    put(MVDS_START + 2, block(tag(0x006, lvd, MVDS_START + 2)))
+    put(MVDS_START + 3, block(tag(0x008, b"", MVDS_START + 3)))
+    put(AVDP_LBA, block(tag(0x002, struct.pack("<IIII", 16 * BLOCK, MVDS_START, 16 * BLOCK, MVDS_START), AVDP_LBA)))
+    # File set
+    fsd = bytes(12) + struct.pack("<HHIIII", 3, 3, 1, 1, 0, 0) + bytes(64) + dstring("UDF_TEST", 128)
+    fsd += bytes(64) + dstring("UDF_TEST", 32) + bytes(64) + long_ad(BLOCK, 1)
+    put(PART_START, block(tag(0x100, fsd, 0)))
+    put(PART_START + 1, file_entry(1, 4, len(dir_data), AD_SHORT, [(2, len(dir_data))]))
+    put(PART_START + 2, block(dir_data))
+    for name, ad_type, _, _ in FILES:
+        put(PART_START + fe_lba[name], file_entry(fe_lba[name], 5, len(contents[name]), ad_type, extents[name]))
+    for lba, d in data.items():
+        put(PART_START + lba, d)
+
+    ref_dir = os.path.join(dir, "reference")
+    os.makedirs(ref_dir, exist_ok=True)
+    for name, d in contents.items():
+        with open(os.path.join(ref_dir, name), "wb") as f:
+            f.write(d)
+    with open(os.path.join(dir, "fragmented.iso"), "wb") as f:
+        f.write(img)
+    for name, _, _, _ in FILES:
+        print("%-18s %8d bytes, %d extents" % (name, len(contents[name]), len(extents[name])))
+    return os.path.join(dir, "fragmented.iso"), ref_dir
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Extraction test for fragmented UDF files")
+    parser.add_argument("--client", metavar="EXE", help="run udf_test.exe against the generated image")
+    parser.add_argument("--generate", metavar="DIR", help="just generate the image in DIR")
+    parser.add_argument("--keep", metavar="DIR", help="generate the image in DIR rather than a temporary one")
+    args = parser.parse_args()
+
+    if args.generate:
+        os.makedirs(args.generate, exist_ok=True)
+        make_image(args.generate)
+        return 0
+    if not args.client:
+        parser.print_usage()
+        return 2
+    with tempfile.TemporaryDirectory() as tmp:
+        dir = args.keep if args.keep else tmp
+        os.makedirs(dir, exist_ok=True)
+        img, ref_dir = make_image(dir)
+        r = subprocess.run([os.path.abspath(args.client), img, ref_dir])
+    return r.returncode
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,124 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Write test for VHD and VHDX images
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build from the src directory, with MinGW:
+ *   gcc -O2 -DRUFUS_DEBUG -I. -Ims-sys/inc -o vhd_test.exe tests/vhd_test.c ms-sys/file.c
+ *     ms-sys/partition_info.c -lole32
+ * then run it against the generated images:
+ *   python tests/vhd_test.py --client vhd_test.exe
+ *
+ * Usage: vhd_test <image> <target file> [--no-discard] [--verify] [--raw]
+ *
+ * The image is written to the target file, which stands in for the physical drive and
+ * must already be at least as large as the virtual disk, as WriteVHD() does. Options:
+ * --no-discard: make DiscardSectors() fail, so that the unallocated blocks get zeroed
+ * --verify: read the data back and check it, as WriteRawImage() does
+ * --raw: the image is a plain disk image, such as an isohybrid ISO, which is written
+ *   with WriteRawImage()
+ * Returns 0 if the image was written (and verified), 1 otherwise.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "../stdio.c"
+#include "../drive.c"
+
+static BOOL no_discard = FALSE;
+
+// Discarding a file region goes through FSCTL_SET_ZERO_DATA, which we may want to disable
+static BOOL DiscardSectorsHook(HANDLE hDrive, uint64_t SectorSize, uint64_t StartSector, uint64_t nSectors)
+{
+	return no_discard ? FALSE : DiscardSectors(hDrive, SectorSize, StartSector, nSectors);
+}
+#define DiscardSectors DiscardSectorsHook
+
+#include "../vhd.c"
+
+// Referenced by stdio.c, drive.c and vhd.c
+HWND hMainDialog = NULL, hLog = NULL;
+DWORD FormatStatus = 0;
+BOOL enable_fixed_disks = FALSE;
+
+char* get_token_data_file(const char* token, const char* filename)
+{
+	return NULL;
+}
+
+void UpdateProgress(int op, float percent)
+{
+}
+
+int main(int argc, char** argv)
+{
+	HANDLE hTarget;
+	LARGE_INTEGER li;
+	uint64_t disk_size;
+	BOOL verify = FALSE, raw = FALSE, r;
+	int i;
+
+	if (argc < 3) {
+		printf("Usage: %s <image> <target file> [--no-discard] [--verify] [--raw]\n", argv[0]);
+		return 2;
+	}
+	for (i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "--no-discard") == 0) {
+			no_discard = TRUE;
+		} else if (strcmp(argv[i], "--verify") == 0) {
+			verify = TRUE;
+		} else if (strcmp(argv[i], "--raw") == 0) {
+			raw = TRUE;
+		} else {
+			printf("Unknown option %s\n", argv[i]);
+			return 2;
+		}
+	}
+
+	if (raw) {
+		hTarget = CreateFileA(argv[1], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if ((hTarget == INVALID_HANDLE_VALUE) || (!GetFileSizeEx(hTarget, &li))) {
+			printf("FAIL: could not open %s: %s\n", argv[1], WindowsErrorString());
+			return 1;
+		}
+		CloseHandle(hTarget);
+		disk_size = li.QuadPart;
+	} else if (!IsVHD(argv[1], &disk_size)) {
+		printf("FAIL: %s is not a VHD or VHDX we can write\n", argv[1]);
+		return 1;
+	}
+	hTarget = CreateFileA(argv[2], GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, 0, NULL);
+	if ((hTarget == INVALID_HANDLE_VALUE) || (!GetFileSizeEx(hTarget, &li))) {
+		printf("FAIL: could not open %s: %s\n", argv[2], WindowsErrorString());
+		return 1;
+	}
+	SelectedDrive.DiskSize = li.QuadPart;
+	SelectedDrive.Geometry.BytesPerSector = 512;
+
+	r = raw ? WriteRawImage(hTarget, argv[1]) : WriteImage(hTarget, argv[1], FALSE, verify);
+	CloseHandle(hTarget);
+	if (!r) {
+		printf("FAIL: could not write %s: 0x%08lX\n", argv[1], FormatStatus);
+		return 1;
+	}
+	printf("Wrote %I64u bytes from %s\n", disk_size, argv[1]);
+	return 0;
+}
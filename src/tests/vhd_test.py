@@ -0,0 +1,274 @@
+#!/usr/bin/env python3
+#
+# Rufus: The Reliable USB Formatting Utility
+# Generates VHD and VHDX images, to test writing them with tests/vhd_test.c
+# Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# The same virtual disk, where some blocks hold data, some are all zeroes and the
+# others are not allocated, is saved as a fixed VHD, a dynamic VHD and a VHDX, in
+# which the unallocated blocks use each of the "not present", "zero" and "unmapped"
+# states. Each image is written to a file that is filled with a pattern beforehand,
+# which must not show through in the unallocated blocks, with and without discard,
+# and with verification. The isohybrid images from iso_test.py, which Rufus detects as
+# such, are also written as plain disk images, the way WriteRawImage() writes them.
+#
+#   python vhd_test.py --client vhd_test.exe [--keep DIR]
+#       generates the images and runs the client against each of them
+#   python vhd_test.py --generate DIR
+#       just generates the images and the reference disk
+
+import argparse
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import uuid
+
+from iso_test import hybrid_images
+
+SECTOR = 512
+VHD_BLOCK = 2 * 1024 * 1024
+VHDX_BLOCK = 1024 * 1024
+MB = 1024 * 1024
+# Ends with a partial block, for both block sizes
+DISK_SIZE = 23 * MB + 5 * SECTOR
+PATTERN = b"\xEE"
+
+# Layout of the disk, in VHDX blocks: 'D' for data, '0' for allocated zeroes, '-' for unallocated.
+# Each VHD block covers two of these, and is only allocated if one of them is.
+LAYOUT = "DD--D0----DD------D--0DD"
+
+VHDX_NOT_PRESENT = 0
+VHDX_ZERO = 2
+VHDX_UNMAPPED = 3
+VHDX_FULLY_PRESENT = 6
+
+VHDX_BAT_GUID = uuid.UUID("2DC27766-F623-4200-9D64-115E9BFD4A08")
+VHDX_METADATA_GUID = uuid.UUID("8B7CA206-4790-4B9A-B8FE-575F050F886E")
+VHDX_FILE_PARAMETERS_GUID = uuid.UUID("CAA16737-FA36-4D43-B3B6-33F0AA44E76B")
+VHDX_DISK_SIZE_GUID = uuid.UUID("2FA54224-CD1B-4876-B211-5DBED83BF4B8")
+VHDX_SECTOR_SIZE_GUID = uuid.UUID("8141BF1D-A96F-4709-BA47-F233A8FAAB5F")
+
+
+def make_disk():
+    rnd = random.Random(40)
+    disk = bytearray()
+    for c in LAYOUT:
+        disk += rnd.randbytes(VHDX_BLOCK) if c == "D" else bytes(VHDX_BLOCK)
+    return bytes(disk[:DISK_SIZE])
+
+
+def vhd_allocated(n):
+    return any(c != "-" for c in LAYOUT[2 * n:2 * n + 2])
+
+
+def vhd_checksum(data):
+    return ~sum(data) & 0xFFFFFFFF
+
+
+def vhd_footer(disk_type, data_offset):
+    f = bytearray(b"conectix" + struct.pack(">IIQI4sIIQQIII", 2, 0x10000, data_offset, 0, b"rufs", 0x10000,
+                                           0x5769326B, DISK_SIZE, DISK_SIZE, 0, disk_type, 0))
+    f += uuid.UUID(int=40).bytes + bytes(SECTOR - len(f) - 16)
+    f[64:68] = struct.pack(">I", vhd_checksum(f))
+    return bytes(f)
+
+
+def make_fixed_vhd(disk):
+    return disk + vhd_footer(2, 0xFFFFFFFFFFFFFFFF)
+
+
+def make_dynamic_vhd(disk):
+    nb_blocks = (DISK_SIZE + VHD_BLOCK - 1) // VHD_BLOCK
+    bitmap_size = ((VHD_BLOCK // SECTOR) // 8 + SECTOR - 1) // SECTOR * SECTOR
+    bat_size = (nb_blocks * 4 + SECTOR - 1) // SECTOR * SECTOR
+    footer = vhd_footer(3, SECTOR)
+    out = bytearray(footer)
+    dyn = bytearray(b"cxsparse" + struct.pack(">QQIIII", 0xFFFFFFFFFFFFFFFF, 3 * SECTOR, 0x10000, nb_blocks,
+                                              VHD_BLOCK, 0))
+    dyn += bytes(1024 - len(dyn))
+    dyn[36:40] = struct.pack(">I", vhd_checksum(dyn))
+    out += dyn
+    bat = bytearray(b"\xFF" * bat_size)
+    data = bytearray()
+    offset = len(out) + bat_size
+    for n in range(nb_blocks):
+        if not vhd_allocated(n):
+            continue
+        bat[4 * n:4 * n + 4] = struct.pack(">I", (offset + len(data)) // SECTOR)
+        block = disk[n * VHD_BLOCK:(n + 1) * VHD_BLOCK]
+        data += b"\xFF" * bitmap_size + block + bytes(VHD_BLOCK - len(block))
+    return bytes(out + bat + data + footer)
+
+
+def crc32c(data):
+    crc = 0xFFFFFFFF
+    table = crc32c.table
+    for b in data:
+        crc = table[(crc ^ b) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
+
+
+crc32c.table = []
+for _i in range(256):
+    _c = _i
+    for _ in range(8):
+        _c = (_c >> 1) ^ (0x82F63B78 if _c & 1 else 0)
+    crc32c.table.append(_c)
+
+
+def with_crc(data, size):
+    # The checksum is at offset 4, and covers the whole structure
+    d = bytearray(data + bytes(size - len(data)))
+    d[4:8] = struct.pack("<I", crc32c(d))
+    return bytes(d)
+
+
+def make_vhdx(disk, unallocated_state):
+    nb_blocks = (DISK_SIZE + VHDX_BLOCK - 1) // VHDX_BLOCK
+    chunk_ratio = (2 ** 23 * SECTOR) // VHDX_BLOCK
+    nb_entries = nb_blocks + (nb_blocks - 1) // chunk_ratio
+    metadata_offset, bat_offset, data_offset = 1 * MB, 2 * MB, 3 * MB
+    out = bytearray(data_offset)
+    out[0:8] = b"vhdxfile"
+    # Two headers: the one with the highest sequence number is current
+    for i, seq in enumerate((1, 2)):
+        h = b"head" + bytes(4) + struct.pack("<Q", seq) + uuid.UUID(int=seq).bytes_le * 2 + bytes(16)
+        h += struct.pack("<HHIQ", 0, 1, MB, MB)
+        out[(i + 1) * 64 * 1024:(i + 1) * 64 * 1024 + 4096] = with_crc(h, 4096)
+    regions = b"regi" + bytes(4) + struct.pack("<II", 2, 0)
+    regions += VHDX_BAT_GUID.bytes_le + struct.pack("<QII", bat_offset, MB, 1)
+    regions += VHDX_METADATA_GUID.bytes_le + struct.pack("<QII", metadata_offset, MB, 1)
+    for off in (192 * 1024, 256 * 1024):
+        out[off:off + 64 * 1024] = with_crc(regions, 64 * 1024)
+    items = [(VHDX_FILE_PARAMETERS_GUID, struct.pack("<II", VHDX_BLOCK, 0)),
+             (VHDX_DISK_SIZE_GUID, struct.pack("<Q", DISK_SIZE)),
+             (VHDX_SECTOR_SIZE_GUID, struct.pack("<I", SECTOR))]
+    meta = bytearray(b"metadata" + struct.pack("<HH20x", 0, len(items)))
+    item_offset = 64 * 1024
+    for guid, value in items:
+        meta += guid.bytes_le + struct.pack("<IIII", item_offset, len(value), 0, 0)
+        out[metadata_offset + item_offset:metadata_offset + item_offset + len(value)] = value
+        item_offset += len(value)
+    out[metadata_offset:metadata_offset + len(meta)] = meta
+    bat = bytearray(nb_entries * 8)
+    for n in range(nb_blocks):
+        j = n + n // chunk_ratio
+        if LAYOUT[n] == "-":
+            bat[8 * j:8 * j + 8] = struct.pack("<Q", unallocated_state)
+        else:
+            bat[8 * j:8 * j + 8] = struct.pack("<Q", (len(out) // MB) << 20 | VHDX_FULLY_PRESENT)
+            block = disk[n * VHDX_BLOCK:(n + 1) * VHDX_BLOCK]
+            out += block + bytes(VHDX_BLOCK - len(block))
+    out[bat_offset:bat_offset + len(bat)] = bat
+    return bytes(out)
+
+
+def make_images(dir):
+    disk = make_disk()
+    images = {
+        "fixed.vhd": make_fixed_vhd(disk),
+        "dynamic.vhd": make_dynamic_vhd(disk),
+        "not_present.vhdx": make_vhdx(disk, VHDX_NOT_PRESENT),
+        "zero.vhdx": make_vhdx(disk, VHDX_ZERO),
+        "unmapped.vhdx": make_vhdx(disk, VHDX_UNMAPPED),
+    }
+    with open(os.path.join(dir, "reference.img"), "wb") as f:
+        f.write(disk)
+    for name, data in images.items():
+        with open(os.path.join(dir, name), "wb") as f:
+            f.write(data)
+        print("%-24s %10d bytes" % (name, len(data)))
+    return disk, sorted(images)
+
+
+def make_raw_images(dir):
+    # Only the images that are detected as isohybrid get written to the drive as is
+    images = {}
+    for name, (data, isohybrid, _) in sorted(hybrid_images().items()):
+        if not isohybrid:
+            continue
+        images["hybrid_%s.iso" % name] = data
+        with open(os.path.join(dir, "hybrid_%s.iso" % name), "wb") as f:
+            f.write(data)
+        print("%-24s %10d bytes" % ("hybrid_%s.iso" % name, len(data)))
+    return images
+
+
+def write_target(exe, dir, name, opts, disk):
+    # The target is larger than the disk, and its tail must be left alone
+    target = os.path.join(dir, "target.img")
+    with open(target, "wb") as f:
+        f.write(PATTERN * (len(disk) + MB))
+    r = subprocess.run([exe, os.path.join(dir, name), target] + opts, stdout=subprocess.PIPE,
+                       stderr=subprocess.STDOUT, universal_newlines=True, errors="replace")
+    with open(target, "rb") as f:
+        data = f.read()
+    desc = " ".join([name] + opts)
+    if r.returncode != 0:
+        print(r.stdout)
+        print("FAIL: %s: the client failed" % desc)
+    elif data[:len(disk)] != disk:
+        offset = next(i for i in range(len(disk)) if data[i] != disk[i])
+        print("FAIL: %s: the target differs from the disk image at 0x%x" % (desc, offset))
+    elif data[len(disk):] != PATTERN * MB:
+        print("FAIL: %s: data was written past the end of the disk image" % desc)
+    else:
+        print("  %-36s OK" % desc)
+        return True
+    return False
+
+
+def run_client(exe, dir):
+    ok = True
+    disk, images = make_images(dir)
+    for name in images:
+        for opts in ([], ["--no-discard"], ["--verify"]):
+            ok = write_target(exe, dir, name, opts, disk) and ok
+    for name, data in sorted(make_raw_images(dir).items()):
+        ok = write_target(exe, dir, name, ["--raw"], data) and ok
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Write test for VHD and VHDX images")
+    parser.add_argument("--client", metavar="EXE", help="run vhd_test.exe against the generated images")
+    parser.add_argument("--generate", metavar="DIR", help="just generate the images in DIR")
+    parser.add_argument("--keep", metavar="DIR", help="generate the images in DIR rather than a temporary one")
+    args = parser.parse_args()
+
+    if args.generate:
+        os.makedirs(args.generate, exist_ok=True)
+        make_images(args.generate)
+        make_raw_images(args.generate)
+        return 0
+    if not args.client:
+        parser.print_usage()
+        return 2
+    if args.keep:
+        os.makedirs(args.keep, exist_ok=True)
+        ok = run_client(os.path.abspath(args.client), args.keep)
+    else:
+        with tempfile.TemporaryDirectory() as dir:
+            ok = run_client(os.path.abspath(args.client), dir)
+    print("All tests passed" if ok else "Some tests FAILED")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
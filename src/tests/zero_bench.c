@@ -0,0 +1,127 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Queue depth benchmark for the zeroing of the FAT system area
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build and run from the src directory, with MinGW:
+ *   gcc -O2 -DRUFUS_DEBUG -I. -Ims-sys/inc -o zero_bench.exe tests/zero_bench.c ms-sys/file.c
+ *     ms-sys/partition_info.c -lole32
+ *   zero_bench.exe \\.\PhysicalDrive# [size_MB] [burst_KB]
+ *
+ * THIS DESTROYS THE CONTENT OF THE DRIVE. It must have no mounted volume, e.g. after
+ * a 'clean' in diskpart. Image files can't be used, as the write engine would reopen
+ * them with caching enabled, which makes the comparison meaningless.
+ *
+ * Zeroes the start of the target with the write engine, in both of the modes that
+ * CreateFAT() can use:
+ * - before: through the dismounted volume, which can't be reopened, so the writes are
+ *   issued by the writer thread on a synchronous handle, one at a time.
+ * - after: through the disk, reopened for overlapped I/O, with ASYNC_QUEUE_DEPTH
+ *   writes in flight.
+ * Each mode is run twice, alternating, and the best run of each is reported.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "../stdio.c"
+#include "../drive.c"
+
+// Referenced by stdio.c and drive.c
+HWND hMainDialog = NULL, hLog = NULL;
+DWORD FormatStatus = 0;
+BOOL enable_fixed_disks = FALSE;
+
+char* get_token_data_file(const char* token, const char* filename)
+{
+	return NULL;
+}
+
+#define NB_RUNS         2
+#define DEFAULT_BURST   (4*1024*1024)	// FAT_ZERO_BURST_SIZE
+
+static LARGE_INTEGER freq;
+
+// Returns the throughput in MB/s, or a negative value on error
+static double ZeroRun(HANDLE hTarget, BOOL bOverlapped, uint64_t Size, DWORD BurstSize)
+{
+	ASYNC_WRITER* aw;
+	LARGE_INTEGER start, end;
+	uint64_t i;
+	BOOL r = TRUE;
+
+	aw = AsyncWriteOpen(hTarget, BurstSize, bOverlapped);
+	if (aw == NULL)
+		return -1.0;
+	QueryPerformanceCounter(&start);
+	for (i = 0; (i < Size) && r; i += BurstSize)
+		r = AsyncWriteSectors(aw, 512, i / 512, min(BurstSize, Size - i) / 512, NULL);
+	r = AsyncWriteClose(aw) && r;
+	QueryPerformanceCounter(&end);
+	if (!r)
+		return -1.0;
+	return (Size / (1024.0 * 1024.0)) / ((double)(end.QuadPart - start.QuadPart) / freq.QuadPart);
+}
+
+int main(int argc, char** argv)
+{
+	HANDLE hTarget;
+	uint64_t Size;
+	DWORD BurstSize;
+	double best[2] = { 0.0, 0.0 }, speed;
+	int i, mode;
+
+	if ((argc < 2) || (argc > 4) || (strncmp(argv[1], "\\\\.\\", 4) != 0)) {
+		printf("Usage: %s <\\\\.\\PhysicalDrive#> [size_MB] [burst_KB]\n", argv[0]);
+		return 2;
+	}
+	Size = ((argc > 2) ? _strtoui64(argv[2], NULL, 10) : 256) * 1024 * 1024;
+	BurstSize = (argc > 3) ? atoi(argv[3]) * 1024 : DEFAULT_BURST;
+	if ((Size == 0) || (BurstSize == 0) || ((BurstSize % 4096) != 0)) {
+		printf("Invalid size or burst size\n");
+		return 2;
+	}
+	hTarget = CreateFileA(argv[1], GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, 0, NULL);
+	if (hTarget == INVALID_HANDLE_VALUE) {
+		printf("Could not open %s: %s\n", argv[1], WindowsErrorString());
+		return 1;
+	}
+	QueryPerformanceFrequency(&freq);
+
+	printf("Zeroing %I64u MB of %s, in %d KB writes\n", Size / (1024 * 1024), argv[1], BurstSize / 1024);
+	for (i = 0; i < 2 * NB_RUNS; i++) {
+		mode = i % 2;
+		speed = ZeroRun(hTarget, (mode == 1), Size, BurstSize);
+		if (speed < 0.0) {
+			printf("FAIL: write error in %s mode\n", (mode == 1) ? "overlapped" : "threaded");
+			CloseHandle(hTarget);
+			return 1;
+		}
+		if (mode == 1)
+			printf("  after:  overlapped, %d writes in flight  %8.1f MB/s\n", ASYNC_QUEUE_DEPTH, speed);
+		else
+			printf("  before: synchronous, 1 write in flight   %8.1f MB/s\n", speed);
+		if (speed > best[mode])
+			best[mode] = speed;
+	}
+	printf("Best: before %.1f MB/s, after %.1f MB/s (x%.2f)\n", best[0], best[1], best[1] / best[0]);
+	CloseHandle(hTarget);
+	return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Random access test for compressed images (gzip, xz, zstd and CSO)
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Build from the src directory, with MinGW:
+ *   gcc -O2 -DHAVE_CONFIG_H -I. -Ilibcdio -Ilibcdio/driver -o zstream_test.exe tests/zstream_test.c
+ *     libcdio/driver/_cdio_zstream.c libcdio/driver/_cdio_stream.c libcdio/driver/logging.c
+ *     libcdio/driver/util.c libcdio/driver/utf8.c
+ * then run it against generated images of every supported format:
+ *   python tests/zstream_test.py --client zstream_test.exe
+ *
+ * Usage: zstream_test <image> <reference> [nb_reads] [index dir]
+ *
+ * The image is first read at random offsets, before anything is known of its layout,
+ * then sequentially, and then at random offsets again. If an index directory is given,
+ * the image is then reopened, so that the cached index is used, and read at random
+ * offsets once more. Every read is compared against the uncompressed reference.
+ * Returns 0 if all the reads matched, 1 otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <cdio/cdio.h>
+#include "_cdio_stream.h"
+#include "_cdio_zstream.h"
+
+#define MAX_READ            (1024*1024)
+
+static unsigned char *ref, *buf;
+static off_t ref_size;
+static unsigned int seed = 1;
+
+// Deterministic, so that a failure can be reproduced
+static unsigned int Random(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) & 0x00FFFFFF;
+}
+
+static bool Compare(const char* pass, off_t offset, size_t len, ssize_t r)
+{
+	size_t i, expected = (offset >= ref_size) ? 0 : (size_t)(ref_size - offset);
+
+	if (expected > len)
+		expected = len;
+	if (r != (ssize_t)expected) {
+		printf("FAIL (%s): read of %lu bytes at %lld returned %ld, expected %lu\n", pass,
+			(unsigned long)len, (long long)offset, (long)r, (unsigned long)expected);
+		return false;
+	}
+	if (memcmp(buf, &ref[offset], expected) == 0)
+		return true;
+	for (i = 0; buf[i] == ref[offset + i]; i++);
+	printf("FAIL (%s): read of %lu bytes at %lld differs at offset %lld\n", pass,
+		(unsigned long)len, (long long)offset, (long long)(offset + i));
+	return false;
+}
+
+static bool RandomReads(CdioDataSource_t* s, const char* pass, int nb_reads)
+{
+	off_t offset;
+	size_t len;
+	int i;
+
+	for (i = 0; i < nb_reads; i++) {
+		// Mostly small reads, like the ISO9660 and UDF code does, and the odd large one
+		len = (i % 8 == 7) ? Random() % MAX_READ + 1 : Random() % 8192 + 1;
+		// Include reads that straddle, or start at, the end of the image
+		offset = (off_t)(((unsigned long long)Random() << 24 | Random()) % (ref_size + 1));
+		if (i % 16 == 15)
+			offset = ref_size - (off_t)(Random() % 4096);
+		if (offset < 0)
+			offset = 0;
+		if (cdio_stream_seek(s, offset, SEEK_SET) != 0) {
+			printf("FAIL (%s): could not seek to %lld\n", pass, (long long)offset);
+			return false;
+		}
+		if (!Compare(pass, offset, len, cdio_stream_read(s, buf, 1, len)))
+			return false;
+	}
+	printf("  %s: %d reads OK\n", pass, nb_reads);
+	return true;
+}
+
+static bool SequentialRead(CdioDataSource_t* s)
+{
+	off_t offset = 0;
+	ssize_t r;
+
+	if (cdio_stream_seek(s, 0, SEEK_SET) != 0)
+		return false;
+	do {
+		// Not a multiple of any block size
+		r = cdio_stream_read(s, buf, 1, 100003);
+		if (!Compare("sequential", offset, 100003, r))
+			return false;
+		offset += r;
+	} while (r > 0);
+	if (cdio_stream_stat(s) != ref_size) {
+		printf("FAIL: size is %lld after a full read, expected %lld\n",
+			(long long)cdio_stream_stat(s), (long long)ref_size);
+		return false;
+	}
+	printf("  sequential: %lld bytes OK\n", (long long)offset);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	CdioDataSource_t* s;
+	FILE* fd;
+	int nb_reads;
+	bool r = false;
+
+	if ((argc < 3) || (argc > 5)) {
+		printf("Usage: %s <image> <reference> [nb_reads] [index dir]\n", argv[0]);
+		return 2;
+	}
+	nb_reads = (argc > 3) ? atoi(argv[3]) : 500;
+	fd = fopen(argv[2], "rb");
+	if (fd == NULL) {
+		printf("Could not open %s\n", argv[2]);
+		return 2;
+	}
+	fseek(fd, 0, SEEK_END);
+	ref_size = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	ref = (unsigned char*)malloc((size_t)ref_size + 1);
+	buf = (unsigned char*)malloc(MAX_READ);
+	if ((ref == NULL) || (buf == NULL) || (fread(ref, 1, (size_t)ref_size, fd) != (size_t)ref_size)) {
+		printf("Could not read %s\n", argv[2]);
+		return 2;
+	}
+	fclose(fd);
+	if (argc > 4)
+		cdio_zstream_set_index_dir(argv[4]);
+
+	printf("%s:\n", argv[1]);
+	s = cdio_zstream_new(argv[1]);
+	if (s == NULL) {
+		printf("FAIL: not recognized as a compressed image\n");
+		goto out;
+	}
+	if (!RandomReads(s, "cold", nb_reads) || !SequentialRead(s) || !RandomReads(s, "indexed", nb_reads))
+		goto out;
+	cdio_stream_destroy(s);
+	s = NULL;
+
+	if (argc > 4) {
+		s = cdio_zstream_new(argv[1]);
+		if (s == NULL) {
+			printf("FAIL: could not reopen the image\n");
+			goto out;
+		}
+		// With the cached index, the size must be known before anything is read
+		if (cdio_stream_stat(s) != ref_size) {
+			printf("FAIL: size is %lld on reopen, expected %lld\n",
+				(long long)cdio_stream_stat(s), (long long)ref_size);
+			goto out;
+		}
+		if (!RandomReads(s, "reopened", nb_reads))
+			goto out;
+	}
+	r = true;
+
+out:
+	if (s != NULL)
+		cdio_stream_destroy(s);
+	free(ref);
+	free(buf);
+	printf("%s\n", r ? "PASS" : "FAIL");
+	return r ? 0 : 1;
+}
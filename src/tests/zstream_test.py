@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+#
+# Rufus: The Reliable USB Formatting Utility
+# Generates compressed images, to test random access with tests/zstream_test.c
+# Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# The same reference image is compressed in each of the layouts that the stream
+# code has to handle: gzip (single and multiple members), CSO (with stored and
+# deflated blocks), xz (single block, multiple blocks, concatenated streams with
+# padding) and zstd (single frame, multiple frames, skippable frames). The xz and
+# zstd command line tools are used when present, for the layouts that Python's
+# own modules can't produce.
+#
+#   python zstream_test.py --client zstream_test.exe [--keep DIR]
+#       generates the images and runs the client against each of them
+#   python zstream_test.py --generate DIR
+#       just generates the images
+
+import argparse
+import gzip
+import lzma
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import zlib
+
+IMAGE_SIZE = 24 * 1024 * 1024 + 12345   # several 4 MB spans, and a short last one
+CSO_BLOCK_SIZE = 2048
+
+
+def make_reference(size=IMAGE_SIZE):
+    # Mostly compressible, with incompressible runs and matches from far back
+    rnd = random.Random(42)
+    words = [bytes(rnd.choice(b"abcdefghijklmnopqrstuvwxyz") for _ in range(rnd.randint(2, 10)))
+             for _ in range(512)]
+    out = bytearray()
+    while len(out) < size:
+        kind = rnd.random()
+        if kind < 0.5:
+            out += b" ".join(rnd.choice(words) for _ in range(rnd.randint(100, 4000)))
+        elif kind < 0.7:
+            out += rnd.randbytes(rnd.randint(1, 256 * 1024))
+        elif kind < 0.8:
+            out += bytes(rnd.randint(2048, 512 * 1024))
+        elif len(out) > 1024 * 1024:
+            start = rnd.randrange(len(out) - 1024 * 1024)
+            out += out[start:start + rnd.randint(4, 1024 * 1024)]
+    return bytes(out[:size])
+
+
+def chunks(data, size):
+    return [data[i:i + size] for i in range(0, len(data), size)]
+
+
+def make_cso(data):
+    nb_blocks = (len(data) + CSO_BLOCK_SIZE - 1) // CSO_BLOCK_SIZE
+    header = struct.pack("<4sIQIBB2x", b"CISO", 24, len(data), CSO_BLOCK_SIZE, 1, 0)
+    index, blocks = [], []
+    pos = len(header) + 4 * (nb_blocks + 1)
+    for block in chunks(data, CSO_BLOCK_SIZE):
+        c = zlib.compressobj(9, zlib.DEFLATED, -15)
+        z = c.compress(block) + c.flush()
+        if len(z) >= len(block):
+            index.append(pos | 0x80000000)
+            z = block
+        else:
+            index.append(pos)
+        blocks.append(z)
+        pos += len(z)
+    index.append(pos)
+    return header + struct.pack("<%dI" % len(index), *index) + b"".join(blocks)
+
+
+def run_tool(args, data):
+    return subprocess.run(args, input=data, stdout=subprocess.PIPE, check=True).stdout
+
+
+def zstd(level, data, *opts):
+    # Like 'zstd image.iso' does, record the content size, which isn't known when piping
+    return run_tool(["zstd", "-%d" % level, "-c", "-q", "--stream-size=%d" % len(data)] + list(opts), data)
+
+
+def make_images(dir):
+    ref = make_reference()
+    images = {}
+    images["single.iso.gz"] = gzip.compress(ref, 6)
+    images["members.iso.gz"] = b"".join(gzip.compress(c, 6) for c in chunks(ref, 5 * 1024 * 1024 + 7))
+    images["image.cso"] = make_cso(ref)
+    images["single.iso.xz"] = lzma.compress(ref, preset=6)
+    # Streams of a few blocks each, with stream padding in between, and different checks
+    images["streams.iso.xz"] = (lzma.compress(ref[:7 * 1024 * 1024], check=lzma.CHECK_CRC32) + bytes(8) +
+                                lzma.compress(ref[7 * 1024 * 1024:9 * 1024 * 1024], check=lzma.CHECK_SHA256) +
+                                lzma.compress(ref[9 * 1024 * 1024:], check=lzma.CHECK_NONE) + bytes(4))
+    if shutil.which("xz") is not None:
+        images["blocks.iso.xz"] = run_tool(["xz", "-6", "-T1", "--block-size=1MiB", "-c"], ref)
+        images["odd-blocks.iso.xz"] = run_tool(["xz", "-1", "-T1", "--block-size=3000000", "-c"], ref)
+    else:
+        print("xz not found: skipping the multiple block xz images")
+    if shutil.which("zstd") is not None:
+        skippable = struct.pack("<II", 0x184D2A5A, 16) + bytes(16)
+        images["single.iso.zst"] = zstd(6, ref)
+        images["frames.iso.zst"] = b"".join(zstd(3, c, "--no-check") for c in chunks(ref, 3 * 1024 * 1024 + 11))
+        images["skippable.iso.zst"] = (skippable + zstd(19, ref[:10000000], "--long=24") +
+                                       skippable + zstd(1, ref[10000000:]))
+    else:
+        print("zstd not found: skipping the zstd images")
+    with open(os.path.join(dir, "reference.iso"), "wb") as f:
+        f.write(ref)
+    for name, data in images.items():
+        with open(os.path.join(dir, name), "wb") as f:
+            f.write(data)
+        print("%-20s %10d bytes" % (name, len(data)))
+    return sorted(images)
+
+
+def run_client(exe, dir, nb_reads):
+    ok = True
+    idx_dir = os.path.join(dir, "idx")
+    os.makedirs(idx_dir, exist_ok=True)
+    for name in make_images(dir):
+        r = subprocess.run([exe, os.path.join(dir, name), os.path.join(dir, "reference.iso"),
+                            str(nb_reads), idx_dir])
+        ok = ok and r.returncode == 0
+    # Only gzip and zstd need an index of their own
+    idx = os.listdir(idx_dir)
+    for ext in ("gz", "zst"):
+        if any(n.endswith(ext) for n in os.listdir(dir)) and not any(".iso.%s." % ext in n for n in idx):
+            print("FAIL: no index was saved for the .%s images" % ext)
+            ok = False
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Random access test for compressed images")
+    parser.add_argument("--client", metavar="EXE", help="run zstream_test.exe against the generated images")
+    parser.add_argument("--generate", metavar="DIR", help="just generate the images in DIR")
+    parser.add_argument("--keep", metavar="DIR", help="generate the images in DIR rather than a temporary one")
+    parser.add_argument("--nb-reads", type=int, default=200, metavar="N")
+    args = parser.parse_args()
+
+    if args.generate:
+        os.makedirs(args.generate, exist_ok=True)
+        make_images(args.generate)
+        return 0
+    if not args.client:
+        parser.print_usage()
+        return 2
+    if args.keep:
+        os.makedirs(args.keep, exist_ok=True)
+        ok = run_client(os.path.abspath(args.client), args.keep, args.nb_reads)
+    else:
+        with tempfile.TemporaryDirectory() as dir:
+            ok = run_client(os.path.abspath(args.client), dir, args.nb_reads)
+    print("All tests passed" if ok else "Some tests FAILED")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -23,6 +23,7 @@
 #include "rufus.h"
 #include "msapi_utf8.h"
 #include "registry.h"
+#include "file.h"
 
 static BOOL has_wimgapi = FALSE, has_7z = FALSE;
 
@@ -83,9 +84,12 @@ BOOL WimExtractCheck(void)
 		has_7z = (_access(sevenzip_path, 0) != -1);
 	}
 
-	uprintf("WIM extraction method(s) supported: %s%s%s\n", has_7z?"7z":(has_wimgapi?"":"NONE"),
-		(has_wimgapi && has_7z)?", ":"", has_wimgapi?"wimgapi.dll":"");
-	return (has_wimgapi || has_7z);
+	// Our native extraction doesn't need anything, but doesn't handle every kind of WIM,
+	// so it only counts if the ISO scan found an install image that it can read
+	uprintf("WIM extraction method(s) supported: %s%s%s%s%s\n", iso_report.has_native_wim?"native":"",
+		(iso_report.has_native_wim && (has_7z || has_wimgapi))?", ":"", has_7z?"7z":"",
+		(has_wimgapi && has_7z)?", ":"", has_wimgapi?"wimgapi.dll":((iso_report.has_native_wim || has_7z)?"":"NONE"));
+	return (iso_report.has_native_wim || has_7z || has_wimgapi);
 }
 
 
@@ -208,13 +212,606 @@ static BOOL WimExtractFile_7z(const char* image, int index, const char* src, con
 // Extract a file from a WIM image
 BOOL WimExtractFile(const char* image, int index, const char* src, const char* dst)
 {
-	if ((!has_wimgapi) && (!has_7z) && (!WimExtractCheck()))
-		return FALSE;
 	if ((image == NULL) || (src == NULL) || (dst == NULL))
 		return FALSE;
 
+	// Our own extraction needs neither 7-Zip nor wimgapi.dll, and decompresses on
+	// all the CPU cores. Solid, split and LZMS archives need one of the others though.
+	if (WimExtractFile_Native(image, index, src, dst))
+		return TRUE;
+	uprintf("  Native extraction failed - trying external methods\n");
+	if ((!has_wimgapi) && (!has_7z))
+		WimExtractCheck();
+
 	// Prefer 7-Zip as, unsurprisingly, it's faster than the Microsoft way,
 	// but allow fallback if 7-Zip doesn't succeed
 	return ( (has_7z && WimExtractFile_7z(image, index, src, dst))
 		  || (has_wimgapi && WimExtractFile_API(image, index, src, dst)) );
 }
+
+/*
+ * VHD and VHDX images, as a raw write source. Only the blocks that are allocated in the
+ * image get read and written to the target. The others must read as zeroes, so they are
+ * discarded if the target supports it, so that writing a large, mostly empty, dynamic
+ * image only takes about as long as the data it actually contains, and zeroed otherwise.
+ * Plain disk images, such as isohybrid ISOs, are handled as fully allocated images.
+ * Differencing images, and VHDX images with a log that needs replaying, are not supported.
+ */
+#define VHD_FOOTER_COOKIE        "conectix"
+#define VHD_DYNAMIC_COOKIE       "cxsparse"
+#define VHD_DISK_TYPE_FIXED      2
+#define VHD_DISK_TYPE_DYNAMIC    3
+#define VHD_BAT_UNUSED           0xFFFFFFFF
+#define VHD_FIXED_BLOCK_SIZE     (2*1024*1024)
+#define VHDX_SIGNATURE           "vhdxfile"
+#define VHDX_HEADER_SIGNATURE    "head"
+#define VHDX_REGION_SIGNATURE    "regi"
+#define VHDX_METADATA_SIGNATURE  "metadata"
+#define VHDX_HEADER_OFFSET       (64*1024)
+#define VHDX_REGION_OFFSET       (192*1024)
+#define VHDX_HEADER_SIZE         (4*1024)
+#define VHDX_TABLE_SIZE          (64*1024)
+#define VHDX_HAS_PARENT          0x00000002
+#define VHDX_BAT_STATE_MASK      0x07
+#define VHDX_BAT_FULLY_PRESENT   6
+#define VHDX_BAT_OFFSET_SHIFT    20
+#define VHD_BLOCK_UNALLOCATED    ((uint64_t)-1)
+
+#pragma pack(push, 1)
+typedef struct {
+	char     Cookie[8];
+	uint32_t Features;
+	uint32_t FileFormatVersion;
+	uint64_t DataOffset;
+	uint32_t TimeStamp;
+	char     CreatorApplication[4];
+	uint32_t CreatorVersion;
+	uint32_t CreatorHostOS;
+	uint64_t OriginalSize;
+	uint64_t CurrentSize;
+	uint32_t DiskGeometry;
+	uint32_t DiskType;
+	uint32_t Checksum;
+	uint8_t  UniqueId[16];
+	uint8_t  SavedState;
+	uint8_t  Reserved[427];
+} VHD_FOOTER;
+
+typedef struct {
+	char     Cookie[8];
+	uint64_t DataOffset;
+	uint64_t TableOffset;
+	uint32_t HeaderVersion;
+	uint32_t MaxTableEntries;
+	uint32_t BlockSize;
+	uint32_t Checksum;
+	uint8_t  ParentUniqueId[16];
+	uint32_t ParentTimeStamp;
+	uint32_t Reserved;
+	uint8_t  ParentUnicodeName[512];
+	uint8_t  ParentLocatorEntry[8][24];
+	uint8_t  Reserved2[256];
+} VHD_DYNAMIC_HEADER;
+
+typedef struct {
+	char     Signature[4];
+	uint32_t Checksum;
+	uint64_t SequenceNumber;
+	GUID     FileWriteGuid;
+	GUID     DataWriteGuid;
+	GUID     LogGuid;
+	uint16_t LogVersion;
+	uint16_t Version;
+	uint32_t LogLength;
+	uint64_t LogOffset;
+} VHDX_HEADER;
+
+typedef struct {
+	char     Signature[4];
+	uint32_t Checksum;
+	uint32_t EntryCount;
+	uint32_t Reserved;
+} VHDX_REGION_TABLE_HEADER;
+
+typedef struct {
+	GUID     Guid;
+	uint64_t FileOffset;
+	uint32_t Length;
+	uint32_t Required;
+} VHDX_REGION_TABLE_ENTRY;
+
+typedef struct {
+	char     Signature[8];
+	uint16_t Reserved;
+	uint16_t EntryCount;
+	uint32_t Reserved2[5];
+} VHDX_METADATA_TABLE_HEADER;
+
+typedef struct {
+	GUID     ItemId;
+	uint32_t Offset;
+	uint32_t Length;
+	uint32_t Flags;
+	uint32_t Reserved;
+} VHDX_METADATA_TABLE_ENTRY;
+#pragma pack(pop)
+
+static const GUID vhdx_bat_guid = { 0x2DC27766, 0xF623, 0x4200, { 0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 } };
+static const GUID vhdx_metadata_guid = { 0x8B7CA206, 0x4790, 0x4B9A, { 0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E } };
+static const GUID vhdx_file_parameters_guid = { 0xCAA16737, 0xFA36, 0x4D43, { 0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B } };
+static const GUID vhdx_disk_size_guid = { 0x2FA54224, 0xCD1B, 0x4876, { 0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 } };
+static const GUID vhdx_sector_size_guid = { 0x8141BF1D, 0xA96F, 0x4709, { 0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F } };
+
+/* Layout of a virtual disk, as a set of equally sized blocks */
+typedef struct {
+	HANDLE hFile;
+	uint64_t DiskSize;
+	uint32_t BlockSize;
+	uint64_t NbBlocks;
+	uint64_t* BlockOffset;		// Offset of the block data in the file, or VHD_BLOCK_UNALLOCATED
+} VHD_IMAGE;
+
+static BOOL ReadAt(HANDLE hFile, uint64_t Offset, void* pBuf, DWORD Size)
+{
+	LARGE_INTEGER li;
+	DWORD rSize;
+	uint64_t ts = IOStatsTimestamp();
+
+	li.QuadPart = Offset;
+	if ( (!SetFilePointerEx(hFile, li, NULL, FILE_BEGIN))
+	  || (!ReadFile(hFile, pBuf, Size, &rSize, NULL)) || (rSize != Size) )
+		return FALSE;
+	IOStatsRecord(IOS_SOURCE_READ, rSize, ts);
+	return TRUE;
+}
+
+// CRC-32C (Castagnoli), as used for the VHDX headers
+static uint32_t Crc32c(const uint8_t* pBuf, size_t Size)
+{
+	size_t i;
+	int j;
+	uint32_t crc = 0xFFFFFFFF;
+
+	for (i=0; i<Size; i++) {
+		crc ^= pBuf[i];
+		for (j=0; j<8; j++)
+			crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
+
+// Map an image whose data is laid out as is, from the start of the file, as fully allocated
+static BOOL MapFixedImage(VHD_IMAGE* img)
+{
+	uint64_t i;
+
+	img->BlockSize = VHD_FIXED_BLOCK_SIZE;
+	img->NbBlocks = (img->DiskSize + img->BlockSize - 1) / img->BlockSize;
+	img->BlockOffset = (uint64_t*)malloc((size_t)img->NbBlocks * sizeof(uint64_t));
+	if (img->BlockOffset == NULL)
+		return FALSE;
+	for (i=0; i<img->NbBlocks; i++)
+		img->BlockOffset[i] = i * img->BlockSize;
+	return TRUE;
+}
+
+static BOOL OpenVHD(VHD_IMAGE* img)
+{
+	VHD_FOOTER footer;
+	VHD_DYNAMIC_HEADER dyn;
+	LARGE_INTEGER li;
+	uint32_t* bat = NULL;
+	uint64_t i;
+
+	if (!GetFileSizeEx(img->hFile, &li) || (li.QuadPart < sizeof(footer))
+	  || (!ReadAt(img->hFile, li.QuadPart - sizeof(footer), &footer, sizeof(footer)))
+	  || (memcmp(footer.Cookie, VHD_FOOTER_COOKIE, sizeof(footer.Cookie)) != 0))
+		return FALSE;
+	img->DiskSize = _byteswap_uint64(footer.CurrentSize);
+
+	switch (_byteswap_ulong(footer.DiskType)) {
+	case VHD_DISK_TYPE_FIXED:
+		// The data is laid out as is, ahead of the footer
+		return MapFixedImage(img);
+	case VHD_DISK_TYPE_DYNAMIC:
+		break;
+	default:
+		uprintf("Unsupported VHD disk type %d\n", _byteswap_ulong(footer.DiskType));
+		return FALSE;
+	}
+
+	if ( (!ReadAt(img->hFile, _byteswap_uint64(footer.DataOffset), &dyn, sizeof(dyn)))
+	  || (memcmp(dyn.Cookie, VHD_DYNAMIC_COOKIE, sizeof(dyn.Cookie)) != 0) ) {
+		uprintf("Could not read VHD dynamic disk header\n");
+		return FALSE;
+	}
+	img->BlockSize = _byteswap_ulong(dyn.BlockSize);
+	img->NbBlocks = _byteswap_ulong(dyn.MaxTableEntries);
+	if ((img->BlockSize == 0) || (img->BlockSize % 512 != 0)
+	  || (img->NbBlocks * img->BlockSize < img->DiskSize)) {
+		uprintf("Invalid VHD block size or table\n");
+		return FALSE;
+	}
+	bat = (uint32_t*)malloc((size_t)img->NbBlocks * sizeof(uint32_t));
+	img->BlockOffset = (uint64_t*)malloc((size_t)img->NbBlocks * sizeof(uint64_t));
+	if ( (bat == NULL) || (img->BlockOffset == NULL)
+	  || (!ReadAt(img->hFile, _byteswap_uint64(dyn.TableOffset), bat, (DWORD)img->NbBlocks * sizeof(uint32_t))) ) {
+		safe_free(bat);
+		return FALSE;
+	}
+	// Each allocated block starts with a sector bitmap, padded to a sector boundary
+	for (i=0; i<img->NbBlocks; i++)
+		img->BlockOffset[i] = (bat[i] == VHD_BAT_UNUSED) ? VHD_BLOCK_UNALLOCATED : (uint64_t)_byteswap_ulong(bat[i]) * 512 +
+			(((img->BlockSize / 512) / 8 + 511) & ~511);
+	free(bat);
+	return TRUE;
+}
+
+static BOOL OpenVHDX(VHD_IMAGE* img)
+{
+	BOOL r = FALSE;
+	uint8_t* buf;
+	uint64_t* bat = NULL;
+	uint64_t i, seq = 0, bat_offset = 0, metadata_offset = 0, nb_entries, chunk_ratio;
+	uint32_t j, nb_items, checksum, flags = 0, sector_size = 0, bat_size = 0;
+	VHDX_HEADER* header;
+	VHDX_REGION_TABLE_HEADER* region;
+	VHDX_REGION_TABLE_ENTRY* region_entry;
+	VHDX_METADATA_TABLE_HEADER* metadata;
+	VHDX_METADATA_TABLE_ENTRY* metadata_entry;
+	GUID log_guid = { 0 }, null_guid = { 0 };
+
+	buf = (uint8_t*)malloc(VHDX_TABLE_SIZE);
+	if (buf == NULL)
+		return FALSE;
+
+	// Use the current header, i.e. the valid one with the highest sequence number
+	for (j=0; j<2; j++) {
+		header = (VHDX_HEADER*)buf;
+		if (!ReadAt(img->hFile, VHDX_HEADER_OFFSET*(j+1), buf, VHDX_HEADER_SIZE))
+			continue;
+		checksum = header->Checksum;
+		header->Checksum = 0;
+		if ( (memcmp(header->Signature, VHDX_HEADER_SIGNATURE, sizeof(header->Signature)) != 0)
+		  || (Crc32c(buf, VHDX_HEADER_SIZE) != checksum) || (header->SequenceNumber < seq) )
+			continue;
+		seq = header->SequenceNumber;
+		log_guid = header->LogGuid;
+	}
+	if (seq == 0) {
+		uprintf("No valid VHDX header found\n");
+		goto out;
+	}
+	if (memcmp(&log_guid, &null_guid, sizeof(GUID)) != 0) {
+		uprintf("This VHDX has a log that needs to be replayed: please mount it in Windows once\n");
+		goto out;
+	}
+
+	// Locate the BAT and metadata regions
+	region = (VHDX_REGION_TABLE_HEADER*)buf;
+	if ( (!ReadAt(img->hFile, VHDX_REGION_OFFSET, buf, VHDX_TABLE_SIZE))
+	  || (memcmp(region->Signature, VHDX_REGION_SIGNATURE, sizeof(region->Signature)) != 0) ) {
+		uprintf("Invalid VHDX region table\n");
+		goto out;
+	}
+	region_entry = (VHDX_REGION_TABLE_ENTRY*)&region[1];
+	for (j=0; (j<region->EntryCount) && (j<(VHDX_TABLE_SIZE-sizeof(*region))/sizeof(*region_entry)); j++) {
+		if (memcmp(&region_entry[j].Guid, &vhdx_bat_guid, sizeof(GUID)) == 0) {
+			bat_offset = region_entry[j].FileOffset;
+			bat_size = region_entry[j].Length;
+		} else if (memcmp(&region_entry[j].Guid, &vhdx_metadata_guid, sizeof(GUID)) == 0) {
+			metadata_offset = region_entry[j].FileOffset;
+		}
+	}
+	metadata = (VHDX_METADATA_TABLE_HEADER*)buf;
+	if ( (bat_offset == 0) || (metadata_offset == 0)
+	  || (!ReadAt(img->hFile, metadata_offset, buf, VHDX_TABLE_SIZE))
+	  || (memcmp(metadata->Signature, VHDX_METADATA_SIGNATURE, sizeof(metadata->Signature)) != 0) ) {
+		uprintf("Invalid VHDX metadata\n");
+		goto out;
+	}
+
+	// Get the block size, disk size and sector size
+	metadata_entry = (VHDX_METADATA_TABLE_ENTRY*)&metadata[1];
+	nb_items = (uint32_t)min(metadata->EntryCount, (VHDX_TABLE_SIZE-sizeof(*metadata))/sizeof(*metadata_entry));
+	for (j=0; j<nb_items; j++) {
+		if (memcmp(&metadata_entry[j].ItemId, &vhdx_file_parameters_guid, sizeof(GUID)) == 0) {
+			if ( (metadata_entry[j].Length < 2*sizeof(uint32_t))
+			  || (!ReadAt(img->hFile, metadata_offset + metadata_entry[j].Offset, &img->BlockSize, sizeof(uint32_t)))
+			  || (!ReadAt(img->hFile, metadata_offset + metadata_entry[j].Offset + sizeof(uint32_t), &flags, sizeof(uint32_t))) )
+				break;
+		} else if (memcmp(&metadata_entry[j].ItemId, &vhdx_disk_size_guid, sizeof(GUID)) == 0) {
+			if ( (metadata_entry[j].Length < sizeof(uint64_t))
+			  || (!ReadAt(img->hFile, metadata_offset + metadata_entry[j].Offset, &img->DiskSize, sizeof(uint64_t))) )
+				break;
+		} else if (memcmp(&metadata_entry[j].ItemId, &vhdx_sector_size_guid, sizeof(GUID)) == 0) {
+			if ( (metadata_entry[j].Length < sizeof(uint32_t))
+			  || (!ReadAt(img->hFile, metadata_offset + metadata_entry[j].Offset, &sector_size, sizeof(uint32_t))) )
+				break;
+		}
+	}
+	if (j < nb_items) {
+		uprintf("Could not read VHDX metadata item %d: %s\n", j, WindowsErrorString());
+		goto out;
+	}
+	if (flags & VHDX_HAS_PARENT) {
+		uprintf("Differencing VHDX images are not supported\n");
+		goto out;
+	}
+	if ((img->BlockSize == 0) || (img->DiskSize == 0) || (sector_size == 0)) {
+		uprintf("Missing VHDX metadata\n");
+		goto out;
+	}
+
+	// The BAT interleaves a sector bitmap entry after every chunk_ratio payload entries
+	img->NbBlocks = (img->DiskSize + img->BlockSize - 1) / img->BlockSize;
+	chunk_ratio = ((1ULL << 23) * sector_size) / img->BlockSize;
+	if (chunk_ratio == 0) {
+		uprintf("Invalid VHDX block size\n");
+		goto out;
+	}
+	nb_entries = img->NbBlocks + (img->NbBlocks - 1) / chunk_ratio;
+	if (nb_entries * sizeof(uint64_t) > bat_size) {
+		uprintf("VHDX block allocation table is too small\n");
+		goto out;
+	}
+	bat = (uint64_t*)malloc((size_t)nb_entries * sizeof(uint64_t));
+	img->BlockOffset = (uint64_t*)malloc((size_t)img->NbBlocks * sizeof(uint64_t));
+	if ((bat == NULL) || (img->BlockOffset == NULL))
+		goto out;
+	if (!ReadAt(img->hFile, bat_offset, bat, (DWORD)(nb_entries * sizeof(uint64_t)))) {
+		uprintf("Could not read VHDX block allocation table: %s\n", WindowsErrorString());
+		goto out;
+	}
+	// Blocks that are not fully present (zero, unmapped, not present...) all read as zeroes
+	for (i=0; i<img->NbBlocks; i++) {
+		j = (uint32_t)(i + i / chunk_ratio);
+		img->BlockOffset[i] = ((bat[j] & VHDX_BAT_STATE_MASK) == VHDX_BAT_FULLY_PRESENT) ?
+			(bat[j] >> VHDX_BAT_OFFSET_SHIFT) * 1024 * 1024 : VHD_BLOCK_UNALLOCATED;
+	}
+	r = TRUE;
+
+out:
+	safe_free(bat);
+	free(buf);
+	return r;
+}
+
+static void CloseImage(VHD_IMAGE* img)
+{
+	safe_free(img->BlockOffset);
+	safe_closehandle(img->hFile);
+}
+
+static BOOL OpenImage(const char* path, VHD_IMAGE* img, BOOL bRaw)
+{
+	char signature[8];
+	LARGE_INTEGER li;
+
+	memset(img, 0, sizeof(*img));
+	img->hFile = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (img->hFile == INVALID_HANDLE_VALUE) {
+		img->hFile = NULL;
+		return FALSE;
+	}
+	if (bRaw) {
+		if (GetFileSizeEx(img->hFile, &li) && (li.QuadPart != 0)) {
+			img->DiskSize = li.QuadPart;
+			if (MapFixedImage(img))
+				return TRUE;
+		}
+	} else if ( ((ReadAt(img->hFile, 0, signature, sizeof(signature)))
+	  && (memcmp(signature, VHDX_SIGNATURE, sizeof(signature)) == 0)) ? OpenVHDX(img) : OpenVHD(img) )
+		return TRUE;
+	CloseImage(img);
+	return FALSE;
+}
+
+// Returns TRUE if the image is a VHD or VHDX we can write, along with its virtual disk size
+BOOL IsVHD(const char* path, uint64_t* disk_size)
+{
+	VHD_IMAGE img;
+	LARGE_INTEGER li;
+	uint64_t i, allocated = 0;
+
+	if (!OpenImage(path, &img, FALSE))
+		return FALSE;
+	for (i=0; i<img.NbBlocks; i++)
+		if (img.BlockOffset[i] != VHD_BLOCK_UNALLOCATED)
+			allocated++;
+	li.QuadPart = img.DiskSize;
+	uprintf("Virtual disk image: %s, %lld of %lld blocks (%d KB) allocated\n", SizeToHumanReadable(li),
+		allocated, img.NbBlocks, img.BlockSize/1024);
+	if (disk_size != NULL)
+		*disk_size = img.DiskSize;
+	CloseImage(&img);
+	return TRUE;
+}
+
+// Check that nSectors from StartSector read back as zeroes
+static BOOL CheckZeroed(HANDLE hPhysicalDrive, uint64_t SectorSize, uint64_t StartSector, uint64_t nSectors, uint8_t* buf)
+{
+	uint64_t i, n;
+	size_t j;
+
+	for (i=0; i<nSectors; i+=n) {
+		if (FormatStatus)
+			return FALSE;
+		n = min(ASYNC_WRITE_SIZE / SectorSize, nSectors - i);
+		if (read_sectors(hPhysicalDrive, SectorSize, StartSector + i, n, buf) != (int64_t)(n * SectorSize)) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+			return FALSE;
+		}
+		for (j=0; (j<n*SectorSize) && (buf[j]==0); j++);
+		if (j < n*SectorSize) {
+			uprintf("Verification failed: the data at offset 0x%llx should be zeroes\n", (StartSector + i) * SectorSize + j);
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// Write an image to a physical drive. The runs of unallocated blocks are discarded, if
+// the drive reads discarded sectors back as zeroes, and zeroed otherwise, so that none of
+// the previous content of the drive shows through. If requested, the data is then read
+// back from the drive and compared with the image.
+static BOOL WriteImage(HANDLE hPhysicalDrive, const char* path, BOOL bRaw, BOOL bVerify)
+{
+	BOOL r = FALSE, use_discard = TRUE;
+	VHD_IMAGE img;
+	LARGE_INTEGER li;
+	ASYNC_WRITER* aw = NULL;
+	uint8_t *buf = NULL, *cmp = NULL;
+	uint64_t i, j, k, pos, size, start, nb_sectors, allocated = 0, discarded = 0, written = 0, total;
+	uint64_t SectorSize = SelectedDrive.Geometry.BytesPerSector;
+
+	if (!OpenImage(path, &img, bRaw)) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
+		return FALSE;
+	}
+	if ((SectorSize == 0) || (img.BlockSize % SectorSize != 0)) {
+		uprintf("The virtual disk block size is not a multiple of the target sector size\n");
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INVALID_PARAMETER;
+		goto out;
+	}
+	if (img.DiskSize > (uint64_t)SelectedDrive.DiskSize) {
+		uprintf("The virtual disk is larger than the target\n");
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INVALID_PARAMETER;
+		goto out;
+	}
+	// The last block may be partial
+	for (i=0; i<img.NbBlocks; i++)
+		if (img.BlockOffset[i] != VHD_BLOCK_UNALLOCATED)
+			allocated += min(img.BlockSize, img.DiskSize - i*img.BlockSize);
+	total = bVerify ? 2*img.DiskSize : img.DiskSize;
+
+	buf = (uint8_t*)malloc(ASYNC_WRITE_SIZE);
+	cmp = bVerify ? (uint8_t*)malloc(ASYNC_WRITE_SIZE) : NULL;
+	aw = AsyncWriteOpen(hPhysicalDrive, ASYNC_WRITE_SIZE, TRUE);
+	if ((buf == NULL) || (aw == NULL) || ((bVerify) && (cmp == NULL))) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	li.QuadPart = allocated;
+	uprintf("Writing %s of allocated data from %s\n", SizeToHumanReadable(li), path);
+	for (i=0; i<img.NbBlocks; i=j) {
+		if (img.BlockOffset[i] == VHD_BLOCK_UNALLOCATED) {
+			for (j=i+1; (j<img.NbBlocks) && (img.BlockOffset[j] == VHD_BLOCK_UNALLOCATED); j++);
+			start = i*img.BlockSize / SectorSize;
+			nb_sectors = (min(j*img.BlockSize, img.DiskSize) - i*img.BlockSize + SectorSize - 1) / SectorSize;
+			// Once a discard has failed, don't retry it for every run
+			if ((use_discard) && (DiscardSectors(hPhysicalDrive, SectorSize, start, nb_sectors))) {
+				discarded += nb_sectors * SectorSize;
+				written += nb_sectors * SectorSize;
+				continue;
+			}
+			use_discard = FALSE;
+			for (k=0; k<nb_sectors; k+=size) {
+				if (FormatStatus) goto out;
+				size = min(ASYNC_WRITE_SIZE / SectorSize, nb_sectors - k);
+				if (!AsyncWriteSectors(aw, SectorSize, start + k, size, NULL)) {
+					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+					goto out;
+				}
+				written += size * SectorSize;
+				UpdateProgress(OP_DOS, (100.0f*written)/(1.0f*total));
+			}
+			continue;
+		}
+		j = i + 1;
+		for (pos=0; (pos<img.BlockSize) && (i*img.BlockSize + pos < img.DiskSize); pos+=size) {
+			if (FormatStatus) goto out;
+			size = min(min(ASYNC_WRITE_SIZE, img.BlockSize - pos), img.DiskSize - i*img.BlockSize - pos);
+			if (!ReadAt(img.hFile, img.BlockOffset[i] + pos, buf, (DWORD)size)) {
+				uprintf("Could not read image at block %lld: %s\n", i, WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+				goto out;
+			}
+			// Pad a partial last sector with zeroes
+			memset(&buf[size], 0, (size_t)(((size + SectorSize - 1) / SectorSize) * SectorSize - size));
+			if (!AsyncWriteSectors(aw, SectorSize, (i*img.BlockSize + pos) / SectorSize,
+				(size + SectorSize - 1) / SectorSize, buf)) {
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+				goto out;
+			}
+			written += size;
+			UpdateProgress(OP_DOS, (100.0f*written)/(1.0f*total));
+		}
+	}
+	r = AsyncWriteClose(aw);
+	aw = NULL;
+	if (!r) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		goto out;
+	}
+	if (discarded != 0) {
+		li.QuadPart = discarded;
+		uprintf("Discarded %s of unallocated data\n", SizeToHumanReadable(li));
+	}
+	if (allocated + discarded < img.DiskSize) {
+		li.QuadPart = img.DiskSize - allocated - discarded;
+		uprintf("Zeroed %s of unallocated data\n", SizeToHumanReadable(li));
+	}
+	if (!bVerify)
+		goto out;
+
+	// Read everything back, in the same large sequential chunks
+	r = FALSE;
+	PrintStatus(0, TRUE, "Verifying written data...");
+	for (i=0; i<img.NbBlocks; i++) {
+		for (pos=0; (pos<img.BlockSize) && (i*img.BlockSize + pos < img.DiskSize); pos+=size) {
+			if (FormatStatus) goto out;
+			size = min(min(ASYNC_WRITE_SIZE, img.BlockSize - pos), img.DiskSize - i*img.BlockSize - pos);
+			nb_sectors = (size + SectorSize - 1) / SectorSize;
+			if (img.BlockOffset[i] == VHD_BLOCK_UNALLOCATED) {
+				if (!CheckZeroed(hPhysicalDrive, SectorSize, (i*img.BlockSize + pos) / SectorSize, nb_sectors, cmp))
+					goto out;
+				written += size;
+				UpdateProgress(OP_DOS, (100.0f*written)/(1.0f*total));
+				continue;
+			}
+			if (!ReadAt(img.hFile, img.BlockOffset[i] + pos, buf, (DWORD)size)) {
+				uprintf("Could not read image at block %lld: %s\n", i, WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+				goto out;
+			}
+			if (read_sectors(hPhysicalDrive, SectorSize, (i*img.BlockSize + pos) / SectorSize, nb_sectors, cmp)
+				!= (int64_t)(nb_sectors * SectorSize)) {
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+				goto out;
+			}
+			if (memcmp(buf, cmp, (size_t)size) != 0) {
+				uprintf("Verification failed: the data at offset 0x%llx differs from the image\n", i*img.BlockSize + pos);
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+				goto out;
+			}
+			written += size;
+			UpdateProgress(OP_DOS, (100.0f*written)/(1.0f*total));
+		}
+	}
+	li.QuadPart = img.DiskSize;
+	uprintf("Verified %s of written data\n", SizeToHumanReadable(li));
+	r = TRUE;
+
+out:
+	if (aw != NULL)
+		AsyncWriteClose(aw);
+	safe_free(buf);
+	safe_free(cmp);
+	CloseImage(&img);
+	return r;
+}
+
+BOOL WriteVHD(HANDLE hPhysicalDrive, const char* path)
+{
+	return WriteImage(hPhysicalDrive, path, FALSE, FALSE);
+}
+
+// Write a plain disk image, such as an isohybrid ISO, as is, and verify it
+BOOL WriteRawImage(HANDLE hPhysicalDrive, const char* path)
+{
+	return WriteImage(hPhysicalDrive, path, TRUE, TRUE);
+}
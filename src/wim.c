@@ -0,0 +1,1011 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Native WIM file extraction (uncompressed, XPRESS and LZX resources)
+ * Copyright (c) 2013 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a minimal WIM reader, that only does what we need for Windows 7 EFI
+ * boot, i.e. extract a single file from an image: it reads the header and the
+ * lookup table, walks the metadata resource of the image down to the requested
+ * path, and decompresses the chunks of the file data on a set of worker threads.
+ * Only the chunks of the metadata resource that are needed for the path lookup
+ * are decompressed. Split (SWM), solid (ESD) and LZMS compressed archives are not
+ * supported, in which case the caller should fall back to 7-Zip or wimgapi.
+ * The format descriptions come from Microsoft's MS-XCA specifications and from
+ * the documentation of the wimlib project (http://wimlib.sourceforge.net).
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "rufus.h"
+#include "msapi_utf8.h"
+
+#define WIM_MAGIC                   "MSWIM\0\0"
+#define WIM_HDR_FLAG_COMPRESSION    0x00000002
+#define WIM_HDR_FLAG_COMPRESS_XPRESS 0x00020000
+#define WIM_HDR_FLAG_COMPRESS_LZX   0x00040000
+#define WIM_SOLID_VERSION           0x00000E00
+#define WIM_RESHDR_FLAG_METADATA    0x02
+#define WIM_RESHDR_FLAG_COMPRESSED  0x04
+#define WIM_RESHDR_FLAG_SPANNED     0x08
+#define WIM_RESHDR_FLAG_SOLID       0x10
+#define WIM_DEFAULT_CHUNK_SIZE      32768
+#define WIM_MAX_CHUNK_SIZE          65536
+#define WIM_MAX_THREADS             8
+#define WIM_CHUNKS_PER_THREAD       4
+#define WIM_DENTRY_DISK_SIZE        102
+#define WIM_STREAM_DISK_SIZE        38
+#define SHA1_HASH_SIZE              20
+#define ALIGN8(x)                   (((x) + 7) & ~7ULL)
+
+enum wim_compression_type {
+	WIM_COMPRESSION_NONE,
+	WIM_COMPRESSION_XPRESS,
+	WIM_COMPRESSION_LZX
+};
+
+#pragma pack(push, 1)
+typedef struct {
+	uint8_t size[7];
+	uint8_t flags;
+	uint64_t offset;
+	uint64_t original_size;
+} wim_reshdr;
+
+typedef struct {
+	char magic[8];
+	uint32_t header_size;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t chunk_size;
+	uint8_t guid[16];
+	uint16_t part_number;
+	uint16_t total_parts;
+	uint32_t image_count;
+	wim_reshdr lookup_table;
+	wim_reshdr xml_data;
+	wim_reshdr boot_metadata;
+	uint32_t boot_index;
+	wim_reshdr integrity;
+	uint8_t unused[60];
+} wim_header;
+
+typedef struct {
+	wim_reshdr reshdr;
+	uint16_t part_number;
+	uint32_t refcnt;
+	uint8_t hash[SHA1_HASH_SIZE];
+} wim_lookup_entry;
+#pragma pack(pop)
+
+typedef struct {
+	HANDLE handle;
+	int compression;
+	uint32_t chunk_size;
+} wim_file;
+
+typedef struct {
+	wim_file* wim;
+	uint8_t flags;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t original_size;
+	uint32_t nb_chunks;
+	uint64_t* chunk_offset;		// absolute file offsets, with nb_chunks+1 entries
+	uint8_t* chunk_data;		// last decompressed chunk
+	uint8_t* chunk_in;
+	uint32_t cached_chunk;
+} wim_resource;
+
+/*
+ * Canonical Huffman decoding, for codes that are read MSB first
+ * (same approach as zlib's puff)
+ */
+#define HUFFMAN_MAX_LEN             16
+#define HUFFMAN_MAX_SYMBOLS         512
+typedef struct {
+	uint16_t count[HUFFMAN_MAX_LEN+1];
+	uint16_t symbol[HUFFMAN_MAX_SYMBOLS];
+} huffman_code;
+
+// Returns FALSE if the code is over-subscribed (incomplete codes are allowed)
+static BOOL huffman_build(huffman_code* h, const uint8_t* lens, int nb_symbols)
+{
+	int i, left = 1;
+	uint16_t offs[HUFFMAN_MAX_LEN+1];
+
+	memset(h->count, 0, sizeof(h->count));
+	for (i = 0; i < nb_symbols; i++)
+		h->count[lens[i]]++;
+	for (i = 1; i <= HUFFMAN_MAX_LEN; i++) {
+		left <<= 1;
+		left -= h->count[i];
+		if (left < 0)
+			return FALSE;
+	}
+	offs[1] = 0;
+	for (i = 1; i < HUFFMAN_MAX_LEN; i++)
+		offs[i+1] = offs[i] + h->count[i];
+	for (i = 0; i < nb_symbols; i++) {
+		if (lens[i] != 0)
+			h->symbol[offs[lens[i]]++] = (uint16_t)i;
+	}
+	return TRUE;
+}
+
+// 'bits' holds the next 'max_len' bits of the stream, MSB first.
+// Returns the decoded symbol and sets 'len' to the codeword length, or -1 on error.
+static __inline int huffman_decode(const huffman_code* h, uint32_t bits, int max_len, int* len)
+{
+	int l, code = 0, first = 0, index = 0, count;
+
+	for (l = 1; l <= max_len; l++) {
+		code |= (bits >> (max_len - l)) & 1;
+		count = h->count[l];
+		if (code - count < first) {
+			*len = l;
+			return h->symbol[index + (code - first)];
+		}
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+static __inline uint16_t get_le16(const uint8_t* p, const uint8_t* end)
+{
+	return (p + 2 <= end)?(uint16_t)(p[0] | (p[1] << 8)):0;
+}
+
+/*
+ * XPRESS (LZ77 + Huffman) decompression, as per [MS-XCA] 2.2.4
+ * WIM chunks are never larger than 64 KB, so they always consist of a single block.
+ */
+static BOOL xpress_decompress(const uint8_t* in, uint32_t in_len, uint8_t* out, uint32_t out_len)
+{
+	huffman_code* h;
+	uint8_t lens[HUFFMAN_MAX_SYMBOLS];
+	const uint8_t *pos = &in[256], *end = &in[in_len];
+	uint32_t next_bits, out_pos = 0, match_len, match_offset;
+	int i, sym, len, extra_bit_count, offset_bits;
+	BOOL r = FALSE;
+
+	if (in_len < 260)
+		return FALSE;
+	h = (huffman_code*)malloc(sizeof(huffman_code));
+	if (h == NULL)
+		return FALSE;
+	for (i = 0; i < 256; i++) {
+		lens[2*i] = in[i] & 0x0F;
+		lens[2*i+1] = in[i] >> 4;
+	}
+	if (!huffman_build(h, lens, HUFFMAN_MAX_SYMBOLS))
+		goto out;
+
+	next_bits = ((uint32_t)get_le16(pos, end) << 16) | get_le16(pos + 2, end);
+	pos += 4;
+	extra_bit_count = 16;
+	while (out_pos < out_len) {
+		sym = huffman_decode(h, next_bits >> 17, 15, &len);
+		if (sym < 0)
+			goto out;
+		next_bits <<= len;
+		extra_bit_count -= len;
+		if (extra_bit_count < 0) {
+			next_bits |= (uint32_t)get_le16(pos, end) << (-extra_bit_count);
+			extra_bit_count += 16;
+			pos += 2;
+		}
+		if (sym < 256) {
+			out[out_pos++] = (uint8_t)sym;
+			continue;
+		}
+		sym -= 256;
+		match_len = sym & 0x0F;
+		offset_bits = sym >> 4;
+		if (match_len == 15) {
+			if (pos >= end)
+				goto out;
+			match_len = *pos++;
+			if (match_len == 255) {
+				if (pos + 2 > end)
+					goto out;
+				match_len = get_le16(pos, end);
+				pos += 2;
+				if (match_len < 15)
+					goto out;
+				match_len -= 15;
+			}
+			match_len += 15;
+		}
+		match_len += 3;
+		match_offset = (offset_bits == 0)?0:(next_bits >> (32 - offset_bits));
+		match_offset += (1 << offset_bits);
+		next_bits = (offset_bits == 0)?next_bits:(next_bits << offset_bits);
+		extra_bit_count -= offset_bits;
+		if (extra_bit_count < 0) {
+			next_bits |= (uint32_t)get_le16(pos, end) << (-extra_bit_count);
+			extra_bit_count += 16;
+			pos += 2;
+		}
+		if ((match_offset > out_pos) || (match_len > out_len - out_pos))
+			goto out;
+		for (; match_len > 0; match_len--, out_pos++)
+			out[out_pos] = out[out_pos - match_offset];
+	}
+	r = TRUE;
+
+out:
+	free(h);
+	return r;
+}
+
+/*
+ * LZX decompression, for the WIM variant of the format: each chunk is independent,
+ * the window size is the chunk size (32 KB) and E8 translation is always enabled
+ * with a file size of 12000000.
+ */
+#define LZX_NUM_CHARS               256
+#define LZX_NUM_PRIMARY_LENS        7
+#define LZX_NUM_LEN_SYMBOLS         249
+#define LZX_MIN_MATCH_LEN           2
+#define LZX_NUM_OFFSET_SLOTS        30		// for a 32 KB window
+#define LZX_MAIN_SYMBOLS            (LZX_NUM_CHARS + 8*LZX_NUM_OFFSET_SLOTS)
+#define LZX_PRECODE_SYMBOLS         20
+#define LZX_ALIGNED_SYMBOLS         8
+#define LZX_BLOCKTYPE_VERBATIM      1
+#define LZX_BLOCKTYPE_ALIGNED       2
+#define LZX_BLOCKTYPE_UNCOMPRESSED  3
+#define LZX_DEFAULT_BLOCK_SIZE      32768
+#define LZX_WIM_MAGIC_FILESIZE      12000000
+
+typedef struct {
+	const uint8_t* next;
+	const uint8_t* end;
+	uint32_t bitbuf;
+	int bitsleft;
+} lzx_bitstream;
+
+typedef struct {
+	lzx_bitstream bs;
+	huffman_code main_code, len_code, aligned_code, precode;
+	uint8_t main_lens[LZX_MAIN_SYMBOLS];
+	uint8_t len_lens[LZX_NUM_LEN_SYMBOLS];
+} lzx_state;
+
+// Make sure that at least n bits (n <= 16) are available
+static __inline void lzx_ensure_bits(lzx_bitstream* bs, int n)
+{
+	if (bs->bitsleft < n) {
+		bs->bitbuf |= (uint32_t)get_le16(bs->next, bs->end) << (16 - bs->bitsleft);
+		bs->bitsleft += 16;
+		if (bs->next + 2 <= bs->end)
+			bs->next += 2;
+	}
+}
+
+static __inline uint32_t lzx_read_bits(lzx_bitstream* bs, int n)
+{
+	uint32_t r;
+
+	if (n == 0)
+		return 0;
+	lzx_ensure_bits(bs, n);
+	r = bs->bitbuf >> (32 - n);
+	bs->bitbuf <<= n;
+	bs->bitsleft -= n;
+	return r;
+}
+
+static __inline int lzx_read_symbol(lzx_bitstream* bs, const huffman_code* h)
+{
+	int sym, len;
+
+	lzx_ensure_bits(bs, HUFFMAN_MAX_LEN);
+	sym = huffman_decode(h, bs->bitbuf >> (32 - HUFFMAN_MAX_LEN), HUFFMAN_MAX_LEN, &len);
+	if (sym >= 0) {
+		bs->bitbuf <<= len;
+		bs->bitsleft -= len;
+	}
+	return sym;
+}
+
+// Read a set of delta encoded codeword lengths, using a precode
+static BOOL lzx_read_lens(lzx_state* s, uint8_t* lens, int nb_lens)
+{
+	uint8_t precode_lens[LZX_PRECODE_SYMBOLS];
+	int i, presym, run, len;
+
+	for (i = 0; i < LZX_PRECODE_SYMBOLS; i++)
+		precode_lens[i] = (uint8_t)lzx_read_bits(&s->bs, 4);
+	if (!huffman_build(&s->precode, precode_lens, LZX_PRECODE_SYMBOLS))
+		return FALSE;
+
+	for (i = 0; i < nb_lens; ) {
+		presym = lzx_read_symbol(&s->bs, &s->precode);
+		if (presym < 0)
+			return FALSE;
+		if (presym < 17) {
+			len = lens[i] - presym;
+			lens[i++] = (uint8_t)((len < 0)?len + 17:len);
+			continue;
+		}
+		if (presym == 17) {
+			run = 4 + lzx_read_bits(&s->bs, 4);
+			len = 0;
+		} else if (presym == 18) {
+			run = 20 + lzx_read_bits(&s->bs, 5);
+			len = 0;
+		} else {
+			run = 4 + lzx_read_bits(&s->bs, 1);
+			presym = lzx_read_symbol(&s->bs, &s->precode);
+			if ((presym < 0) || (presym > 16))
+				return FALSE;
+			len = lens[i] - presym;
+			if (len < 0)
+				len += 17;
+		}
+		for (; (run > 0) && (i < nb_lens); run--)
+			lens[i++] = (uint8_t)len;
+	}
+	return TRUE;
+}
+
+static void lzx_undo_e8_translation(uint8_t* data, uint32_t size)
+{
+	uint32_t i;
+	int32_t abs_offset, rel_offset;
+
+	if (size <= 10)
+		return;
+	for (i = 0; i < size - 10; ) {
+		if (data[i] != 0xE8) {
+			i++;
+			continue;
+		}
+		abs_offset = (int32_t)(data[i+1] | (data[i+2] << 8) | (data[i+3] << 16) | ((uint32_t)data[i+4] << 24));
+		if (abs_offset >= 0) {
+			if (abs_offset >= LZX_WIM_MAGIC_FILESIZE) {
+				i += 5;
+				continue;
+			}
+			rel_offset = abs_offset - (int32_t)i;
+		} else {
+			if (abs_offset < -(int32_t)i) {
+				i += 5;
+				continue;
+			}
+			rel_offset = abs_offset + LZX_WIM_MAGIC_FILESIZE;
+		}
+		data[i+1] = (uint8_t)rel_offset;
+		data[i+2] = (uint8_t)(rel_offset >> 8);
+		data[i+3] = (uint8_t)(rel_offset >> 16);
+		data[i+4] = (uint8_t)(rel_offset >> 24);
+		i += 5;
+	}
+}
+
+static BOOL lzx_decompress(const uint8_t* in, uint32_t in_len, uint8_t* out, uint32_t out_len)
+{
+	lzx_state* s;
+	uint8_t aligned_lens[LZX_ALIGNED_SYMBOLS];
+	uint32_t offset_base[LZX_NUM_OFFSET_SLOTS], recent[3] = { 1, 1, 1 };
+	uint32_t i, out_pos = 0, block_end, block_size, match_len, match_offset, extra;
+	int block_type, sym, slot, extra_bits[LZX_NUM_OFFSET_SLOTS];
+	BOOL r = FALSE;
+
+	if (out_len > LZX_DEFAULT_BLOCK_SIZE)
+		return FALSE;
+	s = (lzx_state*)calloc(1, sizeof(lzx_state));
+	if (s == NULL)
+		return FALSE;
+	for (i = 0; i < LZX_NUM_OFFSET_SLOTS; i++) {
+		extra_bits[i] = (i < 4)?0:(i - 2) / 2;
+		offset_base[i] = (i == 0)?0:offset_base[i-1] + (1 << extra_bits[i-1]);
+	}
+	s->bs.next = in;
+	s->bs.end = &in[in_len];
+
+	while (out_pos < out_len) {
+		block_type = lzx_read_bits(&s->bs, 3);
+		block_size = lzx_read_bits(&s->bs, 1)?LZX_DEFAULT_BLOCK_SIZE:lzx_read_bits(&s->bs, 16);
+		if ((block_size == 0) || (block_size > out_len - out_pos))
+			goto out;
+		block_end = out_pos + block_size;
+
+		switch (block_type) {
+		case LZX_BLOCKTYPE_ALIGNED:
+			for (i = 0; i < LZX_ALIGNED_SYMBOLS; i++)
+				aligned_lens[i] = (uint8_t)lzx_read_bits(&s->bs, 3);
+			if (!huffman_build(&s->aligned_code, aligned_lens, LZX_ALIGNED_SYMBOLS))
+				goto out;
+			// Fall through
+		case LZX_BLOCKTYPE_VERBATIM:
+			if ( (!lzx_read_lens(s, s->main_lens, LZX_NUM_CHARS))
+			  || (!lzx_read_lens(s, &s->main_lens[LZX_NUM_CHARS], LZX_MAIN_SYMBOLS - LZX_NUM_CHARS))
+			  || (!huffman_build(&s->main_code, s->main_lens, LZX_MAIN_SYMBOLS))
+			  || (!lzx_read_lens(s, s->len_lens, LZX_NUM_LEN_SYMBOLS))
+			  || (!huffman_build(&s->len_code, s->len_lens, LZX_NUM_LEN_SYMBOLS)) )
+				goto out;
+			while (out_pos < block_end) {
+				sym = lzx_read_symbol(&s->bs, &s->main_code);
+				if (sym < 0)
+					goto out;
+				if (sym < LZX_NUM_CHARS) {
+					out[out_pos++] = (uint8_t)sym;
+					continue;
+				}
+				sym -= LZX_NUM_CHARS;
+				slot = sym >> 3;
+				match_len = LZX_MIN_MATCH_LEN + (sym & 7);
+				if ((sym & 7) == LZX_NUM_PRIMARY_LENS) {
+					sym = lzx_read_symbol(&s->bs, &s->len_code);
+					if (sym < 0)
+						goto out;
+					match_len += sym;
+				}
+				if (slot < 3) {
+					match_offset = recent[slot];
+					recent[slot] = recent[0];
+					recent[0] = match_offset;
+				} else {
+					if ((block_type == LZX_BLOCKTYPE_ALIGNED) && (extra_bits[slot] >= 3)) {
+						extra = lzx_read_bits(&s->bs, extra_bits[slot] - 3) << 3;
+						sym = lzx_read_symbol(&s->bs, &s->aligned_code);
+						if (sym < 0)
+							goto out;
+						extra += sym;
+					} else {
+						extra = lzx_read_bits(&s->bs, extra_bits[slot]);
+					}
+					match_offset = offset_base[slot] + extra - 2;
+					recent[2] = recent[1];
+					recent[1] = recent[0];
+					recent[0] = match_offset;
+				}
+				if ((match_offset == 0) || (match_offset > out_pos) || (match_len > block_end - out_pos))
+					goto out;
+				for (; match_len > 0; match_len--, out_pos++)
+					out[out_pos] = out[out_pos - match_offset];
+			}
+			break;
+		case LZX_BLOCKTYPE_UNCOMPRESSED:
+			// Align on a 16-bit boundary (discarding 16 bits if we already are)
+			lzx_ensure_bits(&s->bs, 1);
+			s->bs.bitbuf = 0;
+			s->bs.bitsleft = 0;
+			if (s->bs.end - s->bs.next < 12 + (ptrdiff_t)block_size)
+				goto out;
+			for (i = 0; i < 3; i++) {
+				recent[i] = s->bs.next[0] | (s->bs.next[1] << 8) | (s->bs.next[2] << 16) | ((uint32_t)s->bs.next[3] << 24);
+				s->bs.next += 4;
+			}
+			memcpy(&out[out_pos], s->bs.next, block_size);
+			s->bs.next += block_size;
+			if ((block_size & 1) && (s->bs.next < s->bs.end))
+				s->bs.next++;
+			out_pos += block_size;
+			break;
+		default:
+			goto out;
+		}
+	}
+	lzx_undo_e8_translation(out, out_len);
+	r = TRUE;
+
+out:
+	free(s);
+	return r;
+}
+
+static BOOL decompress_chunk(int compression, const uint8_t* in, uint32_t in_len, uint8_t* out, uint32_t out_len)
+{
+	// Chunks that don't compress are stored as is
+	if (in_len == out_len) {
+		memcpy(out, in, out_len);
+		return TRUE;
+	}
+	switch (compression) {
+	case WIM_COMPRESSION_XPRESS:
+		return xpress_decompress(in, in_len, out, out_len);
+	case WIM_COMPRESSION_LZX:
+		return lzx_decompress(in, in_len, out, out_len);
+	default:
+		return FALSE;
+	}
+}
+
+static BOOL read_at(HANDLE h, uint64_t offset, void* buf, DWORD size)
+{
+	LARGE_INTEGER ptr;
+	DWORD rd_size;
+
+	ptr.QuadPart = offset;
+	return (SetFilePointerEx(h, ptr, NULL, FILE_BEGIN) && ReadFile(h, buf, size, &rd_size, NULL) && (rd_size == size));
+}
+
+/*
+ * Resource handling
+ */
+static void close_resource(wim_resource* res)
+{
+	safe_free(res->chunk_offset);
+	safe_free(res->chunk_data);
+	safe_free(res->chunk_in);
+}
+
+static BOOL open_resource(wim_file* wim, const wim_reshdr* reshdr, wim_resource* res)
+{
+	uint32_t i, entry_size;
+	uint64_t table_size;
+	uint8_t* table = NULL;
+
+	memset(res, 0, sizeof(wim_resource));
+	res->wim = wim;
+	res->flags = reshdr->flags;
+	res->offset = reshdr->offset;
+	for (i = 0; i < 7; i++)
+		res->size |= ((uint64_t)reshdr->size[i]) << (8*i);
+	res->original_size = reshdr->original_size;
+	if (res->flags & (WIM_RESHDR_FLAG_SPANNED|WIM_RESHDR_FLAG_SOLID)) {
+		uprintf("  Spanned and solid WIM resources are not supported\n");
+		return FALSE;
+	}
+	if (!(res->flags & WIM_RESHDR_FLAG_COMPRESSED) || (wim->compression == WIM_COMPRESSION_NONE)) {
+		res->flags &= ~WIM_RESHDR_FLAG_COMPRESSED;
+		return TRUE;
+	}
+
+	// Compressed resources start with a table of the chunk offsets, minus the first one
+	res->nb_chunks = (uint32_t)((res->original_size + wim->chunk_size - 1) / wim->chunk_size);
+	entry_size = (res->original_size > 0xFFFFFFFFULL)?8:4;
+	table_size = (uint64_t)(res->nb_chunks - 1) * entry_size;
+	res->chunk_offset = (uint64_t*)malloc((res->nb_chunks + 1) * sizeof(uint64_t));
+	res->chunk_data = (uint8_t*)malloc(wim->chunk_size);
+	res->chunk_in = (uint8_t*)malloc(wim->chunk_size);
+	table = (uint8_t*)malloc((size_t)table_size + 1);
+	if ((res->chunk_offset == NULL) || (res->chunk_data == NULL) || (res->chunk_in == NULL) || (table == NULL)) {
+		uprintf("  Could not allocate WIM chunk table\n");
+		goto out;
+	}
+	if ((table_size > res->size) || ((table_size != 0) && !read_at(wim->handle, res->offset, table, (DWORD)table_size))) {
+		uprintf("  Could not read WIM chunk table\n");
+		goto out;
+	}
+	res->chunk_offset[0] = res->offset + table_size;
+	for (i = 1; i < res->nb_chunks; i++) {
+		res->chunk_offset[i] = res->offset + table_size + ((entry_size == 8)?
+			*(uint64_t*)&table[(i-1)*entry_size]:*(uint32_t*)&table[(i-1)*entry_size]);
+	}
+	res->chunk_offset[res->nb_chunks] = res->offset + res->size;
+	for (i = 0; i < res->nb_chunks; i++) {
+		if ((res->chunk_offset[i+1] < res->chunk_offset[i]) ||
+			(res->chunk_offset[i+1] - res->chunk_offset[i] > wim->chunk_size)) {
+			uprintf("  Invalid WIM chunk table\n");
+			goto out;
+		}
+	}
+	res->cached_chunk = (uint32_t)-1;
+	free(table);
+	return TRUE;
+
+out:
+	safe_free(table);
+	close_resource(res);
+	return FALSE;
+}
+
+static __inline uint32_t chunk_original_size(const wim_resource* res, uint32_t chunk)
+{
+	return (chunk == res->nb_chunks - 1)?
+		(uint32_t)(res->original_size - (uint64_t)chunk * res->wim->chunk_size):res->wim->chunk_size;
+}
+
+// Read 'size' bytes at 'offset' from the uncompressed data of a resource
+static BOOL read_resource(wim_resource* res, uint64_t offset, void* buf, size_t size)
+{
+	uint8_t* dst = (uint8_t*)buf;
+	uint32_t chunk, chunk_offset, len;
+
+	if ((offset > res->original_size) || (size > res->original_size - offset))
+		return FALSE;
+	if (!(res->flags & WIM_RESHDR_FLAG_COMPRESSED))
+		return read_at(res->wim->handle, res->offset + offset, buf, (DWORD)size);
+
+	while (size > 0) {
+		chunk = (uint32_t)(offset / res->wim->chunk_size);
+		chunk_offset = (uint32_t)(offset % res->wim->chunk_size);
+		if (chunk != res->cached_chunk) {
+			len = (uint32_t)(res->chunk_offset[chunk+1] - res->chunk_offset[chunk]);
+			if ( (!read_at(res->wim->handle, res->chunk_offset[chunk], res->chunk_in, len))
+			  || (!decompress_chunk(res->wim->compression, res->chunk_in, len,
+					res->chunk_data, chunk_original_size(res, chunk))) ) {
+				uprintf("  Could not decompress WIM chunk %d\n", chunk);
+				res->cached_chunk = (uint32_t)-1;
+				return FALSE;
+			}
+			res->cached_chunk = chunk;
+		}
+		len = (uint32_t)min(size, chunk_original_size(res, chunk) - chunk_offset);
+		memcpy(dst, &res->chunk_data[chunk_offset], len);
+		dst += len;
+		offset += len;
+		size -= len;
+	}
+	return TRUE;
+}
+
+/*
+ * Parallel chunk decompression: the compressed data for a batch of chunks is
+ * read sequentially, then all the worker threads pick chunks until none remain.
+ */
+typedef struct {
+	const wim_resource* res;
+	uint32_t first;
+	uint32_t count;
+	const uint8_t* in;
+	uint8_t* out;
+	volatile LONG next;
+	volatile LONG errors;
+} chunk_batch;
+
+static DWORD WINAPI ChunkWorkerThread(LPVOID param)
+{
+	chunk_batch* batch = (chunk_batch*)param;
+	const wim_resource* res = batch->res;
+	uint32_t i, chunk, in_offset, out_offset;
+
+	while ((i = (uint32_t)InterlockedIncrement(&batch->next) - 1) < batch->count) {
+		chunk = batch->first + i;
+		in_offset = (uint32_t)(res->chunk_offset[chunk] - res->chunk_offset[batch->first]);
+		out_offset = i * res->wim->chunk_size;
+		if (!decompress_chunk(res->wim->compression, &batch->in[in_offset],
+			(uint32_t)(res->chunk_offset[chunk+1] - res->chunk_offset[chunk]),
+			&batch->out[out_offset], chunk_original_size(res, chunk)))
+			InterlockedIncrement(&batch->errors);
+	}
+	return 0;
+}
+
+// Extract the whole uncompressed data of a resource to a file, and hash it on the way
+static BOOL extract_resource(wim_resource* res, HANDLE hDst, HCRYPTHASH hHash)
+{
+	BOOL r = FALSE;
+	SYSTEM_INFO si;
+	HANDLE threads[WIM_MAX_THREADS];
+	chunk_batch batch = { 0 };
+	uint8_t *in = NULL, *out = NULL;
+	uint32_t i, nb_threads, batch_size, in_size, out_size;
+	uint64_t offset;
+	DWORD size, wr_size;
+
+	if (!(res->flags & WIM_RESHDR_FLAG_COMPRESSED)) {
+		out = (uint8_t*)malloc(WIM_MAX_CHUNK_SIZE);
+		if (out == NULL)
+			goto out;
+		for (offset = 0; offset < res->original_size; offset += size) {
+			size = (DWORD)min(WIM_MAX_CHUNK_SIZE, res->original_size - offset);
+			if ( (!read_at(res->wim->handle, res->offset + offset, out, size))
+			  || (!WriteFile(hDst, out, size, &wr_size, NULL)) || (size != wr_size)
+			  || (!CryptHashData(hHash, out, size, 0)) )
+				goto out;
+		}
+		r = TRUE;
+		goto out;
+	}
+
+	GetSystemInfo(&si);
+	nb_threads = min(max(si.dwNumberOfProcessors, 1), WIM_MAX_THREADS);
+	batch_size = nb_threads * WIM_CHUNKS_PER_THREAD;
+	in = (uint8_t*)malloc(batch_size * res->wim->chunk_size);
+	out = (uint8_t*)malloc(batch_size * res->wim->chunk_size);
+	if ((in == NULL) || (out == NULL)) {
+		uprintf("  Could not allocate WIM decompression buffers\n");
+		goto out;
+	}
+	batch.res = res;
+	batch.in = in;
+	batch.out = out;
+	for (batch.first = 0; batch.first < res->nb_chunks; batch.first += batch.count) {
+		if (FormatStatus)
+			goto out;
+		batch.count = min(batch_size, res->nb_chunks - batch.first);
+		batch.next = 0;
+		batch.errors = 0;
+		in_size = (uint32_t)(res->chunk_offset[batch.first + batch.count] - res->chunk_offset[batch.first]);
+		if (!read_at(res->wim->handle, res->chunk_offset[batch.first], in, in_size)) {
+			uprintf("  Could not read WIM data: %s\n", WindowsErrorString());
+			goto out;
+		}
+		// The current thread is also a worker
+		for (i = 0; i < min(nb_threads, batch.count) - 1; i++) {
+			threads[i] = CreateThread(NULL, 0, ChunkWorkerThread, &batch, 0, NULL);
+			if (threads[i] == NULL)
+				break;
+		}
+		ChunkWorkerThread(&batch);
+		if (i > 0) {
+			WaitForMultipleObjects(i, threads, TRUE, INFINITE);
+			while (i > 0)
+				CloseHandle(threads[--i]);
+		}
+		if (batch.errors != 0) {
+			uprintf("  Could not decompress WIM data\n");
+			goto out;
+		}
+		out_size = (batch.count - 1) * res->wim->chunk_size + chunk_original_size(res, batch.first + batch.count - 1);
+		if ((!WriteFile(hDst, out, out_size, &wr_size, NULL)) || (out_size != wr_size)) {
+			uprintf("  Could not write file: %s\n", WindowsErrorString());
+			goto out;
+		}
+		if (!CryptHashData(hHash, out, out_size, 0))
+			goto out;
+	}
+	r = TRUE;
+
+out:
+	safe_free(in);
+	safe_free(out);
+	return r;
+}
+
+/*
+ * Look up a path in the directory tree of a metadata resource, and return the
+ * hash of its unnamed data stream
+ */
+static BOOL find_path_hash(wim_resource* metadata, const char* path, uint8_t* hash)
+{
+	BOOL r = FALSE, found;
+	uint8_t dentry[WIM_DENTRY_DISK_SIZE], stream[WIM_STREAM_DISK_SIZE];
+	uint32_t sec_len, attributes;
+	uint64_t offset, length, subdir_offset = 0;
+	uint16_t i, name_len, nb_streams;
+	wchar_t *wpath = NULL, *wname = NULL, *token, *next;
+	static const uint8_t zero_hash[SHA1_HASH_SIZE] = { 0 };
+
+	wpath = utf8_to_wchar(path);
+	wname = (wchar_t*)calloc(0x8000, sizeof(wchar_t));
+	if ((wpath == NULL) || (wname == NULL))
+		goto out;
+
+	// Skip the security data, which is followed by the root directory entry
+	if (!read_resource(metadata, 0, &sec_len, sizeof(sec_len)))
+		goto out;
+	offset = ALIGN8(max(sec_len, 8));
+	if (!read_resource(metadata, offset, dentry, sizeof(dentry)))
+		goto out;
+	subdir_offset = *(uint64_t*)&dentry[16];
+	attributes = FILE_ATTRIBUTE_DIRECTORY;
+
+	for (token = wpath; *token != 0; token++) {
+		if (*token == L'/')
+			*token = L'\\';
+	}
+	for (token = wpath; token != NULL; token = next) {
+		next = wcschr(token, L'\\');
+		if (next != NULL)
+			*next++ = 0;
+		if (*token == 0)
+			continue;
+		if (!(attributes & FILE_ATTRIBUTE_DIRECTORY) || (subdir_offset == 0))
+			goto out;
+		found = FALSE;
+		for (offset = subdir_offset; !found; ) {
+			if (!read_resource(metadata, offset, &length, sizeof(length)) || (length < WIM_DENTRY_DISK_SIZE))
+				goto out;	// end of directory => not found
+			if (!read_resource(metadata, offset, dentry, sizeof(dentry)))
+				goto out;
+			attributes = *(uint32_t*)&dentry[8];
+			subdir_offset = *(uint64_t*)&dentry[16];
+			memcpy(hash, &dentry[64], SHA1_HASH_SIZE);
+			nb_streams = *(uint16_t*)&dentry[96];
+			name_len = *(uint16_t*)&dentry[100];
+			if (!read_resource(metadata, offset + WIM_DENTRY_DISK_SIZE, wname, name_len))
+				goto out;
+			wname[name_len / sizeof(wchar_t)] = 0;
+			found = (_wcsicmp(wname, token) == 0);
+			// Move to the alternate data streams entries, if any
+			offset = ALIGN8(offset + length);
+			for (i = 0; i < nb_streams; i++) {
+				if (!read_resource(metadata, offset, stream, sizeof(stream)))
+					goto out;
+				// The unnamed data stream may be stored as a nameless alternate entry
+				if (found && (*(uint16_t*)&stream[36] == 0) && (memcmp(hash, zero_hash, SHA1_HASH_SIZE) == 0))
+					memcpy(hash, &stream[16], SHA1_HASH_SIZE);
+				offset = ALIGN8(offset + *(uint64_t*)stream);
+			}
+		}
+	}
+	if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+		uprintf("  '%s' is a directory\n", path);
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	safe_free(wpath);
+	safe_free(wname);
+	return r;
+}
+
+// Check that a WIM header describes an archive that we can read, and set its compression parameters
+static BOOL check_header(const wim_header* header, wim_file* wim)
+{
+	if (memcmp(header->magic, WIM_MAGIC, sizeof(header->magic)) != 0) {
+		uprintf("  Not a WIM image\n");
+		return FALSE;
+	}
+	if ((header->total_parts != 1) || (header->version == WIM_SOLID_VERSION)) {
+		uprintf("  Split and solid WIM images are not supported\n");
+		return FALSE;
+	}
+	if (header->flags & WIM_HDR_FLAG_COMPRESSION) {
+		if (header->flags & WIM_HDR_FLAG_COMPRESS_XPRESS) {
+			wim->compression = WIM_COMPRESSION_XPRESS;
+		} else if (header->flags & WIM_HDR_FLAG_COMPRESS_LZX) {
+			wim->compression = WIM_COMPRESSION_LZX;
+		} else {
+			uprintf("  Unsupported WIM compression (flags: 0x%08X)\n", header->flags);
+			return FALSE;
+		}
+		if (header->chunk_size != 0)
+			wim->chunk_size = header->chunk_size;
+		if ( (wim->chunk_size > WIM_MAX_CHUNK_SIZE)
+		  || ((wim->compression == WIM_COMPRESSION_LZX) && (wim->chunk_size != LZX_DEFAULT_BLOCK_SIZE)) ) {
+			uprintf("  Unsupported WIM chunk size: %d\n", wim->chunk_size);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Check, from the start of a WIM image, whether we can extract files from it natively.
+ * This is used during the ISO scan, to find out if 7-Zip or wimgapi.dll will be needed.
+ */
+BOOL WimIsNativelySupported(const void* buf, size_t size)
+{
+	wim_file wim = { INVALID_HANDLE_VALUE, WIM_COMPRESSION_NONE, WIM_DEFAULT_CHUNK_SIZE };
+
+	if (size < sizeof(wim_header))
+		return FALSE;
+	return check_header((const wim_header*)buf, &wim);
+}
+
+// Extract a file from a WIM image without relying on external tools
+BOOL WimExtractFile_Native(const char* image, int index, const char* src, const char* dst)
+{
+	BOOL r = FALSE;
+	wim_header header;
+	wim_file wim = { INVALID_HANDLE_VALUE, WIM_COMPRESSION_NONE, WIM_DEFAULT_CHUNK_SIZE };
+	wim_resource lookup = { 0 }, metadata = { 0 }, file_res = { 0 };
+	wim_lookup_entry* table = NULL;
+	uint8_t hash[SHA1_HASH_SIZE], data_hash[SHA1_HASH_SIZE];
+	static const uint8_t zero_hash[SHA1_HASH_SIZE] = { 0 };
+	uint32_t i, nb_entries;
+	int nb_images = 0;
+	HANDLE hDst = INVALID_HANDLE_VALUE;
+	HCRYPTPROV hProv = 0;
+	HCRYPTHASH hHash = 0;
+	DWORD hash_size = sizeof(data_hash);
+
+	uprintf("Opening: %s:[%d] (native)\n", image, index);
+	wim.handle = CreateFileU(image, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (wim.handle == INVALID_HANDLE_VALUE) {
+		uprintf("  Could not open image: %s\n", WindowsErrorString());
+		goto out;
+	}
+	if (!read_at(wim.handle, 0, &header, sizeof(header))) {
+		uprintf("  Could not read WIM header: %s\n", WindowsErrorString());
+		goto out;
+	}
+	if (!check_header(&header, &wim))
+		goto out;
+	if ((index <= 0) || ((uint32_t)index > header.image_count)) {
+		uprintf("  Invalid image index\n");
+		goto out;
+	}
+
+	// Read the lookup table, and find the metadata resource for our image
+	if (!open_resource(&wim, &header.lookup_table, &lookup))
+		goto out;
+	nb_entries = (uint32_t)(lookup.original_size / sizeof(wim_lookup_entry));
+	table = (wim_lookup_entry*)malloc(nb_entries * sizeof(wim_lookup_entry));
+	if ((table == NULL) || (!read_resource(&lookup, 0, table, nb_entries * sizeof(wim_lookup_entry)))) {
+		uprintf("  Could not read WIM lookup table\n");
+		goto out;
+	}
+	for (i = 0; i < nb_entries; i++) {
+		if ((table[i].reshdr.flags & WIM_RESHDR_FLAG_METADATA) && (++nb_images == index))
+			break;
+	}
+	if ((i >= nb_entries) || (!open_resource(&wim, &table[i].reshdr, &metadata))) {
+		uprintf("  Could not access metadata for image %d\n", index);
+		goto out;
+	}
+
+	if (!find_path_hash(&metadata, src, hash)) {
+		uprintf("  Could not find '%s' in image\n", src);
+		goto out;
+	}
+
+	uprintf("Extracting: %s (From %s)\n", dst, src);
+	hDst = CreateFileU(dst, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hDst == INVALID_HANDLE_VALUE) {
+		uprintf("  Could not create file: %s\n", WindowsErrorString());
+		goto out;
+	}
+	// A zero hash denotes an empty stream
+	if (memcmp(hash, zero_hash, SHA1_HASH_SIZE) != 0) {
+		for (i = 0; i < nb_entries; i++) {
+			if ((memcmp(table[i].hash, hash, SHA1_HASH_SIZE) == 0) && !(table[i].reshdr.flags & WIM_RESHDR_FLAG_METADATA))
+				break;
+		}
+		if (i >= nb_entries) {
+			uprintf("  Could not find data for '%s' in lookup table\n", src);
+			goto out;
+		}
+		// The lookup table hash is the SHA-1 of the uncompressed data, so it validates our decompression
+		if ( (!CryptAcquireContext(&hProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+		  || (!CryptCreateHash(hProv, CALG_SHA1, 0, 0, &hHash)) ) {
+			uprintf("  Unable to initialize SHA-1: %s\n", WindowsErrorString());
+			goto out;
+		}
+		if ((!open_resource(&wim, &table[i].reshdr, &file_res)) || (!extract_resource(&file_res, hDst, hHash))) {
+			uprintf("  Could not extract file\n");
+			goto out;
+		}
+		if ( (!CryptGetHashParam(hHash, HP_HASHVAL, data_hash, &hash_size, 0))
+		  || (memcmp(data_hash, hash, SHA1_HASH_SIZE) != 0) ) {
+			uprintf("  SHA-1 mismatch for extracted data\n");
+			goto out;
+		}
+	}
+	r = TRUE;
+	UpdateProgress(OP_FINALIZE, -1.0f);
+
+out:
+	if (hDst != INVALID_HANDLE_VALUE) {
+		CloseHandle(hDst);
+		if (!r)
+			DeleteFileU(dst);
+	}
+	if (wim.handle != INVALID_HANDLE_VALUE) {
+		uprintf("Closing: %s\n", image);
+		CloseHandle(wim.handle);
+	}
+	if (hHash) CryptDestroyHash(hHash);
+	if (hProv) CryptReleaseContext(hProv, 0);
+	close_resource(&lookup);
+	close_resource(&metadata);
+	close_resource(&file_res);
+	safe_free(table);
+	return r;
+}